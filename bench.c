@@ -0,0 +1,721 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Benchmark driver for the library, meant to be run against mockserver (see "make benchmark"). It logs in, measures
+ * the time to download the account state, to sync a folder down and, with the filesystem mounted, sequential and
+ * random read throughput and the time to write and upload a file. The ramtier test repeats the random reads with
+ * fsramcachesize set to 0, to its default and to a large value and prints the page cache tier statistics of each run.
+ * The patterns test needs no server, it compares the compiled ignore pattern matcher with the loop it replaced. The
+ * pipeline test sends a batch of pipelined API requests on a corked and on an uncorked socket. The rewrite test
+ * uploads a file, rewrites random pages of it and reports what the delta upload planner made of the changes.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "psynclib.h"
+#include "plibs.h"
+#include "psettings.h"
+#include "papi.h"
+#include "pfsupload.h"
+#include "ppagecache.h"
+
+#define BENCH_TIMEOUT     600
+#define BENCH_READ_BUFF   (1024*1024)
+#define BENCH_RANDOM_SIZE 4096
+#define BENCH_RAMTIER_LARGE ((uint64_t)1024*1024*1024)
+#define BENCH_MAX_SETTINGS  16
+#define BENCH_PIPELINE_CMDS 1000
+#define BENCH_REWRITES      256
+#define BENCH_PATTERN_NAMES 10000
+#define BENCH_PATTERN_ROUNDS 100
+/* the default ignore list plus what developers usually add to it */
+#define BENCH_PATTERNS PSYNC_IGNORE_PATTERNS_DEFAULT ";*.o;*.obj;*.pyc;*.class;*.swp;*.swo;*~;*.tmp;*.bak;node_modules;build;\
+dist;target;.git;.svn;.idea;__pycache__;*.log;.#*;#*#;*.lock;cmake-build-*;*.d"
+
+static const char *host="127.0.0.1";
+static int port=8398;
+static const char *workdir="/tmp/psync-bench";
+static const char *tests="sync,seqread,randread,write";
+static unsigned long expectfiles=1000;
+static unsigned long randcnt=2000;
+static unsigned long writemb=64;
+static char *settings[BENCH_MAX_SETTINGS];
+static int settingcnt=0;
+static char mntdir[1024];
+static unsigned long filecnt;
+static int fsstarted=0;
+
+static double bench_time(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static void bench_sleep_ms(unsigned ms){
+  usleep(ms*1000);
+}
+
+static int count_file(const char *path, const struct stat *st, int flag, struct FTW *ftw){
+  if (flag==FTW_F)
+    filecnt++;
+  return 0;
+}
+
+static unsigned long count_files(const char *dir){
+  filecnt=0;
+  nftw(dir, count_file, 16, FTW_PHYS);
+  return filecnt;
+}
+
+static int wait_ready(double timeout){
+  pstatus_t st;
+  double end;
+  end=bench_time()+timeout;
+  while (bench_time()<end){
+    psync_get_status(&st);
+    if (st.status==PSTATUS_READY)
+      return 0;
+    if (st.status==PSTATUS_BAD_LOGIN_DATA || st.status==PSTATUS_BAD_LOGIN_TOKEN || st.status==PSTATUS_USER_MISMATCH){
+      fprintf(stderr, "login failed, status %u\n", (unsigned)st.status);
+      return -1;
+    }
+    bench_sleep_ms(20);
+  }
+  fprintf(stderr, "timeout waiting for the library to become ready\n");
+  return -1;
+}
+
+static int bench_sync(){
+  char local[1024];
+  pstatus_t st;
+  double start;
+  unsigned long cnt;
+  snprintf(local, sizeof(local), "%s/sync", workdir);
+  mkdir(local, 0755);
+  start=bench_time();
+  if (psync_add_sync_by_path(local, "/files", PSYNC_DOWNLOAD_ONLY)==(psync_syncid_t)-1){
+    fprintf(stderr, "could not add sync of /files to %s\n", local);
+    return -1;
+  }
+  while (bench_time()<start+BENCH_TIMEOUT){
+    cnt=count_files(local);
+    psync_get_status(&st);
+    if (cnt>=expectfiles && st.status==PSTATUS_READY && !st.filestodownload)
+      break;
+    bench_sleep_ms(50);
+  }
+  start=bench_time()-start;
+  cnt=count_files(local);
+  printf("sync:     %lu files in %.3f s, %.1f files/s\n", cnt, start, cnt/start);
+  return cnt>=expectfiles?0:-1;
+}
+
+static int start_fs(){
+  char path[1100];
+  struct stat st;
+  double end;
+  if (fsstarted)
+    return 0;
+  if (psync_fs_start()){
+    fprintf(stderr, "could not start the filesystem\n");
+    return -1;
+  }
+  fsstarted=1;
+  snprintf(path, sizeof(path), "%s/bench", mntdir);
+  end=bench_time()+30;
+  while (stat(path, &st)){
+    if (bench_time()>end){
+      fprintf(stderr, "timeout waiting for %s\n", path);
+      return -1;
+    }
+    bench_sleep_ms(50);
+  }
+  return 0;
+}
+
+static int bench_seqread(){
+  char path[1100];
+  char *buff;
+  double start;
+  ssize_t rd;
+  unsigned long long total;
+  int fd;
+  if (start_fs())
+    return -1;
+  snprintf(path, sizeof(path), "%s/bench/read.bin", mntdir);
+  fd=open(path, O_RDONLY);
+  if (fd==-1){
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  buff=(char *)malloc(BENCH_READ_BUFF);
+  total=0;
+  start=bench_time();
+  while ((rd=read(fd, buff, BENCH_READ_BUFF))>0)
+    total+=rd;
+  start=bench_time()-start;
+  free(buff);
+  close(fd);
+  if (rd==-1){
+    fprintf(stderr, "error reading %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  printf("seqread:  %llu bytes in %.3f s, %.2f MB/s\n", total, start, total/start/(1024*1024));
+  return 0;
+}
+
+static int open_random_file(unsigned long *blocks){
+  char path[1100];
+  struct stat st;
+  int fd;
+  snprintf(path, sizeof(path), "%s/bench/random.bin", mntdir);
+  fd=open(path, O_RDONLY);
+  if (fd==-1 || fstat(fd, &st)){
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    if (fd!=-1)
+      close(fd);
+    return -1;
+  }
+  *blocks=st.st_size/BENCH_RANDOM_SIZE;
+  if (!*blocks){
+    close(fd);
+    fprintf(stderr, "%s is too small\n", path);
+    return -1;
+  }
+  return fd;
+}
+
+/* does randcnt random reads, returns the time they took or -1 on error */
+static double random_reads(int fd, unsigned long blocks, unsigned seed){
+  char buff[BENCH_RANDOM_SIZE];
+  double start;
+  unsigned long i;
+  srandom(seed);
+  start=bench_time();
+  for (i=0; i<randcnt; i++)
+    if (pread(fd, buff, BENCH_RANDOM_SIZE, (off_t)(random()%blocks)*BENCH_RANDOM_SIZE)!=BENCH_RANDOM_SIZE){
+      fprintf(stderr, "error reading random.bin: %s\n", strerror(errno));
+      return -1;
+    }
+  return bench_time()-start;
+}
+
+static int bench_randread(){
+  double tm;
+  unsigned long blocks;
+  int fd;
+  if (start_fs())
+    return -1;
+  fd=open_random_file(&blocks);
+  if (fd==-1)
+    return -1;
+  tm=random_reads(fd, blocks, getpid());
+  close(fd);
+  if (tm<0)
+    return -1;
+  printf("randread: %lu reads of %d bytes in %.3f s, %.0f IOPS, %.3f ms average\n", randcnt, BENCH_RANDOM_SIZE, tm,
+         randcnt/tm, tm*1000/randcnt);
+  return 0;
+}
+
+/* Every configuration reads the same blocks twice, the second pass is where pages read before can come from the RAM
+ * tier. The file is reopened for each pass so the reads are not served by the kernel. */
+static int bench_ramtier(){
+  const char *names[]={"off", "default", "large"};
+  uint64_t sizes[3], oldsize;
+  psync_pagecache_tier_stats_t before, after;
+  double tm;
+  unsigned long blocks;
+  int i, pass, fd;
+  if (start_fs())
+    return -1;
+  oldsize=psync_get_uint_setting("fsramcachesize");
+  sizes[0]=0;
+  sizes[1]=oldsize;
+  sizes[2]=BENCH_RAMTIER_LARGE;
+  for (i=0; i<3; i++){
+    psync_set_uint_setting("fsramcachesize", sizes[i]);
+    psync_pagecache_get_tier_stats(&before);
+    tm=0;
+    for (pass=0; pass<2; pass++){
+      fd=open_random_file(&blocks);
+      if (fd==-1){
+        psync_set_uint_setting("fsramcachesize", oldsize);
+        return -1;
+      }
+      tm=random_reads(fd, blocks, 1000+i);
+      close(fd);
+      if (tm<0){
+        psync_set_uint_setting("fsramcachesize", oldsize);
+        return -1;
+      }
+    }
+    psync_pagecache_get_tier_stats(&after);
+    printf("ramtier:  %-7s %u pages, second pass %.0f IOPS, %.3f ms average; hits ram %llu disk %llu pool %llu, misses %llu, "
+           "promotions %llu, demotions %llu\n", names[i], (unsigned)after.rampages, randcnt/tm, tm*1000/randcnt,
+           (unsigned long long)(after.ramhits-before.ramhits), (unsigned long long)(after.diskhits-before.diskhits),
+           (unsigned long long)(after.memhits-before.memhits), (unsigned long long)(after.misses-before.misses),
+           (unsigned long long)(after.promotions-before.promotions), (unsigned long long)(after.demotions-before.demotions));
+  }
+  psync_set_uint_setting("fsramcachesize", oldsize);
+  return 0;
+}
+
+/* the upload is only counted after the file is closed, wait for it to show up before waiting for it to finish, returns
+ * 0 if no upload was seen */
+static int wait_upload(double closed){
+  pstatus_t st;
+  double end;
+  int seen;
+  seen=0;
+  end=closed+BENCH_TIMEOUT;
+  while (bench_time()<end){
+    psync_get_status(&st);
+    if (st.filestoupload)
+      seen=1;
+    else if (seen || bench_time()>closed+10)
+      break;
+    bench_sleep_ms(20);
+  }
+  return seen;
+}
+
+static int write_random_file(const char *path, unsigned long mb){
+  char *buff;
+  unsigned long i;
+  int fd;
+  fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd==-1){
+    fprintf(stderr, "could not create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  buff=(char *)malloc(BENCH_READ_BUFF);
+  for (i=0; i<BENCH_READ_BUFF; i++)
+    buff[i]=(char)random();
+  for (i=0; i<mb; i++)
+    if (write(fd, buff, BENCH_READ_BUFF)!=BENCH_READ_BUFF){
+      fprintf(stderr, "error writing %s: %s\n", path, strerror(errno));
+      free(buff);
+      close(fd);
+      return -1;
+    }
+  free(buff);
+  return close(fd);
+}
+
+static int bench_write(){
+  char path[1100];
+  double start, written, end;
+  int seen;
+  if (start_fs())
+    return -1;
+  snprintf(path, sizeof(path), "%s/bench/upload-%u.bin", mntdir, (unsigned)getpid());
+  start=bench_time();
+  if (write_random_file(path, writemb))
+    return -1;
+  written=bench_time();
+  seen=wait_upload(written);
+  end=bench_time();
+  printf("write:    %lu MB written in %.3f s, %.2f MB/s\n", writemb, written-start, writemb/(written-start));
+  if (seen)
+    printf("upload:   %lu MB uploaded in %.3f s after close, %.2f MB/s\n", writemb, end-written, writemb/(end-written));
+  else
+    printf("upload:   not observed\n");
+  unlink(path);
+  return 0;
+}
+
+/* Uploads a writemb MB file, then rewrites BENCH_REWRITES random pages of it like a database would, three out of four
+ * with a few changed bytes and the rest with their old content, and reports the delta plan made for the second upload. */
+static int bench_rewrite(){
+  char path[1100], page[BENCH_RANDOM_SIZE];
+  psync_fsupload_delta_stats_t before, after;
+  double start, written, end;
+  unsigned long i, pages, changed;
+  off_t off;
+  int fd, seen;
+  if (start_fs())
+    return -1;
+  snprintf(path, sizeof(path), "%s/bench/rewrite-%u.bin", mntdir, (unsigned)getpid());
+  if (write_random_file(path, writemb))
+    return -1;
+  if (!wait_upload(bench_time())){
+    fprintf(stderr, "rewrite: upload of the original file not observed\n");
+    unlink(path);
+    return -1;
+  }
+  fd=open(path, O_RDWR);
+  if (fd==-1){
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    unlink(path);
+    return -1;
+  }
+  pages=writemb*BENCH_READ_BUFF/BENCH_RANDOM_SIZE;
+  psync_fsupload_get_delta_stats(&before);
+  srandom(getpid());
+  changed=0;
+  start=bench_time();
+  for (i=0; i<BENCH_REWRITES; i++){
+    off=(off_t)(random()%pages)*BENCH_RANDOM_SIZE;
+    if (pread(fd, page, BENCH_RANDOM_SIZE, off)!=BENCH_RANDOM_SIZE)
+      goto err;
+    if (random()%4){
+      memset(page+random()%(BENCH_RANDOM_SIZE-16), (int)random(), 16);
+      changed++;
+    }
+    if (pwrite(fd, page, BENCH_RANDOM_SIZE, off)!=BENCH_RANDOM_SIZE)
+      goto err;
+  }
+  close(fd);
+  written=bench_time();
+  seen=wait_upload(written);
+  end=bench_time();
+  psync_fsupload_get_delta_stats(&after);
+  unlink(path);
+  printf("rewrite:  %d page rewrites, %lu changed, in %.3f s", BENCH_REWRITES, changed, written-start);
+  if (seen)
+    printf(", uploaded in %.3f s after close\n", end-written);
+  else
+    printf(", upload not observed\n");
+  printf("rewrite:  %llu plans, %llu requests, %llu bytes sent (%llu of them gaps from cache), %llu rewritten bytes unchanged, "
+         "%llu bytes copied on the server\n", (unsigned long long)(after.plans-before.plans),
+         (unsigned long long)(after.requests-before.requests), (unsigned long long)(after.uploadbytes-before.uploadbytes),
+         (unsigned long long)(after.cachebytes-before.cachebytes), (unsigned long long)(after.samebytes-before.samebytes),
+         (unsigned long long)(after.copybytes-before.copybytes));
+  return 0;
+err:
+  fprintf(stderr, "error rewriting %s: %s\n", path, strerror(errno));
+  close(fd);
+  unlink(path);
+  return -1;
+}
+
+/* applies a name=value setting, value is tried as a number, then as a boolean and then as a string */
+static int apply_setting(char *setting){
+  char *value, *end;
+  uint64_t num;
+  value=strchr(setting, '=');
+  if (!value){
+    fprintf(stderr, "setting %s is not in name=value format\n", setting);
+    return -1;
+  }
+  *value++=0;
+  num=strtoull(value, &end, 10);
+  if (*value && !*end && (!psync_set_uint_setting(setting, num) || !psync_set_bool_setting(setting, num!=0)))
+    goto ok;
+  if (!psync_set_string_setting(setting, value))
+    goto ok;
+  fprintf(stderr, "could not set %s to %s\n", setting, value);
+  value[-1]='=';
+  return -1;
+ok:
+  printf("setting:  %s=%s\n", setting, value);
+  value[-1]='=';
+  return 0;
+}
+
+/* Sends BENCH_PIPELINE_CMDS nop requests before reading any result and asks the mock server in how many TCP segments
+ * they arrived (only reported on Linux). */
+static int pipeline_run(int cork){
+  psync_socket *sock;
+  binresult *res;
+  const binresult *segs;
+  double start;
+  uint64_t requests, segments;
+  unsigned long i;
+  sock=psync_api_connect(0);
+  if (!sock){
+    fprintf(stderr, "pipeline: could not connect to the API server\n");
+    return -1;
+  }
+  if (cork)
+    psync_socket_cork(sock);
+  start=bench_time();
+  for (i=0; i<BENCH_PIPELINE_CMDS; i++)
+    if (!do_send_command(sock, "nop", 3, NULL, 0, -1, 0))
+      goto err;
+  if (cork && psync_socket_uncork(sock))
+    goto err;
+  for (i=0; i<BENCH_PIPELINE_CMDS; i++){
+    res=get_result(sock);
+    if (!res)
+      goto err;
+    psync_free(res);
+  }
+  start=bench_time()-start;
+  res=do_send_command(sock, "connstats", 9, NULL, 0, -1, 1);
+  if (!res)
+    goto err;
+  requests=psync_find_result(res, "requests", PARAM_NUM)->num;
+  segs=psync_check_result(res, "segments", PARAM_NUM);
+  segments=segs?segs->num:0;
+  psync_free(res);
+  psync_socket_close(sock);
+  // the connstats request itself is not part of the batch
+  printf("pipeline: %-8s %lu requests in %.3f s, %.0f requests/s", cork?"corked":"uncorked", (unsigned long)(requests-1),
+         start, BENCH_PIPELINE_CMDS/start);
+  if (segments)
+    printf(", %llu TCP segments\n", (unsigned long long)(segments-1));
+  else
+    printf("\n");
+  return 0;
+err:
+  fprintf(stderr, "pipeline: connection failed\n");
+  psync_socket_close_bad(sock);
+  return -1;
+}
+
+static int bench_pipeline(){
+  if (pipeline_run(0) || pipeline_run(1))
+    return -1;
+  return 0;
+}
+
+/* the matching loop psync_is_name_to_ignore() used before the patterns were compiled, patterns are lowercase */
+static int pattern_match_loop(const char *ign, const char *name){
+  const char *sc, *pt;
+  char *namelower;
+  unsigned char *lp;
+  size_t ilen, off, pl;
+  namelower=strdup(name);
+  lp=(unsigned char *)namelower;
+  while (*lp){
+    *lp=tolower(*lp);
+    lp++;
+  }
+  ilen=strlen(ign);
+  off=0;
+  do {
+    sc=(const char *)memchr(ign+off, ';', ilen-off);
+    if (sc)
+      pl=sc-ign-off;
+    else
+      pl=ilen-off;
+    pt=ign+off;
+    off+=pl+1;
+    while (pl && isspace((unsigned char)*pt)){
+      pt++;
+      pl--;
+    }
+    while (pl && isspace((unsigned char)pt[pl-1]))
+      pl--;
+    if (psync_match_pattern(namelower, pt, pl)){
+      free(namelower);
+      return 1;
+    }
+  } while (sc);
+  free(namelower);
+  return 0;
+}
+
+static int bench_patterns(){
+  static const char *templates[]={"report_%d.docx", "IMG_%04d.JPG", "main%d.c", "main%d.o", ".~lock.report_%d.docx#",
+    "Thumbs.db", "._IMG_%04d.JPG", "node_modules", "video_%d.mp4.part", "notes%d.txt~", "libfoo.so.%d", ".git",
+    "Cargo%d.lock", "cmake-build-release%d", "Budget %d (final).xlsx", "src%d", "index%d.html", "style%d.css",
+    "package%d.json", "Makefile.%d", "DSC_%05d.NEF", "song %d.mp3", "archive-%d.tar.gz", "README%d.md"};
+  char (*names)[64], *pats;
+  psync_pattern_set_t *set;
+  double start, tloop, tset;
+  unsigned long i, r, hloop, hset;
+  names=(char (*)[64])malloc(sizeof(*names)*BENCH_PATTERN_NAMES);
+  for (i=0; i<BENCH_PATTERN_NAMES; i++)
+    snprintf(names[i], sizeof(names[i]), templates[i%(sizeof(templates)/sizeof(templates[0]))], (int)i);
+  pats=strdup(BENCH_PATTERNS);
+  for (i=0; pats[i]; i++)
+    pats[i]=tolower((unsigned char)pats[i]);
+  set=psync_pattern_set_compile(pats, 1);
+  for (i=0; i<BENCH_PATTERN_NAMES; i++)
+    if (pattern_match_loop(pats, names[i])!=psync_pattern_set_match(set, names[i])){
+      fprintf(stderr, "patterns: matchers disagree on %s\n", names[i]);
+      psync_free(set);
+      free(pats);
+      free(names);
+      return -1;
+    }
+  hloop=0;
+  start=bench_time();
+  for (r=0; r<BENCH_PATTERN_ROUNDS; r++)
+    for (i=0; i<BENCH_PATTERN_NAMES; i++)
+      hloop+=pattern_match_loop(pats, names[i]);
+  tloop=bench_time()-start;
+  hset=0;
+  start=bench_time();
+  for (r=0; r<BENCH_PATTERN_ROUNDS; r++)
+    for (i=0; i<BENCH_PATTERN_NAMES; i++)
+      hset+=psync_pattern_set_match(set, names[i]);
+  tset=bench_time()-start;
+  printf("patterns: %lu names, %lu ignored; loop %.3f s, %.0f ns/name; compiled %.3f s, %.0f ns/name\n",
+         (unsigned long)BENCH_PATTERN_NAMES*BENCH_PATTERN_ROUNDS, hset, tloop,
+         tloop*1e9/BENCH_PATTERN_NAMES/BENCH_PATTERN_ROUNDS, tset, tset*1e9/BENCH_PATTERN_NAMES/BENCH_PATTERN_ROUNDS);
+  psync_free(set);
+  free(pats);
+  free(names);
+  return hloop==hset?0:-1;
+}
+
+static const struct {
+  const char *name;
+  int (*func)();
+  int online;
+} benchmarks[]={
+  {"sync", bench_sync, 1},
+  {"seqread", bench_seqread, 1},
+  {"randread", bench_randread, 1},
+  {"write", bench_write, 1},
+  {"ramtier", bench_ramtier, 1},
+  {"pipeline", bench_pipeline, 1},
+  {"rewrite", bench_rewrite, 1},
+  {"patterns", bench_patterns, 0}
+};
+
+/* returns 1 if any of the tests in the list talks to the server, 0 if none does and -1 for an unknown test */
+static int tests_need_server(const char *list){
+  char *tlist, *t, *saveptr;
+  size_t i;
+  int ret;
+  ret=0;
+  tlist=strdup(list);
+  for (t=strtok_r(tlist, ",", &saveptr); t; t=strtok_r(NULL, ",", &saveptr)){
+    for (i=0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); i++)
+      if (!strcmp(benchmarks[i].name, t))
+        break;
+    if (i==sizeof(benchmarks)/sizeof(benchmarks[0])){
+      fprintf(stderr, "unknown test %s\n", t);
+      ret=-1;
+      break;
+    }
+    if (benchmarks[i].online)
+      ret=1;
+  }
+  free(tlist);
+  return ret;
+}
+
+static void usage(const char *name){
+  size_t i;
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -h host     API server (default %s)\n"
+          "  -p port     API server port (default %d)\n"
+          "  -d dir      work directory, the database is recreated on every run (default %s)\n"
+          "  -t tests    comma separated list of tests (default %s)\n"
+          "  -n count    number of files the server has under /files (default %lu)\n"
+          "  -r count    number of random reads (default %lu)\n"
+          "  -w MB       size of the written file (default %lu)\n"
+          "  -s name=val set a library setting before the tests, can be repeated\n"
+          "tests:",
+          name, host, port, workdir, tests, expectfiles, randcnt, writemb);
+  for (i=0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); i++)
+    fprintf(stderr, " %s", benchmarks[i].name);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  char path[1024], *tlist, *t, *saveptr;
+  double start;
+  size_t i;
+  int opt, ret, online;
+  while ((opt=getopt(argc, argv, "h:p:d:t:n:r:w:s:"))!=-1)
+    switch (opt){
+      case 'h': host=optarg; break;
+      case 'p': port=atoi(optarg); break;
+      case 'd': workdir=optarg; break;
+      case 't': tests=optarg; break;
+      case 'n': expectfiles=strtoul(optarg, NULL, 10); break;
+      case 'r': randcnt=strtoul(optarg, NULL, 10); break;
+      case 'w': writemb=strtoul(optarg, NULL, 10); break;
+      case 's':
+        if (settingcnt==BENCH_MAX_SETTINGS)
+          usage(argv[0]);
+        settings[settingcnt++]=optarg;
+        break;
+      default: usage(argv[0]);
+    }
+  online=tests_need_server(tests);
+  if (online==-1)
+    usage(argv[0]);
+  mkdir(workdir, 0755);
+  snprintf(path, sizeof(path), "%s/data.db", workdir);
+  unlink(path);
+  psync_set_database_path(path);
+  psync_set_apiserver(host, port, port);
+  if (psync_init()){
+    fprintf(stderr, "psync_init failed\n");
+    return 1;
+  }
+  snprintf(mntdir, sizeof(mntdir), "%s/mnt", workdir);
+  mkdir(mntdir, 0755);
+  snprintf(path, sizeof(path), "%s/cache", workdir);
+  mkdir(path, 0755);
+  psync_set_bool_setting("usessl", 0);
+  psync_set_bool_setting("p2psync", 0);
+  psync_set_bool_setting("autostartfs", 0);
+  psync_set_string_setting("fsroot", mntdir);
+  psync_set_string_setting("fscachepath", path);
+  for (i=0; i<settingcnt; i++)
+    if (apply_setting(settings[i])){
+      psync_destroy();
+      return 1;
+    }
+  if (online){
+    psync_set_user_pass("bench@localhost", "bench", 0);
+    start=bench_time();
+    psync_start_sync(NULL, NULL);
+    if (wait_ready(BENCH_TIMEOUT)){
+      psync_destroy();
+      return 1;
+    }
+    printf("login:    account state downloaded in %.3f s\n", bench_time()-start);
+  }
+  ret=0;
+  tlist=strdup(tests);
+  for (t=strtok_r(tlist, ",", &saveptr); t; t=strtok_r(NULL, ",", &saveptr)){
+    for (i=0; i<sizeof(benchmarks)/sizeof(benchmarks[0]); i++)
+      if (!strcmp(benchmarks[i].name, t)){
+        if (benchmarks[i].func())
+          ret=1;
+        break;
+      }
+  }
+  free(tlist);
+  if (fsstarted)
+    psync_fs_stop();
+  psync_destroy();
+  return ret;
+}
@@ -0,0 +1,1933 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Mock API and content server for testing and benchmarking the library without an account or network. It speaks the
+ * binary API protocol of papi.c on one port and serves file contents over HTTP on another, both without SSL. The
+ * initial tree has files with generated contents, uploaded files are kept in memory. Responses can be delayed by a
+ * fixed latency and transfers shaped to a bandwidth shared by all connections. The connstats command returns how many
+ * requests the connection sent and, on Linux, in how many TCP segments its data arrived, so client side batching of
+ * pipelined requests can be measured.
+ *
+ * The library is pointed to it with psync_set_apiserver("127.0.0.1", 8398, 8398) and the usessl setting turned off.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#if defined(__linux__)
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define MOCK_API_PORT         8398
+#define MOCK_HTTP_PORT        8399
+#define MOCK_USERID           1
+#define MOCK_QUOTA            ((uint64_t)1<<40)
+#define MOCK_AUTH             "mockauthtoken"
+#define MOCK_EMAIL            "bench@localhost"
+#define MOCK_SUBSCRIBE_TIMEOUT 60
+#define MOCK_DIFF_LIMIT       500000
+#define MOCK_IO_CHUNK         (64*1024)
+#define MOCK_UPLOAD_CHUNK     (1024*1024)
+#define MOCK_HTTP_HEADER_MAX  8192
+
+/* the same values as the RPARAM_ constants of papi.c */
+#define RPARAM_STR4           3
+#define RPARAM_NUM8           15
+#define RPARAM_HASH           16
+#define RPARAM_ARRAY          17
+#define RPARAM_BFALSE         18
+#define RPARAM_BTRUE          19
+#define RPARAM_DATA           20
+#define RPARAM_SHORT_STR_BASE 100
+#define RPARAM_SMALL_NUM_BASE 200
+#define RPARAM_END            255
+
+#define PARAM_STR             0
+#define PARAM_NUM             1
+#define PARAM_BOOL            2
+
+#define MOCK_EV_CREATEFOLDER  0
+#define MOCK_EV_MODIFYFOLDER  1
+#define MOCK_EV_DELETEFOLDER  2
+#define MOCK_EV_CREATEFILE    3
+#define MOCK_EV_MODIFYFILE    4
+#define MOCK_EV_DELETEFILE    5
+
+static const char *mock_event_names[]={"createfolder", "modifyfolder", "deletefolder", "createfile", "modifyfile", "deletefile"};
+
+typedef struct {
+  uint32_t h[5];
+  uint64_t len;
+  unsigned char buff[64];
+} mock_sha1_ctx;
+
+/* contents are shared between files (copyfile) and referenced while being sent, data is NULL for generated contents */
+typedef struct {
+  unsigned char *data;
+  uint64_t size;
+  uint64_t seed;
+  uint32_t refcnt;
+  int hassha1;
+  char sha1[41];
+} mock_content_t;
+
+typedef struct {
+  char *name;
+  mock_content_t *content;
+  uint64_t parentfolderid;
+  uint64_t hash;
+  uint64_t created;
+  uint64_t modified;
+  int deleted;
+} mock_file_t;
+
+typedef struct {
+  char *name;
+  uint64_t parentfolderid;
+  uint64_t created;
+  uint64_t modified;
+  int deleted;
+} mock_folder_t;
+
+typedef struct {
+  uint64_t id;
+  uint64_t time;
+  uint32_t type;
+} mock_event_t;
+
+typedef struct {
+  unsigned char *data;
+  uint64_t size;
+  uint64_t alloc;
+  int used;
+} mock_upload_t;
+
+typedef struct {
+  const char *name;
+  const char *str;
+  uint64_t num;
+  uint32_t len;
+  uint32_t type;
+} mock_param_t;
+
+typedef struct {
+  char cmd[128];
+  mock_param_t params[256];
+  unsigned char buff[65536];
+  uint64_t datalen;
+  uint32_t paramcnt;
+  int hasdata;
+} mock_request_t;
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t alloc;
+} mock_buff_t;
+
+typedef struct {
+  mock_buff_t out;
+  uint64_t requests;
+  int fd;
+} mock_conn_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  uint64_t next;
+} mock_shaper_t;
+
+typedef void (*mock_command_t)(mock_conn_t *, mock_request_t *);
+
+static pthread_mutex_t mock_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_diffcond=PTHREAD_COND_INITIALIZER;
+
+static mock_folder_t *folders=NULL;
+static uint64_t foldercnt=0, folderalloc=0;
+static mock_file_t *files=NULL;
+static uint64_t filecnt=0, filealloc=0;
+static mock_event_t *events=NULL;
+static uint64_t eventcnt=0, eventalloc=0;
+static mock_upload_t *uploads=NULL;
+static uint64_t uploadcnt=0, uploadalloc=0;
+static uint64_t usedquota=0;
+static uint64_t hashseq=0;
+static uint64_t starttime;
+
+static mock_shaper_t shapedown={PTHREAD_MUTEX_INITIALIZER, 0};
+static mock_shaper_t shapeup={PTHREAD_MUTEX_INITIALIZER, 0};
+
+static const char *host="127.0.0.1";
+static int apiport=MOCK_API_PORT;
+static int httpport=MOCK_HTTP_PORT;
+static uint64_t nfiles=1000;
+static uint64_t filesize=64*1024;
+static uint64_t filesperfolder=100;
+static uint64_t readsize=256*1024*1024;
+static uint32_t latency=0;
+static uint64_t bandwidth=0;
+static int verbose=0;
+
+static void *mock_malloc(size_t size){
+  void *ptr;
+  ptr=malloc(size);
+  if (!ptr && size){
+    fprintf(stderr, "out of memory allocating %lu bytes\n", (unsigned long)size);
+    exit(1);
+  }
+  return ptr;
+}
+
+static void *mock_realloc(void *ptr, size_t size){
+  ptr=realloc(ptr, size);
+  if (!ptr && size){
+    fprintf(stderr, "out of memory allocating %lu bytes\n", (unsigned long)size);
+    exit(1);
+  }
+  return ptr;
+}
+
+static char *mock_strdup(const char *str){
+  size_t len;
+  char *ret;
+  len=strlen(str)+1;
+  ret=(char *)mock_malloc(len);
+  memcpy(ret, str, len);
+  return ret;
+}
+
+static uint64_t mock_microtime(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+static void mock_sleep_micro(uint64_t usec){
+  struct timespec ts;
+  ts.tv_sec=usec/1000000;
+  ts.tv_nsec=(usec%1000000)*1000;
+  while (nanosleep(&ts, &ts) && errno==EINTR);
+}
+
+/* both directions have their own bucket shared by all connections, like the two directions of one link */
+static void mock_shape(mock_shaper_t *sh, size_t len){
+  uint64_t now, at;
+  if (!bandwidth)
+    return;
+  pthread_mutex_lock(&sh->mutex);
+  now=mock_microtime();
+  if (sh->next<now)
+    sh->next=now;
+  sh->next+=(uint64_t)len*1000000/bandwidth;
+  at=sh->next;
+  pthread_mutex_unlock(&sh->mutex);
+  now=mock_microtime();
+  if (at>now)
+    mock_sleep_micro(at-now);
+}
+
+static uint64_t mock_mix(uint64_t x){
+  x+=0x9E3779B97F4A7C15ULL;
+  x=(x^(x>>30))*0xBF58476D1CE4E5B9ULL;
+  x=(x^(x>>27))*0x94D049BB133111EBULL;
+  return x^(x>>31);
+}
+
+static void mock_generate(uint64_t seed, uint64_t off, unsigned char *buff, size_t len){
+  uint64_t w;
+  size_t i;
+  w=mock_mix(seed^(off>>3));
+  for (i=0; i<len; i++, off++){
+    if (!(off&7) && i)
+      w=mock_mix(seed^(off>>3));
+    buff[i]=(unsigned char)(w>>((off&7)*8));
+  }
+}
+
+#define SHA1_ROL(v, b) (((v)<<(b))|((v)>>(32-(b))))
+
+static void mock_sha1_block(mock_sha1_ctx *ctx, const unsigned char *b){
+  uint32_t w[80], a, bb, c, d, e, f, k, t;
+  int i;
+  for (i=0; i<16; i++)
+    w[i]=((uint32_t)b[i*4]<<24)|((uint32_t)b[i*4+1]<<16)|((uint32_t)b[i*4+2]<<8)|b[i*4+3];
+  for (i=16; i<80; i++)
+    w[i]=SHA1_ROL(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+  a=ctx->h[0];
+  bb=ctx->h[1];
+  c=ctx->h[2];
+  d=ctx->h[3];
+  e=ctx->h[4];
+  for (i=0; i<80; i++){
+    if (i<20){
+      f=(bb&c)|(~bb&d);
+      k=0x5A827999;
+    }
+    else if (i<40){
+      f=bb^c^d;
+      k=0x6ED9EBA1;
+    }
+    else if (i<60){
+      f=(bb&c)|(bb&d)|(c&d);
+      k=0x8F1BBCDC;
+    }
+    else{
+      f=bb^c^d;
+      k=0xCA62C1D6;
+    }
+    t=SHA1_ROL(a, 5)+f+e+k+w[i];
+    e=d;
+    d=c;
+    c=SHA1_ROL(bb, 30);
+    bb=a;
+    a=t;
+  }
+  ctx->h[0]+=a;
+  ctx->h[1]+=bb;
+  ctx->h[2]+=c;
+  ctx->h[3]+=d;
+  ctx->h[4]+=e;
+}
+
+static void mock_sha1_init(mock_sha1_ctx *ctx){
+  ctx->h[0]=0x67452301;
+  ctx->h[1]=0xEFCDAB89;
+  ctx->h[2]=0x98BADCFE;
+  ctx->h[3]=0x10325476;
+  ctx->h[4]=0xC3D2E1F0;
+  ctx->len=0;
+}
+
+static void mock_sha1_update(mock_sha1_ctx *ctx, const unsigned char *data, size_t len){
+  size_t off, cp;
+  off=ctx->len%64;
+  ctx->len+=len;
+  if (off){
+    cp=64-off;
+    if (cp>len)
+      cp=len;
+    memcpy(ctx->buff+off, data, cp);
+    data+=cp;
+    len-=cp;
+    if (off+cp<64)
+      return;
+    mock_sha1_block(ctx, ctx->buff);
+  }
+  while (len>=64){
+    mock_sha1_block(ctx, data);
+    data+=64;
+    len-=64;
+  }
+  memcpy(ctx->buff, data, len);
+}
+
+static void mock_sha1_final_hex(mock_sha1_ctx *ctx, char *hex){
+  static const char hexdigits[]="0123456789abcdef";
+  unsigned char pad[72];
+  uint64_t bits;
+  size_t padlen;
+  int i;
+  bits=ctx->len*8;
+  padlen=64-(ctx->len+8)%64;
+  memset(pad, 0, sizeof(pad));
+  pad[0]=0x80;
+  for (i=0; i<8; i++)
+    pad[padlen+i]=(unsigned char)(bits>>(56-i*8));
+  mock_sha1_update(ctx, pad, padlen+8);
+  for (i=0; i<20; i++){
+    hex[i*2]=hexdigits[(ctx->h[i/4]>>(24-(i%4)*8)>>4)&15];
+    hex[i*2+1]=hexdigits[(ctx->h[i/4]>>(24-(i%4)*8))&15];
+  }
+  hex[40]=0;
+}
+
+static mock_content_t *mock_content_new(unsigned char *data, uint64_t size, uint64_t seed){
+  mock_content_t *ct;
+  ct=(mock_content_t *)mock_malloc(sizeof(mock_content_t));
+  ct->data=data;
+  ct->size=size;
+  ct->seed=seed;
+  ct->refcnt=1;
+  ct->hassha1=0;
+  return ct;
+}
+
+static void mock_content_release_locked(mock_content_t *ct){
+  if (--ct->refcnt==0){
+    free(ct->data);
+    free(ct);
+  }
+}
+
+static void mock_content_read(mock_content_t *ct, uint64_t off, unsigned char *buff, size_t len){
+  if (ct->data)
+    memcpy(buff, ct->data+off, len);
+  else
+    mock_generate(ct->seed, off, buff, len);
+}
+
+/* checksums are only computed on request, generated contents of large files take a while */
+static void mock_content_sha1(mock_content_t *ct, char *hex){
+  mock_sha1_ctx ctx;
+  unsigned char *buff;
+  uint64_t off;
+  size_t len;
+  pthread_mutex_lock(&mock_mutex);
+  if (ct->hassha1){
+    memcpy(hex, ct->sha1, sizeof(ct->sha1));
+    pthread_mutex_unlock(&mock_mutex);
+    return;
+  }
+  ct->refcnt++;
+  pthread_mutex_unlock(&mock_mutex);
+  mock_sha1_init(&ctx);
+  if (ct->data)
+    mock_sha1_update(&ctx, ct->data, ct->size);
+  else{
+    buff=(unsigned char *)mock_malloc(MOCK_UPLOAD_CHUNK);
+    for (off=0; off<ct->size; off+=len){
+      len=ct->size-off>MOCK_UPLOAD_CHUNK?MOCK_UPLOAD_CHUNK:ct->size-off;
+      mock_generate(ct->seed, off, buff, len);
+      mock_sha1_update(&ctx, buff, len);
+    }
+    free(buff);
+  }
+  mock_sha1_final_hex(&ctx, hex);
+  pthread_mutex_lock(&mock_mutex);
+  memcpy(ct->sha1, hex, sizeof(ct->sha1));
+  ct->hassha1=1;
+  mock_content_release_locked(ct);
+  pthread_mutex_unlock(&mock_mutex);
+}
+
+static uint64_t mock_new_hash_locked(){
+  return mock_mix(++hashseq)>>1;
+}
+
+static void mock_add_event_locked(uint32_t type, uint64_t id){
+  if (eventcnt==eventalloc){
+    eventalloc=eventalloc?eventalloc*2:1024;
+    events=(mock_event_t *)mock_realloc(events, sizeof(mock_event_t)*eventalloc);
+  }
+  events[eventcnt].id=id;
+  events[eventcnt].time=time(NULL);
+  events[eventcnt].type=type;
+  eventcnt++;
+  pthread_cond_broadcast(&mock_diffcond);
+}
+
+static uint64_t mock_add_folder_locked(uint64_t parentfolderid, const char *name, uint64_t tm){
+  if (foldercnt==folderalloc){
+    folderalloc=folderalloc?folderalloc*2:256;
+    folders=(mock_folder_t *)mock_realloc(folders, sizeof(mock_folder_t)*folderalloc);
+  }
+  folders[foldercnt].name=mock_strdup(name);
+  folders[foldercnt].parentfolderid=parentfolderid;
+  folders[foldercnt].created=tm;
+  folders[foldercnt].modified=tm;
+  folders[foldercnt].deleted=0;
+  if (foldercnt)
+    mock_add_event_locked(MOCK_EV_CREATEFOLDER, foldercnt);
+  return foldercnt++;
+}
+
+static uint64_t mock_add_file_locked(uint64_t parentfolderid, const char *name, mock_content_t *ct, uint64_t tm){
+  if (filecnt==filealloc){
+    filealloc=filealloc?filealloc*2:1024;
+    files=(mock_file_t *)mock_realloc(files, sizeof(mock_file_t)*filealloc);
+  }
+  /* fileid 0 is not valid */
+  if (!filecnt){
+    memset(&files[0], 0, sizeof(mock_file_t));
+    files[0].deleted=1;
+    filecnt++;
+  }
+  files[filecnt].name=mock_strdup(name);
+  files[filecnt].content=ct;
+  files[filecnt].parentfolderid=parentfolderid;
+  files[filecnt].hash=mock_new_hash_locked();
+  files[filecnt].created=tm;
+  files[filecnt].modified=tm;
+  files[filecnt].deleted=0;
+  usedquota+=ct->size;
+  mock_add_event_locked(MOCK_EV_CREATEFILE, filecnt);
+  return filecnt++;
+}
+
+static mock_file_t *mock_get_file_locked(uint64_t fileid){
+  if (fileid>=filecnt || files[fileid].deleted)
+    return NULL;
+  else
+    return &files[fileid];
+}
+
+static mock_folder_t *mock_get_folder_locked(uint64_t folderid){
+  if (folderid>=foldercnt || folders[folderid].deleted)
+    return NULL;
+  else
+    return &folders[folderid];
+}
+
+static uint64_t mock_find_file_locked(uint64_t folderid, const char *name){
+  uint64_t i;
+  for (i=1; i<filecnt; i++)
+    if (!files[i].deleted && files[i].parentfolderid==folderid && !strcmp(files[i].name, name))
+      return i;
+  return 0;
+}
+
+static uint64_t mock_find_folder_locked(uint64_t folderid, const char *name){
+  uint64_t i;
+  for (i=1; i<foldercnt; i++)
+    if (!folders[i].deleted && folders[i].parentfolderid==folderid && !strcmp(folders[i].name, name))
+      return i;
+  return 0;
+}
+
+static void mock_create_tree(){
+  char name[64];
+  uint64_t tm, filesfolderid, benchfolderid, folderid, i;
+  tm=starttime;
+  pthread_mutex_lock(&mock_mutex);
+  mock_add_folder_locked(0, "", tm);
+  filesfolderid=mock_add_folder_locked(0, "files", tm);
+  folderid=filesfolderid;
+  for (i=0; i<nfiles; i++){
+    if (filesperfolder && i%filesperfolder==0){
+      snprintf(name, sizeof(name), "dir%05lu", (unsigned long)(i/filesperfolder));
+      folderid=mock_add_folder_locked(filesfolderid, name, tm);
+    }
+    snprintf(name, sizeof(name), "file%07lu.bin", (unsigned long)i);
+    mock_add_file_locked(folderid, name, mock_content_new(NULL, filesize, mock_mix(i+1)), tm);
+  }
+  if (readsize){
+    benchfolderid=mock_add_folder_locked(0, "bench", tm);
+    mock_add_file_locked(benchfolderid, "read.bin", mock_content_new(NULL, readsize, mock_mix(nfiles+1)), tm);
+    mock_add_file_locked(benchfolderid, "random.bin", mock_content_new(NULL, readsize, mock_mix(nfiles+2)), tm);
+  }
+  pthread_mutex_unlock(&mock_mutex);
+}
+
+static void out_put(mock_buff_t *b, const void *data, size_t len){
+  if (b->len+len>b->alloc){
+    while (b->len+len>b->alloc)
+      b->alloc*=2;
+    b->data=(unsigned char *)mock_realloc(b->data, b->alloc);
+  }
+  memcpy(b->data+b->len, data, len);
+  b->len+=len;
+}
+
+static void out_byte(mock_buff_t *b, unsigned char ch){
+  out_put(b, &ch, 1);
+}
+
+static void out_lstr(mock_buff_t *b, const char *str, size_t len){
+  uint32_t l;
+  if (len<50)
+    out_byte(b, RPARAM_SHORT_STR_BASE+len);
+  else{
+    l=len;
+    out_byte(b, RPARAM_STR4);
+    out_put(b, &l, 4);
+  }
+  out_put(b, str, len);
+}
+
+static void out_str(mock_buff_t *b, const char *str){
+  out_lstr(b, str, strlen(str));
+}
+
+static void out_num(mock_buff_t *b, uint64_t num){
+  if (num<20)
+    out_byte(b, RPARAM_SMALL_NUM_BASE+num);
+  else{
+    out_byte(b, RPARAM_NUM8);
+    out_put(b, &num, 8);
+  }
+}
+
+static void out_bool(mock_buff_t *b, int val){
+  out_byte(b, val?RPARAM_BTRUE:RPARAM_BFALSE);
+}
+
+static void out_hash(mock_buff_t *b){
+  out_byte(b, RPARAM_HASH);
+}
+
+static void out_array(mock_buff_t *b){
+  out_byte(b, RPARAM_ARRAY);
+}
+
+static void out_end(mock_buff_t *b){
+  out_byte(b, RPARAM_END);
+}
+
+static void out_key_num(mock_buff_t *b, const char *key, uint64_t num){
+  out_str(b, key);
+  out_num(b, num);
+}
+
+static void out_key_str(mock_buff_t *b, const char *key, const char *str){
+  out_str(b, key);
+  out_str(b, str);
+}
+
+static void out_key_bool(mock_buff_t *b, const char *key, int val){
+  out_str(b, key);
+  out_bool(b, val);
+}
+
+static void out_file_meta_locked(mock_buff_t *b, uint64_t fileid){
+  char id[32];
+  mock_file_t *f;
+  f=&files[fileid];
+  snprintf(id, sizeof(id), "f%lu", (unsigned long)fileid);
+  out_hash(b);
+  out_key_num(b, "fileid", fileid);
+  out_key_num(b, "parentfolderid", f->parentfolderid);
+  out_key_str(b, "name", f->name);
+  out_key_str(b, "id", id);
+  out_key_num(b, "size", f->content->size);
+  out_key_num(b, "hash", f->hash);
+  out_key_num(b, "created", f->created);
+  out_key_num(b, "modified", f->modified);
+  out_key_bool(b, "isfolder", 0);
+  out_key_bool(b, "ismine", 1);
+  out_key_bool(b, "isshared", 0);
+  out_key_bool(b, "thumb", 0);
+  out_key_num(b, "category", 0);
+  out_key_str(b, "icon", "file");
+  out_key_str(b, "contenttype", "application/octet-stream");
+  if (f->deleted)
+    out_key_bool(b, "isdeleted", 1);
+  out_end(b);
+}
+
+static void out_folder_meta_locked(mock_buff_t *b, uint64_t folderid){
+  char id[32];
+  mock_folder_t *f;
+  f=&folders[folderid];
+  snprintf(id, sizeof(id), "d%lu", (unsigned long)folderid);
+  out_hash(b);
+  out_key_num(b, "folderid", folderid);
+  out_key_num(b, "parentfolderid", f->parentfolderid);
+  out_key_str(b, "name", f->name);
+  out_key_str(b, "id", id);
+  out_key_num(b, "created", f->created);
+  out_key_num(b, "modified", f->modified);
+  out_key_bool(b, "isfolder", 1);
+  out_key_bool(b, "ismine", 1);
+  out_key_bool(b, "isshared", 0);
+  out_key_bool(b, "thumb", 0);
+  out_key_str(b, "icon", "folder");
+  if (f->deleted)
+    out_key_bool(b, "isdeleted", 1);
+  out_end(b);
+}
+
+static void out_start(mock_conn_t *c){
+  c->out.len=4;
+}
+
+static int conn_write(mock_conn_t *c, const void *data, size_t len){
+  const char *d;
+  ssize_t wr;
+  d=(const char *)data;
+  while (len){
+    wr=send(c->fd, d, len, MSG_NOSIGNAL);
+    if (wr<=0){
+      if (wr==-1 && errno==EINTR)
+        continue;
+      return -1;
+    }
+    d+=wr;
+    len-=wr;
+  }
+  return 0;
+}
+
+static int conn_read(mock_conn_t *c, void *data, size_t len){
+  char *d;
+  ssize_t rd;
+  d=(char *)data;
+  while (len){
+    rd=recv(c->fd, d, len, 0);
+    if (rd<=0){
+      if (rd==-1 && errno==EINTR)
+        continue;
+      return -1;
+    }
+    d+=rd;
+    len-=rd;
+  }
+  return 0;
+}
+
+static int conn_write_shaped(mock_conn_t *c, const void *data, size_t len){
+  const char *d;
+  size_t l;
+  d=(const char *)data;
+  while (len){
+    l=len>MOCK_IO_CHUNK?MOCK_IO_CHUNK:len;
+    mock_shape(&shapedown, l);
+    if (conn_write(c, d, l))
+      return -1;
+    d+=l;
+    len-=l;
+  }
+  return 0;
+}
+
+static int conn_read_shaped(mock_conn_t *c, void *data, size_t len){
+  char *d;
+  size_t l;
+  d=(char *)data;
+  while (len){
+    l=len>MOCK_IO_CHUNK?MOCK_IO_CHUNK:len;
+    mock_shape(&shapeup, l);
+    if (conn_read(c, d, l))
+      return -1;
+    d+=l;
+    len-=l;
+  }
+  return 0;
+}
+
+static int out_send(mock_conn_t *c){
+  uint32_t len;
+  len=c->out.len-4;
+  memcpy(c->out.data, &len, 4);
+  if (latency)
+    mock_sleep_micro((uint64_t)latency*1000);
+  return conn_write_shaped(c, c->out.data, c->out.len);
+}
+
+static void send_error(mock_conn_t *c, uint64_t result, const char *error){
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", result);
+  out_key_str(&c->out, "error", error);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void send_ok(mock_conn_t *c){
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static const mock_param_t *get_param(mock_request_t *r, const char *name, uint32_t type){
+  uint32_t i;
+  for (i=0; i<r->paramcnt; i++)
+    if (r->params[i].type==type && !strcmp(r->params[i].name, name))
+      return &r->params[i];
+  return NULL;
+}
+
+static uint64_t get_num(mock_request_t *r, const char *name, uint64_t def){
+  const mock_param_t *p;
+  p=get_param(r, name, PARAM_NUM);
+  return p?p->num:def;
+}
+
+static const char *get_str(mock_request_t *r, const char *name){
+  const mock_param_t *p;
+  p=get_param(r, name, PARAM_STR);
+  return p?p->str:NULL;
+}
+
+static int has_param(mock_request_t *r, const char *name){
+  uint32_t i;
+  for (i=0; i<r->paramcnt; i++)
+    if (!strcmp(r->params[i].name, name))
+      return 1;
+  return 0;
+}
+
+/* parameter names and string values are zero terminated in place, the byte after each one is not needed anymore */
+static int read_request(mock_conn_t *c, mock_request_t *r){
+  unsigned char *d, *end;
+  uint32_t i, len, type, nlen;
+  uint16_t plen;
+  if (conn_read(c, &plen, 2) || plen<2 || conn_read(c, r->buff, plen))
+    return -1;
+  d=r->buff;
+  end=r->buff+plen;
+  len=*d++;
+  r->hasdata=(len&0x80)!=0;
+  len&=0x7f;
+  if (r->hasdata){
+    if (d+8>end)
+      return -1;
+    memcpy(&r->datalen, d, 8);
+    d+=8;
+  }
+  else
+    r->datalen=0;
+  if (d+len+1>end)
+    return -1;
+  memcpy(r->cmd, d, len);
+  r->cmd[len]=0;
+  d+=len;
+  r->paramcnt=*d++;
+  for (i=0; i<r->paramcnt; i++){
+    if (d>=end)
+      return -1;
+    type=*d>>6;
+    nlen=*d&0x3f;
+    d++;
+    if (d+nlen>end)
+      return -1;
+    r->params[i].name=(const char *)d;
+    r->params[i].type=type;
+    d+=nlen;
+    if (type==PARAM_STR){
+      if (d+4>end)
+        return -1;
+      memcpy(&len, d, 4);
+      d[0]=0;
+      d+=4;
+      if (d+len>end)
+        return -1;
+      r->params[i].str=(const char *)d;
+      r->params[i].len=len;
+      r->params[i].num=0;
+      d+=len;
+    }
+    else if (type==PARAM_NUM){
+      if (d+8>end)
+        return -1;
+      memcpy(&r->params[i].num, d, 8);
+      d[0]=0;
+      d+=8;
+    }
+    else if (type==PARAM_BOOL){
+      if (d+1>end)
+        return -1;
+      r->params[i].num=*d&1;
+      d[0]=0;
+      d++;
+    }
+    else
+      return -1;
+  }
+  /* string values are terminated by the type byte of the next parameter or by the end of the buffer */
+  for (i=0; i<r->paramcnt; i++)
+    if (r->params[i].type==PARAM_STR)
+      ((char *)r->params[i].str)[r->params[i].len]=0;
+  return 0;
+}
+
+/* skips the data of a request that was not consumed by its handler */
+static int skip_data(mock_conn_t *c, mock_request_t *r){
+  unsigned char buff[MOCK_IO_CHUNK];
+  size_t l;
+  while (r->datalen){
+    l=r->datalen>sizeof(buff)?sizeof(buff):r->datalen;
+    if (conn_read_shaped(c, buff, l))
+      return -1;
+    r->datalen-=l;
+  }
+  return 0;
+}
+
+static void cmd_getdigest(mock_conn_t *c, mock_request_t *r){
+  char digest[33];
+  snprintf(digest, sizeof(digest), "%016"PRIx64"%016"PRIx64, mock_mix(mock_microtime()), mock_mix(starttime));
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_str(&c->out, "digest", digest);
+  out_key_num(&c->out, "expires", time(NULL)+600);
+  out_end(&c->out);
+  out_send(c);
+}
+
+/* any user name, password or token is accepted */
+static void cmd_userinfo(mock_conn_t *c, mock_request_t *r){
+  uint64_t uq;
+  pthread_mutex_lock(&mock_mutex);
+  uq=usedquota;
+  pthread_mutex_unlock(&mock_mutex);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_str(&c->out, "auth", MOCK_AUTH);
+  out_key_num(&c->out, "userid", MOCK_USERID);
+  out_key_str(&c->out, "email", MOCK_EMAIL);
+  out_key_bool(&c->out, "emailverified", 1);
+  out_key_bool(&c->out, "premium", 1);
+  out_key_num(&c->out, "premiumexpires", starttime+365*86400);
+  out_key_num(&c->out, "quota", MOCK_QUOTA);
+  out_key_num(&c->out, "usedquota", uq);
+  out_key_str(&c->out, "language", "en");
+  out_key_num(&c->out, "registered", starttime);
+  out_key_bool(&c->out, "cryptosetup", 0);
+  out_key_bool(&c->out, "cryptosubscription", 0);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void out_diff_entries_locked(mock_buff_t *b, uint64_t diffid, uint64_t limit, uint64_t *lastdiffid){
+  mock_event_t *ev;
+  uint64_t i;
+  out_str(b, "entries");
+  out_array(b);
+  for (i=diffid; i<eventcnt && i-diffid<limit; i++){
+    ev=&events[i];
+    out_hash(b);
+    out_key_str(b, "event", mock_event_names[ev->type]);
+    out_key_num(b, "diffid", i+1);
+    out_key_num(b, "time", ev->time);
+    out_str(b, "metadata");
+    if (ev->type>=MOCK_EV_CREATEFILE)
+      out_file_meta_locked(b, ev->id);
+    else
+      out_folder_meta_locked(b, ev->id);
+    out_end(b);
+  }
+  out_end(b);
+  *lastdiffid=i;
+}
+
+static void cmd_diff(mock_conn_t *c, mock_request_t *r){
+  uint64_t diffid, lastdiffid;
+  diffid=get_num(r, "diffid", 0);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  pthread_mutex_lock(&mock_mutex);
+  out_diff_entries_locked(&c->out, diffid, get_num(r, "limit", MOCK_DIFF_LIMIT), &lastdiffid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_key_num(&c->out, "diffid", lastdiffid);
+  out_end(&c->out);
+  out_send(c);
+}
+
+/* waits for new diff entries; a command that arrives in the meantime (e.g. a nop) cancels the wait with 6002 */
+static void cmd_subscribe(mock_conn_t *c, mock_request_t *r){
+  struct pollfd pfd;
+  struct timespec ts;
+  uint64_t diffid, lastdiffid, deadline;
+  diffid=get_num(r, "diffid", 0);
+  deadline=mock_microtime()+MOCK_SUBSCRIBE_TIMEOUT*1000000ULL;
+  pfd.fd=c->fd;
+  pfd.events=POLLIN;
+  pthread_mutex_lock(&mock_mutex);
+  while (eventcnt<=diffid){
+    if (mock_microtime()>=deadline){
+      pthread_mutex_unlock(&mock_mutex);
+      send_error(c, 6003, "Timeout.");
+      return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec+=100*1000000;
+    if (ts.tv_nsec>=1000000000){
+      ts.tv_sec++;
+      ts.tv_nsec-=1000000000;
+    }
+    pthread_cond_timedwait(&mock_diffcond, &mock_mutex, &ts);
+    if (eventcnt>diffid)
+      break;
+    pthread_mutex_unlock(&mock_mutex);
+    if (poll(&pfd, 1, 0)==1){
+      send_error(c, 6002, "Cancelled.");
+      return;
+    }
+    pthread_mutex_lock(&mock_mutex);
+  }
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_str(&c->out, "from", "diff");
+  out_diff_entries_locked(&c->out, diffid, get_num(r, "difflimit", MOCK_DIFF_LIMIT), &lastdiffid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_key_num(&c->out, "diffid", lastdiffid);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_nop(mock_conn_t *c, mock_request_t *r){
+  send_ok(c);
+}
+
+#if defined(__linux__)
+/* data segments received on the connection, 0 if the kernel does not report them */
+static uint64_t conn_segments_in(mock_conn_t *c){
+  struct tcp_info ti;
+  socklen_t len;
+  memset(&ti, 0, sizeof(ti));
+  len=sizeof(ti);
+  if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+    return 0;
+  return ti.tcpi_data_segs_in;
+}
+#endif
+
+static void cmd_connstats(mock_conn_t *c, mock_request_t *r){
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_num(&c->out, "requests", c->requests);
+#if defined(__linux__)
+  out_key_num(&c->out, "segments", conn_segments_in(c));
+#endif
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_getfilelink(mock_conn_t *c, mock_request_t *r){
+  char path[96], hst[128];
+  mock_file_t *f;
+  uint64_t fileid, hash, size;
+  fileid=get_num(r, "fileid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(fileid);
+  if (!f || (has_param(r, "hash") && get_num(r, "hash", 0)!=f->hash)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  hash=f->hash;
+  size=f->content->size;
+  pthread_mutex_unlock(&mock_mutex);
+  snprintf(path, sizeof(path), "/%lu/%lu/data", (unsigned long)fileid, (unsigned long)hash);
+  snprintf(hst, sizeof(hst), "%s:%d", host, httpport);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_str(&c->out, "path", path);
+  out_str(&c->out, "hosts");
+  out_array(&c->out);
+  out_str(&c->out, hst);
+  out_end(&c->out);
+  out_key_num(&c->out, "size", size);
+  out_key_num(&c->out, "hash", hash);
+  out_key_num(&c->out, "expires", time(NULL)+86400);
+  out_end(&c->out);
+  out_send(c);
+}
+
+/* takes a reference to the contents of a file, NULL if the file or the revision does not exist */
+static mock_content_t *get_file_content(mock_request_t *r, uint64_t *fileid){
+  mock_content_t *ct;
+  mock_file_t *f;
+  *fileid=get_num(r, "fileid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(*fileid);
+  if (!f || (has_param(r, "hash") && get_num(r, "hash", 0)!=f->hash))
+    ct=NULL;
+  else{
+    ct=f->content;
+    ct->refcnt++;
+  }
+  pthread_mutex_unlock(&mock_mutex);
+  return ct;
+}
+
+static void release_content(mock_content_t *ct){
+  pthread_mutex_lock(&mock_mutex);
+  mock_content_release_locked(ct);
+  pthread_mutex_unlock(&mock_mutex);
+}
+
+static int send_content(mock_conn_t *c, mock_content_t *ct, uint64_t off, uint64_t len){
+  unsigned char *buff;
+  size_t l;
+  int ret;
+  buff=(unsigned char *)mock_malloc(MOCK_IO_CHUNK);
+  ret=0;
+  while (len){
+    l=len>MOCK_IO_CHUNK?MOCK_IO_CHUNK:len;
+    mock_content_read(ct, off, buff, l);
+    mock_shape(&shapedown, l);
+    if (conn_write(c, buff, l)){
+      ret=-1;
+      break;
+    }
+    off+=l;
+    len-=l;
+  }
+  free(buff);
+  return ret;
+}
+
+static void cmd_readfile(mock_conn_t *c, mock_request_t *r){
+  mock_content_t *ct;
+  uint64_t fileid, off, cnt;
+  ct=get_file_content(r, &fileid);
+  if (!ct){
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  off=get_num(r, "offset", 0);
+  cnt=get_num(r, "count", 0);
+  if (off>ct->size)
+    off=ct->size;
+  if (cnt>ct->size-off)
+    cnt=ct->size-off;
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "data");
+  out_byte(&c->out, RPARAM_DATA);
+  out_put(&c->out, &cnt, 8);
+  out_end(&c->out);
+  if (!out_send(c))
+    send_content(c, ct, off, cnt);
+  release_content(ct);
+}
+
+static void cmd_checksumfile(mock_conn_t *c, mock_request_t *r){
+  char sha1[41];
+  mock_content_t *ct;
+  uint64_t fileid;
+  ct=get_file_content(r, &fileid);
+  if (!ct){
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  mock_content_sha1(ct, sha1);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_str(&c->out, "sha1", sha1);
+  out_str(&c->out, "metadata");
+  pthread_mutex_lock(&mock_mutex);
+  mock_content_release_locked(ct);
+  out_file_meta_locked(&c->out, fileid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+/* creates a file or replaces the contents of the file with the same name, takes ownership of ct */
+static uint64_t mock_save_file_locked(uint64_t folderid, const char *name, mock_content_t *ct, uint64_t mtime, uint64_t *err){
+  mock_file_t *f;
+  uint64_t fileid;
+  if (!mock_get_folder_locked(folderid)){
+    *err=2005;
+    mock_content_release_locked(ct);
+    return 0;
+  }
+  if (!name || !name[0] || strchr(name, '/')){
+    *err=2001;
+    mock_content_release_locked(ct);
+    return 0;
+  }
+  *err=0;
+  if (!mtime)
+    mtime=time(NULL);
+  fileid=mock_find_file_locked(folderid, name);
+  if (!fileid)
+    return mock_add_file_locked(folderid, name, ct, mtime);
+  f=&files[fileid];
+  usedquota-=f->content->size;
+  usedquota+=ct->size;
+  mock_content_release_locked(f->content);
+  f->content=ct;
+  f->hash=mock_new_hash_locked();
+  f->modified=mtime;
+  mock_add_event_locked(MOCK_EV_MODIFYFILE, fileid);
+  return fileid;
+}
+
+static const char *mock_error_str(uint64_t err){
+  switch (err){
+    case 2001: return "Invalid file/folder name.";
+    case 2004: return "File or folder alredy exists.";
+    case 2005: return "Directory does not exist.";
+    case 2006: return "Folder is not empty.";
+    case 2009: return "File not found.";
+    case 2068: return "Invalid upload id.";
+    default:   return "Error.";
+  }
+}
+
+static void cmd_uploadfile(mock_conn_t *c, mock_request_t *r){
+  unsigned char *data;
+  uint64_t fileid, err;
+  data=(unsigned char *)mock_malloc(r->datalen?r->datalen:1);
+  if (conn_read_shaped(c, data, r->datalen)){
+    free(data);
+    r->datalen=0;
+    return;
+  }
+  pthread_mutex_lock(&mock_mutex);
+  fileid=mock_save_file_locked(get_num(r, "folderid", 0), get_str(r, "filename"), mock_content_new(data, r->datalen, 0),
+                               get_num(r, "mtime", 0), &err);
+  r->datalen=0;
+  if (err){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, err, mock_error_str(err));
+    return;
+  }
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_array(&c->out);
+  out_file_meta_locked(&c->out, fileid);
+  out_end(&c->out);
+  out_str(&c->out, "fileids");
+  out_array(&c->out);
+  out_num(&c->out, fileid);
+  out_end(&c->out);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_upload_create(mock_conn_t *c, mock_request_t *r){
+  uint64_t uploadid, size;
+  size=get_num(r, "filesize", 0);
+  pthread_mutex_lock(&mock_mutex);
+  if (uploadcnt==uploadalloc){
+    uploadalloc=uploadalloc?uploadalloc*2:64;
+    uploads=(mock_upload_t *)mock_realloc(uploads, sizeof(mock_upload_t)*uploadalloc);
+  }
+  /* uploadid 0 is not valid */
+  if (!uploadcnt)
+    uploads[uploadcnt++].used=0;
+  uploadid=uploadcnt++;
+  uploads[uploadid].data=(unsigned char *)mock_malloc(size?size:1);
+  uploads[uploadid].alloc=size?size:1;
+  uploads[uploadid].size=0;
+  uploads[uploadid].used=1;
+  pthread_mutex_unlock(&mock_mutex);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_num(&c->out, "uploadid", uploadid);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static mock_upload_t *mock_get_upload_locked(uint64_t uploadid){
+  if (uploadid>=uploadcnt || !uploads[uploadid].used)
+    return NULL;
+  else
+    return &uploads[uploadid];
+}
+
+static void mock_upload_put_locked(mock_upload_t *u, uint64_t off, const unsigned char *data, uint64_t len){
+  if (off+len>u->alloc){
+    while (off+len>u->alloc)
+      u->alloc*=2;
+    u->data=(unsigned char *)mock_realloc(u->data, u->alloc);
+  }
+  if (off>u->size)
+    memset(u->data+u->size, 0, off-u->size);
+  memcpy(u->data+off, data, len);
+  if (off+len>u->size)
+    u->size=off+len;
+}
+
+static void cmd_upload_write(mock_conn_t *c, mock_request_t *r){
+  unsigned char *buff;
+  mock_upload_t *u;
+  uint64_t uploadid, off;
+  size_t l;
+  int bad;
+  uploadid=get_num(r, "uploadid", 0);
+  off=get_num(r, "uploadoffset", 0);
+  buff=(unsigned char *)mock_malloc(MOCK_UPLOAD_CHUNK);
+  bad=0;
+  while (r->datalen){
+    l=r->datalen>MOCK_UPLOAD_CHUNK?MOCK_UPLOAD_CHUNK:r->datalen;
+    if (conn_read_shaped(c, buff, l)){
+      free(buff);
+      r->datalen=0;
+      return;
+    }
+    pthread_mutex_lock(&mock_mutex);
+    u=mock_get_upload_locked(uploadid);
+    if (u)
+      mock_upload_put_locked(u, off, buff, l);
+    else
+      bad=1;
+    pthread_mutex_unlock(&mock_mutex);
+    off+=l;
+    r->datalen-=l;
+  }
+  free(buff);
+  if (bad)
+    send_error(c, 2068, mock_error_str(2068));
+  else
+    send_ok(c);
+}
+
+static void cmd_upload_writefromfile(mock_conn_t *c, mock_request_t *r){
+  unsigned char *buff;
+  mock_content_t *ct;
+  mock_upload_t *u;
+  uint64_t fileid, uploadid, uoff, off, cnt;
+  size_t l;
+  int bad;
+  ct=get_file_content(r, &fileid);
+  if (!ct){
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  uploadid=get_num(r, "uploadid", 0);
+  uoff=get_num(r, "uploadoffset", 0);
+  off=get_num(r, "offset", 0);
+  cnt=get_num(r, "count", 0);
+  if (off>ct->size)
+    off=ct->size;
+  if (cnt>ct->size-off)
+    cnt=ct->size-off;
+  buff=(unsigned char *)mock_malloc(MOCK_UPLOAD_CHUNK);
+  bad=0;
+  while (cnt && !bad){
+    l=cnt>MOCK_UPLOAD_CHUNK?MOCK_UPLOAD_CHUNK:cnt;
+    mock_content_read(ct, off, buff, l);
+    pthread_mutex_lock(&mock_mutex);
+    u=mock_get_upload_locked(uploadid);
+    if (u)
+      mock_upload_put_locked(u, uoff, buff, l);
+    else
+      bad=1;
+    pthread_mutex_unlock(&mock_mutex);
+    off+=l;
+    uoff+=l;
+    cnt-=l;
+  }
+  free(buff);
+  release_content(ct);
+  if (bad)
+    send_error(c, 2068, mock_error_str(2068));
+  else
+    send_ok(c);
+}
+
+static void cmd_upload_info(mock_conn_t *c, mock_request_t *r){
+  mock_sha1_ctx ctx;
+  mock_upload_t *u;
+  uint64_t size;
+  char sha1[41];
+  pthread_mutex_lock(&mock_mutex);
+  u=mock_get_upload_locked(get_num(r, "uploadid", 0));
+  if (!u){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2068, mock_error_str(2068));
+    return;
+  }
+  mock_sha1_init(&ctx);
+  mock_sha1_update(&ctx, u->data, u->size);
+  mock_sha1_final_hex(&ctx, sha1);
+  size=u->size;
+  pthread_mutex_unlock(&mock_mutex);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_num(&c->out, "size", size);
+  out_key_str(&c->out, "sha1", sha1);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_upload_delete(mock_conn_t *c, mock_request_t *r){
+  mock_upload_t *u;
+  pthread_mutex_lock(&mock_mutex);
+  u=mock_get_upload_locked(get_num(r, "uploadid", 0));
+  if (u){
+    free(u->data);
+    u->used=0;
+  }
+  pthread_mutex_unlock(&mock_mutex);
+  send_ok(c);
+}
+
+static void cmd_upload_save(mock_conn_t *c, mock_request_t *r){
+  mock_upload_t *u;
+  mock_content_t *ct;
+  uint64_t fileid, err;
+  pthread_mutex_lock(&mock_mutex);
+  u=mock_get_upload_locked(get_num(r, "uploadid", 0));
+  if (!u){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2068, mock_error_str(2068));
+    return;
+  }
+  ct=mock_content_new(u->data, u->size, 0);
+  u->data=NULL;
+  u->used=0;
+  fileid=mock_save_file_locked(get_num(r, "folderid", 0), get_str(r, "name"), ct, get_num(r, "mtime", 0), &err);
+  if (err){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, err, mock_error_str(err));
+    return;
+  }
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_file_meta_locked(&c->out, fileid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_copyfile(mock_conn_t *c, mock_request_t *r){
+  mock_content_t *ct;
+  mock_file_t *f;
+  const char *name;
+  uint64_t fileid, newfileid, err;
+  ct=get_file_content(r, &fileid);
+  if (!ct){
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(fileid);
+  name=get_str(r, "toname");
+  if (!name && f)
+    name=f->name;
+  newfileid=mock_save_file_locked(get_num(r, "tofolderid", 0), name, ct, 0, &err);
+  if (err){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, err, mock_error_str(err));
+    return;
+  }
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_file_meta_locked(&c->out, newfileid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_getfilesbychecksum(mock_conn_t *c, mock_request_t *r){
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_array(&c->out);
+  out_end(&c->out);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_deletefile(mock_conn_t *c, mock_request_t *r){
+  mock_file_t *f;
+  uint64_t fileid;
+  fileid=get_num(r, "fileid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(fileid);
+  if (!f){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  f->deleted=1;
+  usedquota-=f->content->size;
+  mock_add_event_locked(MOCK_EV_DELETEFILE, fileid);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_file_meta_locked(&c->out, fileid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_renamefile(mock_conn_t *c, mock_request_t *r){
+  mock_file_t *f;
+  const char *name;
+  uint64_t fileid, folderid, existing;
+  fileid=get_num(r, "fileid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(fileid);
+  if (!f){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2009, "File not found.");
+    return;
+  }
+  folderid=get_num(r, "tofolderid", f->parentfolderid);
+  name=get_str(r, "toname");
+  if (!name)
+    name=f->name;
+  if (!mock_get_folder_locked(folderid)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2005, mock_error_str(2005));
+    return;
+  }
+  /* like the real server, renaming over an existing file replaces it */
+  existing=mock_find_file_locked(folderid, name);
+  if (existing && existing!=fileid){
+    files[existing].deleted=1;
+    usedquota-=files[existing].content->size;
+    mock_add_event_locked(MOCK_EV_DELETEFILE, existing);
+  }
+  f->parentfolderid=folderid;
+  if (strcmp(f->name, name)){
+    free(f->name);
+    f->name=mock_strdup(name);
+  }
+  mock_add_event_locked(MOCK_EV_MODIFYFILE, fileid);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_file_meta_locked(&c->out, fileid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void do_createfolder(mock_conn_t *c, mock_request_t *r, int ifnotexists){
+  const char *name;
+  uint64_t parentfolderid, folderid;
+  int created;
+  parentfolderid=get_num(r, "folderid", 0);
+  name=get_str(r, "name");
+  pthread_mutex_lock(&mock_mutex);
+  if (!mock_get_folder_locked(parentfolderid)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2005, mock_error_str(2005));
+    return;
+  }
+  if (!name || !name[0] || strchr(name, '/')){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2001, mock_error_str(2001));
+    return;
+  }
+  folderid=mock_find_folder_locked(parentfolderid, name);
+  if (folderid){
+    if (!ifnotexists){
+      pthread_mutex_unlock(&mock_mutex);
+      send_error(c, 2004, mock_error_str(2004));
+      return;
+    }
+    created=0;
+  }
+  else{
+    folderid=mock_add_folder_locked(parentfolderid, name, time(NULL));
+    created=1;
+  }
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_key_bool(&c->out, "created", created);
+  out_str(&c->out, "metadata");
+  out_folder_meta_locked(&c->out, folderid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_createfolder(mock_conn_t *c, mock_request_t *r){
+  do_createfolder(c, r, 0);
+}
+
+static void cmd_createfolderifnotexists(mock_conn_t *c, mock_request_t *r){
+  do_createfolder(c, r, 1);
+}
+
+static int mock_folder_is_empty_locked(uint64_t folderid){
+  uint64_t i;
+  for (i=1; i<filecnt; i++)
+    if (!files[i].deleted && files[i].parentfolderid==folderid)
+      return 0;
+  for (i=1; i<foldercnt; i++)
+    if (!folders[i].deleted && folders[i].parentfolderid==folderid)
+      return 0;
+  return 1;
+}
+
+static void cmd_deletefolder(mock_conn_t *c, mock_request_t *r){
+  uint64_t folderid;
+  folderid=get_num(r, "folderid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  if (!folderid || !mock_get_folder_locked(folderid)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, folderid?2005:2007, folderid?mock_error_str(2005):"Cannot delete the root folder.");
+    return;
+  }
+  if (!mock_folder_is_empty_locked(folderid)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2006, mock_error_str(2006));
+    return;
+  }
+  folders[folderid].deleted=1;
+  mock_add_event_locked(MOCK_EV_DELETEFOLDER, folderid);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_folder_meta_locked(&c->out, folderid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static void cmd_renamefolder(mock_conn_t *c, mock_request_t *r){
+  mock_folder_t *f;
+  const char *name;
+  uint64_t folderid, tofolderid, p;
+  folderid=get_num(r, "folderid", 0);
+  pthread_mutex_lock(&mock_mutex);
+  f=folderid?mock_get_folder_locked(folderid):NULL;
+  if (!f){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2005, mock_error_str(2005));
+    return;
+  }
+  tofolderid=get_num(r, "tofolderid", f->parentfolderid);
+  name=get_str(r, "toname");
+  if (!name)
+    name=f->name;
+  if (!mock_get_folder_locked(tofolderid)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2005, mock_error_str(2005));
+    return;
+  }
+  for (p=tofolderid; p; p=folders[p].parentfolderid)
+    if (p==folderid){
+      pthread_mutex_unlock(&mock_mutex);
+      send_error(c, 2023, "You are trying to place shared folder into another shared folder.");
+      return;
+    }
+  if (mock_find_folder_locked(tofolderid, name)){
+    pthread_mutex_unlock(&mock_mutex);
+    send_error(c, 2004, mock_error_str(2004));
+    return;
+  }
+  f->parentfolderid=tofolderid;
+  if (strcmp(f->name, name)){
+    free(f->name);
+    f->name=mock_strdup(name);
+  }
+  f->modified=time(NULL);
+  mock_add_event_locked(MOCK_EV_MODIFYFOLDER, folderid);
+  out_start(c);
+  out_hash(&c->out);
+  out_key_num(&c->out, "result", 0);
+  out_str(&c->out, "metadata");
+  out_folder_meta_locked(&c->out, folderid);
+  pthread_mutex_unlock(&mock_mutex);
+  out_end(&c->out);
+  out_send(c);
+}
+
+static const struct {
+  const char *name;
+  mock_command_t func;
+} commands[]={
+  {"getdigest", cmd_getdigest},
+  {"userinfo", cmd_userinfo},
+  {"diff", cmd_diff},
+  {"subscribe", cmd_subscribe},
+  {"nop", cmd_nop},
+  {"connstats", cmd_connstats},
+  {"getfilelink", cmd_getfilelink},
+  {"readfile", cmd_readfile},
+  {"checksumfile", cmd_checksumfile},
+  {"uploadfile", cmd_uploadfile},
+  {"upload_create", cmd_upload_create},
+  {"upload_write", cmd_upload_write},
+  {"upload_writefromfile", cmd_upload_writefromfile},
+  {"upload_info", cmd_upload_info},
+  {"upload_delete", cmd_upload_delete},
+  {"upload_save", cmd_upload_save},
+  {"copyfile", cmd_copyfile},
+  {"getfilesbychecksum", cmd_getfilesbychecksum},
+  {"deletefile", cmd_deletefile},
+  {"renamefile", cmd_renamefile},
+  {"createfolder", cmd_createfolder},
+  {"createfolderifnotexists", cmd_createfolderifnotexists},
+  {"deletefolder", cmd_deletefolder},
+  {"renamefolder", cmd_renamefolder}
+};
+
+static void *api_thread(void *ptr){
+  mock_request_t *r;
+  mock_conn_t c;
+  size_t i;
+  c.fd=(int)(intptr_t)ptr;
+  c.requests=0;
+  c.out.alloc=4096;
+  c.out.data=(unsigned char *)mock_malloc(c.out.alloc);
+  r=(mock_request_t *)mock_malloc(sizeof(mock_request_t));
+  while (!read_request(&c, r)){
+    c.requests++;
+    if (verbose)
+      fprintf(stderr, "api: %s\n", r->cmd);
+    for (i=0; i<sizeof(commands)/sizeof(commands[0]); i++)
+      if (!strcmp(commands[i].name, r->cmd)){
+        commands[i].func(&c, r);
+        break;
+      }
+    if (i==sizeof(commands)/sizeof(commands[0])){
+      if (verbose)
+        fprintf(stderr, "api: command %s is not implemented\n", r->cmd);
+      send_error(&c, 5002, "Command not implemented by the mock server.");
+    }
+    if (skip_data(&c, r))
+      break;
+  }
+  close(c.fd);
+  free(r);
+  free(c.out.data);
+  return NULL;
+}
+
+static int http_send_status(mock_conn_t *c, const char *status){
+  char hdr[256];
+  int len;
+  len=snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Length: 0\r\nKeep-Alive: timeout=60\r\nConnection: Keep-Alive\r\n\r\n", status);
+  return conn_write(c, hdr, len);
+}
+
+/* serves GET /<fileid>/<hash>/data with optional single byte ranges on a keep-alive connection */
+static int http_serve(mock_conn_t *c, char *req){
+  char hdr[512];
+  mock_content_t *ct;
+  mock_file_t *f;
+  char *p;
+  unsigned long long fileid, hash, from, to;
+  int len, partial;
+  if (strncmp(req, "GET ", 4) || sscanf(req+4, "/%llu/%llu/", &fileid, &hash)!=2)
+    return http_send_status(c, "404 Not Found");
+  pthread_mutex_lock(&mock_mutex);
+  f=mock_get_file_locked(fileid);
+  if (!f || f->hash!=hash){
+    pthread_mutex_unlock(&mock_mutex);
+    return http_send_status(c, "404 Not Found");
+  }
+  ct=f->content;
+  ct->refcnt++;
+  pthread_mutex_unlock(&mock_mutex);
+  from=0;
+  to=ct->size?ct->size-1:0;
+  partial=0;
+  for (p=strchr(req, '\n'); p; p=strchr(p, '\n')){
+    p++;
+    if (!strncasecmp(p, "range:", 6)){
+      p+=6;
+      while (*p==' ')
+        p++;
+      if (!strncmp(p, "bytes=", 6)){
+        partial=1;
+        from=strtoull(p+6, &p, 10);
+        if (*p=='-' && p[1]>='0' && p[1]<='9')
+          to=strtoull(p+1, NULL, 10);
+        if (to>=ct->size)
+          to=ct->size-1;
+      }
+    }
+  }
+  if (partial && (from>to || from>=ct->size)){
+    release_content(ct);
+    return http_send_status(c, "416 Requested Range Not Satisfiable");
+  }
+  if (latency)
+    mock_sleep_micro((uint64_t)latency*1000);
+  if (partial)
+    len=snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\nContent-Range: bytes %llu-%llu/%llu\r\n"
+                 "Content-Type: application/octet-stream\r\nKeep-Alive: timeout=60\r\nConnection: Keep-Alive\r\n\r\n",
+                 to-from+1, from, to, (unsigned long long)ct->size);
+  else
+    len=snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n"
+                 "Content-Type: application/octet-stream\r\nKeep-Alive: timeout=60\r\nConnection: Keep-Alive\r\n\r\n",
+                 (unsigned long long)ct->size);
+  if (conn_write(c, hdr, len) || (ct->size && send_content(c, ct, from, to-from+1))){
+    release_content(ct);
+    return -1;
+  }
+  release_content(ct);
+  return 0;
+}
+
+static void *http_thread(void *ptr){
+  mock_conn_t c;
+  char *buff, *end;
+  size_t have;
+  ssize_t rd;
+  c.fd=(int)(intptr_t)ptr;
+  buff=(char *)mock_malloc(MOCK_HTTP_HEADER_MAX+1);
+  have=0;
+  while (1){
+    buff[have]=0;
+    end=strstr(buff, "\r\n\r\n");
+    if (!end){
+      if (have==MOCK_HTTP_HEADER_MAX)
+        break;
+      rd=recv(c.fd, buff+have, MOCK_HTTP_HEADER_MAX-have, 0);
+      if (rd<=0){
+        if (rd==-1 && errno==EINTR)
+          continue;
+        break;
+      }
+      have+=rd;
+      continue;
+    }
+    *end=0;
+    if (verbose)
+      fprintf(stderr, "http: %.*s\n", (int)strcspn(buff, "\r\n"), buff);
+    if (http_serve(&c, buff))
+      break;
+    /* keep pipelined requests */
+    end+=4;
+    have-=end-buff;
+    memmove(buff, end, have);
+  }
+  close(c.fd);
+  free(buff);
+  return NULL;
+}
+
+static int listen_on(int port){
+  struct sockaddr_in addr;
+  int sock, on;
+  sock=socket(AF_INET, SOCK_STREAM, 0);
+  if (sock==-1)
+    return -1;
+  on=1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr)!=1)
+    addr.sin_addr.s_addr=htonl(INADDR_ANY);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 128)){
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+typedef struct {
+  int sock;
+  void *(*handler)(void *);
+} mock_listener_t;
+
+static void *accept_thread(void *ptr){
+  mock_listener_t *l;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int fd, on;
+  l=(mock_listener_t *)ptr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  while (1){
+    fd=accept(l->sock, NULL, NULL);
+    if (fd==-1){
+      if (errno==EINTR || errno==ECONNABORTED)
+        continue;
+      perror("accept");
+      break;
+    }
+    on=1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (pthread_create(&thread, &attr, l->handler, (void *)(intptr_t)fd))
+      close(fd);
+  }
+  pthread_attr_destroy(&attr);
+  return NULL;
+}
+
+static void usage(const char *name){
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -H host     address to listen on and to return in file links (default %s)\n"
+          "  -a port     API port (default %d)\n"
+          "  -w port     HTTP content port (default %d)\n"
+          "  -n count    number of files under /files (default %lu)\n"
+          "  -s bytes    size of each file under /files (default %lu)\n"
+          "  -f count    files per folder under /files, 0 for a single folder (default %lu)\n"
+          "  -r bytes    size of /bench/read.bin and /bench/random.bin, 0 to skip them (default %lu)\n"
+          "  -l ms       latency added to every API response and HTTP request (default 0)\n"
+          "  -b KB/s     bandwidth of each direction, shared by all connections, 0 for unlimited (default 0)\n"
+          "  -v          log requests to stderr\n",
+          name, host, apiport, httpport, (unsigned long)nfiles, (unsigned long)filesize, (unsigned long)filesperfolder,
+          (unsigned long)readsize);
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  mock_listener_t apil, httpl;
+  pthread_t thread;
+  int opt;
+  while ((opt=getopt(argc, argv, "H:a:w:n:s:f:r:l:b:v"))!=-1)
+    switch (opt){
+      case 'H': host=optarg; break;
+      case 'a': apiport=atoi(optarg); break;
+      case 'w': httpport=atoi(optarg); break;
+      case 'n': nfiles=strtoull(optarg, NULL, 10); break;
+      case 's': filesize=strtoull(optarg, NULL, 10); break;
+      case 'f': filesperfolder=strtoull(optarg, NULL, 10); break;
+      case 'r': readsize=strtoull(optarg, NULL, 10); break;
+      case 'l': latency=atoi(optarg); break;
+      case 'b': bandwidth=strtoull(optarg, NULL, 10)*1024; break;
+      case 'v': verbose=1; break;
+      default: usage(argv[0]);
+    }
+  signal(SIGPIPE, SIG_IGN);
+  starttime=time(NULL);
+  mock_create_tree();
+  apil.sock=listen_on(apiport);
+  httpl.sock=listen_on(httpport);
+  if (apil.sock==-1 || httpl.sock==-1){
+    perror("could not listen");
+    return 1;
+  }
+  apil.handler=api_thread;
+  httpl.handler=http_thread;
+  if (pthread_create(&thread, NULL, accept_thread, &httpl)){
+    perror("pthread_create");
+    return 1;
+  }
+  printf("mock server listening on %s, API port %d, HTTP port %d, %lu files, %lu diff entries\n", host, apiport, httpport,
+         (unsigned long)(filecnt?filecnt-1:0), (unsigned long)eventcnt);
+  fflush(stdout);
+  accept_thread(&apil);
+  return 0;
+}
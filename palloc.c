@@ -0,0 +1,371 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "palloc.h"
+#include "pcompat.h"
+#include "plibs.h"
+#include "psettings.h"
+#include "ptimer.h"
+#include "pcache.h"
+#include <string.h>
+#include <stddef.h>
+
+#define ALLOC_ALIGN sizeof(uint64_t)
+#define align_size(s) (((s)+ALLOC_ALIGN-1)/ALLOC_ALIGN*ALLOC_ALIGN)
+
+struct _psync_slab {
+  pthread_mutex_t mutex;
+  const char *name;
+  void *freelist;
+  char *chunk;
+  size_t chunkleft;
+  size_t objsize;
+  size_t chunksize;
+  uint64_t chunks;
+  int64_t live;
+  uint32_t id;
+};
+
+typedef struct {
+  void *head;
+  uint32_t cnt;
+  int32_t live;
+} psync_slab_cache_t;
+
+typedef struct _psync_arena_block {
+  struct _psync_arena_block *next;
+  size_t size;
+  size_t used;
+  char data[];
+} psync_arena_block_t;
+
+struct _psync_arena {
+  psync_arena_block_t *blocks;
+  size_t blocksize;
+};
+
+static pthread_mutex_t slabs_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_slab_t slabs[PSYNC_SLAB_MAX_SLABS];
+static uint32_t slabcnt=0;
+static PSYNC_THREAD psync_slab_cache_t slab_caches[PSYNC_SLAB_MAX_SLABS];
+static PSYNC_THREAD int slab_thread_registered=0;
+static pthread_once_t slab_key_once=PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+#if IS_DEBUG
+static uint64_t arenas_live=0;
+static uint64_t arenas_bytes=0;
+#endif
+
+psync_slab_t *psync_slab_create(const char *name, size_t objsize){
+  psync_slab_t *slab;
+  pthread_mutex_lock(&slabs_mutex);
+  if (unlikely(slabcnt>=PSYNC_SLAB_MAX_SLABS)){
+    pthread_mutex_unlock(&slabs_mutex);
+    debug(D_CRITICAL, "too many slabs, increase PSYNC_SLAB_MAX_SLABS");
+    abort();
+  }
+  slab=&slabs[slabcnt];
+  pthread_mutex_init(&slab->mutex, NULL);
+  slab->name=name;
+  slab->freelist=NULL;
+  slab->chunk=NULL;
+  slab->chunkleft=0;
+  if (objsize<sizeof(void *))
+    objsize=sizeof(void *);
+  slab->objsize=align_size(objsize);
+  if (slab->objsize*PSYNC_SLAB_BATCH>PSYNC_SLAB_CHUNK_SIZE)
+    slab->chunksize=slab->objsize*PSYNC_SLAB_BATCH;
+  else
+    slab->chunksize=PSYNC_SLAB_CHUNK_SIZE;
+  slab->chunks=0;
+  slab->live=0;
+  slab->id=slabcnt++;
+  pthread_mutex_unlock(&slabs_mutex);
+  return slab;
+}
+
+static void psync_slab_flush_locked(psync_slab_t *slab, psync_slab_cache_t *c, uint32_t cnt){
+  void *ptr;
+  while (cnt-- && c->head){
+    ptr=c->head;
+    c->head=*(void **)ptr;
+    *(void **)ptr=slab->freelist;
+    slab->freelist=ptr;
+    c->cnt--;
+  }
+  slab->live+=c->live;
+  c->live=0;
+}
+
+PSYNC_NOINLINE static void psync_slab_flush(psync_slab_t *slab, psync_slab_cache_t *c, uint32_t cnt){
+  pthread_mutex_lock(&slab->mutex);
+  psync_slab_flush_locked(slab, c, cnt);
+  pthread_mutex_unlock(&slab->mutex);
+}
+
+static void psync_slab_thread_exit(void *ptr){
+  uint32_t i, cnt;
+  pthread_mutex_lock(&slabs_mutex);
+  cnt=slabcnt;
+  pthread_mutex_unlock(&slabs_mutex);
+  for (i=0; i<cnt; i++)
+    if (slab_caches[i].head || slab_caches[i].live)
+      psync_slab_flush(&slabs[i], &slab_caches[i], ~0U);
+}
+
+static void psync_slab_create_key(){
+  pthread_key_create(&slab_key, psync_slab_thread_exit);
+}
+
+/* The per thread caches are given back when the thread exits. This is done by a key destructor, as not all threads
+ * are started by us (e.g. fuse worker threads). */
+PSYNC_NOINLINE static void psync_slab_register_thread(){
+  pthread_once(&slab_key_once, psync_slab_create_key);
+  pthread_setspecific(slab_key, &slab_thread_registered);
+  slab_thread_registered=1;
+}
+
+PSYNC_NOINLINE static void psync_slab_refill(psync_slab_t *slab, psync_slab_cache_t *c){
+  void *ptr;
+  uint32_t cnt;
+  if (unlikely(!slab_thread_registered))
+    psync_slab_register_thread();
+  pthread_mutex_lock(&slab->mutex);
+  for (cnt=0; cnt<PSYNC_SLAB_BATCH; cnt++){
+    if (slab->freelist){
+      ptr=slab->freelist;
+      slab->freelist=*(void **)ptr;
+    }
+    else{
+      if (slab->chunkleft<slab->objsize){
+        slab->chunk=(char *)psync_malloc(slab->chunksize);
+        slab->chunkleft=slab->chunksize;
+        slab->chunks++;
+      }
+      ptr=slab->chunk;
+      slab->chunk+=slab->objsize;
+      slab->chunkleft-=slab->objsize;
+    }
+    *(void **)ptr=c->head;
+    c->head=ptr;
+  }
+  c->cnt+=cnt;
+  slab->live+=c->live;
+  c->live=0;
+  pthread_mutex_unlock(&slab->mutex);
+}
+
+void *psync_slab_alloc(psync_slab_t *slab){
+  psync_slab_cache_t *c;
+  void *ret;
+  c=&slab_caches[slab->id];
+  if (unlikely(!c->head))
+    psync_slab_refill(slab, c);
+  ret=c->head;
+  c->head=*(void **)ret;
+  c->cnt--;
+#if IS_DEBUG
+  c->live++;
+  memset(ret, 0xfa, slab->objsize);
+#endif
+  return ret;
+}
+
+void psync_slab_free(psync_slab_t *slab, void *ptr){
+  psync_slab_cache_t *c;
+  c=&slab_caches[slab->id];
+  if (unlikely(!slab_thread_registered))
+    psync_slab_register_thread();
+#if IS_DEBUG
+  c->live--;
+  memset(ptr, 0xfb, slab->objsize);
+#endif
+  *(void **)ptr=c->head;
+  c->head=ptr;
+  if (unlikely(++c->cnt>=PSYNC_SLAB_THREAD_CACHE))
+    psync_slab_flush(slab, c, PSYNC_SLAB_THREAD_CACHE/2);
+}
+
+psync_arena_t *psync_arena_create(size_t blocksize){
+  psync_arena_t *arena;
+  arena=psync_new(psync_arena_t);
+  arena->blocks=NULL;
+  arena->blocksize=blocksize;
+#if IS_DEBUG
+  pthread_mutex_lock(&slabs_mutex);
+  arenas_live++;
+  pthread_mutex_unlock(&slabs_mutex);
+#endif
+  return arena;
+}
+
+PSYNC_NOINLINE static void *psync_arena_alloc_block(psync_arena_t *arena, size_t size){
+  psync_arena_block_t *b;
+  size_t bsize;
+  bsize=size>arena->blocksize?size:arena->blocksize;
+  b=(psync_arena_block_t *)psync_malloc(offsetof(psync_arena_block_t, data)+bsize);
+  b->size=bsize;
+  b->used=size;
+#if IS_DEBUG
+  pthread_mutex_lock(&slabs_mutex);
+  arenas_bytes+=bsize;
+  pthread_mutex_unlock(&slabs_mutex);
+#endif
+  // large allocations go behind the current block, so the space left in it is not wasted
+  if (arena->blocks && size>arena->blocksize/2){
+    b->next=arena->blocks->next;
+    arena->blocks->next=b;
+  }
+  else{
+    b->next=arena->blocks;
+    arena->blocks=b;
+  }
+  return b->data;
+}
+
+void *psync_arena_alloc(psync_arena_t *arena, size_t size){
+  psync_arena_block_t *b;
+  void *ret;
+  size=align_size(size);
+  b=arena->blocks;
+  if (unlikely(!b || b->size-b->used<size))
+    return psync_arena_alloc_block(arena, size);
+  ret=b->data+b->used;
+  b->used+=size;
+  return ret;
+}
+
+void psync_arena_destroy(psync_arena_t *arena){
+  psync_arena_block_t *b, *n;
+#if IS_DEBUG
+  uint64_t bytes=0;
+#endif
+  b=arena->blocks;
+  while (b){
+    n=b->next;
+#if IS_DEBUG
+    bytes+=b->size;
+#endif
+    psync_free(b);
+    b=n;
+  }
+#if IS_DEBUG
+  pthread_mutex_lock(&slabs_mutex);
+  arenas_live--;
+  arenas_bytes-=bytes;
+  pthread_mutex_unlock(&slabs_mutex);
+#endif
+  psync_free(arena);
+}
+
+void psync_alloc_dump_stats(){
+  uint32_t i;
+  pthread_mutex_lock(&slabs_mutex);
+  for (i=0; i<slabcnt; i++){
+    pthread_mutex_lock(&slabs[i].mutex);
+    debug(D_NOTICE, "slab %s: object size %u, %lu chunks of %u bytes, %ld live objects (not counting running threads)",
+          slabs[i].name, (unsigned)slabs[i].objsize, (unsigned long)slabs[i].chunks, (unsigned)slabs[i].chunksize, (long)slabs[i].live);
+    pthread_mutex_unlock(&slabs[i].mutex);
+  }
+#if IS_DEBUG
+  debug(D_NOTICE, "%lu arenas using %lu bytes", (unsigned long)arenas_live, (unsigned long)arenas_bytes);
+#endif
+  pthread_mutex_unlock(&slabs_mutex);
+}
+
+static int64_t mem_current[PSYNC_MEM_TAG_CNT+1];
+static int64_t mem_peak[PSYNC_MEM_TAG_CNT+1];
+static uint64_t mem_budgets[PSYNC_MEM_TAG_CNT+1];
+
+static void mem_update_peak(int64_t *peak, int64_t current){
+  int64_t old;
+  do {
+    old=*peak;
+  } while (current>old && !psync_atomic_cas(peak, old, current));
+}
+
+void psync_mem_account(uint32_t tag, int64_t bytes){
+  int64_t cur, total;
+  cur=psync_atomic_add(&mem_current[tag], bytes)+bytes;
+  total=psync_atomic_add(&mem_current[PSYNC_MEM_TOTAL], bytes)+bytes;
+  if (bytes>0){
+    mem_update_peak(&mem_peak[tag], cur);
+    mem_update_peak(&mem_peak[PSYNC_MEM_TOTAL], total);
+  }
+}
+
+/* the page cache pool is allocated once at start and stacks live as long as their threads, freeing caches does not
+ * shrink either, so the total budget only applies to the rest */
+#define mem_tag_reclaimable(tag) ((tag)!=PSYNC_MEM_TAG_PAGECACHE && (tag)!=PSYNC_MEM_TAG_STACKS)
+
+static int64_t mem_reclaimable(){
+  return mem_current[PSYNC_MEM_TOTAL]-mem_current[PSYNC_MEM_TAG_PAGECACHE]-mem_current[PSYNC_MEM_TAG_STACKS];
+}
+
+static int mem_total_over_budget(){
+  return mem_budgets[PSYNC_MEM_TOTAL] && mem_reclaimable()>(int64_t)mem_budgets[PSYNC_MEM_TOTAL];
+}
+
+int psync_mem_over_budget(uint32_t tag){
+  return (mem_budgets[tag] && mem_current[tag]>(int64_t)mem_budgets[tag]) ||
+         (mem_tag_reclaimable(tag) && mem_total_over_budget());
+}
+
+uint64_t psync_mem_budget(uint32_t tag){
+  return mem_budgets[tag];
+}
+
+void psync_mem_get_stats(psync_memory_stats_t *stats){
+  uint32_t i;
+  for (i=0; i<=PSYNC_MEM_TAG_CNT; i++){
+    stats[i].current=mem_current[i]>0?mem_current[i]:0;
+    stats[i].peak=mem_peak[i];
+    stats[i].budget=mem_budgets[i];
+  }
+}
+
+int psync_mem_set_budget(uint32_t tag, uint64_t bytes){
+  if (tag>PSYNC_MEM_TOTAL)
+    return -1;
+  mem_budgets[tag]=bytes;
+  return 0;
+}
+
+static void mem_check_budget(psync_timer_t timer, void *ptr){
+  if (mem_total_over_budget()){
+    debug(D_NOTICE, "using %lu bytes of reclaimable memory, over the budget of %lu, freeing caches",
+          (unsigned long)mem_reclaimable(), (unsigned long)mem_budgets[PSYNC_MEM_TOTAL]);
+    psync_try_free_memory();
+  }
+  else if (mem_budgets[PSYNC_MEM_TAG_CACHE] && mem_current[PSYNC_MEM_TAG_CACHE]>(int64_t)mem_budgets[PSYNC_MEM_TAG_CACHE])
+    psync_cache_clean_all();
+}
+
+void psync_mem_init(){
+  psync_timer_register(mem_check_budget, PSYNC_MEM_CHECK_INTERVAL, NULL);
+}
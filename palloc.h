@@ -0,0 +1,68 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_ALLOC_H
+#define _PSYNC_ALLOC_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "psynclib.h"
+
+/* Slabs are for small fixed size objects that are allocated and freed at high rate. Each thread keeps a short
+ * free list per slab, so the fast path takes no locks. Memory of a slab is never returned to the system, it is
+ * reused for objects of the same size.
+ *
+ * Arenas are for groups of objects with the same lifetime (e.g. a tree built and then thrown away as a whole).
+ * Objects can not be freed one by one, everything is freed by psync_arena_destroy().
+ */
+
+typedef struct _psync_slab psync_slab_t;
+typedef struct _psync_arena psync_arena_t;
+
+psync_slab_t *psync_slab_create(const char *name, size_t objsize);
+void *psync_slab_alloc(psync_slab_t *slab);
+void psync_slab_free(psync_slab_t *slab, void *ptr);
+
+psync_arena_t *psync_arena_create(size_t blocksize);
+void *psync_arena_alloc(psync_arena_t *arena, size_t size);
+void psync_arena_destroy(psync_arena_t *arena);
+
+void psync_alloc_dump_stats();
+
+/* Memory accounting, tags are PSYNC_MEM_TAG_* from psynclib.h. Blocks from psync_malloc() are accounted as
+ * PSYNC_MEM_TAG_OTHER, subsystems allocate with psync_malloc_tag() and account memory that does not come from
+ * psync_malloc() (mmap-ed caches, thread stacks) with psync_mem_account().
+ */
+void *psync_malloc_tag(uint32_t tag, size_t size);
+void psync_mem_account(uint32_t tag, int64_t bytes);
+int psync_mem_over_budget(uint32_t tag);
+uint64_t psync_mem_budget(uint32_t tag);
+void psync_mem_get_stats(psync_memory_stats_t *stats);
+int psync_mem_set_budget(uint32_t tag, uint64_t bytes);
+void psync_mem_init();
+
+#endif
@@ -29,6 +29,8 @@
 #include "psynclib.h"
 #include "plibs.h"
 #include "psettings.h"
+#include "platency.h"
+#include "palloc.h"
 #include <string.h>
 #include <stddef.h>
 
@@ -100,9 +102,22 @@ static const binresult NUM_SMALL[VSMALL_NUMBER_NUM]={
 };
 
 static uint32_t connfailures=0;
+static char *apihost=NULL;
+static uint16_t apiport, apiportssl;
+
+void psync_api_set_server(const char *host, uint16_t port, uint16_t portssl){
+  char *oldhost;
+  oldhost=apihost;
+  apiport=port;
+  apiportssl=portssl;
+  apihost=host?psync_strdup(host):NULL;
+  psync_free(oldhost);
+}
 
 psync_socket *psync_api_connect(int usessl){
-  if (connfailures%5==4)
+  if (apihost)
+    return psync_socket_connect(apihost, usessl?apiportssl:apiport, usessl);
+  else if (connfailures%5==4)
     return psync_socket_connect(PSYNC_API_AHOST, usessl?PSYNC_API_APORT_SSL:PSYNC_API_APORT, usessl);
   else
     return psync_socket_connect(PSYNC_API_HOST, usessl?PSYNC_API_PORT_SSL:PSYNC_API_PORT, usessl);
@@ -224,7 +239,24 @@ static ssize_t calc_ret_len(unsigned char **restrict data, size_t *restrict data
     return -1;
 }
 
-static binresult *do_parse_result(unsigned char **restrict indata, unsigned char **restrict odata, binresult **restrict strings, size_t *restrict nextstrid){
+/* parse_stack holds children of arrays and hashes while they are parsed, so that a single buffer is used per result
+ * instead of one per array/hash; nested collections use the part of the stack above their parent's entries */
+typedef struct {
+  void **stack;
+  size_t used;
+  size_t alloc;
+} parse_stack;
+
+static void parse_stack_push(parse_stack *st, void *ptr){
+  if (unlikely(st->used==st->alloc)){
+    st->alloc*=2;
+    st->stack=(void **)psync_realloc(st->stack, sizeof(void *)*st->alloc);
+  }
+  st->stack[st->used++]=ptr;
+}
+
+static binresult *do_parse_result(unsigned char **restrict indata, unsigned char **restrict odata, binresult **restrict strings,
+                                  size_t *restrict nextstrid, parse_stack *restrict st){
   binresult *ret;
   long cond;
   psync_uint_t type, len;
@@ -280,59 +312,47 @@ static binresult *do_parse_result(unsigned char **restrict indata, unsigned char
   else if (type==RPARAM_BFALSE)
     return (binresult *)&BOOL_FALSE;
   else if (type==RPARAM_ARRAY){
-    binresult **arr;
-    psync_uint_t cnt, alloc;
+    size_t base, cnt;
     ret=(binresult *)(*odata);
     *odata+=sizeof(binresult);
     ret->type=PARAM_ARRAY;
-    arr=NULL;
-    cnt=0;
-    alloc=128;
-    arr=(binresult **)psync_malloc(sizeof(binresult *)*alloc);
-    while (**indata!=RPARAM_END){
-      if (cnt==alloc){
-        alloc*=2;
-        arr=(binresult **)psync_realloc(arr, sizeof(binresult *)*alloc);
-      }
-      arr[cnt++]=do_parse_result(indata, odata, strings, nextstrid);
-    }
+    base=st->used;
+    while (**indata!=RPARAM_END)
+      parse_stack_push(st, do_parse_result(indata, odata, strings, nextstrid, st));
     (*indata)++;
+    cnt=st->used-base;
     ret->length=cnt;
     ret->array=(struct _binresult **)*odata;
     *odata+=sizeof(struct _binresult *)*cnt;
-    memcpy(ret->array, arr, sizeof(struct _binresult *)*cnt);
-    psync_free(arr);
+    memcpy(ret->array, st->stack+base, sizeof(struct _binresult *)*cnt);
+    st->used=base;
     return ret;
   }
   else if (type==RPARAM_HASH){
-    struct _hashpair *arr;
-    psync_uint_t cnt, alloc;
-    binresult *key;
+    size_t base, cnt, i;
+    binresult *key, *value;
     ret=(binresult *)(*odata);
     *odata+=sizeof(binresult);
     ret->type=PARAM_HASH;
-    arr=NULL;
-    cnt=0;
-    alloc=32;
-    arr=(struct _hashpair *)psync_malloc(sizeof(struct _hashpair)*alloc);
+    base=st->used;
     while (**indata!=RPARAM_END){
-      if (cnt==alloc){
-        alloc*=2;
-        arr=(struct _hashpair *)psync_realloc(arr, sizeof(struct _hashpair)*alloc);
-      }
-      key=do_parse_result(indata, odata, strings, nextstrid);
-      arr[cnt].value=do_parse_result(indata, odata, strings, nextstrid);
+      key=do_parse_result(indata, odata, strings, nextstrid, st);
+      value=do_parse_result(indata, odata, strings, nextstrid, st);
       if (key->type==PARAM_STR){
-        arr[cnt].key=key->str;
-        cnt++;
+        parse_stack_push(st, (void *)key->str);
+        parse_stack_push(st, value);
       }
     }
     (*indata)++;
+    cnt=(st->used-base)/2;
     ret->length=cnt;
     ret->hash=(struct _hashpair *)*odata;
     *odata+=sizeof(struct _hashpair)*cnt;
-    memcpy(ret->hash, arr, sizeof(struct _hashpair)*cnt);
-    psync_free(arr);
+    for (i=0; i<cnt; i++){
+      ret->hash[i].key=(const char *)st->stack[base+i*2];
+      ret->hash[i].value=(binresult *)st->stack[base+i*2+1];
+    }
+    st->used=base;
     return ret;
   }
   else if (type==RPARAM_DATA){
@@ -350,6 +370,7 @@ static binresult *parse_result(unsigned char *data, size_t datalen){
   unsigned char *datac;
   binresult **strings;
   binresult *res;
+  parse_stack st;
   ssize_t retlen;
   size_t datalenc, strcnt;
   datac=data;
@@ -358,10 +379,14 @@ static binresult *parse_result(unsigned char *data, size_t datalen){
   retlen=calc_ret_len(&datac, &datalenc, &strcnt);
   if (retlen==-1)
     return NULL;
-  datac=psync_new_cnt(unsigned char, retlen);
+  datac=(unsigned char *)psync_malloc_tag(PSYNC_MEM_TAG_API, retlen);
   strings=psync_new_cnt(binresult *, strcnt);
+  st.used=0;
+  st.alloc=256;
+  st.stack=psync_new_cnt(void *, st.alloc);
   strcnt=0;
-  res=do_parse_result(&data, &datac, strings, &strcnt);
+  res=do_parse_result(&data, &datac, strings, &strcnt, &st);
+  psync_free(st.stack);
   psync_free(strings);
   return res;
 }
@@ -372,7 +397,7 @@ binresult *get_result(psync_socket *sock){
   uint32_t ressize;
   if (unlikely_log(psync_socket_readall(sock, &ressize, sizeof(uint32_t))!=sizeof(uint32_t)))
     return NULL;
-  data=(unsigned char *)psync_malloc(ressize);
+  data=(unsigned char *)psync_malloc_tag(PSYNC_MEM_TAG_API, ressize);
   if (unlikely_log(psync_socket_readall(sock, data, ressize)!=ressize)){
     psync_free(data);
     return NULL;
@@ -388,7 +413,7 @@ binresult *get_result_thread(psync_socket *sock){
   uint32_t ressize;
   if (unlikely_log(psync_socket_readall_thread(sock, &ressize, sizeof(uint32_t))!=sizeof(uint32_t)))
     return NULL;
-  data=(unsigned char *)psync_malloc(ressize);
+  data=(unsigned char *)psync_malloc_tag(PSYNC_MEM_TAG_API, ressize);
   if (unlikely_log(psync_socket_readall_thread(sock, data, ressize)!=ressize)){
     psync_free(data);
     return NULL;
@@ -429,7 +454,7 @@ again:
       reader->state=1;
       reader->bytesread=0;
       reader->bytestoread=reader->respsize;
-      reader->data=(unsigned char *)psync_malloc(reader->respsize);
+      reader->data=(unsigned char *)psync_malloc_tag(PSYNC_MEM_TAG_API, reader->respsize);
       goto again;
     }
     else{
@@ -497,7 +522,10 @@ unsigned char *do_prepare_command(const char *command, size_t cmdlen, const binp
 
 binresult *do_send_command(psync_socket *sock, const char *command, size_t cmdlen, const binparam *params, size_t paramcnt, int64_t datalen, int readres){
   unsigned char *sdata;
+  binresult *res;
+  uint64_t start;
   size_t plen;
+  start=psync_latency_now();
   sdata=do_prepare_command(command, cmdlen, params, paramcnt, datalen, 0, &plen);
   if (!sdata)
     return NULL;
@@ -514,8 +542,12 @@ binresult *do_send_command(psync_socket *sock, const char *command, size_t cmdle
     }
   }
   psync_free(sdata);
-  if (readres&1)
-    return get_result(sock);
+  if (readres&1){
+    res=get_result(sock);
+    if (res)
+      psync_latency_api_add(command, cmdlen, start, psync_latency_now()-start);
+    return res;
+  }
   else
     return PTR_OK;
 }
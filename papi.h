@@ -103,6 +103,7 @@ typedef struct {
 #define psync_find_result(res, name, type) psync_do_find_result(res, name, type, __FILE__, __FUNCTION__, __LINE__)
 #define psync_check_result(res, name, type) psync_do_check_result(res, name, type, __FILE__, __FUNCTION__, __LINE__)
 
+void psync_api_set_server(const char *host, uint16_t port, uint16_t portssl);
 psync_socket *psync_api_connect(int usessl);
 void psync_api_conn_fail_inc();
 void psync_api_conn_fail_reset();
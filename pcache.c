@@ -32,6 +32,7 @@
 #include "plist.h"
 #include "plibs.h"
 #include "pssl.h"
+#include "palloc.h"
 #include <string.h>
 
 #define CACHE_HASH_SIZE 2048
@@ -168,9 +169,14 @@ void psync_cache_add(const char *key, void *ptr, time_t freeafter, psync_cache_f
   psync_list *lst;
   size_t l;
   uint32_t h;
+  if (unlikely(psync_mem_over_budget(PSYNC_MEM_TAG_CACHE))){
+    debug(D_NOTICE, "not adding key %s to cache as the memory budget is exceeded", key);
+    freefunc(ptr);
+    return;
+  }
   h=hash_funcl(key, &l);
   l++;
-  he=(hash_element *)psync_malloc(offsetof(hash_element, key)+l);
+  he=(hash_element *)psync_malloc_tag(PSYNC_MEM_TAG_CACHE, offsetof(hash_element, key)+l);
   he->value=ptr;
   he->free=freefunc;
   he->hash=h;
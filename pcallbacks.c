@@ -31,6 +31,9 @@
 #include "plibs.h"
 #include "plist.h"
 #include "pfolder.h"
+#include "psettings.h"
+#include "ptimer.h"
+#include "palloc.h"
 
 #define MAX_STATUS_STR_LEN 64
 #define DONT_SHOW_TIME_IF_SEC_OVER (2*86400)
@@ -43,15 +46,33 @@ static int statusthreadrunning=0;
 
 static pthread_mutex_t eventmutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t eventcond=PTHREAD_COND_INITIALIZER;
-static psync_list eventlist;
+static pthread_cond_t eventspacecond=PTHREAD_COND_INITIALIZER;
 static int eventthreadrunning=0;
 
-typedef struct {
-  psync_list list;
+typedef struct _event_t {
+  struct _event_t *hnext;
   psync_eventdata_t data;
   psync_eventtype_t event;
-  int freedata;
-} event_list_t;
+  psync_syncid_t syncid;
+  psync_fileorfolderid_t remoteid;
+  const char *localpath;
+  const char *remotepath;
+  uint32_t hash;
+  unsigned char freedata;
+  unsigned char freepath;
+} event_t;
+
+static event_t **eventring=NULL;
+static event_t *eventhash[PSYNC_EVENT_HASH_SIZE];
+static uint32_t eventringsize=PSYNC_EVENT_QUEUE_MAX;
+static uint32_t eventringhead=0;
+static uint32_t eventringcnt=0;
+static uint32_t eventwaiters=0;
+static uint32_t eventpolicy=PEVENT_QUEUE_DROP_OLDEST;
+static uint64_t eventsdropped=0;
+static uint64_t eventscoalesced=0;
+static pevent_callback_t eventcallback=NULL;
+static pevent_batch_callback_t eventbatchcallback=NULL;
 
 static char *cat_lstr(char *src, const char *app, size_t len){
   return (char *)memcpy(src, app, len)+len;
@@ -279,116 +300,322 @@ void psync_send_status_update(){
   }
 }
 
-static void event_thread(void *ptr){
-  pevent_callback_t callback=(pevent_callback_t)ptr;
-  event_list_t *event;
+/* Events are hashed by the object they are about, the hash holds only the newest queued event of each object. Events
+ * without a local path are about nothing but themselves, so for them the event type is part of the object. */
+static uint32_t event_hash(psync_eventtype_t eventid, psync_syncid_t syncid, psync_fileorfolderid_t remoteid, const char *localpath){
+  uint32_t h;
+  h=localpath?0:eventid*0x9E3779B1U;
+  h^=syncid+(h<<6)+(h>>2);
+  h^=(uint32_t)remoteid+(uint32_t)(remoteid>>32)+(h<<6)+(h>>2);
+  if (localpath)
+    while (*localpath)
+      h=h*31+(unsigned char)*localpath++;
+  return h;
+}
+
+static int event_same_object(const event_t *e, const event_t *ev){
+  if (e->syncid!=ev->syncid || e->remoteid!=ev->remoteid || (e->localpath==NULL)!=(ev->localpath==NULL))
+    return 0;
+  if (ev->localpath)
+    return !strcmp(e->localpath, ev->localpath);
+  else
+    return e->event==ev->event;
+}
+
+static int event_equal(const event_t *e, const event_t *ev){
+  if (e->event!=ev->event)
+    return 0;
+  if ((e->remotepath==NULL)!=(ev->remotepath==NULL) || (ev->remotepath && strcmp(e->remotepath, ev->remotepath)))
+    return 0;
+  return 1;
+}
+
+static event_t *event_find_object_locked(const event_t *ev){
+  event_t *e;
+  for (e=eventhash[ev->hash%PSYNC_EVENT_HASH_SIZE]; e; e=e->hnext)
+    if (e->hash==ev->hash && event_same_object(e, ev))
+      return e;
+  return NULL;
+}
+
+static void event_hash_remove_locked(event_t *event){
+  event_t **pe;
+  if (event->freedata)
+    return;
+  pe=&eventhash[event->hash%PSYNC_EVENT_HASH_SIZE];
+  while (*pe){
+    if (*pe==event){
+      *pe=event->hnext;
+      return;
+    }
+    pe=&(*pe)->hnext;
+  }
+}
+
+static void event_free(event_t *event){
+  if (event->freedata)
+    psync_free(event->data.ptr);
+  if (event->freepath)
+    psync_free((char *)event->remotepath);
+  psync_free(event);
+}
+
+static event_t *event_pop_locked(){
+  event_t *event;
+  event=eventring[eventringhead];
+  eventringhead=(eventringhead+1)%eventringsize;
+  eventringcnt--;
+  event_hash_remove_locked(event);
+  return event;
+}
+
+static void event_drop_oldest_locked(){
+  event_t *event;
+  event=event_pop_locked();
+  if (++eventsdropped%1000==1)
+    debug(D_WARNING, "event queue is full, dropped %lu events so far", (unsigned long)eventsdropped);
+  event_free(event);
+}
+
+/* the queue is also considered full when queued events exceed their memory budget */
+static int event_queue_full_locked(){
+  return eventringcnt>=eventringsize || (eventringcnt && psync_mem_over_budget(PSYNC_MEM_TAG_EVENTS));
+}
+
+static void event_push(event_t *event){
+  struct timespec tm;
+  event_t *e;
+  pthread_mutex_lock(&eventmutex);
+  // an event is merged only into the newest queued event of the same object, otherwise the order of changes is lost
+  if (!event->freedata && (e=event_find_object_locked(event))){
+    if (event_equal(e, event)){
+      eventscoalesced++;
+      pthread_mutex_unlock(&eventmutex);
+      event_free(event);
+      return;
+    }
+    event_hash_remove_locked(e);
+  }
+  if (event_queue_full_locked()){
+    if (eventpolicy==PEVENT_QUEUE_DROP_NEWEST){
+      eventsdropped++;
+      pthread_mutex_unlock(&eventmutex);
+      event_free(event);
+      return;
+    }
+    // never wait while holding the database lock, that would stall every thread that needs the database
+    else if (eventpolicy==PEVENT_QUEUE_BLOCK && !psync_sql_isrdlocked() && !psync_sql_iswrlocked()){
+      tm.tv_sec=psync_current_time+PSYNC_EVENT_BLOCK_TIMEOUT;
+      tm.tv_nsec=0;
+      eventwaiters++;
+      while (event_queue_full_locked() && psync_do_run)
+        if (pthread_cond_timedwait(&eventspacecond, &eventmutex, &tm))
+          break;
+      eventwaiters--;
+    }
+    if (event_queue_full_locked())
+      event_drop_oldest_locked();
+  }
+  eventring[(eventringhead+eventringcnt)%eventringsize]=event;
+  eventringcnt++;
+  if (!event->freedata){
+    event->hnext=eventhash[event->hash%PSYNC_EVENT_HASH_SIZE];
+    eventhash[event->hash%PSYNC_EVENT_HASH_SIZE]=event;
+  }
+  pthread_cond_signal(&eventcond);
+  pthread_mutex_unlock(&eventmutex);
+}
+
+/* Paths of events sent by id are resolved only here, just before delivery, most events of large syncs never need
+ * a walk up the folder tree while queued or coalesced. An object deleted in the meantime falls back to its local
+ * name. */
+static void event_resolve_path(event_t *event){
+  const char *name;
+  char *remotepath;
+  if (event->event&PEVENT_TYPE_FOLDER)
+    remotepath=psync_get_path_by_folderid(event->remoteid, NULL);
+  else
+    remotepath=psync_get_path_by_fileid(event->remoteid, NULL);
+  if (unlikely(!remotepath)){
+    debug(D_NOTICE, "could not resolve remote path of %lu for event %u, using the local name",
+          (unsigned long)event->remoteid, (unsigned)event->event);
+    name=strrchr(event->localpath, PSYNC_DIRECTORY_SEPARATORC);
+    remotepath=psync_strcat("/", name?name+1:event->localpath, NULL);
+  }
+  event->remotepath=remotepath;
+  event->freepath=1;
+}
+
+static void event_materialize(event_t *event){
+  const char *remotepath, *name;
+  if (!event->localpath)
+    return;
+  if (!event->remotepath)
+    event_resolve_path(event);
+  remotepath=event->remotepath;
+  name=strrchr(remotepath, '/');
+  name=name?name+1:remotepath;
+  if (event->event&PEVENT_TYPE_FOLDER){
+    psync_folder_event_t *f=event->data.folder;
+    f->folderid=event->remoteid;
+    f->name=name;
+    f->localpath=event->localpath;
+    f->remotepath=remotepath;
+    f->syncid=event->syncid;
+  }
+  else{
+    psync_file_event_t *f=event->data.file;
+    f->fileid=event->remoteid;
+    f->name=name;
+    f->localpath=event->localpath;
+    f->remotepath=remotepath;
+    f->syncid=event->syncid;
+  }
+}
+
+static void event_thread(){
+  event_t *events[PSYNC_EVENT_BATCH];
+  psync_eventtype_t types[PSYNC_EVENT_BATCH];
+  psync_eventdata_t datas[PSYNC_EVENT_BATCH];
+  uint32_t cnt, i;
   while (1){
     pthread_mutex_lock(&eventmutex);
-    while (psync_list_isempty(&eventlist))
+    while (!eventringcnt)
       pthread_cond_wait(&eventcond, &eventmutex);
-    event=psync_list_remove_head_element(&eventlist, event_list_t, list);
+    cnt=0;
+    while (cnt<PSYNC_EVENT_BATCH && eventringcnt)
+      events[cnt++]=event_pop_locked();
+    if (eventwaiters)
+      pthread_cond_broadcast(&eventspacecond);
     pthread_mutex_unlock(&eventmutex);
-    if (!psync_do_run)
+    if (!psync_do_run){
+      for (i=0; i<cnt; i++)
+        event_free(events[i]);
       break;
-    callback(event->event, event->data);
-    if (event->freedata)
-      psync_free(event->data.ptr);
-    psync_free(event);
+    }
+    for (i=0; i<cnt; i++){
+      event_materialize(events[i]);
+      types[i]=events[i]->event;
+      datas[i]=events[i]->data;
+    }
+    if (eventbatchcallback)
+      eventbatchcallback(types, datas, cnt);
+    else
+      for (i=0; i<cnt; i++)
+        eventcallback(types[i], datas[i]);
+    for (i=0; i<cnt; i++)
+      event_free(events[i]);
   }
 }
 
-void psync_set_event_callback(pevent_callback_t callback){
-  pthread_mutex_lock(&statusmutex);
+static void event_start_thread(){
+  pthread_mutex_lock(&eventmutex);
+  if (eventthreadrunning){
+    pthread_mutex_unlock(&eventmutex);
+    debug(D_BUG, "event callback is already set");
+    return;
+  }
+  eventring=psync_new_cnt(event_t *, eventringsize);
   eventthreadrunning=1;
-  pthread_mutex_unlock(&statusmutex);
-  psync_list_init(&eventlist);
-  psync_run_thread1("event", event_thread, callback);
+  pthread_mutex_unlock(&eventmutex);
+  psync_run_thread("event", event_thread);
 }
 
-void psync_send_event_by_id(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid){
-  if (eventthreadrunning){
-    char *remotepath;
-    if (eventid&PEVENT_TYPE_FOLDER)
-      remotepath=psync_get_path_by_folderid(remoteid, NULL);
-    else
-      remotepath=psync_get_path_by_fileid(remoteid, NULL);
-    if (unlikely_log(!remotepath))
-      return;
-    psync_send_event_by_path(eventid, syncid, localpath, remoteid, remotepath);
-    psync_free(remotepath);
+void psync_set_event_callback(pevent_callback_t callback){
+  eventcallback=callback;
+  event_start_thread();
+}
+
+void psync_callbacks_set_event_batch_callback(pevent_batch_callback_t callback){
+  eventbatchcallback=callback;
+  event_start_thread();
+}
+
+void psync_callbacks_set_event_queue_policy(uint32_t maxevents, uint32_t policy){
+  pthread_mutex_lock(&eventmutex);
+  if (eventthreadrunning)
+    debug(D_BUG, "event queue policy should be set before the event callback");
+  else{
+    eventringsize=maxevents?maxevents:PSYNC_EVENT_QUEUE_MAX;
+    eventpolicy=policy;
   }
+  pthread_mutex_unlock(&eventmutex);
 }
 
-void psync_send_event_by_path(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid, const char *remotepath){
-  if (eventthreadrunning){
-    event_list_t *event;
-    size_t llen, rlen, slen;
-    char *lcopy, *rcopy, *strct, *name;
-    llen=strlen(localpath)+1;
-    rlen=strlen(remotepath)+1;
-    if (eventid&PEVENT_TYPE_FOLDER)
-      slen=sizeof(psync_file_event_t);
-    else
-      slen=sizeof(psync_folder_event_t);
-    event=(event_list_t *)psync_malloc(sizeof(event_list_t)+slen+llen+rlen);
-    strct=(char *)(event+1);
-    lcopy=strct+slen;
+static event_t *event_alloc(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid,
+                            const char *remotepath){
+  event_t *event;
+  size_t llen, rlen, slen;
+  char *strct, *lcopy, *rcopy;
+  llen=strlen(localpath)+1;
+  rlen=remotepath?strlen(remotepath)+1:0;
+  if (eventid&PEVENT_TYPE_FOLDER)
+    slen=sizeof(psync_folder_event_t);
+  else
+    slen=sizeof(psync_file_event_t);
+  event=(event_t *)psync_malloc_tag(PSYNC_MEM_TAG_EVENTS, sizeof(event_t)+slen+llen+rlen);
+  strct=(char *)(event+1);
+  lcopy=strct+slen;
+  memcpy(lcopy, localpath, llen);
+  if (remotepath){
     rcopy=lcopy+llen;
-    memcpy(lcopy, localpath, llen);
     memcpy(rcopy, remotepath, rlen);
-    name=strrchr(rcopy, '/')+1;
-    if (eventid&PEVENT_TYPE_FOLDER){
-      psync_folder_event_t *f=(psync_folder_event_t *)strct;
-      f->folderid=remoteid;
-      f->name=name;
-      f->localpath=lcopy;
-      f->remotepath=rcopy;
-      f->syncid=syncid;
-      event->data.folder=f;
-    }
-    else{
-      psync_file_event_t *f=(psync_file_event_t *)strct;
-      f->fileid=remoteid;
-      f->name=name;
-      f->localpath=lcopy;
-      f->remotepath=rcopy;
-      f->syncid=syncid;
-      event->data.file=f;
-    }
-    event->event=eventid;
-    event->freedata=0;
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->remotepath=rcopy;
   }
+  else
+    event->remotepath=NULL;
+  event->data.ptr=strct;
+  event->event=eventid;
+  event->syncid=syncid;
+  event->remoteid=remoteid;
+  event->localpath=lcopy;
+  event->hash=event_hash(eventid, syncid, remoteid, lcopy);
+  event->freedata=0;
+  event->freepath=0;
+  return event;
+}
+
+void psync_send_event_by_id(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid){
+  if (eventthreadrunning)
+    event_push(event_alloc(eventid, syncid, localpath, remoteid, NULL));
+}
+
+void psync_send_event_by_path(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid, const char *remotepath){
+  if (eventthreadrunning)
+    event_push(event_alloc(eventid, syncid, localpath, remoteid, remotepath));
 }
 
 void psync_send_eventid(psync_eventtype_t eventid){
   if (eventthreadrunning){
-    event_list_t *event;
-    event=psync_new(event_list_t);
+    event_t *event;
+    event=(event_t *)psync_malloc_tag(PSYNC_MEM_TAG_EVENTS, sizeof(event_t));
     event->data.ptr=NULL;
     event->event=eventid;
-    event->freedata=0;    
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->syncid=0;
+    event->remoteid=0;
+    event->localpath=NULL;
+    event->remotepath=NULL;
+    event->hash=event_hash(eventid, 0, 0, NULL);
+    event->freedata=0;
+    event->freepath=0;
+    event_push(event);
   }
 }
 
 void psync_send_eventdata(psync_eventtype_t eventid, void *eventdata){
   if (eventthreadrunning){
-    event_list_t *event;
-    event=psync_new(event_list_t);
+    event_t *event;
+    event=(event_t *)psync_malloc_tag(PSYNC_MEM_TAG_EVENTS, sizeof(event_t));
     event->data.ptr=eventdata;
     event->event=eventid;
+    event->syncid=0;
+    event->remoteid=0;
+    event->localpath=NULL;
+    event->remotepath=NULL;
+    event->hash=0;
     event->freedata=1;
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->freepath=0;
+    event_push(event);
   }
   else
     psync_free(eventdata);
@@ -34,6 +34,8 @@ void psync_callbacks_get_status(pstatus_t *status);
 void psync_set_status_callback(pstatus_change_callback_t callback);
 void psync_send_status_update();
 void psync_set_event_callback(pevent_callback_t callback);
+void psync_callbacks_set_event_batch_callback(pevent_batch_callback_t callback);
+void psync_callbacks_set_event_queue_policy(uint32_t maxevents, uint32_t policy);
 void psync_send_event_by_id(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid);
 void psync_send_event_by_path(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid, const char *remotepath);
 void psync_send_eventid(psync_eventtype_t eventid);
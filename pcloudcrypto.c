@@ -37,6 +37,8 @@
 #include "pfileops.h"
 #include "pmemlock.h"
 #include "pstatus.h"
+#include "plist.h"
+#include "platency.h"
 #include <string.h>
 
 #define PSYNC_CRYPTO_API_ERR_INTERNAL -511
@@ -61,6 +63,19 @@ static psync_rsa_privatekey_t crypto_privkey=PSYNC_INVALID_RSA;
 static pthread_rwlock_t crypto_lock=PTHREAD_RWLOCK_INITIALIZER;
 static uint32_t crypto_started_un=0;
 
+typedef struct {
+  psync_list list;
+  psync_fileid_t fileid;
+  uint64_t hash;
+  psync_encrypted_symmetric_key_t enckey;
+} key_prefetch_job_t;
+
+static pthread_mutex_t keyjob_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keyjob_cond=PTHREAD_COND_INITIALIZER;
+static psync_list keyjobs=PSYNC_LIST_STATIC_INIT(keyjobs);
+static int keyjob_workers=-1;
+static uint64_t cached_file_keys=0;
+
 typedef struct {
   uint32_t type;
   uint32_t flags;
@@ -82,7 +97,7 @@ typedef struct {
 } sym_key_ver1;
 
 void psync_cloud_crypto_clean_cache(){
-  const char *prefixes[]={"DKEY", "FKEY", "FLDE", "FLDD", "SEEN"};
+  const char *prefixes[]={"DKEY", "FKEY", "FLDE", "FLDD", "SEEN", "KPRF"};
   psync_cache_clean_starting_with_one_of(prefixes, ARRAY_SIZE(prefixes));
 }
 
@@ -856,6 +871,7 @@ static psync_symmetric_key_t psync_crypto_get_file_symkey_locked(psync_fileid_t
   psync_get_string_id2(buff, "DKEY", fileid, hash);
   symkey=(psync_symmetric_key_t)psync_cache_get(buff);
   if (symkey){
+    psync_atomic_add(&cached_file_keys, -1);
     debug(D_NOTICE, "got key for file %lu from cache", (unsigned long)fileid);
     return symkey;
   }
@@ -881,10 +897,208 @@ static void psync_crypto_release_folder_symkey_locked(psync_folderid_t folderid,
   psync_cache_add(buff, key, PSYNC_CRYPTO_CACHE_DIR_SYM_KEY, psync_crypto_release_symkey_ptr, 2);
 }
 
+static void psync_crypto_release_file_symkey_ptr(void *ptr){
+  psync_atomic_add(&cached_file_keys, -1);
+  psync_ssl_free_symmetric_key((psync_symmetric_key_t)ptr);
+}
+
 static void psync_crypto_release_file_symkey_locked(psync_fileid_t fileid, uint64_t hash, psync_symmetric_key_t key){
   char buff[32];
+  // decrypted keys live in locked memory, so the number of cached ones is capped
+  if (psync_atomic_add(&cached_file_keys, 1)>=PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS){
+    psync_atomic_add(&cached_file_keys, -1);
+    psync_ssl_free_symmetric_key(key);
+    return;
+  }
   psync_get_string_id2(buff, "DKEY", fileid, hash);
-  psync_cache_add(buff, key, PSYNC_CRYPTO_CACHE_FILE_SYM_KEY, psync_crypto_release_symkey_ptr, 2);
+  psync_cache_add(buff, key, PSYNC_CRYPTO_CACHE_FILE_SYM_KEY, psync_crypto_release_file_symkey_ptr, 2);
+}
+
+static void psync_crypto_free_key_job(key_prefetch_job_t *job){
+  psync_free(job->enckey);
+  psync_free(job);
+}
+
+static void psync_crypto_key_worker(){
+  key_prefetch_job_t *job;
+  psync_symmetric_key_t symkey;
+  char buff[32];
+  while (1){
+    pthread_mutex_lock(&keyjob_mutex);
+    while (psync_list_isempty(&keyjobs))
+      pthread_cond_wait(&keyjob_cond, &keyjob_mutex);
+    job=psync_list_remove_head_element(&keyjobs, key_prefetch_job_t, list);
+    pthread_mutex_unlock(&keyjob_mutex);
+    psync_get_string_id2(buff, "DKEY", job->fileid, job->hash);
+    pthread_rwlock_rdlock(&crypto_lock);
+    if (crypto_started_l && cached_file_keys<PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS && !psync_cache_has(buff)){
+      symkey=psync_ssl_rsa_decrypt_symmetric_key(crypto_privkey, job->enckey);
+      if (likely_log(symkey!=PSYNC_INVALID_SYM_KEY))
+        psync_crypto_release_file_symkey_locked(job->fileid, job->hash, symkey);
+    }
+    pthread_rwlock_unlock(&crypto_lock);
+    psync_crypto_free_key_job(job);
+  }
+}
+
+static void psync_crypto_queue_key_jobs(psync_list *jobs){
+  int i;
+  if (psync_list_isempty(jobs))
+    return;
+  pthread_mutex_lock(&keyjob_mutex);
+  if (keyjob_workers==-1){
+    keyjob_workers=psync_get_cpu_count()-1;
+    if (keyjob_workers<1)
+      keyjob_workers=1;
+    else if (keyjob_workers>PSYNC_CRYPTO_KEY_WORKER_THREADS)
+      keyjob_workers=PSYNC_CRYPTO_KEY_WORKER_THREADS;
+    debug(D_NOTICE, "starting %d key decryption threads", keyjob_workers);
+    for (i=0; i<keyjob_workers; i++)
+      psync_run_thread("key decryption worker", psync_crypto_key_worker);
+  }
+  while (!psync_list_isempty(jobs))
+    psync_list_add_tail(&keyjobs, psync_list_remove_head(jobs));
+  pthread_cond_broadcast(&keyjob_cond);
+  pthread_mutex_unlock(&keyjob_mutex);
+}
+
+static int psync_crypto_prefetch_parse_key(key_prefetch_job_t *job, const binresult *res){
+  const binresult *b64key;
+  unsigned char *key;
+  size_t keylen;
+  if (psync_find_result(res, "result", PARAM_NUM)->num)
+    return -1;
+  b64key=psync_find_result(res, "key", PARAM_STR);
+  key=psync_base64_decode((const unsigned char *)b64key->str, b64key->length, &keylen);
+  if (unlikely_log(!key))
+    return -1;
+  job->hash=psync_find_result(res, "hash", PARAM_NUM)->num;
+  job->enckey=psync_ssl_alloc_encrypted_symmetric_key(keylen);
+  memcpy(job->enckey->data, key, keylen);
+  psync_free(key);
+  return 0;
+}
+
+// keys of a batch are requested back to back on one connection, so a batch costs a single round trip
+static void psync_crypto_prefetch_download(psync_list *missing, psync_list *ready){
+  key_prefetch_job_t *jobs[PSYNC_CRYPTO_PREFETCH_BATCH];
+  psync_socket *api;
+  binresult *res;
+  psync_sql_res *sres;
+  psync_uint_t i, cnt, sent;
+  while (!psync_list_isempty(missing)){
+    cnt=0;
+    while (cnt<PSYNC_CRYPTO_PREFETCH_BATCH && !psync_list_isempty(missing))
+      jobs[cnt++]=psync_list_remove_head_element(missing, key_prefetch_job_t, list);
+    api=psync_apipool_get();
+    if (unlikely_log(!api)){
+      for (i=0; i<cnt; i++)
+        psync_crypto_free_key_job(jobs[i]);
+      psync_list_for_each_element_call(missing, key_prefetch_job_t, list, psync_crypto_free_key_job);
+      return;
+    }
+    psync_socket_cork(api);
+    for (sent=0; sent<cnt; sent++){
+      binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", jobs[sent]->fileid)};
+      if (unlikely_log(!send_command_no_res(api, "crypto_getfilekey", params)))
+        break;
+    }
+    for (i=0; i<sent; i++){
+      res=get_result(api);
+      if (unlikely_log(!res))
+        break;
+      if (psync_crypto_prefetch_parse_key(jobs[i], res))
+        debug(D_NOTICE, "could not get key of file %lu", (unsigned long)jobs[i]->fileid);
+      psync_free(res);
+    }
+    if (i==cnt)
+      psync_apipool_release(api);
+    else
+      psync_apipool_release_bad(api);
+    psync_sql_start_transaction();
+    for (i=0; i<cnt; i++)
+      if (jobs[i]->enckey){
+        sres=psync_sql_prep_statement("REPLACE INTO cryptofilekey (fileid, hash, enckey) VALUES (?, ?, ?)");
+        psync_sql_bind_uint(sres, 1, jobs[i]->fileid);
+        psync_sql_bind_uint(sres, 2, jobs[i]->hash);
+        psync_sql_bind_blob(sres, 3, (const char *)jobs[i]->enckey->data, jobs[i]->enckey->datalen);
+        psync_sql_run_free(sres);
+        psync_list_add_tail(ready, &jobs[i]->list);
+      }
+      else
+        psync_crypto_free_key_job(jobs[i]);
+    psync_sql_commit_transaction();
+  }
+}
+
+static void psync_crypto_prefetch_folder_thread(void *ptr){
+  psync_list ready, missing;
+  key_prefetch_job_t *job;
+  psync_sql_res *res;
+  psync_variant_row row;
+  const char *ckey;
+  psync_folderid_t folderid;
+  uint64_t start;
+  size_t ckeylen;
+  psync_uint_t cnt, limit;
+  char buff[32];
+  folderid=*(psync_folderid_t *)ptr;
+  psync_free(ptr);
+  start=psync_latency_now();
+  psync_list_init(&ready);
+  psync_list_init(&missing);
+  limit=cached_file_keys;
+  if (limit>=PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS)
+    return;
+  limit=PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS-limit;
+  if (limit>PSYNC_CRYPTO_PREFETCH_MAX_FILES)
+    limit=PSYNC_CRYPTO_PREFETCH_MAX_FILES;
+  cnt=0;
+  res=psync_sql_query_rdlock("SELECT f.id, f.hash, k.enckey FROM file f LEFT JOIN cryptofilekey k ON k.fileid=f.id AND k.hash=f.hash "
+                             "WHERE f.parentfolderid=? LIMIT ?");
+  psync_sql_bind_uint(res, 1, folderid);
+  psync_sql_bind_uint(res, 2, limit);
+  while ((row=psync_sql_fetch_row(res))){
+    job=psync_new(key_prefetch_job_t);
+    job->fileid=psync_get_number(row[0]);
+    job->hash=psync_get_number(row[1]);
+    psync_get_string_id2(buff, "DKEY", job->fileid, job->hash);
+    if (psync_cache_has(buff)){
+      psync_free(job);
+      continue;
+    }
+    ckey=psync_get_lstring_or_null(row[2], &ckeylen);
+    if (ckey){
+      job->enckey=psync_ssl_alloc_encrypted_symmetric_key(ckeylen);
+      memcpy(job->enckey->data, ckey, ckeylen);
+      psync_list_add_tail(&ready, &job->list);
+    }
+    else{
+      job->enckey=NULL;
+      psync_list_add_tail(&missing, &job->list);
+    }
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  psync_crypto_queue_key_jobs(&ready);
+  psync_crypto_prefetch_download(&missing, &ready);
+  psync_crypto_queue_key_jobs(&ready);
+  debug(D_NOTICE, "prefetched %lu keys of folder %lu in %lu ms", (unsigned long)cnt, (unsigned long)folderid,
+        (unsigned long)((psync_latency_now()-start)/1000));
+}
+
+void psync_cloud_crypto_prefetch_folder_keys(psync_folderid_t folderid){
+  psync_folderid_t *fid;
+  char buff[16];
+  if (!crypto_started_un || cached_file_keys>=PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS)
+    return;
+  psync_get_string_id(buff, "KPRF", folderid);
+  if (psync_cache_has(buff))
+    return;
+  psync_cache_add(buff, psync_malloc(1), PSYNC_CRYPTO_PREFETCH_FOLDER_SEC, psync_free, 1);
+  fid=psync_new(psync_folderid_t);
+  *fid=folderid;
+  psync_run_thread1("key prefetch", psync_crypto_prefetch_folder_thread, fid);
 }
 
 static psync_symmetric_key_t psync_crypto_sym_key_ver1_to_sym_key(sym_key_ver1 *v1){
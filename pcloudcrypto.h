@@ -64,6 +64,7 @@ char *psync_cloud_crypto_encode_filename(psync_crypto_aes256_text_encoder_t enco
 psync_crypto_aes256_sector_encoder_decoder_t psync_cloud_crypto_get_file_encoder(psync_fsfileid_t fileid, uint64_t hash, int nonetwork);
 psync_crypto_aes256_sector_encoder_decoder_t psync_cloud_crypto_get_file_encoder_from_binresult(psync_fileid_t fileid, binresult *res);
 void psync_cloud_crypto_release_file_encoder(psync_fsfileid_t fileid, uint64_t hash, psync_crypto_aes256_sector_encoder_decoder_t encoder);
+void psync_cloud_crypto_prefetch_folder_keys(psync_folderid_t folderid);
 
 char *psync_cloud_crypto_get_file_encoded_key(psync_fsfileid_t fileid, uint64_t hash, size_t *keylen);
 char *psync_cloud_crypto_get_new_encoded_key(uint32_t flags, size_t *keylen);
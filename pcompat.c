@@ -36,13 +36,19 @@
 #include "psettings.h"
 #include "pssl.h"
 #include "ptimer.h"
+#include "palloc.h"
 
 #if defined(P_OS_LINUX)
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#if !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #endif
 
 #if defined(P_OS_MACOSX)
 #include <sys/sysctl.h>
+#include <sys/clonefile.h>
 #endif
 
 #if defined(P_OS_POSIX)
@@ -55,6 +61,7 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <net/if.h>
 #include <limits.h>
@@ -105,6 +112,7 @@ static int psync_gids_cnt;
 #endif
 
 static int psync_page_size;
+static int psync_cpu_count;
 
 static const char *psync_software_name="pCloudSync library "PSYNC_LIB_VERSION;
 
@@ -236,14 +244,19 @@ void psync_compat_init(){
 #else
   psync_page_size=sysconf(_SC_PAGESIZE);
 #endif
+  psync_cpu_count=sysconf(_SC_NPROCESSORS_ONLN);
 #elif defined(P_OS_WINDOWS)
   SYSTEM_INFO si;
   GetSystemInfo(&si);
   psync_page_size=si.dwPageSize;
+  psync_cpu_count=si.dwNumberOfProcessors;
 #else
   psync_page_size=-1;
+  psync_cpu_count=1;
 #endif
-  debug(D_NOTICE, "detected page size %d", psync_page_size);
+  if (psync_cpu_count<1)
+    psync_cpu_count=1;
+  debug(D_NOTICE, "detected page size %d, %d cpus", psync_page_size, psync_cpu_count);
 }
 
 int psync_stat_mode_ok(psync_stat_t *buf, unsigned int bits){
@@ -353,7 +366,7 @@ char *psync_get_private_dir(char *name){
   if (!path)
     return NULL;
   rpath=psync_strcat(path, PSYNC_DIRECTORY_SEPARATOR, name, NULL);
-  free(path);
+  psync_free(path);
   if (psync_stat(rpath, &st) && psync_mkdir(rpath)){
     psync_free(rpath);
     return NULL;
@@ -424,10 +437,12 @@ void psync_yield_cpu(){
 }
 
 static void thread_started(){
+  psync_mem_account(PSYNC_MEM_TAG_STACKS, PSYNC_STACK_SIZE);
   debug(D_NOTICE, "thread started");
 }
 
 static void thread_exited(){
+  psync_mem_account(PSYNC_MEM_TAG_STACKS, -PSYNC_STACK_SIZE);
   debug(D_NOTICE, "thread exited");
 }
 
@@ -865,7 +880,152 @@ static int psync_wait_socket_readable_microsec(psync_socket_t sock, long sec, lo
 #define psync_wait_socket_readable(sock, sec) psync_wait_socket_readable_microsec(sock, sec, 0)
 #define psync_wait_socket_read_timeout(sock) psync_wait_socket_readable(sock, PSYNC_SOCK_READ_TIMEOUT)
 
-static psync_socket_t connect_res(struct addrinfo *res){
+typedef struct {
+  struct addrinfo *addr;
+  uint64_t latency;
+  uint64_t score;
+  uint64_t started;
+  uint64_t oldlatency;
+  uint64_t updated;
+  uint32_t failures;
+  uint32_t oldfailures;
+  psync_socket_t sock;
+  unsigned char known;
+  unsigned char result;
+} connect_candidate;
+
+#define CONNECT_RES_NONE   0
+#define CONNECT_RES_OK     1
+#define CONNECT_RES_FAILED 2
+
+static uint64_t connect_millitime(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000+tm.tv_nsec/1000000;
+}
+
+static void connect_load_scores(connect_candidate *cand, size_t cnt){
+  psync_sql_res *res;
+  psync_uint_row row;
+  size_t i;
+  psync_sql_rdlock();
+  res=psync_sql_query_nolock("SELECT latency, failures, updated FROM resolverscore WHERE data=? AND updated>=?");
+  for (i=0; i<cnt; i++){
+    psync_sql_bind_blob(res, 1, (const char *)cand[i].addr->ai_addr, cand[i].addr->ai_addrlen);
+    psync_sql_bind_uint(res, 2, psync_timer_time()-PSYNC_SOCK_CONNECT_SCORE_TTL);
+    if ((row=psync_sql_fetch_rowint(res))){
+      cand[i].latency=row[0];
+      cand[i].failures=row[1];
+      cand[i].oldlatency=row[0];
+      cand[i].oldfailures=row[1];
+      cand[i].updated=row[2];
+      cand[i].known=1;
+      cand[i].score=row[0]+row[1]*PSYNC_SOCK_CONNECT_FAIL_PENALTY_MS;
+    }
+    psync_sql_reset(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_rdunlock();
+}
+
+/* A score is written only when it is new, its failure count changed, its latency moved by more than
+ * PSYNC_SOCK_CONNECT_SCORE_CHANGE_PCT or the stored row is getting stale, so most connects touch no database at all. */
+static int connect_score_changed(const connect_candidate *cand, uint64_t now){
+  uint64_t diff;
+  if (cand->result==CONNECT_RES_NONE)
+    return 0;
+  if (!cand->known || cand->failures!=cand->oldfailures || cand->updated+PSYNC_SOCK_CONNECT_SCORE_REFRESH<now)
+    return 1;
+  diff=cand->latency>cand->oldlatency?cand->latency-cand->oldlatency:cand->oldlatency-cand->latency;
+  return diff*100>cand->oldlatency*PSYNC_SOCK_CONNECT_SCORE_CHANGE_PCT;
+}
+
+static void connect_save_scores(connect_candidate *cand, size_t cnt){
+  psync_sql_res *res;
+  uint64_t now;
+  size_t i;
+  now=psync_timer_time();
+  for (i=0; i<cnt; i++)
+    if (connect_score_changed(&cand[i], now))
+      break;
+  if (i==cnt)
+    return;
+  if (psync_sql_isrdlocked() && psync_sql_tryupgradelock())
+    return;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("REPLACE INTO resolverscore (data, latency, failures, updated) VALUES (?, ?, ?, ?)");
+  for (; i<cnt; i++){
+    if (!connect_score_changed(&cand[i], now))
+      continue;
+    psync_sql_bind_blob(res, 1, (const char *)cand[i].addr->ai_addr, cand[i].addr->ai_addrlen);
+    psync_sql_bind_uint(res, 2, cand[i].latency);
+    psync_sql_bind_uint(res, 3, cand[i].failures);
+    psync_sql_bind_uint(res, 4, now);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+}
+
+static void connect_prune_scores_timer(psync_timer_t timer, void *ptr){
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("DELETE FROM resolverscore WHERE updated<?");
+  psync_sql_bind_uint(res, 1, psync_timer_time()-PSYNC_SOCK_CONNECT_SCORE_TTL);
+  psync_sql_run_free(res);
+}
+
+void psync_compat_timers_init(){
+  psync_timer_register(connect_prune_scores_timer, PSYNC_SOCK_CONNECT_SCORE_PRUNE_INTERVAL, NULL);
+}
+
+static void connect_record(connect_candidate *cand, int result, uint64_t now){
+  cand->result=result;
+  if (result==CONNECT_RES_OK){
+    if (cand->known && !cand->failures)
+      cand->latency=(cand->latency*3+now-cand->started)/4;
+    else
+      cand->latency=now-cand->started;
+    cand->failures=0;
+  }
+  else if (cand->failures<PSYNC_SOCK_CONNECT_MAX_FAILURES)
+    cand->failures++;
+}
+
+/* Orders candidates as in RFC 8305: addresses of each family are sorted by their score (stable, so the order
+ * returned by getaddrinfo is kept for ties), then families are interleaved starting with the family of the best
+ * address. */
+static void connect_order_candidates(connect_candidate *cand, size_t cnt){
+  connect_candidate *sorted, tmp;
+  size_t i, j, f1, f2, o;
+  int family;
+  for (i=1; i<cnt; i++){
+    tmp=cand[i];
+    for (j=i; j>0 && cand[j-1].score>tmp.score; j--)
+      cand[j]=cand[j-1];
+    cand[j]=tmp;
+  }
+  family=cand[0].addr->ai_family;
+  sorted=psync_new_cnt(connect_candidate, cnt);
+  f1=0;
+  f2=0;
+  o=0;
+  while (o<cnt){
+    while (f1<cnt && cand[f1].addr->ai_family!=family)
+      f1++;
+    if (f1<cnt)
+      sorted[o++]=cand[f1++];
+    while (f2<cnt && cand[f2].addr->ai_family==family)
+      f2++;
+    if (f2<cnt)
+      sorted[o++]=cand[f2++];
+  }
+  memcpy(cand, sorted, sizeof(connect_candidate)*cnt);
+  psync_free(sorted);
+}
+
+/* returns 1 if connected, 0 if the connection is in progress and -1 on error */
+static int connect_start(connect_candidate *cand){
+  struct addrinfo *res;
   psync_socket_t sock;
 #if defined(SOCK_NONBLOCK)
 #if defined(SOCK_CLOEXEC)
@@ -877,37 +1037,156 @@ static psync_socket_t connect_res(struct addrinfo *res){
 #define PSOCK_TYPE_OR 0
 #define PSOCK_NEED_NOBLOCK
 #endif
-  while (res){
-    sock=socket(res->ai_family, res->ai_socktype|PSOCK_TYPE_OR, res->ai_protocol);
+  res=cand->addr;
+  cand->started=connect_millitime();
+  sock=socket(res->ai_family, res->ai_socktype|PSOCK_TYPE_OR, res->ai_protocol);
 #if defined(P_OS_WINDOWS)
-    if (unlikely(sock==INVALID_SOCKET && WSAGetLastError()==WSANOTINITIALISED)){
-      WSADATA wsaData;
-      if (!WSAStartup(MAKEWORD(2, 2), &wsaData))
-        sock=socket(res->ai_family, res->ai_socktype|PSOCK_TYPE_OR, res->ai_protocol);
-    }
+  if (unlikely(sock==INVALID_SOCKET && WSAGetLastError()==WSANOTINITIALISED)){
+    WSADATA wsaData;
+    if (!WSAStartup(MAKEWORD(2, 2), &wsaData))
+      sock=socket(res->ai_family, res->ai_socktype|PSOCK_TYPE_OR, res->ai_protocol);
+  }
 #endif
-    if (likely_log(sock!=INVALID_SOCKET)){
+  if (unlikely_log(sock==INVALID_SOCKET))
+    return -1;
 #if defined(PSOCK_NEED_NOBLOCK)
 #if defined(P_OS_WINDOWS)
-      unsigned long mode=1;
-      int bufsize=PSYNC_SOCK_WIN_SNDBUF;
-      ioctlsocket(sock, FIONBIO, &mode);
-      setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&bufsize, sizeof(bufsize));
+  {
+    unsigned long mode=1;
+    int bufsize=PSYNC_SOCK_WIN_SNDBUF;
+    ioctlsocket(sock, FIONBIO, &mode);
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&bufsize, sizeof(bufsize));
+  }
 #elif defined(P_OS_POSIX)
-      fcntl(sock, F_SETFD, FD_CLOEXEC);
-      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)|O_NONBLOCK);
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)|O_NONBLOCK);
 #else
 #error "Need to set non-blocking for your OS"
 #endif
 #endif
-      if ((connect(sock, res->ai_addr, res->ai_addrlen)!=SOCKET_ERROR) ||
-          (psync_sock_err()==P_INPROGRESS && !psync_wait_socket_writable(sock, PSYNC_SOCK_CONNECT_TIMEOUT)))
-        return sock;
-      psync_close_socket(sock);
+  cand->sock=sock;
+  if (connect(sock, res->ai_addr, res->ai_addrlen)!=SOCKET_ERROR)
+    return 1;
+  if (psync_sock_err()==P_INPROGRESS)
+    return 0;
+  psync_close_socket(sock);
+  cand->sock=INVALID_SOCKET;
+  return -1;
+}
+
+/* Races connections to all addresses (happy eyeballs), a new attempt is started every
+ * PSYNC_SOCK_CONNECT_ATTEMPT_DELAY_MS or as soon as an attempt fails, the first connection to succeed wins and all
+ * others are cancelled. */
+static psync_socket_t connect_res(struct addrinfo *res){
+  connect_candidate *cand;
+  struct addrinfo *a;
+  fd_set wfds, efds;
+  struct timeval tv;
+  uint64_t now, deadline, nextstart, wait;
+  psync_socket_t sock, maxfd;
+  size_t cnt, next, active, i;
+  socklen_t errlen;
+  int err, r;
+  cnt=0;
+  for (a=res; a; a=a->ai_next)
+    cnt++;
+  if (unlikely_log(!cnt))
+    return INVALID_SOCKET;
+  cand=psync_new_cnt(connect_candidate, cnt);
+  memset(cand, 0, sizeof(connect_candidate)*cnt);
+  for (a=res, i=0; a; a=a->ai_next, i++){
+    cand[i].addr=a;
+    cand[i].sock=INVALID_SOCKET;
+  }
+  connect_load_scores(cand, cnt);
+  connect_order_candidates(cand, cnt);
+  sock=INVALID_SOCKET;
+  now=connect_millitime();
+  deadline=now+PSYNC_SOCK_CONNECT_TIMEOUT*1000;
+  nextstart=now;
+  next=0;
+  active=0;
+  while (1){
+    now=connect_millitime();
+    if (next<cnt && (now>=nextstart || !active)){
+      r=connect_start(&cand[next]);
+      if (r==1){
+        connect_record(&cand[next], CONNECT_RES_OK, connect_millitime());
+        sock=cand[next].sock;
+        cand[next].sock=INVALID_SOCKET;
+        break;
+      }
+      next++;
+      if (r==0){
+        active++;
+        nextstart=now+PSYNC_SOCK_CONNECT_ATTEMPT_DELAY_MS;
+      }
+      else{
+        connect_record(&cand[next-1], CONNECT_RES_FAILED, now);
+        nextstart=now;
+      }
+      continue;
     }
-    res=res->ai_next;
+    if (!active || now>=deadline)
+      break;
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    maxfd=0;
+    for (i=0; i<next; i++)
+      if (cand[i].sock!=INVALID_SOCKET){
+        FD_SET(cand[i].sock, &wfds);
+        FD_SET(cand[i].sock, &efds);
+        if (cand[i].sock>maxfd)
+          maxfd=cand[i].sock;
+      }
+    wait=deadline-now;
+    if (next<cnt && nextstart-now<wait)
+      wait=nextstart-now;
+    tv.tv_sec=wait/1000;
+    tv.tv_usec=(wait%1000)*1000;
+    r=select(maxfd+1, NULL, &wfds, &efds, &tv);
+    if (r<=0){
+      if (r<0 && psync_sock_err()!=P_INTR){
+        debug(D_WARNING, "select failed with error %d", (int)psync_sock_err());
+        break;
+      }
+      continue;
+    }
+    now=connect_millitime();
+    for (i=0; i<next; i++){
+      if (cand[i].sock==INVALID_SOCKET || (!FD_ISSET(cand[i].sock, &wfds) && !FD_ISSET(cand[i].sock, &efds)))
+        continue;
+      err=0;
+      errlen=sizeof(err);
+      if (!FD_ISSET(cand[i].sock, &efds) && !getsockopt(cand[i].sock, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) && !err){
+        connect_record(&cand[i], CONNECT_RES_OK, now);
+        sock=cand[i].sock;
+        cand[i].sock=INVALID_SOCKET;
+        break;
+      }
+      psync_close_socket(cand[i].sock);
+      cand[i].sock=INVALID_SOCKET;
+      connect_record(&cand[i], CONNECT_RES_FAILED, now);
+      active--;
+      nextstart=now;
+    }
+    if (sock!=INVALID_SOCKET)
+      break;
   }
-  return INVALID_SOCKET;
+  for (i=0; i<next; i++)
+    if (cand[i].sock!=INVALID_SOCKET){
+      psync_close_socket(cand[i].sock);
+      // attempts that were still running when the connection timed out are counted as failed, losers of the race are not
+      if (sock==INVALID_SOCKET)
+        connect_record(&cand[i], CONNECT_RES_FAILED, now);
+    }
+  if (sock!=INVALID_SOCKET)
+    debug(D_NOTICE, "connected after %u attempt(s)", (unsigned)next);
+  else
+    psync_sock_set_err(P_TIMEDOUT);
+  connect_save_scores(cand, cnt);
+  psync_free(cand);
+  return sock;
 }
 
 psync_socket_t psync_create_socket(int domain, int type, int protocol){
@@ -1212,6 +1491,7 @@ psync_socket *psync_socket_connect(const char *host, int unsigned port, int ssl)
   ret->buffer=NULL;
   ret->sock=sock;
   ret->pending=0;
+  ret->cork=NULL;
   return ret;
 }
 
@@ -1223,6 +1503,7 @@ void psync_socket_close(psync_socket *sock){
         break;
       }
   psync_socket_clear_write_buffered(sock);
+  psync_free(sock->cork);
   psync_close_socket(sock->sock);
   psync_free(sock);
 }
@@ -1231,6 +1512,7 @@ void psync_socket_close_bad(psync_socket *sock){
   if (sock->ssl)
     psync_ssl_free(sock->ssl);
   psync_socket_clear_write_buffered(sock);
+  psync_free(sock->cork);
   psync_close_socket(sock->sock);
   psync_free(sock);
 }
@@ -1257,7 +1539,7 @@ void psync_socket_clear_write_buffered(psync_socket *sock){
   psync_socket_buffer *nb;
   while (sock->buffer){
     nb=sock->buffer->next;
-    free(sock->buffer);
+    psync_free(sock->buffer);
     sock->buffer=nb;
   }
 }
@@ -1455,6 +1737,8 @@ static int psync_socket_read_plain(psync_socket *sock, void *buff, int num){
 }
 
 int psync_socket_read(psync_socket *sock, void *buff, int num){
+  if (unlikely(sock->cork && sock->cork->woffset) && psync_socket_flush(sock))
+    return -1;
   if (sock->ssl)
     return psync_socket_read_ssl(sock, buff, num);
   else
@@ -1601,6 +1885,8 @@ int psync_socket_write(psync_socket *sock, const void *buff, int num){
   int r;
   if (sock->buffer)
     return psync_socket_write_to_buf(sock, buff, num);
+  if (unlikely(sock->cork && sock->cork->woffset) && psync_socket_flush(sock))
+    return -1;
   if (psync_wait_socket_write_timeout(sock->sock))
     return -1;
   if (sock->ssl){
@@ -1679,6 +1965,8 @@ static int psync_socket_readall_plain(psync_socket *sock, void *buff, int num){
 }
 
 int psync_socket_readall(psync_socket *sock, void *buff, int num){
+  if (unlikely(sock->cork && sock->cork->woffset) && psync_socket_flush(sock))
+    return -1;
   if (sock->ssl)
     return psync_socket_readall_ssl(sock, buff, num);
   else
@@ -1730,9 +2018,116 @@ static int psync_socket_writeall_plain(psync_socket_t sock, const void *buff, in
   return br;
 }
 
+#if defined(P_OS_POSIX)
+static int psync_socket_writev_plain(psync_socket_t sock, const void *buff1, int num1, const void *buff2, int num2){
+  struct iovec iov[2];
+  ssize_t r;
+  int cnt, br;
+  iov[0].iov_base=(void *)buff1;
+  iov[0].iov_len=num1;
+  iov[1].iov_base=(void *)buff2;
+  iov[1].iov_len=num2;
+  cnt=2;
+  br=0;
+  while (cnt){
+    r=writev(sock, iov+2-cnt, cnt);
+    if (r==-1){
+      if (errno==EWOULDBLOCK || errno==EAGAIN || errno==EINTR){
+        if (psync_wait_socket_write_timeout(sock))
+          return -1;
+        else
+          continue;
+      }
+      else
+        return -1;
+    }
+    br+=r;
+    while (cnt && r>=iov[2-cnt].iov_len){
+      r-=iov[2-cnt].iov_len;
+      cnt--;
+    }
+    if (cnt){
+      iov[2-cnt].iov_base=(char *)iov[2-cnt].iov_base+r;
+      iov[2-cnt].iov_len-=r;
+    }
+  }
+  return br;
+}
+#else
+static int psync_socket_writev_plain(psync_socket_t sock, const void *buff1, int num1, const void *buff2, int num2){
+  if (psync_socket_writeall_plain(sock, buff1, num1)!=num1 || psync_socket_writeall_plain(sock, buff2, num2)!=num2)
+    return -1;
+  return num1+num2;
+}
+#endif
+
+/* A corked socket collects small writes in a buffer of one TLS record and sends them when the buffer is full, before
+ * the socket is read from, or on psync_socket_flush()/psync_socket_uncork(). Not to be used with the _thread functions. */
+void psync_socket_cork(psync_socket *sock){
+  if (sock->cork)
+    return;
+  sock->cork=(psync_socket_buffer *)psync_malloc(offsetof(psync_socket_buffer, buff)+PSYNC_SOCK_CORK_BUFF_SIZE);
+  sock->cork->next=NULL;
+  sock->cork->size=PSYNC_SOCK_CORK_BUFF_SIZE;
+  sock->cork->woffset=0;
+  sock->cork->roffset=0;
+}
+
+int psync_socket_flush(psync_socket *sock){
+  psync_socket_buffer *c;
+  int len;
+  c=sock->cork;
+  if (!c || !c->woffset)
+    return 0;
+  len=c->woffset;
+  c->woffset=0;
+  if (sock->ssl)
+    return psync_socket_writeall_ssl(sock, c->buff, len)==len?0:-1;
+  else
+    return psync_socket_writeall_plain(sock->sock, c->buff, len)==len?0:-1;
+}
+
+int psync_socket_uncork(psync_socket *sock){
+  int ret;
+  ret=psync_socket_flush(sock);
+  psync_free(sock->cork);
+  sock->cork=NULL;
+  return ret;
+}
+
+static int psync_socket_writeall_corked(psync_socket *sock, const void *buff, int num){
+  psync_socket_buffer *c;
+  int wr, len;
+  c=sock->cork;
+  if (c->woffset+num<c->size){
+    memcpy(c->buff+c->woffset, buff, num);
+    c->woffset+=num;
+    return num;
+  }
+  if (!sock->ssl){
+    len=c->woffset;
+    c->woffset=0;
+    return psync_socket_writev_plain(sock->sock, c->buff, len, buff, num)==len+num?num:-1;
+  }
+  /* top up the buffer to a full record and send it, then send what is left in full records and keep the tail */
+  wr=c->size-c->woffset;
+  memcpy(c->buff+c->woffset, buff, wr);
+  c->woffset=c->size;
+  if (psync_socket_flush(sock))
+    return -1;
+  len=(num-wr)/c->size*c->size;
+  if (len && psync_socket_writeall_ssl(sock, (const char *)buff+wr, len)!=len)
+    return -1;
+  memcpy(c->buff, (const char *)buff+wr+len, num-wr-len);
+  c->woffset=num-wr-len;
+  return num;
+}
+
 int psync_socket_writeall(psync_socket *sock, const void *buff, int num){
   if (sock->buffer)
     return psync_socket_write_to_buf(sock, buff, num);
+  if (sock->cork)
+    return psync_socket_writeall_corked(sock, buff, num);
   if (sock->ssl)
     return psync_socket_writeall_ssl(sock, buff, num);
   else
@@ -2374,6 +2769,44 @@ int psync_file_delete(const char *path){
 #endif
 }
 
+/* creates destination as a copy of source without moving the data through userspace, fails with -1 when the
+ * filesystem can not do that (e.g. source and destination are on different filesystems) */
+int psync_file_clone(const char *source, const char *destination, uint64_t size){
+#if defined(P_OS_LINUX)
+  psync_file_t sfd, dfd;
+  ssize_t cp;
+  sfd=psync_file_open(source, P_O_RDONLY, 0);
+  if (unlikely(sfd==INVALID_HANDLE_VALUE))
+    return -1;
+  dfd=psync_file_open(destination, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely(dfd==INVALID_HANDLE_VALUE)){
+    psync_file_close(sfd);
+    return -1;
+  }
+  if (!ioctl(dfd, FICLONE, sfd))
+    size=0;
+#if defined(__NR_copy_file_range)
+  while (size){
+    cp=syscall(__NR_copy_file_range, sfd, NULL, dfd, NULL, size, 0);
+    if (cp<=0)
+      break;
+    size-=cp;
+  }
+#endif
+  psync_file_close(sfd);
+  if (unlikely(psync_file_close(dfd)) || size){
+    psync_file_delete(destination);
+    return -1;
+  }
+  return 0;
+#elif defined(P_OS_MACOSX)
+  psync_file_delete(destination);
+  return clonefile(source, destination, 0);
+#else
+  return -1;
+#endif
+}
+
 psync_file_t psync_file_open(const char *path, int access, int flags){
 #if defined(P_OS_POSIX)
   int fd;
@@ -3110,6 +3543,108 @@ void psync_anon_reset(void *ptr, size_t size){
 #endif
 }
 
+#if defined(P_OS_LINUX)
+static size_t huge_page_round_up(size_t size){
+  return (size+PSYNC_HUGE_PAGE_SIZE-1)&~((size_t)PSYNC_HUGE_PAGE_SIZE-1);
+}
+#endif
+
+void *psync_mmap_anon_huge(size_t size){
+#if defined(P_OS_LINUX)
+  char *ret, *aligned;
+  size_t hsize;
+  hsize=huge_page_round_up(size);
+#if defined(MAP_HUGETLB)
+  ret=(char *)mmap(NULL, hsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if (ret!=MAP_FAILED){
+    debug(D_NOTICE, "allocated %lu bytes in huge pages", (unsigned long)hsize);
+    return ret;
+  }
+#endif
+  /* no reserved huge pages, map a block aligned to the huge page size so transparent huge pages can back all of it */
+  ret=(char *)mmap(NULL, hsize+PSYNC_HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (unlikely(ret==MAP_FAILED))
+    return psync_mmap_anon_safe(hsize);
+  aligned=(char *)(((uintptr_t)ret+PSYNC_HUGE_PAGE_SIZE-1)&~((uintptr_t)PSYNC_HUGE_PAGE_SIZE-1));
+  if (aligned!=ret)
+    munmap(ret, aligned-ret);
+  munmap(aligned+hsize, ret+PSYNC_HUGE_PAGE_SIZE-aligned);
+#if defined(MADV_HUGEPAGE)
+  madvise(aligned, hsize, MADV_HUGEPAGE);
+#endif
+  return aligned;
+#else
+  return psync_mmap_anon_safe(size);
+#endif
+}
+
+int psync_munmap_anon_huge(void *ptr, size_t size){
+#if defined(P_OS_LINUX)
+  return munmap(ptr, huge_page_round_up(size));
+#else
+  return psync_munmap_anon(ptr, size);
+#endif
+}
+
+int psync_numa_node_count(){
+#if defined(P_OS_LINUX)
+  static int nodes=0;
+  char buff[256], *s;
+  ssize_t rd;
+  int fd, n, maxnode;
+  if (nodes)
+    return nodes;
+  maxnode=0;
+  fd=open("/sys/devices/system/node/online", O_RDONLY);
+  if (fd!=-1){
+    rd=read(fd, buff, sizeof(buff)-1);
+    close(fd);
+    if (rd>0){
+      /* format is a list of ranges like "0-1,3" */
+      buff[rd]=0;
+      s=buff;
+      while (*s){
+        if (*s>='0' && *s<='9'){
+          n=0;
+          while (*s>='0' && *s<='9')
+            n=n*10+*s++-'0';
+          if (n>maxnode)
+            maxnode=n;
+        }
+        else
+          s++;
+      }
+    }
+  }
+  nodes=maxnode+1;
+  return nodes;
+#else
+  return 1;
+#endif
+}
+
+int psync_numa_current_node(){
+#if defined(P_OS_LINUX) && defined(SYS_getcpu)
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL)==0)
+    return node;
+#endif
+  return 0;
+}
+
+int psync_numa_bind_preferred(void *ptr, size_t size, int node){
+#if defined(P_OS_LINUX) && defined(SYS_mbind)
+  unsigned long mask;
+  if (node<0 || node>=sizeof(mask)*8-1)
+    return -1;
+  mask=1UL<<node;
+  /* 1 is MPOL_PREFERRED, allocations fall back to other nodes if this one is out of memory */
+  return syscall(SYS_mbind, ptr, size, 1, &mask, sizeof(mask)*8, 0);
+#else
+  return -1;
+#endif
+}
+
 int psync_mlock(void *ptr, size_t size){
 #if defined(_POSIX_MEMLOCK_RANGE)
   return mlock(ptr, size);
@@ -3133,3 +3668,7 @@ int psync_munlock(void *ptr, size_t size){
 int psync_get_page_size(){
   return psync_page_size;
 }
+
+int psync_get_cpu_count(){
+  return psync_cpu_count;
+}
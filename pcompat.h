@@ -339,6 +339,7 @@ typedef struct _psync_socket_buffer {
 typedef struct {
   void *ssl;
   psync_socket_buffer *buffer;
+  psync_socket_buffer *cork;
   psync_socket_t sock;
   int pending;
 } psync_socket;
@@ -402,6 +403,7 @@ typedef void (*psync_thread_start1)(void *);
 extern PSYNC_THREAD const char *psync_thread_name;
 
 void psync_compat_init();
+void psync_compat_timers_init();
 int psync_user_is_admin();
 int psync_stat_mode_ok(psync_stat_t *buf, unsigned int bits) PSYNC_PURE;
 char *psync_get_pcloud_path();
@@ -426,6 +428,9 @@ void psync_socket_set_write_buffered(psync_socket *sock);
 void psync_socket_set_write_buffered_thread(psync_socket *sock);
 void psync_socket_clear_write_buffered(psync_socket *sock);
 void psync_socket_clear_write_buffered_thread(psync_socket *sock);
+void psync_socket_cork(psync_socket *sock);
+int psync_socket_flush(psync_socket *sock);
+int psync_socket_uncork(psync_socket *sock);
 int psync_socket_set_recvbuf(psync_socket *sock, uint32_t bufsize);
 int psync_socket_set_sendbuf(psync_socket *sock, uint32_t bufsize);
 int psync_socket_isssl(psync_socket *sock) PSYNC_PURE;
@@ -467,6 +472,7 @@ int psync_rmdir(const char *path);
 int psync_file_rename(const char *oldpath, const char *newpath);
 int psync_file_rename_overwrite(const char *oldpath, const char *newpath);
 int psync_file_delete(const char *path);
+int psync_file_clone(const char *source, const char *destination, uint64_t size);
 
 psync_file_t psync_file_open(const char *path, int access, int flags);
 int psync_file_close(psync_file_t fd);
@@ -500,10 +506,17 @@ void *psync_mmap_anon(size_t size);
 void *psync_mmap_anon_safe(size_t size);
 int psync_munmap_anon(void *ptr, size_t size);
 void psync_anon_reset(void *ptr, size_t size);
+void *psync_mmap_anon_huge(size_t size);
+int psync_munmap_anon_huge(void *ptr, size_t size);
+
+int psync_numa_node_count();
+int psync_numa_current_node();
+int psync_numa_bind_preferred(void *ptr, size_t size, int node);
 
 int psync_mlock(void *ptr, size_t size);
 int psync_munlock(void *ptr, size_t size);
 
 int psync_get_page_size();
+int psync_get_cpu_count();
 
 #endif
@@ -142,6 +142,21 @@
 #define restrict
 #endif
 
+/* psync_atomic_add returns the value before the addition */
+#if defined(__GNUC__)
+#define psync_atomic_add(ptr, val) __sync_fetch_and_add(ptr, val)
+#define psync_atomic_cas(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define psync_memory_barrier() __sync_synchronize()
+#elif defined(_MSC_VER)
+#define psync_atomic_add(ptr, val) InterlockedExchangeAdd64((LONGLONG volatile *)(ptr), val)
+#define psync_atomic_cas(ptr, oldval, newval) (InterlockedCompareExchange64((LONGLONG volatile *)(ptr), newval, oldval)==(LONGLONG)(oldval))
+#define psync_memory_barrier() MemoryBarrier()
+#else
+#define psync_atomic_add(ptr, val) ((*(ptr)+=(val))-(val))
+#define psync_atomic_cas(ptr, oldval, newval) ((*(ptr)=(newval)), 1)
+#define psync_memory_barrier() do {} while (0)
+#endif
+
 #if defined(__clang__) || defined(_MSC_VER)
 #define psync_alignof __alignof
 #elif defined(__GNUC__)
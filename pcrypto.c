@@ -29,6 +29,7 @@
 #include "pcrypto.h"
 #include "psettings.h"
 #include "pmemlock.h"
+#include "plist.h"
 #include <string.h>
 #include <stddef.h>
 
@@ -727,3 +728,135 @@ void psync_crypto_sign_auth_sector(psync_crypto_aes256_sector_encoder_decoder_t
   psync_aes256_encode_2blocks_consec(enc->encoder, aessrc, aesdst);
   memcpy(authout, aesdst, PSYNC_AES256_BLOCK_SIZE*2);
 }
+
+/* Batched sector encoding/decoding. Runs of sectors are split in chunks of PSYNC_CRYPTO_WORKER_CHUNK_SECTORS that are processed
+ * by a small pool of worker threads and by the calling thread itself, so a 128k FUSE read or write is not limited to the speed
+ * of a single core. Encoders are only read during encoding/decoding, so sharing one between threads is safe.
+ */
+
+typedef struct {
+  psync_list list;
+  psync_crypto_aes256_sector_encoder_decoder_t enc;
+  psync_crypto_sector_batch_t *sectors;
+  uint32_t cnt;
+  uint32_t next;
+  uint32_t done;
+  int encode;
+} psync_crypto_batch_job_t;
+
+static pthread_mutex_t batch_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_job_cond=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done_cond=PTHREAD_COND_INITIALIZER;
+static psync_list batch_jobs=PSYNC_LIST_STATIC_INIT(batch_jobs);
+static int batch_workers=-1;
+
+static void psync_crypto_batch_process(psync_crypto_batch_job_t *job, uint32_t from, uint32_t to){
+  psync_crypto_sector_batch_t *s;
+  for (s=job->sectors+from; s<job->sectors+to; s++)
+    if (job->encode)
+      psync_crypto_aes256_encode_sector(job->enc, s->data, s->datalen, s->out, s->auth, s->sectorid);
+    else
+      s->result=psync_crypto_aes256_decode_sector(job->enc, s->data, s->datalen, s->out, s->auth, s->sectorid);
+}
+
+/* should be called with batch_mutex held, returns 0 if there is nothing more to claim in the job */
+static int psync_crypto_batch_claim(psync_crypto_batch_job_t *job, uint32_t *from, uint32_t *to){
+  if (job->next>=job->cnt)
+    return 0;
+  *from=job->next;
+  if (job->cnt-job->next>PSYNC_CRYPTO_WORKER_CHUNK_SECTORS)
+    job->next+=PSYNC_CRYPTO_WORKER_CHUNK_SECTORS;
+  else
+    job->next=job->cnt;
+  *to=job->next;
+  if (job->next==job->cnt)
+    psync_list_del(&job->list);
+  return 1;
+}
+
+static void psync_crypto_batch_complete(psync_crypto_batch_job_t *job, uint32_t from, uint32_t to){
+  job->done+=to-from;
+  if (job->done==job->cnt)
+    pthread_cond_broadcast(&batch_done_cond);
+}
+
+static void psync_crypto_batch_worker(){
+  psync_crypto_batch_job_t *job;
+  uint32_t from, to;
+  pthread_mutex_lock(&batch_mutex);
+  while (1){
+    while (psync_list_isempty(&batch_jobs))
+      pthread_cond_wait(&batch_job_cond, &batch_mutex);
+    job=psync_list_element(batch_jobs.next, psync_crypto_batch_job_t, list);
+    if (!psync_crypto_batch_claim(job, &from, &to))
+      continue;
+    pthread_mutex_unlock(&batch_mutex);
+    psync_crypto_batch_process(job, from, to);
+    pthread_mutex_lock(&batch_mutex);
+    psync_crypto_batch_complete(job, from, to);
+  }
+}
+
+/* should be called with batch_mutex held */
+static int psync_crypto_batch_has_workers(){
+  int i;
+  if (likely(batch_workers!=-1))
+    return batch_workers;
+  batch_workers=psync_get_cpu_count()-1;
+  if (batch_workers>PSYNC_CRYPTO_MAX_WORKER_THREADS)
+    batch_workers=PSYNC_CRYPTO_MAX_WORKER_THREADS;
+  debug(D_NOTICE, "starting %d crypto worker threads", batch_workers);
+  for (i=0; i<batch_workers; i++)
+    psync_run_thread("crypto worker", psync_crypto_batch_worker);
+  return batch_workers;
+}
+
+static void psync_crypto_batch_run(psync_crypto_batch_job_t *job){
+  uint32_t from, to;
+  if (job->cnt<PSYNC_CRYPTO_PARALLEL_MIN_SECTORS){
+    psync_crypto_batch_process(job, 0, job->cnt);
+    return;
+  }
+  job->next=0;
+  job->done=0;
+  pthread_mutex_lock(&batch_mutex);
+  if (!psync_crypto_batch_has_workers()){
+    pthread_mutex_unlock(&batch_mutex);
+    psync_crypto_batch_process(job, 0, job->cnt);
+    return;
+  }
+  psync_list_add_tail(&batch_jobs, &job->list);
+  pthread_cond_broadcast(&batch_job_cond);
+  while (psync_crypto_batch_claim(job, &from, &to)){
+    pthread_mutex_unlock(&batch_mutex);
+    psync_crypto_batch_process(job, from, to);
+    pthread_mutex_lock(&batch_mutex);
+    psync_crypto_batch_complete(job, from, to);
+  }
+  while (job->done<job->cnt)
+    pthread_cond_wait(&batch_done_cond, &batch_mutex);
+  pthread_mutex_unlock(&batch_mutex);
+}
+
+void psync_crypto_aes256_encode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, psync_crypto_sector_batch_t *sectors, size_t cnt){
+  psync_crypto_batch_job_t job;
+  job.enc=enc;
+  job.sectors=sectors;
+  job.cnt=cnt;
+  job.encode=1;
+  psync_crypto_batch_run(&job);
+}
+
+int psync_crypto_aes256_decode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, psync_crypto_sector_batch_t *sectors, size_t cnt){
+  psync_crypto_batch_job_t job;
+  size_t i;
+  job.enc=enc;
+  job.sectors=sectors;
+  job.cnt=cnt;
+  job.encode=0;
+  psync_crypto_batch_run(&job);
+  for (i=0; i<cnt; i++)
+    if (sectors[i].result)
+      return -1;
+  return 0;
+}
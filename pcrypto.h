@@ -45,6 +45,17 @@ typedef struct {
 
 typedef unsigned char psync_crypto_sector_auth_t[PSYNC_CRYPTO_AUTH_SIZE];
 
+/* one element of a batch for psync_crypto_aes256_encode_sectors/psync_crypto_aes256_decode_sectors, auth is input for decoding
+ * and output for encoding, result is set only when decoding */
+typedef struct {
+  const unsigned char *data;
+  unsigned char *out;
+  unsigned char *auth;
+  uint64_t sectorid;
+  uint32_t datalen;
+  int result;
+} psync_crypto_sector_batch_t;
+
 typedef struct {
   psync_aes256_encoder encoder;
   union {
@@ -93,4 +104,6 @@ void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decode
 int psync_crypto_aes256_decode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, 
                                        unsigned char *out, const psync_crypto_sector_auth_t auth, uint64_t sectorid);
 void psync_crypto_sign_auth_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, psync_crypto_sector_auth_t authout);
+void psync_crypto_aes256_encode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, psync_crypto_sector_batch_t *sectors, size_t cnt);
+int psync_crypto_aes256_decode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, psync_crypto_sector_batch_t *sectors, size_t cnt);
 #endif
@@ -29,6 +29,7 @@
 #define _PSYNC_DATABASE_H
 
 #include "pcompat.h"
+#include "pstatuscounter.h"
 #include <sqlite3.h>
 
 #if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER>=3008002
@@ -43,7 +44,7 @@
 #define PSYNC_TEXT_COL "COLLATE NOCASE"
 #endif
 
-#define PSYNC_DATABASE_VERSION 11
+#define PSYNC_DATABASE_VERSION 16
 
 #define PSYNC_DATABASE_CONFIG \
 "\
@@ -53,6 +54,7 @@ PRAGMA synchronous=1;\
 PRAGMA locking_mode=EXCLUSIVE;\
 PRAGMA cache_size=8000;\
 PRAGMA foreign_keys=ON;\
+PRAGMA recursive_triggers=ON;\
 "
 
 #define PSYNC_DATABASE_STRUCTURE \
@@ -87,7 +89,7 @@ CREATE TABLE IF NOT EXISTS localfile (id INTEGER PRIMARY KEY AUTOINCREMENT, loca
   syncid INTEGER REFERENCES syncfolder(id) ON DELETE CASCADE, size INTEGER, inode INTEGER, mtime INTEGER, mtimenative INTEGER, name VARCHAR(1024) "PSYNC_TEXT_COL", checksum TEXT);\
 CREATE INDEX IF NOT EXISTS klocalfilelpfid ON localfile(localparentfolderid);\
 CREATE INDEX IF NOT EXISTS klocalfilefileid ON localfile(fileid);\
-CREATE INDEX IF NOT EXISTS klocalfilechecksum ON localfile(checksum);\
+CREATE INDEX IF NOT EXISTS klocalfilechecksum ON localfile(checksum, size);\
 CREATE UNIQUE INDEX IF NOT EXISTS klocalfilerpsn ON localfile(syncid, localparentfolderid, name);\
 CREATE TABLE IF NOT EXISTS localfileupload (localfileid INTEGER REFERENCES localfile(id) ON DELETE CASCADE, uploadid INTEGER, PRIMARY KEY (localfileid, uploadid)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS syncedfolder (syncid INTEGER REFERENCES syncfolder(id) ON DELETE CASCADE, folderid INTEGER, localfolderid INTEGER, synctype INTEGER,\
@@ -111,7 +113,7 @@ CREATE UNIQUE INDEX IF NOT EXISTS kpagecachehashpageid ON pagecache(hash, pageid
 CREATE INDEX IF NOT EXISTS kpagecachetype ON pagecache(type);\
 CREATE TABLE IF NOT EXISTS fstask (id INTEGER PRIMARY KEY, type INTEGER, status INTEGER, folderid INTEGER, sfolderid INTEGER, fileid INTEGER,\
   text1 TEXT, text2 TEXT, int1 INTEGER, int2 INTEGER);\
-CREATE INDEX IF NOT EXISTS kfstaskfolderid ON fstask(folderid);\
+CREATE INDEX IF NOT EXISTS kfstaskfolderid ON fstask(folderid, status);\
 CREATE INDEX IF NOT EXISTS kfstasksfolderid ON fstask(sfolderid);\
 CREATE INDEX IF NOT EXISTS kfstaskfileid ON fstask(fileid);\
 CREATE TABLE IF NOT EXISTS fstaskdepend (fstaskid INTEGER REFERENCES fstask(id) ON DELETE CASCADE, dependfstaskid INTEGER REFERENCES fstask(id) ON DELETE CASCADE,\
@@ -122,9 +124,16 @@ CREATE TABLE IF NOT EXISTS fstaskupload (fstaskid INTEGER REFERENCES fstask(id)
 CREATE TABLE IF NOT EXISTS fstaskfileid (fstaskid INTEGER REFERENCES fstask(id) ON DELETE CASCADE, fileid INTEGER, PRIMARY KEY (fstaskid, fileid)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS resolver (hostname TEXT, port TEXT, prio INTEGER, created INTEGER, family INTEGER, socktype INTEGER, protocol INTEGER,\
   data TEXT, PRIMARY KEY (hostname, port, prio)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS resolverscore (data TEXT PRIMARY KEY, latency INTEGER, failures INTEGER, updated INTEGER) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS fsxattr (objectid INTEGER, name TEXT, value BLOB, PRIMARY KEY (objectid, name)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS cryptofolderkey (folderid INTEGER PRIMARY KEY REFERENCES folder(id) ON DELETE CASCADE, enckey BLOB NOT NULL);\
 CREATE TABLE IF NOT EXISTS cryptofilekey (fileid INTEGER PRIMARY KEY REFERENCES file(id) ON DELETE CASCADE, hash INTEGER NOT NULL, enckey BLOB NOT NULL);\
+CREATE TABLE IF NOT EXISTS fspin (id INTEGER PRIMARY KEY, folderid INTEGER, fileid INTEGER, path TEXT NOT NULL, files INTEGER NOT NULL DEFAULT 0,\
+  filescached INTEGER NOT NULL DEFAULT 0, bytes INTEGER NOT NULL DEFAULT 0, bytescached INTEGER NOT NULL DEFAULT 0);\
+CREATE UNIQUE INDEX IF NOT EXISTS kfspinpath ON fspin(path);\
+" PSYNC_STATUS_COUNTER_STRUCTURE "\
+INSERT OR IGNORE INTO statuscounter (id, files, bytes) VALUES (" NTO_STR(PSYNC_STATUS_COUNTER_DOWNLOAD) ", 0, 0);\
+INSERT OR IGNORE INTO statuscounter (id, files, bytes) VALUES (" NTO_STR(PSYNC_STATUS_COUNTER_UPLOAD) ", 0, 0);\
 INSERT OR IGNORE INTO folder (id, name) VALUES (0, '');\
 INSERT OR IGNORE INTO localfolder (id) VALUES (0);\
 INSERT OR IGNORE INTO setting (id, value) VALUES ('dbversion', " NTO_STR(PSYNC_DATABASE_VERSION) ");\
@@ -222,7 +231,33 @@ CREATE INDEX IF NOT EXISTS klocalfolderfolderid ON localfolder(folderid);\
 CREATE INDEX IF NOT EXISTS klocalfoldersyncid ON localfolder(syncid);\
 UPDATE setting SET value=11 WHERE id='dbversion';\
 COMMIT;\
-PRAGMA foreign_keys=ON;"
+PRAGMA foreign_keys=ON;",
+  "BEGIN;\
+" PSYNC_STATUS_COUNTER_STRUCTURE "\
+REPLACE INTO statuscounter (id, files, bytes) SELECT " NTO_STR(PSYNC_STATUS_COUNTER_DOWNLOAD) ", * FROM (" PSYNC_STATUS_COUNTER_RECOUNT_DOWNLOAD ");\
+REPLACE INTO statuscounter (id, files, bytes) SELECT " NTO_STR(PSYNC_STATUS_COUNTER_UPLOAD) ", * FROM (" PSYNC_STATUS_COUNTER_RECOUNT_UPLOAD ");\
+UPDATE setting SET value=12 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+CREATE TABLE IF NOT EXISTS resolverscore (data TEXT PRIMARY KEY, latency INTEGER, failures INTEGER, updated INTEGER) " P_SQL_WOWROWID ";\
+UPDATE setting SET value=13 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+DROP INDEX IF EXISTS kfstaskfolderid;\
+CREATE INDEX IF NOT EXISTS kfstaskfolderid ON fstask(folderid, status);\
+UPDATE setting SET value=14 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+DROP INDEX IF EXISTS klocalfilechecksum;\
+CREATE INDEX IF NOT EXISTS klocalfilechecksum ON localfile(checksum, size);\
+UPDATE setting SET value=15 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+CREATE TABLE IF NOT EXISTS fspin (id INTEGER PRIMARY KEY, folderid INTEGER, fileid INTEGER, path TEXT NOT NULL, files INTEGER NOT NULL DEFAULT 0,\
+  filescached INTEGER NOT NULL DEFAULT 0, bytes INTEGER NOT NULL DEFAULT 0, bytescached INTEGER NOT NULL DEFAULT 0);\
+CREATE UNIQUE INDEX IF NOT EXISTS kfspinpath ON fspin(path);\
+UPDATE setting SET value=16 WHERE id='dbversion';\
+COMMIT;"
 };
 
 #endif
@@ -41,6 +41,7 @@
 #include "pfileops.h"
 #include "pfsxattr.h"
 #include "pfs.h"
+#include "pfspin.h"
 #include "pnotifications.h"
 #include <ctype.h>
 
@@ -1634,6 +1635,7 @@ static void psync_diff_refresh_fs_add_folder(psync_folderid_t folderid){
 }
 
 static void psync_diff_refresh_fs(const binresult *entries){
+  psync_fs_pin_refresh();
   if (psync_fs_need_per_folder_refresh()){
     const binresult *meta;
     psync_folderid_t folderid, lastfolderid;
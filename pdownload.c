@@ -558,14 +558,16 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
   }
   else
     localsize=0;
-  sql=psync_sql_query("SELECT id FROM localfile WHERE size=? AND checksum=?");
-  psync_sql_bind_uint(sql, 1, serversize);
-  psync_sql_bind_lstring(sql, 2, (char *)serverhashhex, PSYNC_HASH_DIGEST_HEXLEN);
+  sql=psync_sql_query("SELECT id, inode, mtimenative FROM localfile WHERE checksum=? AND size=?");
+  psync_sql_bind_lstring(sql, 1, (char *)serverhashhex, PSYNC_HASH_DIGEST_HEXLEN);
+  psync_sql_bind_uint(sql, 2, serversize);
   while ((row=psync_sql_fetch_rowint(sql))){
     tmpname=psync_local_path_for_local_file(row[0], NULL);
     if (unlikely_log(!tmpname))
       continue;
-    rt=psync_copy_local_file_if_checksum_matches(tmpname, name, serverhashhex, serversize);
+    rt=psync_clone_local_file_if_unchanged(tmpname, name, serversize, row[1], row[2]);
+    if (rt!=PSYNC_NET_OK)
+      rt=psync_copy_local_file_if_checksum_matches(tmpname, name, serverhashhex, serversize);
     if (likely(rt==PSYNC_NET_OK)){
       if (unlikely_log(stat_and_create_local(syncid, fileid, localfolderid, filename, name, serverhashhex, serversize, hash)))
         rt=PSYNC_NET_TEMPFAIL;
@@ -599,7 +601,7 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
   
   tmpname=psync_strcat(localpath, PSYNC_DIRECTORY_SEPARATOR, filename, PSYNC_APPEND_PARTIAL_FILES, NULL);
   if (serversize>=PSYNC_MIN_SIZE_FOR_P2P){
-    rt=psync_p2p_check_download(fileid, serverhashhex, serversize, tmpname);
+    rt=psync_p2p_check_download(fileid, serverhashhex, serversize, hash, tmpname);
     if (rt==PSYNC_NET_OK){
       psync_stop_localscan();
       if (unlikely_log(rename_if_notex(tmpname, name, fileid, localfolderid, syncid, filename)) || 
@@ -42,6 +42,7 @@
 #include "pfsfolder.h"
 #include "pcache.h"
 #include "ppagecache.h"
+#include "pfspin.h"
 #include "ptimer.h"
 #include "pfstasks.h"
 #include "pfsupload.h"
@@ -52,6 +53,8 @@
 #include "pcloudcrypto.h"
 #include "pfscrypto.h"
 #include "pfsstatic.h"
+#include "pshaper.h"
+#include "platency.h"
 
 #ifndef FUSE_STAT
 #define FUSE_STAT stat
@@ -168,6 +171,7 @@ int psync_fs_update_openfile(uint64_t taskid, uint64_t writeid, psync_fileid_t n
             psync_interval_tree_free(fl->authenticatedints);
             fl->authenticatedints=NULL;
           }
+          psync_pagecache_free_verified_auth(fl);
           size=psync_fs_crypto_plain_size(size);
         }
         debug(D_NOTICE, "updating fileid %ld to %lu, hash %lu size %lu", (long)fileid, (unsigned long)newfileid, (unsigned long)hash, (unsigned long)size);
@@ -902,8 +906,11 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     }
   }
   psync_sql_rdunlock();
-  if (dec)
+  if (dec){
     psync_cloud_crypto_release_folder_decoder(folderid, dec);
+    if (folderid>0)
+      psync_cloud_crypto_prefetch_folder_keys(folderid);
+  }
   return PRINT_RETURN(0);
 }
 
@@ -988,6 +995,8 @@ static psync_openfile_t *psync_fs_create_file(psync_fsfileid_t fileid, psync_fsf
     fl->encrypted=1;
     fl->encoder=encoder;
     fl->logfile=INVALID_HANDLE_VALUE;
+    fl->foldlog=INVALID_HANDLE_VALUE;
+    psync_list_init(&fl->verifiedauthlru);
   }
   if (lock)
     pthread_mutex_lock(&fl->mutex);
@@ -1580,6 +1589,7 @@ static void psync_fs_free_openfile(psync_openfile_t *of){
     delete_log_files(of);
     if (of->authenticatedints)
       psync_interval_tree_free(of->authenticatedints);
+    psync_pagecache_free_verified_auth(of);
   }
   pthread_mutex_destroy(&of->mutex);
   close_if_valid(of->datafile);
@@ -1692,7 +1702,7 @@ static int psync_fs_flush(const char *path, struct fuse_file_info *fi){
       psync_sql_bind_uint(res, 3, writeid);
       psync_sql_run_free(res);
     }
-    psync_status_recalc_to_upload_async();
+    psync_status_fs_tasks_changed();
     return 0;
   }
   pthread_mutex_unlock(&of->mutex);
@@ -2034,36 +2044,12 @@ PSYNC_NOINLINE static int psync_fs_check_modified_file_write_space(psync_openfil
 }
 
 static void psync_fs_throttle(size_t size, uint64_t speed){
-  static pthread_mutex_t throttle_mutex=PTHREAD_MUTEX_INITIALIZER;
-  static uint64_t writtenthissec=0;
-  static time_t thissec=0;
-  time_t currsec;
-  int cnt;
+  time_t deadline;
   assert(speed>0);
-  cnt=0;
-  while (++cnt<=PSYNC_FS_MAX_SHAPER_SLEEP_SEC){
-    currsec=psync_timer_time();
-    pthread_mutex_lock(&throttle_mutex);
-    if (currsec!=thissec){
-      thissec=currsec;
-      writtenthissec=0;
-    }
-    if (writtenthissec<speed){
-      if (writtenthissec+size>speed){
-        size-=speed-writtenthissec;
-        writtenthissec=speed;
-      }
-      else{
-        writtenthissec+=size;
-        pthread_mutex_unlock(&throttle_mutex);
-        assert(size<=speed);
-        psync_milisleep(size*1000/speed);
-        return;
-      }
-    }
-    pthread_mutex_unlock(&throttle_mutex);
-    psync_timer_wait_next_sec();
-  }
+  psync_shaper_set_rate(&psync_shaper_fswrite, speed);
+  deadline=psync_timer_time()+PSYNC_FS_MAX_SHAPER_SLEEP_SEC;
+  while (size && psync_timer_time()<deadline)
+    size-=psync_shaper_consume(&psync_shaper_fswrite, size);
 }
 
 PSYNC_NOINLINE static int psync_fs_do_check_write_space(psync_openfile_t *of, size_t size){
@@ -2996,6 +2982,7 @@ static void psync_fs_init_once(){
 #endif
   psync_fstask_init();
   psync_pagecache_init();
+  psync_fspin_init();
   atexit(psync_fs_do_stop);
 #if defined(P_OS_POSIX)
   psync_setup_signals();
@@ -3028,6 +3015,118 @@ static void psync_fuse_thread(){
   pthread_mutex_unlock(&start_mutex);
 }
 
+/* wrappers that feed the latency histograms of all filesystem operations */
+#define PSYNC_FS_TIMED(op, call) do {\
+  uint64_t tmstart;\
+  int tmret;\
+  tmstart=psync_latency_now();\
+  tmret=call;\
+  psync_latency_end(PSYNC_LATENCY_FS_##op, tmstart);\
+  return tmret;\
+} while (0)
+
+#if defined(P_OS_MACOSX)
+#define PFS_XATTR_IGN_ARG , ign
+#else
+#define PFS_XATTR_IGN_ARG
+#endif
+
+static int psync_fs_timed_getattr(const char *path, struct FUSE_STAT *stbuf){
+  PSYNC_FS_TIMED(GETATTR, psync_fs_getattr(path, stbuf));
+}
+
+static int psync_fs_timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fuse_off_t offset, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(READDIR, psync_fs_readdir(path, buf, filler, offset, fi));
+}
+
+static int psync_fs_timed_open(const char *path, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(OPEN, psync_fs_open(path, fi));
+}
+
+static int psync_fs_timed_creat(const char *path, mode_t mode, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(CREAT, psync_fs_creat(path, mode, fi));
+}
+
+static int psync_fs_timed_release(const char *path, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(RELEASE, psync_fs_release(path, fi));
+}
+
+static int psync_fs_timed_flush(const char *path, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(FLUSH, psync_fs_flush(path, fi));
+}
+
+static int psync_fs_timed_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(FSYNC, psync_fs_fsync(path, datasync, fi));
+}
+
+static int psync_fs_timed_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(FSYNCDIR, psync_fs_fsyncdir(path, datasync, fi));
+}
+
+static int psync_fs_timed_read(const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(READ, psync_fs_read(path, buf, size, offset, fi));
+}
+
+static int psync_fs_timed_write(const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(WRITE, psync_fs_write(path, buf, size, offset, fi));
+}
+
+static int psync_fs_timed_mkdir(const char *path, mode_t mode){
+  PSYNC_FS_TIMED(MKDIR, psync_fs_mkdir(path, mode));
+}
+
+static int psync_fs_timed_rmdir(const char *path){
+  PSYNC_FS_TIMED(RMDIR, psync_fs_rmdir(path));
+}
+
+static int psync_fs_timed_unlink(const char *path){
+  PSYNC_FS_TIMED(UNLINK, psync_fs_unlink(path));
+}
+
+static int psync_fs_timed_rename(const char *old_path, const char *new_path){
+  PSYNC_FS_TIMED(RENAME, psync_fs_rename(old_path, new_path));
+}
+
+static int psync_fs_timed_statfs(const char *path, struct statvfs *stbuf){
+  PSYNC_FS_TIMED(STATFS, psync_fs_statfs(path, stbuf));
+}
+
+static int psync_fs_timed_chmod(const char *path, mode_t mode){
+  PSYNC_FS_TIMED(CHMOD, psync_fs_chmod(path, mode));
+}
+
+static int psync_fs_timed_chown(const char *path, uid_t uid, gid_t gid){
+  PSYNC_FS_TIMED(CHOWN, psync_fs_chown(path, uid, gid));
+}
+
+static int psync_fs_timed_utimens(const char *path, const struct timespec tv[2]){
+  PSYNC_FS_TIMED(UTIMENS, psync_fs_utimens(path, tv));
+}
+
+static int psync_fs_timed_ftruncate(const char *path, fuse_off_t size, struct fuse_file_info *fi){
+  PSYNC_FS_TIMED(FTRUNCATE, psync_fs_ftruncate(path, size, fi));
+}
+
+static int psync_fs_timed_truncate(const char *path, fuse_off_t size){
+  PSYNC_FS_TIMED(TRUNCATE, psync_fs_truncate(path, size));
+}
+
+static int psync_fs_timed_setxattr(const char *path, const char *name, const char *value, size_t size, int flags PFS_XATTR_IGN){
+  PSYNC_FS_TIMED(SETXATTR, psync_fs_setxattr(path, name, value, size, flags PFS_XATTR_IGN_ARG));
+}
+
+static int psync_fs_timed_getxattr(const char *path, const char *name, char *value, size_t size PFS_XATTR_IGN){
+  PSYNC_FS_TIMED(GETXATTR, psync_fs_getxattr(path, name, value, size PFS_XATTR_IGN_ARG));
+}
+
+static int psync_fs_timed_listxattr(const char *path, char *list, size_t size){
+  PSYNC_FS_TIMED(LISTXATTR, psync_fs_listxattr(path, list, size));
+}
+
+static int psync_fs_timed_removexattr(const char *path, const char *name){
+  PSYNC_FS_TIMED(REMOVEXATTR, psync_fs_removexattr(path, name));
+}
+
 static int psync_fs_do_start(){
   char *mp;
   struct fuse_operations psync_oper;
@@ -3055,31 +3154,31 @@ static int psync_fs_do_start(){
   memset(&psync_oper, 0, sizeof(psync_oper));
 
   psync_oper.init     = psync_fs_init;
-  psync_oper.getattr  = psync_fs_getattr;
-  psync_oper.readdir  = psync_fs_readdir;
-  psync_oper.open     = psync_fs_open;
-  psync_oper.create   = psync_fs_creat;
-  psync_oper.release  = psync_fs_release;
-  psync_oper.flush    = psync_fs_flush;
-  psync_oper.fsync    = psync_fs_fsync;
-  psync_oper.fsyncdir = psync_fs_fsyncdir;
-  psync_oper.read     = psync_fs_read;
-  psync_oper.write    = psync_fs_write;
-  psync_oper.mkdir    = psync_fs_mkdir;
-  psync_oper.rmdir    = psync_fs_rmdir;
-  psync_oper.unlink   = psync_fs_unlink;
-  psync_oper.rename   = psync_fs_rename;
-  psync_oper.statfs   = psync_fs_statfs;
-  psync_oper.chmod    = psync_fs_chmod;
-  psync_oper.chown    = psync_fs_chown;
-  psync_oper.utimens  = psync_fs_utimens;
-  psync_oper.ftruncate= psync_fs_ftruncate;
-  psync_oper.truncate = psync_fs_truncate;
-
-  psync_oper.setxattr = psync_fs_setxattr;
-  psync_oper.getxattr = psync_fs_getxattr;
-  psync_oper.listxattr= psync_fs_listxattr;
-  psync_oper.removexattr=psync_fs_removexattr;
+  psync_oper.getattr  = psync_fs_timed_getattr;
+  psync_oper.readdir  = psync_fs_timed_readdir;
+  psync_oper.open     = psync_fs_timed_open;
+  psync_oper.create   = psync_fs_timed_creat;
+  psync_oper.release  = psync_fs_timed_release;
+  psync_oper.flush    = psync_fs_timed_flush;
+  psync_oper.fsync    = psync_fs_timed_fsync;
+  psync_oper.fsyncdir = psync_fs_timed_fsyncdir;
+  psync_oper.read     = psync_fs_timed_read;
+  psync_oper.write    = psync_fs_timed_write;
+  psync_oper.mkdir    = psync_fs_timed_mkdir;
+  psync_oper.rmdir    = psync_fs_timed_rmdir;
+  psync_oper.unlink   = psync_fs_timed_unlink;
+  psync_oper.rename   = psync_fs_timed_rename;
+  psync_oper.statfs   = psync_fs_timed_statfs;
+  psync_oper.chmod    = psync_fs_timed_chmod;
+  psync_oper.chown    = psync_fs_timed_chown;
+  psync_oper.utimens  = psync_fs_timed_utimens;
+  psync_oper.ftruncate= psync_fs_timed_ftruncate;
+  psync_oper.truncate = psync_fs_timed_truncate;
+
+  psync_oper.setxattr = psync_fs_timed_setxattr;
+  psync_oper.getxattr = psync_fs_timed_getxattr;
+  psync_oper.listxattr= psync_fs_timed_listxattr;
+  psync_oper.removexattr=psync_fs_timed_removexattr;
 
 #if defined(FUSE_HAS_CAN_UNLINK)
   psync_oper.can_unlink=psync_fs_can_unlink;
@@ -3151,6 +3250,7 @@ void psync_fs_pause_until_login(){
 
 void psync_fs_clean_tasks(){
   psync_fstask_clean();
+  psync_fs_xattr_cache_clean();
 }
 
 int psync_fs_start(){
@@ -30,6 +30,7 @@
 
 #include "psynclib.h"
 #include "ptree.h"
+#include "plist.h"
 #include "pintervaltree.h"
 #include "papi.h"
 #include "psettings.h"
@@ -114,10 +115,19 @@ typedef struct {
   psync_crypto_aes256_sector_encoder_decoder_t encoder;
   psync_tree *sectorsinlog;
   psync_interval_tree_t *authenticatedints;
+  psync_tree *verifiedauth;
+  psync_list verifiedauthlru;
+  uint32_t verifiedauthcnt;
   psync_fast_hash256_ctx loghashctx;
   psync_enc_file_extender_t *extender;
   psync_file_t logfile;
+  psync_file_t foldlog;
+  char *foldlogname;
+  uint64_t foldoff;
+  uint64_t foldioff;
+  uint64_t foldsize;
   uint32_t logoffset;
+  unsigned char logcompactor;
 } psync_openfile_t;
 
 typedef struct {
@@ -344,6 +344,8 @@ static int psync_fs_crypto_kill_extender_locked(psync_openfile_t *of){
   return 0;
 }
 
+static int psync_fs_crypto_fold_finish_locked(psync_openfile_t *of);
+
 static int psync_fs_crypto_read_newfile_full_sector_from_datafile(psync_openfile_t *of, char *buf, psync_crypto_sectorid_t sectorid){
   unsigned char buff[PSYNC_CRYPTO_SECTOR_SIZE];
   psync_crypto_sector_auth_t auth;
@@ -352,7 +354,11 @@ static int psync_fs_crypto_read_newfile_full_sector_from_datafile(psync_openfile
   int64_t fs;
   ssize_t rd;
   uint32_t ssize;
+  int ret;
 //  debug(D_NOTICE, "reading sector %u", sectorid);
+  ret=psync_fs_crypto_fold_finish_locked(of);
+  if (unlikely_log(ret))
+    return ret;
   fs=psync_file_size(of->datafile);
   if (unlikely_log(fs==-1))
     return -EIO;
@@ -703,14 +709,11 @@ PSYNC_NOINLINE static int psync_fs_crypto_check_log_hash(psync_file_t lfd, psync
   }
 }
 
-static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, int checkhash){
+static int psync_fs_crypto_start_process_log(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, int checkhash, uint64_t *filesize){
   char buff[PSYNC_CRYPTO_SECTOR_SIZE];
-  psync_fs_index_record *records;
   psync_crypto_master_record *mr;
-  psync_crypto_log_header hdr;
-  uint64_t off, size, ioff;
+  uint64_t size;
   ssize_t rd;
-  uint32_t recid;
   mr=(psync_crypto_master_record *)buff;
   rd=psync_file_pread(lfd, mr, sizeof(psync_crypto_master_record), 0);
   if (unlikely(rd!=sizeof(psync_crypto_master_record))){
@@ -735,15 +738,29 @@ static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync
     return -1;
   }
   size=mr->filesize;
-  off=PSYNC_CRYPTO_SECTOR_SIZE;
   if (unlikely_log(psync_file_seek(dfd, size, P_SEEK_SET)!=size || psync_file_truncate(dfd)))
     return -1;
   if (ifd!=INVALID_HANDLE_VALUE && unlikely_log(psync_file_seek(ifd, sizeof(psync_fs_index_header), P_SEEK_SET)!=sizeof(psync_fs_index_header) || psync_file_truncate(ifd)))
     return -1;
+  *filesize=size;
+  return 0;
+}
+
+/* Replays records starting at *poff until the end of the log or until at least maxbytes of it are processed. Returns 1 if
+ * there is more to do, 0 when done and -1 on error. */
+static int psync_fs_crypto_process_log_records(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, uint64_t size, uint64_t *poff,
+                                               uint64_t *pioff, uint64_t maxbytes){
+  char buff[PSYNC_CRYPTO_SECTOR_SIZE];
+  psync_fs_index_record *records;
+  psync_crypto_log_header hdr;
+  uint64_t off, ioff;
+  ssize_t rd;
+  uint32_t recid;
   records=(psync_fs_index_record *)buff;
   recid=0;
-  ioff=0;
-  while ((rd=psync_file_pread(lfd, &hdr, sizeof(hdr), off))!=0){
+  off=*poff;
+  ioff=*pioff;
+  while (off-*poff<maxbytes && (rd=psync_file_pread(lfd, &hdr, sizeof(hdr), off))!=0){
     if (unlikely_log(rd!=sizeof(hdr)))
       return -1;
     off+=sizeof(hdr);
@@ -792,12 +809,27 @@ static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync
       debug(D_ERROR, "error writing to index file, expected to write %u got %d", (unsigned)(sizeof(psync_fs_index_record)*recid), (int)rd);
       return -1;
     }
+    ioff+=recid;
+  }
+  if (off-*poff>=maxbytes){
+    *poff=off;
+    *pioff=ioff;
+    return 1;
   }
   if (unlikely_log(psync_file_seek(dfd, size, P_SEEK_SET)!=size || psync_file_truncate(dfd)))
     return -1;
   return 0;
 }
 
+static int psync_fs_crypto_process_log(psync_file_t lfd, psync_file_t dfd, psync_file_t ifd, int checkhash){
+  uint64_t size, off, ioff;
+  if (psync_fs_crypto_start_process_log(lfd, dfd, ifd, checkhash, &size))
+    return -1;
+  off=PSYNC_CRYPTO_SECTOR_SIZE;
+  ioff=0;
+  return psync_fs_crypto_process_log_records(lfd, dfd, ifd, size, &off, &ioff, UINT64_MAX);
+}
+
 static void wait_before_flush(psync_openfile_t *of, uint32_t millisec){
   debug(D_NOTICE, "waiting up to %u milliseconds before flush of %s", (unsigned)millisec, of->currentname);
   psync_milisleep(millisec);
@@ -914,13 +946,52 @@ static int psync_fs_write_interval_tree_to_log(psync_openfile_t *of){
   return 0;
 }
 
-static int psync_fs_crypto_do_finalize_log(psync_openfile_t *of, int fullsync){
+static int psync_fs_crypto_fold_batch_locked(psync_openfile_t *of, uint64_t maxbytes){
+  int ret;
+  if (!of->foldoff){
+    debug(D_NOTICE, "flushing log data %s", of->foldlogname);
+    if (unlikely_log(psync_file_sync(of->foldlog)) ||
+        unlikely_log(psync_fs_crypto_start_process_log(of->foldlog, of->datafile, of->indexfile, 0, &of->foldsize))){
+      ret=-1;
+      goto done;
+    }
+    of->foldoff=PSYNC_CRYPTO_SECTOR_SIZE;
+    of->foldioff=0;
+  }
+  ret=psync_fs_crypto_process_log_records(of->foldlog, of->datafile, of->indexfile, of->foldsize, &of->foldoff, &of->foldioff, maxbytes);
+  if (ret==1)
+    return 1;
+  if (!ret && (unlikely_log(psync_file_sync(of->datafile)) || unlikely_log(!of->newfile && psync_file_sync(of->indexfile))))
+    ret=-1;
+  if (!ret)
+    debug(D_NOTICE, "folded log of %s", of->currentname);
+done:
+  psync_file_close(of->foldlog);
+  psync_file_delete(of->foldlogname);
+  psync_free(of->foldlogname);
+  of->foldlog=INVALID_HANDLE_VALUE;
+  of->foldlogname=NULL;
+  return ret?-EIO:0;
+}
+
+/* Anything that looks at the datafile has to see it with the log that is being folded in the background fully applied. */
+static int psync_fs_crypto_fold_finish_locked(psync_openfile_t *of){
+  if (likely(of->foldlog==INVALID_HANDLE_VALUE))
+    return 0;
+  debug(D_NOTICE, "finishing fold of log of %s at offset %lu", of->currentname, (unsigned long)of->foldoff);
+  return psync_fs_crypto_fold_batch_locked(of, UINT64_MAX);
+}
+
+static int psync_fs_crypto_do_finalize_log(psync_openfile_t *of, int fullsync, int fold){
   psync_crypto_offsets_t offsets;
   psync_fsfileid_t fileid;
   const char *cachepath;
   char *olog, *flog;
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   int ret;
+  ret=psync_fs_crypto_fold_finish_locked(of);
+  if (unlikely_log(ret))
+    return ret;
   psync_fs_crypto_offsets_by_plainsize(of->currentsize, &offsets);
   if (of->logoffset==PSYNC_CRYPTO_SECTOR_SIZE && offsets.masterauthoff+(offsets.needmasterauth?PSYNC_CRYPTO_AUTH_SIZE:0)==psync_file_size(of->datafile)){
     debug(D_NOTICE, "skipping finalize of %s", of->currentname);
@@ -965,6 +1036,18 @@ static int psync_fs_crypto_do_finalize_log(psync_openfile_t *of, int fullsync){
   }
   psync_tree_for_each_element_call_safe(of->sectorsinlog, psync_sector_inlog_t, tree, psync_free);
   of->sectorsinlog=PSYNC_TREE_EMPTY;
+  if (fold){
+    of->foldlog=psync_file_open(flog, P_O_RDWR, 0);
+    psync_free(olog);
+    if (unlikely_log(of->foldlog==INVALID_HANDLE_VALUE)){
+      psync_file_delete(flog);
+      psync_free(flog);
+      return -EIO;
+    }
+    of->foldlogname=flog;
+    of->foldoff=0;
+    return 0;
+  }
   ret=psync_fs_crypto_log_flush_and_process(of, flog, 0, 1);
   psync_file_delete(flog);
   psync_free(olog);
@@ -977,14 +1060,73 @@ static int psync_fs_crypto_finalize_log(psync_openfile_t *of, int fullsync){
   if (of->extender){
     assert(of->currentsize==of->extender->extendto);
     of->currentsize=of->extender->extendedto;
-    ret=psync_fs_crypto_do_finalize_log(of, fullsync);
+    ret=psync_fs_crypto_do_finalize_log(of, fullsync, 0);
     of->currentsize=of->extender->extendto;
   }
   else
-    ret=psync_fs_crypto_do_finalize_log(of, fullsync);
+    ret=psync_fs_crypto_do_finalize_log(of, fullsync, 0);
   return ret;
 }
 
+/* Folds the log into the datafile in the background once it grows over PSYNC_CRYPTO_COMPACT_LOG_SIZE, so that long lived
+ * randomly written files (databases, disk images) do not accumulate up to PSYNC_CRYPTO_MAX_LOG_SIZE of log that has to be
+ * re-hashed and replayed on every reopen. The log is finalized and a fresh one started under the lock, then the finalized log is
+ * synced without the lock and replayed in batches of PSYNC_CRYPTO_COMPACT_BATCH_SIZE, releasing the lock in between, so writers
+ * that only append to the new log are not stalled. Crash consistency is the same as for flush - a finalized log is replayed
+ * on startup.
+ */
+static void psync_fs_crypto_compactor_thread(void *ptr){
+  psync_openfile_t *of;
+  char *flog;
+  psync_file_t fd;
+  int ret;
+  of=(psync_openfile_t *)ptr;
+  // give the writer a chance to finish the current burst, all of it will go in the same pass
+  psync_milisleep(PSYNC_SLEEP_BEFORE_LOG_COMPACT);
+  flog=NULL;
+  pthread_mutex_lock(&of->mutex);
+  if (of->logfile!=INVALID_HANDLE_VALUE && of->logoffset>=PSYNC_CRYPTO_COMPACT_LOG_SIZE && !of->extender){
+    debug(D_NOTICE, "compacting log of %s, log size %u", of->currentname, (unsigned)of->logoffset);
+    ret=psync_fs_crypto_do_finalize_log(of, 0, 1);
+    if (unlikely(ret))
+      debug(D_WARNING, "compacting log of %s failed with error %d, will retry on next write", of->currentname, ret);
+    else if (of->foldlog!=INVALID_HANDLE_VALUE)
+      flog=psync_strdup(of->foldlogname);
+  }
+  pthread_mutex_unlock(&of->mutex);
+  if (flog){
+    fd=psync_file_open(flog, P_O_RDONLY, 0);
+    if (fd!=INVALID_HANDLE_VALUE){
+      psync_file_sync(fd);
+      psync_file_close(fd);
+    }
+    psync_free(flog);
+  }
+  pthread_mutex_lock(&of->mutex);
+  while (of->foldlog!=INVALID_HANDLE_VALUE){
+    ret=psync_fs_crypto_fold_batch_locked(of, PSYNC_CRYPTO_COMPACT_BATCH_SIZE);
+    if (ret!=1){
+      if (unlikely(ret))
+        debug(D_WARNING, "folding log of %s failed with error %d", of->currentname, ret);
+      break;
+    }
+    pthread_mutex_unlock(&of->mutex);
+    psync_yield_cpu();
+    pthread_mutex_lock(&of->mutex);
+  }
+  of->logcompactor=0;
+  pthread_mutex_unlock(&of->mutex);
+  psync_fs_dec_of_refcnt(of);
+}
+
+static void psync_fs_crypto_check_compact_log_locked(psync_openfile_t *of){
+  if (of->logoffset<PSYNC_CRYPTO_COMPACT_LOG_SIZE || of->logcompactor)
+    return;
+  of->logcompactor=1;
+  psync_fs_inc_of_refcnt_locked(of);
+  psync_run_thread1("log compactor", psync_fs_crypto_compactor_thread, of);
+}
+
 static void psync_fs_crypt_add_sector_to_interval_tree(psync_openfile_t *of, psync_crypto_sectorid_t sectorid, size_t size){
   uint64_t offset;
   offset=(uint64_t)psync_fs_crypto_data_sectorid_by_sectorid(sectorid)*PSYNC_CRYPTO_SECTOR_SIZE;
@@ -1001,6 +1143,7 @@ PSYNC_NOINLINE static void psync_fs_crypto_reset_log_to_off(psync_openfile_t *of
     char *log;
     psync_fsfileid_t fileid;
     char fileidhex[sizeof(psync_fsfileid_t)*2+2];
+    psync_fs_crypto_fold_finish_locked(of);
     sz=psync_file_size(of->datafile);
     if (sz==-1){
       debug(D_ERROR, "can not stat data file of %s, can't do anything", of->currentname);
@@ -1055,6 +1198,47 @@ static int psync_fs_crypto_write_newfile_full_sector(psync_openfile_t *of, const
   return 0;
 }
 
+/* writes a run of full sectors, encoding them in parallel and appending all the records to the log with a single write */
+static int psync_fs_crypto_write_newfile_full_sectors(psync_openfile_t *of, const char *buf, psync_crypto_sectorid_t sectorid, uint32_t cnt){
+  psync_crypto_sector_batch_t batch[PSYNC_CRYPTO_MAX_WRITE_BATCH];
+  psync_crypto_sector_auth_t auth[PSYNC_CRYPTO_MAX_WRITE_BATCH];
+  psync_crypto_log_data_record *recs;
+  ssize_t wrt;
+  size_t len;
+  uint32_t i;
+  assert(cnt>0 && cnt<=PSYNC_CRYPTO_MAX_WRITE_BATCH);
+  recs=psync_new_cnt(psync_crypto_log_data_record, cnt);
+  for (i=0; i<cnt; i++){
+    batch[i].data=(const unsigned char *)buf+(size_t)i*PSYNC_CRYPTO_SECTOR_SIZE;
+    batch[i].out=recs[i].data;
+    batch[i].auth=auth[i];
+    batch[i].sectorid=sectorid+i;
+    batch[i].datalen=PSYNC_CRYPTO_SECTOR_SIZE;
+    memset(&recs[i].header, 0, sizeof(psync_crypto_log_header));
+    recs[i].header.type=PSYNC_CRYPTO_LOG_DATA;
+    recs[i].header.length=PSYNC_CRYPTO_SECTOR_SIZE;
+    recs[i].header.offset=psync_fs_crypto_data_offset_by_sectorid(sectorid+i);
+  }
+  psync_crypto_aes256_encode_sectors(of->encoder, batch, cnt);
+  len=sizeof(psync_crypto_log_data_record)*cnt;
+  wrt=psync_file_pwrite(of->logfile, recs, len, of->logoffset);
+  if (unlikely(wrt!=len)){
+    debug(D_ERROR, "write to log of %u bytes returned %d", (unsigned)len, (int)wrt);
+    psync_free(recs);
+    psync_fs_crypto_reset_log_to_off(of, of->logoffset);
+    return -EIO;
+  }
+  psync_fast_hash256_update(&of->loghashctx, recs, len);
+  psync_free(recs);
+  for (i=0; i<cnt; i++){
+    psync_fs_crypto_set_sector_log_offset(of, sectorid+i, of->logoffset, auth[i]);
+    of->logoffset+=sizeof(psync_crypto_log_data_record);
+    if (!of->newfile)
+      psync_fs_crypt_add_sector_to_interval_tree(of, sectorid+i, PSYNC_CRYPTO_SECTOR_SIZE);
+  }
+  return 0;
+}
+
 static int psync_fs_crypto_write_newfile_partial_sector(psync_openfile_t *of, const char *buf, psync_crypto_sectorid_t sectorid, size_t size, off_t offset){
   char buff[PSYNC_CRYPTO_SECTOR_SIZE];
   int rd;
@@ -1112,6 +1296,7 @@ fail:
 static int psync_fs_crypto_write_newfile_locked_nu(psync_openfile_t *of, const char *buf, uint64_t size, uint64_t offset, int checkextender){
   uint64_t off2, offdiff;
   psync_crypto_sectorid_t sectorid;
+  uint32_t cnt;
   int ret, wrt;
   assert(of->encrypted);
   assert(of->encoder);
@@ -1151,12 +1336,18 @@ static int psync_fs_crypto_write_newfile_locked_nu(psync_openfile_t *of, const c
       of->currentsize=offset;
   }
   while (size>=PSYNC_CRYPTO_SECTOR_SIZE){
-    ret=psync_fs_crypto_write_newfile_full_sector(of, buf, sectorid, PSYNC_CRYPTO_SECTOR_SIZE);
-    buf+=PSYNC_CRYPTO_SECTOR_SIZE;
-    offset+=PSYNC_CRYPTO_SECTOR_SIZE;
-    wrt+=PSYNC_CRYPTO_SECTOR_SIZE;
-    size-=PSYNC_CRYPTO_SECTOR_SIZE;
-    sectorid++;
+    cnt=size/PSYNC_CRYPTO_SECTOR_SIZE;
+    if (cnt>PSYNC_CRYPTO_MAX_WRITE_BATCH)
+      cnt=PSYNC_CRYPTO_MAX_WRITE_BATCH;
+    if (cnt>1)
+      ret=psync_fs_crypto_write_newfile_full_sectors(of, buf, sectorid, cnt);
+    else
+      ret=psync_fs_crypto_write_newfile_full_sector(of, buf, sectorid, PSYNC_CRYPTO_SECTOR_SIZE);
+    buf+=(size_t)cnt*PSYNC_CRYPTO_SECTOR_SIZE;
+    offset+=(uint64_t)cnt*PSYNC_CRYPTO_SECTOR_SIZE;
+    wrt+=cnt*PSYNC_CRYPTO_SECTOR_SIZE;
+    size-=(uint64_t)cnt*PSYNC_CRYPTO_SECTOR_SIZE;
+    sectorid+=cnt;
     if (ret)
       return ret;
     if (of->currentsize<offset)
@@ -1178,6 +1369,8 @@ static int psync_fs_crypto_write_newfile_locked_nu(psync_openfile_t *of, const c
     if (ret)
       return ret;
   }
+  else
+    psync_fs_crypto_check_compact_log_locked(of);
   return wrt;
 
 }
@@ -1202,6 +1395,9 @@ int psync_fs_crypto_read_modified_locked(psync_openfile_t *of, char *buf, uint64
     return psync_fs_unlock_ret(of, -EINVAL);
   if (unlikely(!size || offset>=of->currentsize))
     return psync_fs_unlock_ret(of, 0);
+  rfr=psync_fs_crypto_fold_finish_locked(of);
+  if (unlikely_log(rfr))
+    return psync_fs_unlock_ret(of, rfr);
   if (offset+size>of->currentsize)
     size=of->currentsize-offset;
   firstsectorid=offset/PSYNC_CRYPTO_SECTOR_SIZE;
@@ -1649,6 +1845,9 @@ int psync_fs_crypto_ftruncate(psync_openfile_t *of, uint64_t size){
   int ret;
   assert(of->modified);
 retry:
+  ret=psync_fs_crypto_fold_finish_locked(of);
+  if (unlikely_log(ret))
+    return ret;
   if (of->currentsize<size){
     debug(D_NOTICE, "truncating file %s from %lu up to %lu", of->currentname, (unsigned long)of->currentsize, (unsigned long)size);
     if (of->extender){
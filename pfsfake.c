@@ -72,6 +72,9 @@ void psync_fs_refresh_folder(psync_folderid_t folderid){
 void psync_pagecache_resize_cache(){
 }
 
+void psync_pagecache_resize_ram_cache(){
+}
+
 int psync_cloud_crypto_setup(const char *password){
   return PSYNC_CRYPTO_SETUP_NOT_SUPPORTED;
 }
@@ -84,3 +87,18 @@ void psync_fs_pause_until_login(){
 
 void psync_fs_clean_tasks(){
 }
+
+void psync_fs_pin_refresh(){
+}
+
+int psync_fs_pin_path(const char *path){
+  return -1;
+}
+
+int psync_fs_unpin_path(const char *path){
+  return -1;
+}
+
+psync_pin_list_t *psync_fs_get_pins(){
+  return NULL;
+}
@@ -0,0 +1,443 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pfspin.h"
+#include "pfs.h"
+#include "pfsfolder.h"
+#include "ppagecache.h"
+#include "pnetlibs.h"
+#include "papi.h"
+#include "plibs.h"
+#include "plist.h"
+#include "psettings.h"
+#include "pstatus.h"
+#include "ptimer.h"
+#include <string.h>
+
+/* Pinned files and folders are kept fully in the page cache. A scan lists all files under the pins, registers their
+ * hashes with the page cache so their pages are never evicted and queues the files for up to PSYNC_FS_PIN_WORKERS
+ * fetch threads that download the missing pages. Scans run on start, on pin changes and after remote changes. */
+
+typedef struct {
+  psync_list list;
+  uint64_t pinid;
+  psync_fileid_t fileid;
+  uint64_t hash;
+  uint64_t size;
+} pin_file_t;
+
+typedef struct {
+  uint64_t pinid;
+  psync_folderid_t folderid;
+  psync_fileid_t fileid;
+  int isfolder;
+} pin_t;
+
+static pthread_mutex_t pin_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pin_cond=PTHREAD_COND_INITIALIZER;
+static psync_list pin_queue=PSYNC_LIST_STATIC_INIT(pin_queue);
+static uint32_t pin_workers=0;
+static int pin_rescan=0;
+static int pin_failed=0;
+static int pin_started=0;
+
+static void pin_add_file(psync_list *files, uint64_t pinid, psync_variant_row row){
+  pin_file_t *f;
+  f=psync_new(pin_file_t);
+  f->pinid=pinid;
+  f->fileid=psync_get_number(row[0]);
+  f->hash=psync_get_number(row[1]);
+  f->size=psync_get_number(row[2]);
+  psync_list_add_tail(files, &f->list);
+}
+
+static void pin_collect_folder(psync_list *files, uint64_t pinid, psync_folderid_t folderid){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_uint_row irow;
+  psync_folderid_t *folders;
+  size_t cnt, alloc, i;
+  alloc=32;
+  folders=psync_new_cnt(psync_folderid_t, alloc);
+  folders[0]=folderid;
+  cnt=1;
+  for (i=0; i<cnt; i++){
+    res=psync_sql_query_rdlock("SELECT id, hash, size FROM file WHERE parentfolderid=?");
+    psync_sql_bind_uint(res, 1, folders[i]);
+    while ((row=psync_sql_fetch_row(res)))
+      pin_add_file(files, pinid, row);
+    psync_sql_free_result(res);
+    res=psync_sql_query_rdlock("SELECT id FROM folder WHERE parentfolderid=?");
+    psync_sql_bind_uint(res, 1, folders[i]);
+    while ((irow=psync_sql_fetch_rowint(res))){
+      if (cnt==alloc){
+        alloc*=2;
+        folders=(psync_folderid_t *)psync_realloc(folders, sizeof(psync_folderid_t)*alloc);
+      }
+      folders[cnt++]=irow[0];
+    }
+    psync_sql_free_result(res);
+  }
+  psync_free(folders);
+}
+
+static void pin_collect(psync_list *files){
+  psync_sql_res *res;
+  psync_variant_row row;
+  pin_t *pins;
+  size_t cnt, alloc, i;
+  alloc=8;
+  cnt=0;
+  pins=psync_new_cnt(pin_t, alloc);
+  res=psync_sql_query_rdlock("SELECT id, folderid, fileid FROM fspin");
+  while ((row=psync_sql_fetch_row(res))){
+    if (cnt==alloc){
+      alloc*=2;
+      pins=(pin_t *)psync_realloc(pins, sizeof(pin_t)*alloc);
+    }
+    pins[cnt].pinid=psync_get_number(row[0]);
+    pins[cnt].isfolder=row[1].type!=PSYNC_TNULL;
+    pins[cnt].folderid=psync_get_number_or_null(row[1]);
+    pins[cnt].fileid=psync_get_number_or_null(row[2]);
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  for (i=0; i<cnt; i++)
+    if (pins[i].isfolder)
+      pin_collect_folder(files, pins[i].pinid, pins[i].folderid);
+    else{
+      res=psync_sql_query_rdlock("SELECT id, hash, size FROM file WHERE id=?");
+      psync_sql_bind_uint(res, 1, pins[i].fileid);
+      if ((row=psync_sql_fetch_row(res)))
+        pin_add_file(files, pins[i].pinid, row);
+      psync_sql_free_result(res);
+    }
+  psync_free(pins);
+}
+
+static int pin_fetch_file(pin_file_t *f){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", f->fileid), P_NUM("hash", f->hash),
+                     P_STR("timeformat", "timestamp"), P_BOOL("skipfilename", 1)};
+  psync_socket *api;
+  psync_http_socket *http;
+  binresult *res;
+  const binresult *hosts;
+  const char *host, *path;
+  unsigned char *cached;
+  uint64_t pagecnt, from, to, result;
+  pagecnt=(f->size+PSYNC_FS_PAGE_SIZE-1)/PSYNC_FS_PAGE_SIZE;
+  if (!pagecnt)
+    return 0;
+  // one range query per file, rescans mostly find pinned files complete
+  cached=psync_pagecache_get_cached_pages(f->hash, pagecnt);
+  from=0;
+  while (from<pagecnt && cached[from])
+    from++;
+  if (from==pagecnt){
+    psync_free(cached);
+    return 0;
+  }
+  debug(D_NOTICE, "fetching pinned file %lu from page %lu of %lu", (unsigned long)f->fileid, (unsigned long)from, (unsigned long)pagecnt);
+  api=psync_apipool_get();
+  if (unlikely_log(!api))
+    goto err0;
+  res=send_command(api, "getfilelink", params);
+  if (unlikely_log(!res)){
+    psync_apipool_release_bad(api);
+    goto err0;
+  }
+  psync_apipool_release(api);
+  result=psync_find_result(res, "result", PARAM_NUM)->num;
+  if (unlikely(result)){
+    debug(D_WARNING, "getfilelink returned error %lu for pinned file %lu", (unsigned long)result, (unsigned long)f->fileid);
+    psync_process_api_error(result);
+    goto err1;
+  }
+  hosts=psync_find_result(res, "hosts", PARAM_ARRAY);
+  path=psync_find_result(res, "path", PARAM_STR)->str;
+  http=psync_http_connect_multihost(hosts, &host);
+  if (unlikely_log(!http))
+    goto err1;
+  while (from<pagecnt){
+    to=from+1;
+    while (to<pagecnt && to-from<PSYNC_FS_PIN_MAX_REQUEST_PAGES && !cached[to])
+      to++;
+    if (unlikely_log(psync_http_request(http, host, path, from*PSYNC_FS_PAGE_SIZE, to*PSYNC_FS_PAGE_SIZE-1)) ||
+        unlikely_log(psync_pagecache_read_pages_from_http(http, f->hash, from, to-from))){
+      psync_http_close(http);
+      goto err1;
+    }
+    from=to;
+    while (from<pagecnt && cached[from])
+      from++;
+  }
+  psync_http_close(http);
+  psync_free(res);
+  psync_free(cached);
+  return 0;
+err1:
+  psync_free(res);
+err0:
+  psync_free(cached);
+  return -1;
+}
+
+static void pin_file_cached(pin_file_t *f){
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("UPDATE fspin SET filescached=filescached+1, bytescached=bytescached+? WHERE id=?");
+  psync_sql_bind_uint(res, 1, f->size);
+  psync_sql_bind_uint(res, 2, f->pinid);
+  psync_sql_run_free(res);
+  pthread_mutex_lock(&pin_mutex);
+  psync_status.pinnedfilescached++;
+  psync_status.pinnedbytescached+=f->size;
+  pthread_mutex_unlock(&pin_mutex);
+  psync_status_send_update();
+}
+
+static void pin_worker(){
+  pin_file_t *f;
+  pthread_mutex_lock(&pin_mutex);
+  while (psync_do_run && !pin_rescan && !psync_list_isempty(&pin_queue)){
+    f=psync_list_remove_head_element(&pin_queue, pin_file_t, list);
+    pthread_mutex_unlock(&pin_mutex);
+    if (pin_fetch_file(f))
+      pin_failed=1;
+    else
+      pin_file_cached(f);
+    psync_free(f);
+    pthread_mutex_lock(&pin_mutex);
+  }
+  if (--pin_workers==0)
+    pthread_cond_broadcast(&pin_cond);
+  pthread_mutex_unlock(&pin_mutex);
+}
+
+static void pin_scan(){
+  psync_list files;
+  psync_sql_res *res;
+  pin_file_t *f;
+  uint64_t *hashes;
+  uint64_t limit, bytes, fetchbytes;
+  size_t cnt, i;
+  uint32_t filecnt;
+  psync_list_init(&files);
+  pin_collect(&files);
+  cnt=0;
+  psync_list_for_each_element(f, &files, pin_file_t, list)
+    cnt++;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("UPDATE fspin SET files=0, filescached=0, bytes=0, bytescached=0");
+  psync_sql_run_free(res);
+  res=psync_sql_prep_statement("UPDATE fspin SET files=files+1, bytes=bytes+? WHERE id=?");
+  psync_list_for_each_element(f, &files, pin_file_t, list){
+    psync_sql_bind_uint(res, 1, f->size);
+    psync_sql_bind_uint(res, 2, f->pinid);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+  // pinned files can not take the whole cache, there would be no room left for anything else
+  limit=psync_setting_get_uint(_PS(fscachesize))/100*PSYNC_FS_PIN_MAX_CACHE_PERCENT;
+  // only files that are fetched are protected from eviction, a file that does not fit does not stop smaller ones
+  hashes=psync_new_cnt(uint64_t, cnt?cnt:1);
+  i=0;
+  bytes=0;
+  fetchbytes=0;
+  filecnt=0;
+  pthread_mutex_lock(&pin_mutex);
+  psync_status.pinnedfilescached=0;
+  psync_status.pinnedbytescached=0;
+  while (!psync_list_isempty(&files)){
+    f=psync_list_remove_head_element(&files, pin_file_t, list);
+    filecnt++;
+    bytes+=f->size;
+    if (fetchbytes+f->size>limit){
+      debug(D_WARNING, "pinned file %lu does not fit in %lu bytes of cache, not fetching it", (unsigned long)f->fileid, (unsigned long)limit);
+      psync_free(f);
+    }
+    else{
+      fetchbytes+=f->size;
+      hashes[i++]=f->hash;
+      psync_list_add_tail(&pin_queue, &f->list);
+    }
+  }
+  psync_pagecache_set_pinned_hashes(hashes, i);
+  psync_status.pinnedfiles=filecnt;
+  psync_status.pinnedbytes=bytes;
+  pin_failed=0;
+  while (pin_workers<PSYNC_FS_PIN_WORKERS && !psync_list_isempty(&pin_queue)){
+    pin_workers++;
+    psync_run_thread("pin fetch", pin_worker);
+  }
+  while (pin_workers)
+    pthread_cond_wait(&pin_cond, &pin_mutex);
+  psync_list_for_each_element_call(&pin_queue, pin_file_t, list, psync_free);
+  psync_list_init(&pin_queue);
+  pthread_mutex_unlock(&pin_mutex);
+  psync_status_send_update();
+  debug(D_NOTICE, "pin scan finished, %u files, %lu bytes%s", (unsigned)filecnt, (unsigned long)bytes, pin_failed?", some failed":"");
+}
+
+static void pin_thread(){
+  while (psync_do_run){
+    pthread_mutex_lock(&pin_mutex);
+    while (!pin_rescan)
+      pthread_cond_wait(&pin_cond, &pin_mutex);
+    pin_rescan=0;
+    pthread_mutex_unlock(&pin_mutex);
+    // remote changes usually come in bursts
+    psync_milisleep(PSYNC_FS_PIN_RESCAN_DELAY_MS);
+    pin_scan();
+  }
+}
+
+static void pin_retry_timer(psync_timer_t timer, void *ptr){
+  if (pin_failed)
+    psync_fs_pin_refresh();
+}
+
+void psync_fs_pin_refresh(){
+  pthread_mutex_lock(&pin_mutex);
+  if (pin_started){
+    pin_rescan=1;
+    pthread_cond_broadcast(&pin_cond);
+  }
+  pthread_mutex_unlock(&pin_mutex);
+}
+
+void psync_fspin_init(){
+  pthread_mutex_lock(&pin_mutex);
+  if (pin_started){
+    pthread_mutex_unlock(&pin_mutex);
+    return;
+  }
+  pin_started=1;
+  pin_rescan=1;
+  pthread_mutex_unlock(&pin_mutex);
+  psync_run_thread("pin scan", pin_thread);
+  psync_timer_register(pin_retry_timer, PSYNC_FS_PIN_RETRY_SEC, NULL);
+}
+
+static int pin_resolve_path(const char *path, psync_folderid_t *folderid, psync_fileid_t *fileid){
+  psync_fspath_t *fspath;
+  psync_fsfolderid_t fid;
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint32_t flags;
+  int ret;
+  ret=-1;
+  psync_sql_rdlock();
+  fid=psync_fsfolderid_by_path(path, &flags);
+  if (fid!=PSYNC_INVALID_FSFOLDERID){
+    if (fid>=0){
+      *folderid=fid;
+      ret=1;
+    }
+  }
+  else if ((fspath=psync_fsfolder_resolve_path(path))){
+    if (fspath->folderid>=0){
+      res=psync_sql_query_nolock("SELECT id FROM file WHERE parentfolderid=? AND name=?");
+      psync_sql_bind_uint(res, 1, fspath->folderid);
+      psync_sql_bind_string(res, 2, fspath->name);
+      if ((row=psync_sql_fetch_rowint(res))){
+        *fileid=row[0];
+        ret=0;
+      }
+      psync_sql_free_result(res);
+    }
+    psync_free(fspath);
+  }
+  psync_sql_rdunlock();
+  return ret;
+}
+
+int psync_fs_pin_path(const char *path){
+  psync_sql_res *res;
+  psync_folderid_t folderid;
+  psync_fileid_t fileid;
+  int isfolder;
+  if (!psync_fs_isstarted())
+    return -1;
+  isfolder=pin_resolve_path(path, &folderid, &fileid);
+  if (isfolder==-1){
+    debug(D_NOTICE, "can not pin %s, not found in the cloud", path);
+    return -1;
+  }
+  res=psync_sql_prep_statement("INSERT OR IGNORE INTO fspin (folderid, fileid, path) VALUES (?, ?, ?)");
+  if (isfolder){
+    psync_sql_bind_uint(res, 1, folderid);
+    psync_sql_bind_null(res, 2);
+  }
+  else{
+    psync_sql_bind_null(res, 1);
+    psync_sql_bind_uint(res, 2, fileid);
+  }
+  psync_sql_bind_string(res, 3, path);
+  psync_sql_run_free(res);
+  debug(D_NOTICE, "pinned %s", path);
+  psync_fs_pin_refresh();
+  return 0;
+}
+
+int psync_fs_unpin_path(const char *path){
+  psync_sql_res *res;
+  uint32_t aff;
+  res=psync_sql_prep_statement("DELETE FROM fspin WHERE path=?");
+  psync_sql_bind_string(res, 1, path);
+  psync_sql_run_free(res);
+  aff=psync_sql_affected_rows();
+  if (!aff)
+    return -1;
+  debug(D_NOTICE, "unpinned %s", path);
+  psync_fs_pin_refresh();
+  return 0;
+}
+
+static int create_pin(psync_list_builder_t *builder, void *element, psync_variant_row row){
+  psync_pin_t *pin;
+  const char *str;
+  size_t len;
+  pin=(psync_pin_t *)element;
+  str=psync_get_lstring(row[0], &len);
+  pin->path=str;
+  psync_list_add_lstring_offset(builder, offsetof(psync_pin_t, path), len);
+  pin->files=psync_get_number(row[1]);
+  pin->filescached=psync_get_number(row[2]);
+  pin->bytes=psync_get_number(row[3]);
+  pin->bytescached=psync_get_number(row[4]);
+  return 0;
+}
+
+psync_pin_list_t *psync_fs_get_pins(){
+  psync_list_builder_t *builder;
+  psync_sql_res *res;
+  builder=psync_list_builder_create(sizeof(psync_pin_t), offsetof(psync_pin_list_t, pins));
+  res=psync_sql_query_rdlock("SELECT path, files, filescached, bytes, bytescached FROM fspin ORDER BY path");
+  psync_list_bulder_add_sql(builder, res, create_pin);
+  return (psync_pin_list_t *)psync_list_builder_finalize(builder);
+}
@@ -35,6 +35,7 @@
 #include "pfolder.h"
 #include "pfs.h"
 #include "pcloudcrypto.h"
+#include "palloc.h"
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -46,9 +47,83 @@ typedef struct {
   char name[];
 } file_history_record;
 
+typedef struct {
+  psync_tree tree;
+  psync_fsfolderid_t folderid;
+} pending_folder_t;
+
 static psync_tree *folders=PSYNC_TREE_EMPTY;
+static psync_tree *pending_folders=PSYNC_TREE_EMPTY;
+static unsigned char pending_bitmap[PSYNC_FSTASK_PENDING_BITMAP/8];
 static uint64_t psync_local_taskid=UINT64_MAX;
 
+static void psync_fstask_load_pending(pending_folder_t *pf);
+
+static uint32_t pending_bit(psync_fsfolderid_t folderid){
+  return (uint32_t)((((uint64_t)folderid)*0x9E3779B97F4A7C15ULL)>>32)%PSYNC_FSTASK_PENDING_BITMAP;
+}
+
+static void psync_fstask_add_pending(psync_fsfolderid_t folderid){
+  pending_folder_t *pf;
+  psync_tree *tr;
+  int64_t d;
+  uint32_t bit;
+  tr=pending_folders;
+  d=-1;
+  while (tr){
+    pf=psync_tree_element(tr, pending_folder_t, tree);
+    d=folderid-pf->folderid;
+    if (d<0){
+      if (tr->left)
+        tr=tr->left;
+      else
+        break;
+    }
+    else if (d>0)
+      if (tr->right)
+        tr=tr->right;
+      else
+        break;
+    else
+      return;
+  }
+  pf=psync_new(pending_folder_t);
+  pf->folderid=folderid;
+  if (d<0)
+    psync_tree_add_before(&pending_folders, tr, &pf->tree);
+  else
+    psync_tree_add_after(&pending_folders, tr, &pf->tree);
+  bit=pending_bit(folderid);
+  pending_bitmap[bit/8]|=1<<(bit%8);
+}
+
+static pending_folder_t *psync_fstask_find_pending(psync_fsfolderid_t folderid){
+  pending_folder_t *pf;
+  psync_tree *tr;
+  uint32_t bit;
+  bit=pending_bit(folderid);
+  if (likely(!(pending_bitmap[bit/8]&(1<<(bit%8)))))
+    return NULL;
+  tr=pending_folders;
+  while (tr){
+    pf=psync_tree_element(tr, pending_folder_t, tree);
+    if (folderid<pf->folderid)
+      tr=tr->left;
+    else if (folderid>pf->folderid)
+      tr=tr->right;
+    else
+      return pf;
+  }
+  return NULL;
+}
+
+static void psync_fstask_load_if_pending(psync_fsfolderid_t folderid){
+  pending_folder_t *pf;
+  pf=psync_fstask_find_pending(folderid);
+  if (unlikely(pf))
+    psync_fstask_load_pending(pf);
+}
+
 psync_uint_t folder_hash(psync_fsfolderid_t folderid){
   return ((uint64_t)folderid)%FOLDER_HASH;
 }
@@ -84,6 +159,7 @@ psync_fstask_folder_t *psync_fstask_get_or_create_folder_tasks_locked(psync_fsfo
   psync_fstask_folder_t *folder;
   psync_tree *tr;
   int64_t d;
+  psync_fstask_load_if_pending(folderid);
   tr=folders;
   d=-1;
   while (tr){
@@ -105,7 +181,7 @@ psync_fstask_folder_t *psync_fstask_get_or_create_folder_tasks_locked(psync_fsfo
       return folder;
     }
   }
-  folder=psync_new(psync_fstask_folder_t);
+  folder=(psync_fstask_folder_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, sizeof(psync_fstask_folder_t));
   memset(folder, 0, sizeof(psync_fstask_folder_t));
   if (d<0)
     psync_tree_add_before(&folders, tr, &folder->tree);
@@ -119,6 +195,7 @@ psync_fstask_folder_t *psync_fstask_get_or_create_folder_tasks_locked(psync_fsfo
 psync_fstask_folder_t *psync_fstask_get_folder_tasks_locked(psync_fsfolderid_t folderid){
   psync_fstask_folder_t *folder;
   psync_tree *tr;
+  psync_fstask_load_if_pending(folderid);
   tr=folders;
   while (tr){
     folder=psync_tree_element(tr, psync_fstask_folder_t, tree);
@@ -137,6 +214,13 @@ psync_fstask_folder_t *psync_fstask_get_folder_tasks_locked(psync_fsfolderid_t f
 psync_fstask_folder_t *psync_fstask_get_folder_tasks_rdlocked(psync_fsfolderid_t folderid){
   psync_fstask_folder_t *folder;
   psync_tree *tr;
+  if (unlikely(psync_fstask_find_pending(folderid))){
+    // loading modifies the trees, so a read lock has to be upgraded first, the lock may be released while upgrading
+    // and another thread may load the folder in the meantime
+    if (psync_sql_isrdlocked())
+      psync_sql_upgradelock();
+    psync_fstask_load_if_pending(folderid);
+  }
   tr=folders;
   while (tr){
     folder=psync_tree_element(tr, psync_fstask_folder_t, tree);
@@ -372,7 +456,7 @@ int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name, uint32_t f
     return -EIO;
   }
   len++;
-  task=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+len);
+  task=(psync_fstask_mkdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_mkdir_t, name)+len);
   task->taskid=taskid;
   task->ctime=task->mtime=ctime;
   task->folderid=-(psync_fsfolderid_t)taskid;
@@ -546,7 +630,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name){
     return -EIO;
   }
   len++;
-  task=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+len);
+  task=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+len);
   task->taskid=taskid;
   task->folderid=cfolderid;
   memcpy(task->name, name, len);
@@ -583,12 +667,12 @@ psync_fstask_creat_t *psync_fstask_add_creat(psync_fstask_folder_t *folder, cons
   if (unlikely_log(psync_sql_commit_transaction()))
     return NULL;
   len++;
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=taskid;
   un->fileid=-(psync_fsfileid_t)taskid;
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
-  task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
+  task=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-(psync_fsfileid_t)taskid;
   memcpy(task->name, name, len);
@@ -642,12 +726,12 @@ psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *fold
   if (unlikely_log(psync_sql_commit_transaction()))
     return NULL;
   len++;
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=taskid;
   un->fileid=fileid;
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
-  task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
+  task=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-(psync_fsfileid_t)taskid;
   memcpy(task->name, name, len);
@@ -687,13 +771,13 @@ int psync_fstask_add_local_creat_static(psync_fsfolderid_t folderid, const char
   }
   debug(D_NOTICE, "adding file %s to folderid %ld, datalen %lu", name, (long)folderid, (unsigned long)datalen);
   len++;
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=psync_local_taskid;
   un->fileid=0;
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
   addlen=psync_fstask_creat_local_offset(len-1);
-  cr=(psync_fstask_creat_t *)psync_malloc(addlen+sizeof(psync_fstask_local_creat_t));
+  cr=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, addlen+sizeof(psync_fstask_local_creat_t));
   cr->taskid=psync_local_taskid;
   cr->fileid=0;
   memcpy(cr->name, name, len);
@@ -875,7 +959,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
     return -EIO;
   }
   len++;
-  task=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  task=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   task->taskid=taskid;
   task->fileid=fileid;
   memcpy(task->name, name, len);
@@ -895,7 +979,7 @@ static void add_history_record(psync_fileid_t fileid, psync_folderid_t folderid,
   while ((rec=(file_history_record *)psync_cache_get(key)))
     psync_free(rec);
   len=strlen(name)+1;
-  rec=(file_history_record *)psync_malloc(offsetof(file_history_record, name)+len);
+  rec=(file_history_record *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(file_history_record, name)+len);
   rec->folderid=folderid;
   memcpy(rec->name, name, len);
   psync_cache_add(key, rec, PSYNC_FS_FILE_LOC_HIST_SEC, psync_free, 1);
@@ -958,7 +1042,7 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
   }
   psync_fs_rename_openfile_locked(fileid, to_folderid, new_name);
   nlen++;
-  rm=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+nlen);
+  rm=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+nlen);
   rm->taskid=ftaskid;
   rm->fileid=fileid;
   memcpy(rm->name, name, nlen);
@@ -977,12 +1061,12 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
     psync_free(cr);
     folder->taskscnt--;
   }
-  rm=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+nnlen);
+  rm=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+nnlen);
   rm->taskid=ttaskid;
   rm->fileid=fileid;
   memcpy(rm->name, new_name, nnlen);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &rm->tree);
-  cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+nnlen);
+  cr=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+nnlen);
   cr->taskid=ttaskid;
   cr->fileid=fileid;
   memcpy(cr->name, new_name, nnlen);
@@ -1127,7 +1211,7 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
     folder->taskscnt--;
   }
   nlen++;
-  rm=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+nlen);
+  rm=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+nlen);
   rm->taskid=ftaskid;
   rm->folderid=folderid;
   memcpy(rm->name, name, nlen);
@@ -1143,12 +1227,12 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
     folder->taskscnt--;
   }
   nnlen++;
-  rm=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+nnlen);
+  rm=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+nnlen);
   rm->taskid=ttaskid;
   rm->folderid=folderid;
   memcpy(rm->name, new_name, nnlen);
   psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
-  mk=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+nnlen);
+  mk=(psync_fstask_mkdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_mkdir_t, name)+nnlen);
   mk->taskid=ttaskid;
   mk->folderid=folderid;
   mk->flags=targetflags;
@@ -1437,7 +1521,7 @@ static void psync_init_task_mkdir(psync_variant_row row){
   ctime=psync_get_number(row[6]);
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   len++;
-  task=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+len);
+  task=(psync_fstask_mkdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_mkdir_t, name)+len);
   task->taskid=taskid;
   task->ctime=task->mtime=ctime;
   task->folderid=-(psync_fsfolderid_t)taskid;
@@ -1469,7 +1553,7 @@ static void psync_init_task_rmdir(psync_variant_row row){
     folder->taskscnt--;
   }
   len++;
-  task=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+len);
+  task=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+len);
   task->taskid=taskid;
   task->folderid=cfolderid;
   memcpy(task->name, name, len);
@@ -1491,12 +1575,12 @@ static void psync_init_task_creat(psync_variant_row row){
   name=psync_get_lstring(row[4], &len);
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   len++;
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=taskid;
   un->fileid=-(psync_fsfileid_t)taskid;
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
-  task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
+  task=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-(psync_fsfileid_t)taskid;
   memcpy(task->name, name, len);
@@ -1518,7 +1602,7 @@ static void psync_init_do_task_unlink(uint64_t taskid, psync_fsfolderid_t folder
     folder->taskscnt--;
   }
   namelen++;
-  task=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+namelen);
+  task=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+namelen);
   task->taskid=taskid;
   task->fileid=fileid;
   memcpy(task->name, name, namelen);
@@ -1555,7 +1639,7 @@ static void psync_init_task_renfile_from(psync_variant_row row){
     folder->taskscnt--;
   }
   len++;
-  rm=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  rm=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   rm->taskid=psync_get_number(row[0]);
   rm->fileid=psync_get_snumber(row[3]);
   memcpy(rm->name, name, len);
@@ -1585,12 +1669,12 @@ static void psync_init_task_renfile_to(psync_variant_row row){
   len++;
   taskid=psync_get_number(row[0]);
   fileid=psync_get_snumber(row[3]);
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=taskid;
   un->fileid=fileid;
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_creat_t, name), &un->tree);
-  cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
+  cr=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+len);
   cr->taskid=taskid;
   cr->fileid=fileid;
   memcpy(cr->name, name, len);
@@ -1614,7 +1698,7 @@ static void psync_init_task_renfolder_from(psync_variant_row row){
     folder->taskscnt--;
   }
   len++;
-  rm=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+len);
+  rm=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+len);
   rm->taskid=psync_get_number(row[0]);
   rm->folderid=psync_get_snumber(row[8]);
   memcpy(rm->name, name, len);
@@ -1636,12 +1720,12 @@ static void psync_init_task_renfolder_to(psync_variant_row row){
   len++;
   taskid=psync_get_number(row[0]);
   folderid=psync_get_snumber(row[8]);
-  rm=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+len);
+  rm=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+len);
   rm->taskid=taskid;
   rm->folderid=folderid;
   memcpy(rm->name, name, len);
   psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
-  mk=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+len);
+  mk=(psync_fstask_mkdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_mkdir_t, name)+len);
   mk->taskid=taskid;
   mk->folderid=folderid;
   mk->flags=psync_get_number(row[7]);
@@ -1669,12 +1753,12 @@ static void psync_init_task_modify(psync_variant_row row){
     folder->taskscnt--;
   }
   len++;
-  un=(psync_fstask_unlink_t *)psync_malloc(offsetof(psync_fstask_unlink_t, name)+len);
+  un=(psync_fstask_unlink_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_unlink_t, name)+len);
   un->taskid=taskid;
   un->fileid=psync_get_snumber(row[3]);
   memcpy(un->name, name, len);
   psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
-  cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
+  cr=(psync_fstask_creat_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_creat_t, name)+len);
   cr->taskid=taskid;
   cr->fileid=-(psync_fsfileid_t)cr->taskid;
   memcpy(cr->name, name, len);
@@ -1699,6 +1783,31 @@ static psync_init_task_ptr psync_init_task_func[]={
   psync_init_task_unlink_set_rev
 };
 
+static void psync_fstask_load_pending(pending_folder_t *pf){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_uint_t tp, cnt;
+  psync_fsfolderid_t folderid;
+  folderid=pf->folderid;
+  // removed before replaying, the init functions look up the same folder
+  psync_tree_del(&pending_folders, &pf->tree);
+  psync_free(pf);
+  cnt=0;
+  res=psync_sql_query("SELECT id, type, folderid, fileid, text1, text2, int1, int2, sfolderid FROM fstask WHERE folderid=? AND status NOT IN (3) ORDER BY id");
+  psync_sql_bind_int(res, 1, folderid);
+  while ((row=psync_sql_fetch_row(res))){
+    tp=psync_get_number(row[1]);
+    if (!tp || tp>=ARRAY_SIZE(psync_init_task_func)){
+      debug(D_BUG, "invalid fstask type %lu", (long unsigned)tp);
+      continue;
+    }
+    psync_init_task_func[tp](row);
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  debug(D_NOTICE, "loaded %lu tasks of folder %ld", (unsigned long)cnt, (long)folderid);
+}
+
 static void psync_fstask_free_tree(psync_tree *tr){
   psync_tree *ntr;
   tr=psync_tree_get_first_safe(tr);
@@ -1733,6 +1842,9 @@ void psync_fstask_clean(){
       folder->taskscnt=0;
     }
   }
+  psync_fstask_free_tree(pending_folders);
+  pending_folders=PSYNC_TREE_EMPTY;
+  memset(pending_bitmap, 0, sizeof(pending_bitmap));
   psync_sql_unlock();
 }
 
@@ -1742,14 +1854,14 @@ void psync_fstask_add_banned_folder(psync_fsfolderid_t folderid, const char *nam
   psync_fstask_rmdir_t *rm;
   size_t len;
   len=strlen(name)+1;
-  mk=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+len);
+  mk=(psync_fstask_mkdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_mkdir_t, name)+len);
   mk->taskid=0;
   mk->ctime=mk->mtime=0;
   mk->folderid=0;
   mk->subdircnt=0;
   mk->flags=PSYNC_FOLDER_FLAG_INVISIBLE;
   memcpy(mk->name, name, len);
-  rm=(psync_fstask_rmdir_t *)psync_malloc(offsetof(psync_fstask_rmdir_t, name)+len);
+  rm=(psync_fstask_rmdir_t *)psync_malloc_tag(PSYNC_MEM_TAG_FSTASKS, offsetof(psync_fstask_rmdir_t, name)+len);
   rm->taskid=0;
   rm->folderid=0;
   memcpy(rm->name, name, len);
@@ -1769,22 +1881,16 @@ void psync_fstask_add_banned_folders(){
 }
 
 void psync_fstask_init(){
-  psync_uint_t tp;
   psync_sql_res *res;
   psync_variant_row row;
   res=psync_sql_prep_statement("UPDATE fstask SET status=0 WHERE status IN (1, 2)");
   psync_sql_run_free(res);
   res=psync_sql_prep_statement("UPDATE fstask SET status=11 WHERE status=12");
   psync_sql_run_free(res);
-  res=psync_sql_query("SELECT id, type, folderid, fileid, text1, text2, int1, int2, sfolderid FROM fstask WHERE status NOT IN (3) ORDER BY id");
-  while ((row=psync_sql_fetch_row(res))){
-    tp=psync_get_number(row[1]);
-    if (!tp || tp>=ARRAY_SIZE(psync_init_task_func)){
-      debug(D_BUG, "invalid fstask type %lu", (long unsigned)tp);
-      continue;
-    }
-    psync_init_task_func[tp](row);
-  }
+  // tasks are replayed per folder on first access, only the folder list is read here
+  res=psync_sql_query("SELECT DISTINCT folderid FROM fstask WHERE status NOT IN (3)");
+  while ((row=psync_sql_fetch_row(res)))
+    psync_fstask_add_pending(psync_get_snumber(row[0]));
   psync_sql_free_result(res);
   psync_fsupload_init();
 }
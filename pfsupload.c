@@ -389,7 +389,7 @@ static int save_meta(const binresult *meta, psync_folderid_t folderid, const cha
   }
   psync_sql_commit_transaction();
   debug(D_NOTICE, "file %lu/%s uploaded", (unsigned long)folderid, name);
-  psync_status_recalc_to_upload_async();
+  psync_status_fs_tasks_changed();
   return 0;
 }
 
@@ -686,42 +686,212 @@ static int upload_modify_send_copy_from(psync_socket *api, psync_uploadid_t uplo
   }
 }
 
-static int upload_modify_send_local(psync_socket *api, psync_uploadid_t uploadid, uint64_t offset, uint64_t length, psync_file_t fd, uint64_t *upl){
-  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", offset), P_NUM("uploadid", uploadid)};
+#define DELTA_SEG_COPY  0 /* unmodified, copied from the original on the server */
+#define DELTA_SEG_SAME  1 /* rewritten with the same content, the local file is valid */
+#define DELTA_SEG_LOCAL 2 /* modified, sent from the local file */
+#define DELTA_SEG_MEM   3 /* unmodified gap sent from data taken from the page cache */
+
+typedef struct {
+  uint64_t from;
+  uint64_t to;
+  char *data;
+  uint32_t type;
+} upload_delta_seg_t;
+
+typedef struct {
+  upload_delta_seg_t *segs;
+  size_t cnt;
+  size_t alloc;
+  uint64_t membytes;
+} upload_delta_plan_t;
+
+static pthread_mutex_t delta_stats_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_fsupload_delta_stats_t delta_stats;
+
+static void upload_delta_add(upload_delta_plan_t *plan, uint64_t from, uint64_t to, uint32_t type){
+  upload_delta_seg_t *seg;
+  if (from>=to)
+    return;
+  if (plan->cnt && plan->segs[plan->cnt-1].type==type && plan->segs[plan->cnt-1].to==from){
+    plan->segs[plan->cnt-1].to=to;
+    return;
+  }
+  if (plan->cnt==plan->alloc){
+    plan->alloc=plan->alloc?plan->alloc*2:64;
+    plan->segs=(upload_delta_seg_t *)psync_realloc(plan->segs, sizeof(upload_delta_seg_t)*plan->alloc);
+  }
+  seg=&plan->segs[plan->cnt++];
+  seg->from=from;
+  seg->to=to;
+  seg->data=NULL;
+  seg->type=type;
+}
+
+static void upload_delta_free(upload_delta_plan_t *plan){
+  size_t i;
+  for (i=0; i<plan->cnt; i++)
+    psync_free(plan->segs[i].data);
+  psync_free(plan->segs);
+}
+
+/* splits a modified range into page aligned chunks that differ from the cached original and ones that do not,
+ * gives up at the first page that is not in the cache */
+static void upload_delta_add_modified(upload_delta_plan_t *plan, uint64_t from, uint64_t to, psync_file_t fd, uint64_t hash,
+                                      char *lbuff, char *obuff){
+  uint64_t end;
+  size_t len;
+  while (from<to){
+    end=(from/PSYNC_FS_PAGE_SIZE+1)*PSYNC_FS_PAGE_SIZE;
+    if (end>to)
+      end=to;
+    len=end-from;
+    if (psync_pagecache_read_cached_range(hash, from, obuff, len))
+      break;
+    if (psync_file_pread(fd, lbuff, len, from)==len && !memcmp(lbuff, obuff, len))
+      upload_delta_add(plan, from, end, DELTA_SEG_SAME);
+    else
+      upload_delta_add(plan, from, end, DELTA_SEG_LOCAL);
+    from=end;
+  }
+  upload_delta_add(plan, from, to, DELTA_SEG_LOCAL);
+}
+
+/* Gaps between two modified segments cost an extra upload_writefromfile and a new upload_write. Short ones are cheaper
+ * to send as data: rewritten ranges straight from the local file, never written ones from the cached original. */
+static void upload_delta_merge_gaps(upload_delta_plan_t *plan, uint64_t hash){
+  upload_delta_seg_t *seg;
+  uint64_t len;
+  size_t i;
+  for (i=1; i+1<plan->cnt; i++){
+    seg=&plan->segs[i];
+    if (seg->type==DELTA_SEG_LOCAL || seg->type==DELTA_SEG_MEM || plan->segs[i-1].type<DELTA_SEG_LOCAL ||
+        plan->segs[i+1].type!=DELTA_SEG_LOCAL)
+      continue;
+    len=seg->to-seg->from;
+    if (len>PSYNC_FS_DELTA_MERGE_GAP)
+      continue;
+    if (seg->type==DELTA_SEG_SAME)
+      seg->type=DELTA_SEG_LOCAL;
+    else if (plan->membytes+len<=PSYNC_FS_DELTA_MAX_MERGE_MEM){
+      seg->data=psync_malloc(len);
+      if (psync_pagecache_read_cached_range(hash, seg->from, seg->data, len)){
+        psync_free(seg->data);
+        seg->data=NULL;
+      }
+      else{
+        seg->type=DELTA_SEG_MEM;
+        plan->membytes+=len;
+      }
+    }
+  }
+}
+
+static void upload_delta_plan(upload_delta_plan_t *plan, psync_interval_tree_t *tree, int64_t fsize, psync_file_t fd, uint64_t hash, int cmp){
+  psync_interval_tree_t *interval;
+  char *lbuff, *obuff;
+  uint64_t coff, to, dirty, same, copy;
+  size_t i, reqs;
+  memset(plan, 0, sizeof(upload_delta_plan_t));
+  if (cmp){
+    lbuff=psync_malloc(PSYNC_FS_PAGE_SIZE*2);
+    obuff=lbuff+PSYNC_FS_PAGE_SIZE;
+  }
+  else
+    lbuff=obuff=NULL;
+  coff=0;
+  interval=psync_interval_tree_get_first(tree);
+  while (interval && interval->from<(uint64_t)fsize){
+    upload_delta_add(plan, coff, interval->from, DELTA_SEG_COPY);
+    to=i64min(interval->to, fsize);
+    if (cmp)
+      upload_delta_add_modified(plan, interval->from, to, fd, hash, lbuff, obuff);
+    else
+      upload_delta_add(plan, interval->from, to, DELTA_SEG_LOCAL);
+    coff=to;
+    interval=psync_interval_tree_get_next(interval);
+  }
+  upload_delta_add(plan, coff, fsize, DELTA_SEG_COPY);
+  psync_free(lbuff);
+  if (cmp)
+    upload_delta_merge_gaps(plan, hash);
+  dirty=same=copy=0;
+  reqs=0;
+  for (i=0; i<plan->cnt; i++){
+    if (plan->segs[i].type==DELTA_SEG_SAME)
+      same+=plan->segs[i].to-plan->segs[i].from;
+    else if (plan->segs[i].type==DELTA_SEG_COPY)
+      copy+=plan->segs[i].to-plan->segs[i].from;
+    else
+      dirty+=plan->segs[i].to-plan->segs[i].from;
+    if (!i || (plan->segs[i].type>=DELTA_SEG_LOCAL)!=(plan->segs[i-1].type>=DELTA_SEG_LOCAL))
+      reqs++;
+  }
+  debug(D_NOTICE, "delta plan: %lu requests, %lu bytes to upload, %lu rewritten bytes unchanged, %lu bytes of gaps filled from cache",
+        (unsigned long)reqs, (unsigned long)dirty, (unsigned long)same, (unsigned long)plan->membytes);
+  pthread_mutex_lock(&delta_stats_mutex);
+  delta_stats.plans++;
+  delta_stats.requests+=reqs;
+  delta_stats.uploadbytes+=dirty;
+  delta_stats.samebytes+=same;
+  delta_stats.cachebytes+=plan->membytes;
+  delta_stats.copybytes+=copy;
+  pthread_mutex_unlock(&delta_stats_mutex);
+}
+
+void psync_fsupload_get_delta_stats(psync_fsupload_delta_stats_t *stats){
+  pthread_mutex_lock(&delta_stats_mutex);
+  memcpy(stats, &delta_stats, sizeof(psync_fsupload_delta_stats_t));
+  pthread_mutex_unlock(&delta_stats_mutex);
+}
+
+static int upload_modify_send_local(psync_socket *api, psync_uploadid_t uploadid, const upload_delta_seg_t *segs, size_t cnt,
+                                    psync_file_t fd, uint64_t *upl){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", segs[0].from), P_NUM("uploadid", uploadid)};
   void *buff;
-  uint64_t bw;
-  size_t rd;
+  uint64_t bw, length;
+  size_t rd, i;
   ssize_t rrd;
-  debug(D_NOTICE, "uploading %lu byte from local file at offset %lu", (unsigned long)length, (unsigned long)offset);
-  if (unlikely_log(psync_file_seek(fd, offset, P_SEEK_SET)==-1) ||
-      unlikely_log(!do_send_command(api, "upload_write", strlen("upload_write"), params, ARRAY_SIZE(params), length, 0)))
+  length=segs[cnt-1].to-segs[0].from;
+  debug(D_NOTICE, "uploading %lu byte from local file at offset %lu in %lu parts", (unsigned long)length, (unsigned long)segs[0].from,
+        (unsigned long)cnt);
+  if (unlikely_log(!do_send_command(api, "upload_write", strlen("upload_write"), params, ARRAY_SIZE(params), length, 0)))
     return PSYNC_NET_TEMPFAIL;
-  bw=0;
-
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
-  while (bw<length){
-    if (unlikely(stop_current_upload)){
-      debug(D_NOTICE, "got stop");
-      goto err0;
+  for (i=0; i<cnt; i++){
+    length=segs[i].to-segs[i].from;
+    if (segs[i].type==DELTA_SEG_MEM){
+      if (unlikely_log(psync_socket_writeall_upload(api, segs[i].data, length)!=length))
+        goto err0;
+      *upl+=length;
+      psync_upload_add_bytes_uploaded(length);
+      continue;
     }
-    psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
-    if (length-bw>PSYNC_COPY_BUFFER_SIZE)
-      rd=PSYNC_COPY_BUFFER_SIZE;
-    else
-      rd=length-bw;
-    rrd=psync_file_read(fd, buff, rd);
-    if (unlikely_log(rrd<=0)){
-      if (rrd==0)
-        goto errp;
+    if (unlikely_log(psync_file_seek(fd, segs[i].from, P_SEEK_SET)==-1))
+      goto err0;
+    bw=0;
+    while (bw<length){
+      if (unlikely(stop_current_upload)){
+        debug(D_NOTICE, "got stop");
+        goto err0;
+      }
+      psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
+      if (length-bw>PSYNC_COPY_BUFFER_SIZE)
+        rd=PSYNC_COPY_BUFFER_SIZE;
       else
+        rd=length-bw;
+      rrd=psync_file_read(fd, buff, rd);
+      if (unlikely_log(rrd<=0)){
+        if (rrd==0)
+          goto errp;
+        else
+          goto err0;
+      }
+      bw+=rrd;
+      if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
         goto err0;
+      *upl+=rrd;
+      psync_upload_add_bytes_uploaded(rrd);
     }
-    bw+=rrd;
-    if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
-      goto err0;
-    *upl+=rrd;
-    psync_upload_add_bytes_uploaded(rrd);
-
   }
   psync_free(buff);
   return PSYNC_NET_OK;
@@ -753,14 +923,16 @@ static int upload_modify_read_req(psync_socket *api){
 int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename, const char *indexname, psync_fileid_t fileid,
               uint64_t hash, uint64_t writeid, const char *key){
   binparam aparams[]={P_STR("auth", psync_my_auth)};
-  psync_interval_tree_t *tree, *cinterval;
+  psync_interval_tree_t *tree;
+  upload_delta_plan_t plan;
   psync_socket *api;
   binresult *res;
   psync_sql_res *sql;
-  int64_t fsize, coff, len;
+  int64_t fsize;
   uint64_t result, asize;
   psync_uploadid_t uploadid;
   psync_uint_t reqs;
+  size_t i, j;
   psync_file_t fd;
   psync_fs_err_t err;
   int ret;
@@ -826,52 +998,45 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
   fsize=psync_file_size(fd);
   if (unlikely_log(fsize==-1))
     goto err3;
-  coff=0;
+  // the page cache holds the encrypted original of encrypted files, so only plain files are compared against it
+  upload_delta_plan(&plan, tree, fsize, fd, hash, !key && hash);
+  psync_socket_cork(api);
   reqs=0;
-  cinterval=psync_interval_tree_get_first(tree);
-  while (coff<fsize){
+  i=0;
+  while (i<plan.cnt){
     if (reqs && (psync_socket_pendingdata(api) || psync_select_in(&api->sock, 1, 0)!=SOCKET_ERROR)){
       if ((ret=upload_modify_read_req(api))){
         if (unlikely_log(ret==PSYNC_NET_PERMFAIL))
           perm_fail_upload_task(taskid);
-        goto err3;
+        goto err4;
       }
       else
         reqs--;
     }
-    if (cinterval){
-      if (cinterval->from>coff){
-        len=i64min(cinterval->from, fsize)-coff;
-        ret=upload_modify_send_copy_from(api, uploadid, coff, len, fileid, hash, &asize);
-        reqs++;
-        coff+=len;
-      }
-      else if (cinterval->from<=coff && cinterval->to>coff){
-        ret=upload_modify_send_local(api, uploadid, coff, i64min(cinterval->to, fsize)-coff, fd, &asize);
-        reqs++;
-        coff=cinterval->to;
-        cinterval=psync_interval_tree_get_next(cinterval);
-      }
-      else{
-        debug(D_BUG, "broken interval tree");
-        break;
-      }
+    j=i+1;
+    if (plan.segs[i].type>=DELTA_SEG_LOCAL){
+      while (j<plan.cnt && plan.segs[j].type>=DELTA_SEG_LOCAL)
+        j++;
+      ret=upload_modify_send_local(api, uploadid, plan.segs+i, j-i, fd, &asize);
     }
     else{
-      ret=upload_modify_send_copy_from(api, uploadid, coff, fsize-coff, fileid, hash, &asize);
-      reqs++;
-      coff=fsize;
+      while (j<plan.cnt && plan.segs[j].type<DELTA_SEG_LOCAL)
+        j++;
+      ret=upload_modify_send_copy_from(api, uploadid, plan.segs[i].from, plan.segs[j-1].to-plan.segs[i].from, fileid, hash, &asize);
     }
+    reqs++;
+    i=j;
     if (ret){
       if (unlikely_log(ret==PSYNC_NET_PERMFAIL))
         perm_fail_upload_task(taskid);
-      goto err3;
+      goto err4;
     }
     if (unlikely(stop_current_upload)){
       debug(D_NOTICE, "got stop for file %s", name);
-      goto err3;
+      goto err4;
     }
   }
+  upload_delta_free(&plan);
   psync_file_close(fd);
   while (reqs--)
     if ((ret=upload_modify_read_req(api))){
@@ -887,6 +1052,8 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     return -1;
   }
   return large_upload_save(api, uploadid, folderid, name, taskid, writeid, 0, hash, key, filename);
+err4:
+  upload_delta_free(&plan);
 err3:
   psync_file_close(fd);
 err2:
@@ -1490,10 +1657,10 @@ static void psync_fsupload_process_tasks(psync_list *tasks){
   psync_sql_commit_transaction();
   if (creats){
     psync_upload_dec_uploads_cnt(creats);
-    psync_status_recalc_to_upload_async();
+    psync_status_fs_tasks_changed();
   }
   else if (cancels)
-    psync_status_recalc_to_upload_async();
+    psync_status_fs_tasks_changed();
 }
 
 static void psync_fsupload_run_tasks(psync_list *tasks){
@@ -1506,6 +1673,7 @@ static void psync_fsupload_run_tasks(psync_list *tasks){
   api=psync_apipool_get();
   if (!api)
     goto err;
+  psync_socket_cork(api);
   rtask=psync_list_element(tasks->next, fsupload_task_t, list);
   ret=0;
   np=0;
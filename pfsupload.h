@@ -30,9 +30,20 @@
 
 #include "psynclib.h"
 
+/* totals over all delta upload plans made for modified drive files */
+typedef struct {
+  uint64_t plans;
+  uint64_t requests;
+  uint64_t uploadbytes; /* modified data sent, including gaps merged into it */
+  uint64_t samebytes; /* rewritten with unchanged content and copied on the server instead */
+  uint64_t cachebytes; /* never written gaps sent from the page cache */
+  uint64_t copybytes; /* untouched ranges copied on the server */
+} psync_fsupload_delta_stats_t;
+
 void psync_fsupload_init();
 void psync_fsupload_wake();
 void psync_fsupload_stop_upload_locked(uint64_t taskid);
 int psync_fsupload_in_current_small_uploads_batch_locked(uint64_t taskid);
+void psync_fsupload_get_delta_stats(psync_fsupload_delta_stats_t *stats);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include "plibs.h"
 #include "pfsfolder.h"
 #include "pfstasks.h"
+#include "plist.h"
+#include "psettings.h"
+#include "palloc.h"
 #include <fuse.h>
 #include <errno.h>
 #include <string.h>
@@ -49,11 +52,168 @@ enum
 #define taskid_to_objid(id) ((id)*OBJECT_MULTIPLIER+OBJECT_TASK)
 #define static_taskid_to_objid(id) ((UINT64_MAX-id+1)*OBJECT_MULTIPLIER+OBJECT_STATICFILE)
 
+#define XATTR_CACHE_HASH 1024
+
+/* All attributes of an object, packed as (namelen, valuelen, name with terminating zero, value) records. An entry with
+ * no records caches the fact that the object has no attributes. Entries are filled under the sql read lock and
+ * changed or dropped only under the write lock, together with the fsxattr rows they mirror. */
+typedef struct {
+  psync_list list;
+  psync_list lru;
+  uint64_t oid;
+  uint32_t cnt;
+  uint32_t size;
+  char data[];
+} xattr_cache_entry_t;
+
+typedef struct {
+  uint32_t namelen;
+  uint32_t valuelen;
+} xattr_cache_rec_t;
+
+#define xattr_cache_rec_size(namelen, valuelen) ((sizeof(xattr_cache_rec_t)+(namelen)+(valuelen)+3)&~((size_t)3))
+
+static pthread_mutex_t xattr_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list xattr_cache_hash[XATTR_CACHE_HASH];
+static psync_list xattr_cache_lru=PSYNC_LIST_STATIC_INIT(xattr_cache_lru);
+static uint32_t xattr_cache_cnt=0;
+static int xattr_cache_inited=0;
+
+static void xattr_cache_init_locked(){
+  uint32_t i;
+  for (i=0; i<XATTR_CACHE_HASH; i++)
+    psync_list_init(&xattr_cache_hash[i]);
+  xattr_cache_inited=1;
+}
+
+static xattr_cache_entry_t *xattr_cache_find_locked(uint64_t oid){
+  xattr_cache_entry_t *e;
+  if (unlikely(!xattr_cache_inited))
+    xattr_cache_init_locked();
+  psync_list_for_each_element(e, &xattr_cache_hash[oid%XATTR_CACHE_HASH], xattr_cache_entry_t, list)
+    if (e->oid==oid)
+      return e;
+  return NULL;
+}
+
+static void xattr_cache_free_entry_locked(xattr_cache_entry_t *e){
+  psync_list_del(&e->list);
+  psync_list_del(&e->lru);
+  xattr_cache_cnt--;
+  psync_free(e);
+}
+
+static void xattr_cache_add_locked(xattr_cache_entry_t *e){
+  psync_list_add_head(&xattr_cache_hash[e->oid%XATTR_CACHE_HASH], &e->list);
+  psync_list_add_head(&xattr_cache_lru, &e->lru);
+  if (++xattr_cache_cnt>PSYNC_FS_XATTR_CACHE_OBJECTS)
+    xattr_cache_free_entry_locked(psync_list_element(xattr_cache_lru.prev, xattr_cache_entry_t, lru));
+}
+
+static void xattr_cache_drop(uint64_t oid){
+  xattr_cache_entry_t *e;
+  pthread_mutex_lock(&xattr_cache_mutex);
+  e=xattr_cache_find_locked(oid);
+  if (e)
+    xattr_cache_free_entry_locked(e);
+  pthread_mutex_unlock(&xattr_cache_mutex);
+}
+
+static void xattr_cache_move(uint64_t ooid, uint64_t noid){
+  xattr_cache_entry_t *oe, *ne;
+  pthread_mutex_lock(&xattr_cache_mutex);
+  oe=xattr_cache_find_locked(ooid);
+  ne=xattr_cache_find_locked(noid);
+  // the rows of ooid replace rows of noid with the same name, the result is known only if noid is cached with none
+  if (oe && (!ne || ne->cnt)){
+    xattr_cache_free_entry_locked(oe);
+    oe=NULL;
+  }
+  if (ne)
+    xattr_cache_free_entry_locked(ne);
+  if (oe){
+    psync_list_del(&oe->list);
+    oe->oid=noid;
+    psync_list_add_head(&xattr_cache_hash[noid%XATTR_CACHE_HASH], &oe->list);
+  }
+  pthread_mutex_unlock(&xattr_cache_mutex);
+}
+
+/* returns NULL if attributes of the object are too large to be cached */
+static xattr_cache_entry_t *xattr_cache_load_locked(uint64_t oid){
+  xattr_cache_entry_t *e;
+  xattr_cache_rec_t *rec;
+  psync_sql_res *res;
+  psync_variant_row row;
+  const char *name, *value;
+  size_t namelen, valuelen, recsize, alloced;
+  alloced=offsetof(xattr_cache_entry_t, data)+256;
+  e=(xattr_cache_entry_t *)psync_malloc_tag(PSYNC_MEM_TAG_CACHE, alloced);
+  e->oid=oid;
+  e->cnt=0;
+  e->size=0;
+  res=psync_sql_query_nolock("SELECT name, value FROM fsxattr WHERE objectid=?");
+  psync_sql_bind_uint(res, 1, oid);
+  while ((row=psync_sql_fetch_row(res))){
+    name=psync_get_lstring(row[0], &namelen);
+    value=psync_get_lstring_or_null(row[1], &valuelen);
+    if (!value)
+      valuelen=0;
+    namelen++;
+    recsize=xattr_cache_rec_size(namelen, valuelen);
+    if (e->size+recsize>PSYNC_FS_XATTR_CACHE_MAX_OBJECT_SIZE){
+      psync_sql_free_result(res);
+      psync_free(e);
+      return NULL;
+    }
+    if (offsetof(xattr_cache_entry_t, data)+e->size+recsize>alloced){
+      alloced=offsetof(xattr_cache_entry_t, data)+PSYNC_FS_XATTR_CACHE_MAX_OBJECT_SIZE;
+      e=(xattr_cache_entry_t *)psync_realloc(e, alloced);
+    }
+    rec=(xattr_cache_rec_t *)(e->data+e->size);
+    rec->namelen=namelen;
+    rec->valuelen=valuelen;
+    memcpy(rec+1, name, namelen);
+    memcpy(((char *)(rec+1))+namelen, value, valuelen);
+    e->size+=recsize;
+    e->cnt++;
+  }
+  psync_sql_free_result(res);
+  xattr_cache_add_locked(e);
+  return e;
+}
+
+static xattr_cache_entry_t *xattr_cache_get_locked(uint64_t oid){
+  xattr_cache_entry_t *e;
+  e=xattr_cache_find_locked(oid);
+  if (e){
+    psync_list_del(&e->lru);
+    psync_list_add_head(&xattr_cache_lru, &e->lru);
+    return e;
+  }
+  else
+    return xattr_cache_load_locked(oid);
+}
+
+#define xattr_cache_for_each_rec(rec, e, i) for (i=0, rec=(xattr_cache_rec_t *)(e)->data; i<(e)->cnt;\
+  i++, rec=(xattr_cache_rec_t *)(((char *)rec)+xattr_cache_rec_size(rec->namelen, rec->valuelen)))
+
+#define xattr_cache_rec_name(rec) ((const char *)((rec)+1))
+#define xattr_cache_rec_value(rec) (((const char *)((rec)+1))+(rec)->namelen)
+
+void psync_fs_xattr_cache_clean(){
+  pthread_mutex_lock(&xattr_cache_mutex);
+  while (!psync_list_isempty(&xattr_cache_lru))
+    xattr_cache_free_entry_locked(psync_list_element(xattr_cache_lru.next, xattr_cache_entry_t, lru));
+  pthread_mutex_unlock(&xattr_cache_mutex);
+}
+
 static void delete_object_id(uint64_t oid){
   psync_sql_res *res;
   res=psync_sql_prep_statement("DELETE FROM fsxattr WHERE objectid=?");
   psync_sql_bind_uint(res, 1, oid);
   psync_sql_run_free(res);
+  xattr_cache_drop(oid);
 }
 
 void psync_fs_file_deleted(psync_fileid_t fileid){
@@ -74,6 +234,7 @@ static void update_object_id(uint64_t ooid, uint64_t noid){
   psync_sql_bind_uint(res, 1, noid);
   psync_sql_bind_uint(res, 2, ooid);
   psync_sql_run_free(res);
+  xattr_cache_move(ooid, noid);
 }
 
 void psync_fs_task_to_file(uint64_t taskid, psync_fileid_t fileid){
@@ -242,16 +403,42 @@ int psync_fs_setxattr(const char *path, const char *name, const char *value, siz
     psync_sql_run_free(res);
     ret=0;
   }
+  if (!ret)
+    xattr_cache_drop(oid);
   psync_sql_unlock();
   return ret;
 }
 
 int psync_fs_getxattr(const char *path, const char *name, char *value, size_t size PFS_XATTR_IGN){
   psync_sql_res *res;
+  xattr_cache_entry_t *e;
+  xattr_cache_rec_t *rec;
   int64_t oid;
+  uint32_t i;
   int ret;
   psync_fs_set_thread_name();
   LOCK_AND_LOOKUPRD();
+  pthread_mutex_lock(&xattr_cache_mutex);
+  e=xattr_cache_get_locked(oid);
+  if (likely(e)){
+    ret=-ENOATTR;
+    xattr_cache_for_each_rec(rec, e, i)
+      if (!strcmp(xattr_cache_rec_name(rec), name)){
+        if (!size || !value)
+          ret=rec->valuelen;
+        else if (size>=rec->valuelen){
+          memcpy(value, xattr_cache_rec_value(rec), rec->valuelen);
+          ret=rec->valuelen;
+        }
+        else
+          ret=-ERANGE;
+        break;
+      }
+    pthread_mutex_unlock(&xattr_cache_mutex);
+    psync_sql_rdunlock();
+    return ret;
+  }
+  pthread_mutex_unlock(&xattr_cache_mutex);
   if (size && value){
     psync_variant_row row;
     const char *str;
@@ -298,12 +485,34 @@ int psync_fs_getxattr(const char *path, const char *name, char *value, size_t si
 
 int psync_fs_listxattr(const char *path, char *list, size_t size){
   psync_sql_res *res;
+  xattr_cache_entry_t *e;
+  xattr_cache_rec_t *rec;
   int64_t oid;
   const char *str;
   size_t len;
+  uint32_t i;
   int ret;
   psync_fs_set_thread_name();
   LOCK_AND_LOOKUPRD();
+  pthread_mutex_lock(&xattr_cache_mutex);
+  e=xattr_cache_get_locked(oid);
+  if (likely(e)){
+    ret=0;
+    xattr_cache_for_each_rec(rec, e, i){
+      if (size && list){
+        if (ret+rec->namelen>size){
+          ret=-ERANGE;
+          break;
+        }
+        memcpy(list+ret, xattr_cache_rec_name(rec), rec->namelen);
+      }
+      ret+=rec->namelen;
+    }
+    pthread_mutex_unlock(&xattr_cache_mutex);
+    psync_sql_rdunlock();
+    return ret;
+  }
+  pthread_mutex_unlock(&xattr_cache_mutex);
   if (size && list){
     psync_variant_row row;
     ret=0;
@@ -348,6 +557,8 @@ int psync_fs_removexattr(const char *path, const char *name){
   psync_sql_bind_string(res, 2, name);
   psync_sql_run_free(res);
   aff=psync_sql_affected_rows();
+  if (aff)
+    xattr_cache_drop(oid);
   psync_sql_unlock();
   if (aff){
     debug(D_NOTICE, "attribute %s deleted for %s", name, path);
@@ -24,4 +24,6 @@ void psync_fs_task_to_folder(uint64_t taskid, psync_folderid_t folderid);
 void psync_fs_static_to_task(uint64_t statictaskid, uint64_t taskid);
 void psync_fs_file_to_task(psync_fileid_t fileid, uint64_t taskid);
 
+void psync_fs_xattr_cache_clean();
+
 #endif
\ No newline at end of file
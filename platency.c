@@ -0,0 +1,281 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "platency.h"
+#include "pcompat.h"
+#include "plibs.h"
+#include "psettings.h"
+
+#define LATENCY_SUB_BUCKETS (1<<PSYNC_LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS     ((PSYNC_LATENCY_MAX_BITS-PSYNC_LATENCY_SUB_BUCKET_BITS+1)<<PSYNC_LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_HIST_CNT    (PSYNC_LATENCY_FIXED_CNT+PSYNC_LATENCY_MAX_API)
+
+typedef struct {
+  char name[PSYNC_LATENCY_NAME_LEN];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+  uint64_t duration;
+  uint32_t tid;
+} latency_trace_event_t;
+
+static latency_hist_t latency_hists[LATENCY_HIST_CNT]={
+  {"fs.getattr"}, {"fs.readdir"}, {"fs.open"}, {"fs.create"}, {"fs.release"}, {"fs.flush"}, {"fs.fsync"},
+  {"fs.fsyncdir"}, {"fs.read"}, {"fs.write"}, {"fs.mkdir"}, {"fs.rmdir"}, {"fs.unlink"}, {"fs.rename"},
+  {"fs.statfs"}, {"fs.chmod"}, {"fs.chown"}, {"fs.utimens"}, {"fs.ftruncate"}, {"fs.truncate"}, {"fs.setxattr"},
+  {"fs.getxattr"}, {"fs.listxattr"}, {"fs.removexattr"}, {"sql.wrlock.wait"}, {"sql.wrlock.hold"},
+  {"sql.rdlock.wait"}, {"sql.rdlock.hold"}
+};
+
+static uint32_t latency_hist_cnt=PSYNC_LATENCY_FIXED_CNT;
+static pthread_mutex_t latency_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static latency_trace_event_t *latency_trace=NULL;
+static uint32_t latency_trace_size=0;
+static uint32_t latency_trace_pos=0;
+static int latency_tracing=0;
+static uint64_t latency_next_tid=0;
+static PSYNC_THREAD uint32_t latency_tid=0;
+
+uint64_t psync_latency_now(){
+  struct timespec tm;
+#if defined(P_OS_POSIX) && defined(_POSIX_TIMERS) && _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+  if (unlikely(clock_gettime(CLOCK_MONOTONIC, &tm)))
+    psync_nanotime(&tm);
+#else
+  psync_nanotime(&tm);
+#endif
+  return (uint64_t)tm.tv_sec*1000000+tm.tv_nsec/1000;
+}
+
+static uint32_t latency_msb(uint64_t val){
+#if defined(__GNUC__)
+  return 63-__builtin_clzll(val);
+#else
+  uint32_t ret;
+  ret=0;
+  while (val>>=1)
+    ret++;
+  return ret;
+#endif
+}
+
+static uint32_t latency_bucket(uint64_t usec){
+  uint32_t msb;
+  if (usec<LATENCY_SUB_BUCKETS)
+    return (uint32_t)usec;
+  msb=latency_msb(usec);
+  if (msb>=PSYNC_LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS-1;
+  return ((msb-PSYNC_LATENCY_SUB_BUCKET_BITS+1)<<PSYNC_LATENCY_SUB_BUCKET_BITS)+
+         ((usec>>(msb-PSYNC_LATENCY_SUB_BUCKET_BITS))&(LATENCY_SUB_BUCKETS-1));
+}
+
+static uint64_t latency_bucket_upper(uint32_t bucket){
+  uint32_t shift;
+  if (bucket<LATENCY_SUB_BUCKETS)
+    return bucket;
+  shift=(bucket>>PSYNC_LATENCY_SUB_BUCKET_BITS)-1;
+  return (((uint64_t)(LATENCY_SUB_BUCKETS+(bucket&(LATENCY_SUB_BUCKETS-1))))<<shift)+((uint64_t)1<<shift)-1;
+}
+
+static void latency_trace_add(latency_hist_t *hist, uint64_t start, uint64_t usec){
+  latency_trace_event_t *ev;
+  if (!latency_tid)
+    latency_tid=(uint32_t)psync_atomic_add(&latency_next_tid, 1)+1;
+  pthread_mutex_lock(&latency_mutex);
+  if (latency_tracing && latency_trace){
+    ev=&latency_trace[latency_trace_pos%latency_trace_size];
+    ev->name=hist->name;
+    ev->start=start;
+    ev->duration=usec;
+    ev->tid=latency_tid;
+    latency_trace_pos++;
+  }
+  pthread_mutex_unlock(&latency_mutex);
+}
+
+static void latency_hist_add(latency_hist_t *hist, uint64_t start, uint64_t usec){
+  uint64_t max;
+  psync_atomic_add(&hist->buckets[latency_bucket(usec)], 1);
+  psync_atomic_add(&hist->count, 1);
+  psync_atomic_add(&hist->sum, usec);
+  do {
+    max=hist->max;
+  } while (usec>max && !psync_atomic_cas(&hist->max, max, usec));
+  if (unlikely(latency_tracing))
+    latency_trace_add(hist, start, usec);
+}
+
+void psync_latency_add(uint32_t id, uint64_t start, uint64_t usec){
+  latency_hist_add(&latency_hists[id], start, usec);
+}
+
+static latency_hist_t *latency_find_api(const char *name, uint32_t cnt){
+  uint32_t i;
+  for (i=PSYNC_LATENCY_FIXED_CNT; i<cnt; i++)
+    if (!strcmp(latency_hists[i].name, name))
+      return &latency_hists[i];
+  return NULL;
+}
+
+void psync_latency_api_add(const char *command, size_t cmdlen, uint64_t start, uint64_t usec){
+  char name[PSYNC_LATENCY_NAME_LEN];
+  latency_hist_t *hist;
+  uint32_t cnt;
+  if (cmdlen>sizeof(name)-5)
+    cmdlen=sizeof(name)-5;
+  memcpy(name, "api.", 4);
+  memcpy(name+4, command, cmdlen);
+  name[cmdlen+4]=0;
+  cnt=latency_hist_cnt;
+  psync_memory_barrier();
+  hist=latency_find_api(name, cnt);
+  if (!hist){
+    pthread_mutex_lock(&latency_mutex);
+    hist=latency_find_api(name, latency_hist_cnt);
+    if (!hist){
+      if (latency_hist_cnt<LATENCY_HIST_CNT-1){
+        hist=&latency_hists[latency_hist_cnt];
+        psync_strlcpy(hist->name, name, sizeof(hist->name));
+        psync_memory_barrier();
+        latency_hist_cnt++;
+      }
+      else{
+        /* the last one collects all commands that do not fit, the count never goes past it */
+        hist=&latency_hists[LATENCY_HIST_CNT-1];
+        if (latency_hist_cnt<LATENCY_HIST_CNT){
+          psync_strlcpy(hist->name, "api.other", sizeof(hist->name));
+          psync_memory_barrier();
+          latency_hist_cnt=LATENCY_HIST_CNT;
+        }
+      }
+    }
+    pthread_mutex_unlock(&latency_mutex);
+  }
+  latency_hist_add(hist, start, usec);
+}
+
+static uint64_t latency_percentile(const latency_hist_t *hist, uint64_t count, uint64_t permille, uint64_t max){
+  uint64_t threshold, sum, upper;
+  uint32_t i;
+  threshold=(count*permille+999)/1000;
+  sum=0;
+  for (i=0; i<LATENCY_BUCKETS; i++){
+    sum+=hist->buckets[i];
+    if (sum>=threshold){
+      upper=latency_bucket_upper(i);
+      return upper<max?upper:max;
+    }
+  }
+  return max;
+}
+
+int psync_latency_get_stats(uint32_t idx, psync_latency_stats_t *stats){
+  const latency_hist_t *hist;
+  uint64_t count;
+  if (idx>=latency_hist_cnt)
+    return -1;
+  psync_memory_barrier();
+  hist=&latency_hists[idx];
+  psync_strlcpy(stats->name, hist->name, sizeof(stats->name));
+  count=hist->count;
+  stats->count=count;
+  stats->sumus=hist->sum;
+  stats->maxus=hist->max;
+  if (count){
+    stats->p50us=latency_percentile(hist, count, 500, stats->maxus);
+    stats->p90us=latency_percentile(hist, count, 900, stats->maxus);
+    stats->p99us=latency_percentile(hist, count, 990, stats->maxus);
+    stats->p999us=latency_percentile(hist, count, 999, stats->maxus);
+  }
+  else
+    stats->p50us=stats->p90us=stats->p99us=stats->p999us=0;
+  return 0;
+}
+
+void psync_latency_reset(){
+  uint32_t i;
+  for (i=0; i<latency_hist_cnt; i++){
+    memset(latency_hists[i].buckets, 0, sizeof(latency_hists[i].buckets));
+    latency_hists[i].count=0;
+    latency_hists[i].sum=0;
+    latency_hists[i].max=0;
+  }
+}
+
+void psync_latency_trace_start(uint32_t maxevents){
+  latency_trace_event_t *old;
+  if (!maxevents)
+    maxevents=PSYNC_LATENCY_TRACE_DEFAULT;
+  pthread_mutex_lock(&latency_mutex);
+  old=latency_trace;
+  latency_trace=psync_new_cnt(latency_trace_event_t, maxevents);
+  latency_trace_size=maxevents;
+  latency_trace_pos=0;
+  latency_tracing=1;
+  pthread_mutex_unlock(&latency_mutex);
+  psync_free(old);
+}
+
+void psync_latency_trace_stop(){
+  pthread_mutex_lock(&latency_mutex);
+  latency_tracing=0;
+  pthread_mutex_unlock(&latency_mutex);
+}
+
+char *psync_latency_trace_json(){
+  latency_trace_event_t *ev;
+  char *ret;
+  size_t len, alloced;
+  uint32_t i, cnt, first;
+  pthread_mutex_lock(&latency_mutex);
+  if (latency_trace_pos>latency_trace_size){
+    cnt=latency_trace_size;
+    first=latency_trace_pos%latency_trace_size;
+  }
+  else{
+    cnt=latency_trace_pos;
+    first=0;
+  }
+  alloced=(size_t)cnt*(PSYNC_LATENCY_NAME_LEN+128)+32;
+  ret=psync_new_cnt(char, alloced);
+  len=psync_slprintf(ret, alloced, "{\"traceEvents\":[");
+  for (i=0; i<cnt; i++){
+    ev=&latency_trace[(first+i)%latency_trace_size];
+    len+=psync_slprintf(ret+len, alloced-len, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u}",
+                        i?",":"", ev->name, (unsigned long long)ev->start, (unsigned long long)ev->duration, (unsigned)ev->tid);
+  }
+  psync_slprintf(ret+len, alloced-len, "]}");
+  pthread_mutex_unlock(&latency_mutex);
+  return ret;
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PSYNC_LATENCY_H
+#define _PSYNC_LATENCY_H
+
+#include <stdint.h>
+#include "psynclib.h"
+
+/* Always-on latency histograms with logarithmic buckets (PSYNC_LATENCY_SUB_BUCKETS per power of two), values are in
+ * microseconds. Recording is lock-free, only a few atomic additions. An optional trace ring buffer keeps the last
+ * recorded operations and can be exported as Chrome trace JSON.
+ */
+
+#define PSYNC_LATENCY_FS_GETATTR       0
+#define PSYNC_LATENCY_FS_READDIR       1
+#define PSYNC_LATENCY_FS_OPEN          2
+#define PSYNC_LATENCY_FS_CREAT         3
+#define PSYNC_LATENCY_FS_RELEASE       4
+#define PSYNC_LATENCY_FS_FLUSH         5
+#define PSYNC_LATENCY_FS_FSYNC         6
+#define PSYNC_LATENCY_FS_FSYNCDIR      7
+#define PSYNC_LATENCY_FS_READ          8
+#define PSYNC_LATENCY_FS_WRITE         9
+#define PSYNC_LATENCY_FS_MKDIR        10
+#define PSYNC_LATENCY_FS_RMDIR        11
+#define PSYNC_LATENCY_FS_UNLINK       12
+#define PSYNC_LATENCY_FS_RENAME       13
+#define PSYNC_LATENCY_FS_STATFS       14
+#define PSYNC_LATENCY_FS_CHMOD        15
+#define PSYNC_LATENCY_FS_CHOWN        16
+#define PSYNC_LATENCY_FS_UTIMENS      17
+#define PSYNC_LATENCY_FS_FTRUNCATE    18
+#define PSYNC_LATENCY_FS_TRUNCATE     19
+#define PSYNC_LATENCY_FS_SETXATTR     20
+#define PSYNC_LATENCY_FS_GETXATTR     21
+#define PSYNC_LATENCY_FS_LISTXATTR    22
+#define PSYNC_LATENCY_FS_REMOVEXATTR  23
+#define PSYNC_LATENCY_SQL_WRLOCK_WAIT 24
+#define PSYNC_LATENCY_SQL_WRLOCK_HOLD 25
+#define PSYNC_LATENCY_SQL_RDLOCK_WAIT 26
+#define PSYNC_LATENCY_SQL_RDLOCK_HOLD 27
+#define PSYNC_LATENCY_FIXED_CNT       28
+
+uint64_t psync_latency_now();
+void psync_latency_add(uint32_t id, uint64_t start, uint64_t usec);
+void psync_latency_api_add(const char *command, size_t cmdlen, uint64_t start, uint64_t usec);
+
+static inline void psync_latency_end(uint32_t id, uint64_t start){
+  psync_latency_add(id, start, psync_latency_now()-start);
+}
+
+int psync_latency_get_stats(uint32_t idx, psync_latency_stats_t *stats);
+void psync_latency_reset();
+void psync_latency_trace_start(uint32_t maxevents);
+void psync_latency_trace_stop();
+char *psync_latency_trace_json();
+
+#endif
@@ -32,10 +32,12 @@
 #include "ptree.h"
 #include "pdatabase.h"
 #include "plocks.h"
+#include "platency.h"
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <ctype.h>
 
 #define return_error(err) do {psync_error=err; return -1;} while (0)
 
@@ -112,6 +114,12 @@ PSYNC_THREAD uint32_t psync_error=0;
 
 static pthread_mutex_t psync_db_checkpoint_mutex;
 
+/* WAL checkpoints run on psync_db itself, the database is opened with exclusive locking and another connection could
+ * never checkpoint it; they are scheduled around other users of the database instead */
+static pthread_mutex_t checkpoint_stats_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_sql_checkpoint_stats_t checkpoint_stats;
+static int checkpoint_running=0;
+
 
 char *psync_strdup(const char *str){
   size_t len;
@@ -319,31 +327,123 @@ void psync_sql_err_callback(void *ptr, int code, const char *msg){
   debug(D_WARNING, "database warning %d: %s", code, msg);
 }
 
+static uint32_t get_wal_pages(){
+  uint32_t ret;
+  pthread_mutex_lock(&checkpoint_stats_mutex);
+  ret=checkpoint_stats.walpages;
+  pthread_mutex_unlock(&checkpoint_stats_mutex);
+  return ret;
+}
+
+static int run_checkpoint(int mode){
+  uint64_t start, elapsed;
+  int code, logpages, ckptpages;
+  start=psync_latency_now();
+  code=sqlite3_wal_checkpoint_v2(psync_db, NULL, mode, &logpages, &ckptpages);
+  elapsed=psync_latency_now()-start;
+  pthread_mutex_lock(&checkpoint_stats_mutex);
+  if (mode==SQLITE_CHECKPOINT_PASSIVE)
+    checkpoint_stats.passive++;
+  else
+    checkpoint_stats.truncate++;
+  checkpoint_stats.lastusec=elapsed;
+  checkpoint_stats.totalusec+=elapsed;
+  if (elapsed>checkpoint_stats.maxusec)
+    checkpoint_stats.maxusec=elapsed;
+  pthread_mutex_unlock(&checkpoint_stats_mutex);
+  debug(D_NOTICE, "checkpoint mode %d returned %d, %d of %d pages checkpointed in %lu ms", mode, code, ckptpages, logpages,
+        (unsigned long)(elapsed/1000));
+  if (code==SQLITE_BUSY || code==SQLITE_LOCKED)
+    return 1;
+  if (unlikely(code!=SQLITE_OK)){
+    debug(D_CRITICAL, "sqlite3_wal_checkpoint_v2 returned error %d", code);
+    return -1;
+  }
+  // -1 pages means nothing could be checkpointed, e.g. the database is not in WAL mode
+  if (unlikely(logpages==-1 || ckptpages==-1)){
+    debug(D_CRITICAL, "sqlite3_wal_checkpoint_v2 could not checkpoint the database");
+    return -1;
+  }
+  return ckptpages<logpages;
+}
+
 static void psync_sql_wal_checkpoint(){
-  int code;
-  psync_sql_lock();
-  psync_sql_unlock();
+  uint32_t pages, lastpages, deferred, partial;
+  int ret;
   if (pthread_mutex_trylock(&psync_db_checkpoint_mutex)){
     debug(D_NOTICE, "skipping checkpoint");
-    return;
-  }
-  debug(D_NOTICE, "checkpointing database");
-  code=sqlite3_wal_checkpoint(psync_db, NULL);
-  while (code==SQLITE_LOCKED){
-    psync_milisleep(2);
-    code=sqlite3_wal_checkpoint(psync_db, NULL);
+    goto end;
+  }
+  if (!psync_db){
+    pthread_mutex_unlock(&psync_db_checkpoint_mutex);
+    goto end;
+  }
+  lastpages=get_wal_pages();
+  deferred=0;
+  partial=0;
+  while (psync_do_run){
+    pages=get_wal_pages();
+    if (pages<PSYNC_DB_CHECKPOINT_AT_PAGES)
+      break;
+    if (pages>=PSYNC_DB_CHECKPOINT_FORCE_AT_PAGES || partial>=PSYNC_DB_CHECKPOINT_MAX_PARTIAL){
+      /* the WAL is too big or readers keep passive checkpoints from finishing, stop everybody and truncate it; never block
+       * on the lock while holding psync_db_checkpoint_mutex as psync_sql_close() takes them in the opposite order */
+      if (psync_sql_trylock()){
+        if (++deferred>=PSYNC_DB_CHECKPOINT_MAX_DEFERS*4)
+          break;
+        psync_milisleep(PSYNC_DB_CHECKPOINT_IDLE_WAIT_MS/10);
+        continue;
+      }
+      run_checkpoint(SQLITE_CHECKPOINT_TRUNCATE);
+      psync_sql_unlock();
+      break;
+    }
+    // postpone while other threads wait for the database or the WAL grows fast
+    if ((psync_sql_has_waiters() || pages>lastpages+PSYNC_DB_CHECKPOINT_BUSY_PAGES) && deferred<PSYNC_DB_CHECKPOINT_MAX_DEFERS){
+      deferred++;
+      pthread_mutex_lock(&checkpoint_stats_mutex);
+      checkpoint_stats.deferred++;
+      pthread_mutex_unlock(&checkpoint_stats_mutex);
+      lastpages=pages;
+      psync_milisleep(PSYNC_DB_CHECKPOINT_IDLE_WAIT_MS);
+      continue;
+    }
+    ret=run_checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+    // after a complete checkpoint the next commit restarts the WAL from the beginning
+    if (ret<=0)
+      break;
+    partial++;
+    lastpages=get_wal_pages();
+    psync_milisleep(PSYNC_DB_CHECKPOINT_IDLE_WAIT_MS);
   }
   pthread_mutex_unlock(&psync_db_checkpoint_mutex);
-  if (unlikely(code!=SQLITE_OK))
-    debug(D_CRITICAL, "sqlite3_wal_checkpoint returned error %d", code);
+end:
+  pthread_mutex_lock(&checkpoint_stats_mutex);
+  checkpoint_running=0;
+  pthread_mutex_unlock(&checkpoint_stats_mutex);
 }
 
 static int psync_sql_wal_hook(void *ptr, sqlite3 *db, const char *name, int numpages){
-  if (numpages>=PSYNC_DB_CHECKPOINT_AT_PAGES)
+  int run;
+  pthread_mutex_lock(&checkpoint_stats_mutex);
+  checkpoint_stats.walpages=numpages;
+  if (numpages>checkpoint_stats.maxwalpages)
+    checkpoint_stats.maxwalpages=numpages;
+  run=numpages>=PSYNC_DB_CHECKPOINT_AT_PAGES && !checkpoint_running;
+  if (run)
+    checkpoint_running=1;
+  pthread_mutex_unlock(&checkpoint_stats_mutex);
+  if (run)
     psync_run_thread("checkpoint charlie", psync_sql_wal_checkpoint);
   return SQLITE_OK;
 }
 
+void psync_sql_get_checkpoint_stats(psync_sql_checkpoint_stats_t *stats){
+  pthread_mutex_lock(&checkpoint_stats_mutex);
+  memcpy(stats, &checkpoint_stats, sizeof(psync_sql_checkpoint_stats_t));
+  pthread_mutex_unlock(&checkpoint_stats_mutex);
+}
+
 int psync_sql_connect(const char *db){
   static int initmutex=1;
   pthread_mutexattr_t mattr;
@@ -404,6 +504,8 @@ int psync_sql_connect(const char *db){
 
 int psync_sql_close(){
   int code, tries;
+  // wait for a running checkpoint to finish and keep new ones from using psync_db while it is closed
+  pthread_mutex_lock(&psync_db_checkpoint_mutex);
   tries=0;
   while (1){
     code=sqlite3_close(psync_db);
@@ -422,6 +524,7 @@ int psync_sql_close(){
       break;
   }
   psync_db=NULL;
+  pthread_mutex_unlock(&psync_db_checkpoint_mutex);
   if (unlikely(code!=SQLITE_OK)){
     debug(D_CRITICAL, "error when closing database: %d", code);
     return -1;
@@ -463,111 +566,114 @@ void psync_sql_checkpoint_unlock(){
   pthread_mutex_unlock(&psync_db_checkpoint_mutex);
 }
 
-#if IS_DEBUG
-unsigned long sqllockcnt=0;
-struct timespec sqllockstart;
-PSYNC_THREAD unsigned long sqlrdlockcnt=0;
-PSYNC_THREAD struct timespec sqlrdlockstart;
-#endif
+static unsigned long sqllockcnt=0;
+static uint64_t sqllockstart;
+static PSYNC_THREAD unsigned long sqlrdlockcnt=0;
+static PSYNC_THREAD uint64_t sqlrdlockstart;
 
 int psync_sql_trylock(){
-#if IS_DEBUG
   if (psync_rwlock_trywrlock(&psync_db_lock))
     return -1;
-  if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
+  if (++sqllockcnt==1){
+    sqllockstart=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_WRLOCK_WAIT, sqllockstart, 0);
+  }
   return 0;
-#else
-  return psync_rwlock_trywrlock(&psync_db_lock);
-#endif
 }
 
 void psync_sql_lock(){
-#if IS_DEBUG
   if (psync_rwlock_trywrlock(&psync_db_lock)){
-    struct timespec start, end;
-    unsigned long msec;
-    psync_nanotime(&start);
-    memcpy(&end, &start, sizeof(end));
-    end.tv_sec+=30;
-    if (psync_rwlock_timedwrlock(&psync_db_lock, &end)){
-      debug(D_BUG, "sql write lock timed out");
-      abort();
+    uint64_t start, end;
+    start=psync_latency_now();
+#if IS_DEBUG
+    {
+      struct timespec tend;
+      psync_nanotime(&tend);
+      tend.tv_sec+=30;
+      if (psync_rwlock_timedwrlock(&psync_db_lock, &tend)){
+        debug(D_BUG, "sql write lock timed out");
+        abort();
+      }
     }
-    psync_nanotime(&end);
-    msec=(end.tv_sec-start.tv_sec)*1000+end.tv_nsec/1000000-start.tv_nsec/1000000;
-    if (msec>=5)
-      debug(D_WARNING, "waited %lu milliseconds for database write lock", msec);
-    sqllockcnt++;
-    memcpy(&sqllockstart, &end, sizeof(struct timespec));
-  }
-  else if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
 #else
-  psync_rwlock_wrlock(&psync_db_lock);
+    psync_rwlock_wrlock(&psync_db_lock);
+#endif
+    end=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_WRLOCK_WAIT, start, end-start);
+#if IS_DEBUG
+    if (end-start>=5000)
+      debug(D_WARNING, "waited %lu milliseconds for database write lock", (unsigned long)((end-start)/1000));
 #endif
+    sqllockcnt++;
+    sqllockstart=end;
+  }
+  else if (++sqllockcnt==1){
+    sqllockstart=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_WRLOCK_WAIT, sqllockstart, 0);
+  }
 }
 
 void psync_sql_unlock(){
-#if IS_DEBUG
   if (--sqllockcnt==0){
-    struct timespec end;
-    unsigned long msec;
+    uint64_t start, end;
+    start=sqllockstart;
+    end=psync_latency_now();
     psync_rwlock_unlock(&psync_db_lock);
-    psync_nanotime(&end);
-    msec=(end.tv_sec-sqllockstart.tv_sec)*1000+end.tv_nsec/1000000-sqllockstart.tv_nsec/1000000;
-    if (msec>=10)
-      debug(D_WARNING, "held database write lock for %lu milliseconds", msec);
+    psync_latency_add(PSYNC_LATENCY_SQL_WRLOCK_HOLD, start, end-start);
+#if IS_DEBUG
+    if (end-start>=10000)
+      debug(D_WARNING, "held database write lock for %lu milliseconds", (unsigned long)((end-start)/1000));
+#endif
   }
   else
     psync_rwlock_unlock(&psync_db_lock);
-#else
-  psync_rwlock_unlock(&psync_db_lock);
-#endif
 }
 
 void psync_sql_rdlock(){
-#if IS_DEBUG
   if (psync_rwlock_tryrdlock(&psync_db_lock)){
-    struct timespec start, end;
-    unsigned long msec;
-    psync_nanotime(&start);
-    memcpy(&end, &start, sizeof(end));
-    end.tv_sec+=30;
-    if (psync_rwlock_timedrdlock(&psync_db_lock, &end)){
-      debug(D_BUG, "sql read lock timed out");
-      abort();
+    uint64_t start, end;
+    start=psync_latency_now();
+#if IS_DEBUG
+    {
+      struct timespec tend;
+      psync_nanotime(&tend);
+      tend.tv_sec+=30;
+      if (psync_rwlock_timedrdlock(&psync_db_lock, &tend)){
+        debug(D_BUG, "sql read lock timed out");
+        abort();
+      }
     }
-    psync_nanotime(&end);
-    msec=(end.tv_sec-start.tv_sec)*1000+end.tv_nsec/1000000-start.tv_nsec/1000000;
-    if (msec>=5)
-      debug(D_WARNING, "waited %lu milliseconds for database read lock", msec);
-    sqlrdlockcnt++;
-    memcpy(&sqlrdlockstart, &end, sizeof(struct timespec));
-  }
-  else if (++sqlrdlockcnt==1)
-    psync_nanotime(&sqlrdlockstart);
 #else
-  psync_rwlock_rdlock(&psync_db_lock);
+    psync_rwlock_rdlock(&psync_db_lock);
+#endif
+    end=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_RDLOCK_WAIT, start, end-start);
+#if IS_DEBUG
+    if (end-start>=5000)
+      debug(D_WARNING, "waited %lu milliseconds for database read lock", (unsigned long)((end-start)/1000));
 #endif
+    sqlrdlockcnt++;
+    sqlrdlockstart=end;
+  }
+  else if (++sqlrdlockcnt==1){
+    sqlrdlockstart=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_RDLOCK_WAIT, sqlrdlockstart, 0);
+  }
 }
 
 void psync_sql_rdunlock(){
-#if IS_DEBUG
   if (--sqlrdlockcnt==0){
-    struct timespec end;
-    unsigned long msec;
+    uint64_t end;
     psync_rwlock_unlock(&psync_db_lock);
-    psync_nanotime(&end);
-    msec=(end.tv_sec-sqlrdlockstart.tv_sec)*1000+end.tv_nsec/1000000-sqlrdlockstart.tv_nsec/1000000;
-    if (msec>=20)
-      debug(D_WARNING, "held database read lock for %lu milliseconds", msec);
+    end=psync_latency_now();
+    psync_latency_add(PSYNC_LATENCY_SQL_RDLOCK_HOLD, sqlrdlockstart, end-sqlrdlockstart);
+#if IS_DEBUG
+    if (end-sqlrdlockstart>=20000)
+      debug(D_WARNING, "held database read lock for %lu milliseconds", (unsigned long)((end-sqlrdlockstart)/1000));
+#endif
   }
   else
     psync_rwlock_unlock(&psync_db_lock);
-#else
-  psync_rwlock_unlock(&psync_db_lock);
-#endif
 }
 
 int psync_sql_has_waiters(){
@@ -582,10 +688,18 @@ int psync_sql_islocked(){
   return psync_rwlock_holding_lock(&psync_db_lock);
 }
 
+int psync_sql_iswrlocked(){
+  return psync_rwlock_holding_wrlock(&psync_db_lock);
+}
+
 int psync_sql_tryupgradelock(){
   return psync_rwlock_towrlock(&psync_db_lock);
 }
 
+void psync_sql_upgradelock(){
+  psync_rwlock_rdtowrlock(&psync_db_lock);
+}
+
 int psync_sql_sync(){
   int code;
   pthread_mutex_lock(&psync_db_checkpoint_mutex);
@@ -1343,6 +1457,225 @@ int psync_match_pattern(const char *name, const char *pattern, size_t plen){
   return name[i]==0;
 }
 
+/* A pattern set is a list of ";" separated patterns compiled to two tries that are walked once per name, a forward one
+ * for exact names and "prefix*" patterns and a reverse one for "*suffix" patterns. Other patterns hang on the node of
+ * their literal prefix (or suffix) and are only tried with psync_match_pattern() when the walk reaches that node. The set
+ * is one allocation, free it with psync_free(). */
+
+#define PATTERN_NODE_EXACT 1
+#define PATTERN_NODE_ANY   2
+
+#define PATTERN_FORWARD_ROOT 0
+#define PATTERN_REVERSE_ROOT 1
+
+typedef struct {
+  uint32_t child;
+  uint32_t sibling;
+  uint32_t general;
+  unsigned char ch;
+  uint8_t flags;
+} psync_pattern_node_t;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+  uint32_t next;
+} psync_pattern_general_t;
+
+struct _psync_pattern_set_t {
+  psync_pattern_node_t *nodes;
+  psync_pattern_general_t *general;
+  const char *strings;
+  uint32_t nodecnt;
+  uint32_t generalcnt;
+  int caseinsensitive;
+};
+
+typedef struct {
+  psync_pattern_node_t *nodes;
+  psync_pattern_general_t *general;
+  uint32_t nodecnt;
+  uint32_t nodealloc;
+  uint32_t generalcnt;
+  uint32_t generalalloc;
+} pattern_builder_t;
+
+static uint32_t pattern_trie_add(pattern_builder_t *b, uint32_t node, const char *str, size_t len, int reverse){
+  uint32_t n;
+  size_t i;
+  unsigned char ch;
+  for (i=0; i<len; i++){
+    ch=(unsigned char)(reverse?str[len-i-1]:str[i]);
+    for (n=b->nodes[node].child; n; n=b->nodes[n].sibling)
+      if (b->nodes[n].ch==ch)
+        break;
+    if (!n){
+      if (b->nodecnt==b->nodealloc){
+        b->nodealloc*=2;
+        b->nodes=(psync_pattern_node_t *)psync_realloc(b->nodes, sizeof(psync_pattern_node_t)*b->nodealloc);
+      }
+      n=b->nodecnt++;
+      memset(&b->nodes[n], 0, sizeof(psync_pattern_node_t));
+      b->nodes[n].ch=ch;
+      b->nodes[n].sibling=b->nodes[node].child;
+      b->nodes[node].child=n;
+    }
+    node=n;
+  }
+  return node;
+}
+
+static void pattern_add(pattern_builder_t *b, const char *pattern, size_t len, uint32_t offset){
+  size_t first, last, i;
+  uint32_t node;
+  first=last=len;
+  for (i=0; i<len; i++)
+    if (pattern[i]=='*' || pattern[i]=='?'){
+      if (first==len)
+        first=i;
+      last=i;
+    }
+  if (first==len){
+    node=pattern_trie_add(b, PATTERN_FORWARD_ROOT, pattern, len, 0);
+    b->nodes[node].flags|=PATTERN_NODE_EXACT;
+  }
+  else if (first==last && pattern[first]=='*' && first==len-1){
+    node=pattern_trie_add(b, PATTERN_FORWARD_ROOT, pattern, len-1, 0);
+    b->nodes[node].flags|=PATTERN_NODE_ANY;
+  }
+  else if (first==last && pattern[first]=='*' && first==0){
+    node=pattern_trie_add(b, PATTERN_REVERSE_ROOT, pattern+1, len-1, 1);
+    b->nodes[node].flags|=PATTERN_NODE_ANY;
+  }
+  else{
+    if (first)
+      node=pattern_trie_add(b, PATTERN_FORWARD_ROOT, pattern, first, 0);
+    else
+      node=pattern_trie_add(b, PATTERN_REVERSE_ROOT, pattern+last+1, len-last-1, 1);
+    if (b->generalcnt==b->generalalloc){
+      b->generalalloc*=2;
+      b->general=(psync_pattern_general_t *)psync_realloc(b->general, sizeof(psync_pattern_general_t)*b->generalalloc);
+    }
+    b->general[b->generalcnt].offset=offset;
+    b->general[b->generalcnt].len=len;
+    b->general[b->generalcnt].next=b->nodes[node].general;
+    b->nodes[node].general=++b->generalcnt;
+  }
+}
+
+psync_pattern_set_t *psync_pattern_set_compile(const char *patterns, int caseinsensitive){
+  pattern_builder_t b;
+  psync_pattern_set_t *set;
+  const char *sc, *pt;
+  char *mem;
+  size_t plen, off, pl, nsize, gsize;
+  plen=strlen(patterns);
+  b.nodealloc=64;
+  b.nodes=psync_new_cnt(psync_pattern_node_t, b.nodealloc);
+  memset(b.nodes, 0, sizeof(psync_pattern_node_t)*2);
+  b.nodecnt=2;
+  b.generalalloc=8;
+  b.general=psync_new_cnt(psync_pattern_general_t, b.generalalloc);
+  b.generalcnt=0;
+  off=0;
+  do {
+    sc=(const char *)memchr(patterns+off, ';', plen-off);
+    if (sc)
+      pl=sc-patterns-off;
+    else
+      pl=plen-off;
+    pt=patterns+off;
+    off+=pl+1;
+    while (pl && isspace((unsigned char)*pt)){
+      pt++;
+      pl--;
+    }
+    while (pl && isspace((unsigned char)pt[pl-1]))
+      pl--;
+    if (pl)
+      pattern_add(&b, pt, pl, pt-patterns);
+  } while (sc);
+  nsize=sizeof(psync_pattern_node_t)*b.nodecnt;
+  gsize=sizeof(psync_pattern_general_t)*b.generalcnt;
+  mem=(char *)psync_malloc(sizeof(psync_pattern_set_t)+nsize+gsize+plen+1);
+  set=(psync_pattern_set_t *)mem;
+  set->nodes=(psync_pattern_node_t *)(mem+sizeof(psync_pattern_set_t));
+  set->general=(psync_pattern_general_t *)(mem+sizeof(psync_pattern_set_t)+nsize);
+  set->strings=memcpy(mem+sizeof(psync_pattern_set_t)+nsize+gsize, patterns, plen+1);
+  set->nodecnt=b.nodecnt;
+  set->generalcnt=b.generalcnt;
+  set->caseinsensitive=caseinsensitive;
+  memcpy(set->nodes, b.nodes, nsize);
+  memcpy(set->general, b.general, gsize);
+  psync_free(b.nodes);
+  psync_free(b.general);
+  return set;
+}
+
+static int pattern_match_general(const psync_pattern_set_t *set, uint32_t gen, const char *name){
+  while (gen){
+    gen--;
+    if (psync_match_pattern(name, set->strings+set->general[gen].offset, set->general[gen].len))
+      return 1;
+    gen=set->general[gen].next;
+  }
+  return 0;
+}
+
+static uint32_t pattern_child(const psync_pattern_set_t *set, uint32_t node, unsigned char ch){
+  for (node=set->nodes[node].child; node; node=set->nodes[node].sibling)
+    if (set->nodes[node].ch==ch)
+      return node;
+  return 0;
+}
+
+static int pattern_set_walk(const psync_pattern_set_t *set, const char *name, size_t len){
+  const psync_pattern_node_t *n;
+  uint32_t node;
+  size_t i;
+  node=PATTERN_FORWARD_ROOT;
+  for (i=0; ; i++){
+    n=&set->nodes[node];
+    if ((n->flags&PATTERN_NODE_ANY) || (n->general && pattern_match_general(set, n->general, name)))
+      return 1;
+    if (i==len){
+      if (n->flags&PATTERN_NODE_EXACT)
+        return 1;
+      break;
+    }
+    if (!(node=pattern_child(set, node, (unsigned char)name[i])))
+      break;
+  }
+  node=PATTERN_REVERSE_ROOT;
+  for (i=len; ; i--){
+    n=&set->nodes[node];
+    if ((n->flags&PATTERN_NODE_ANY) || (n->general && pattern_match_general(set, n->general, name)))
+      return 1;
+    if (!i || !(node=pattern_child(set, node, (unsigned char)name[i-1])))
+      break;
+  }
+  return 0;
+}
+
+int psync_pattern_set_match(const psync_pattern_set_t *set, const char *name){
+  char buff[512], *lname;
+  size_t len, i;
+  int ret;
+  len=strlen(name);
+  if (!set->caseinsensitive)
+    return pattern_set_walk(set, name, len);
+  if (len<sizeof(buff))
+    lname=buff;
+  else
+    lname=psync_new_cnt(char, len+1);
+  for (i=0; i<=len; i++)
+    lname[i]=tolower((unsigned char)name[i]);
+  ret=pattern_set_walk(set, lname, len);
+  if (lname!=buff)
+    psync_free(lname);
+  return ret;
+}
+
 uint64_t psync_ato64(const char *str){
   uint64_t n=0;
   while (*str>='0' && *str<='9')
@@ -202,6 +202,17 @@ unsigned char *psync_base32_decode(const unsigned char *str, size_t length, size
 unsigned char *psync_base64_encode(const unsigned char *str, size_t length, size_t *ret_length);
 unsigned char *psync_base64_decode(const unsigned char *str, size_t length, size_t *ret_length);
 
+typedef struct {
+  uint64_t passive; /* number of passive checkpoints */
+  uint64_t truncate; /* number of checkpoints that blocked the database to truncate the WAL */
+  uint64_t deferred; /* times a checkpoint was postponed because the database was busy */
+  uint64_t lastusec;
+  uint64_t maxusec;
+  uint64_t totalusec;
+  uint32_t walpages; /* pages in the WAL after the last commit */
+  uint32_t maxwalpages;
+} psync_sql_checkpoint_stats_t;
+
 int psync_sql_connect(const char *db) PSYNC_NONNULL(1);
 int psync_sql_close();
 int psync_sql_reopen(const char *path);
@@ -215,8 +226,11 @@ void psync_sql_rdunlock();
 int psync_sql_has_waiters();
 int psync_sql_isrdlocked();
 int psync_sql_islocked();
+int psync_sql_iswrlocked();
 int psync_sql_tryupgradelock();
+void psync_sql_upgradelock();
 int psync_sql_sync();
+void psync_sql_get_checkpoint_stats(psync_sql_checkpoint_stats_t *stats);
 int psync_sql_start_transaction();
 int psync_sql_commit_transaction();
 int psync_sql_rollback_transaction();
@@ -262,6 +276,11 @@ void psync_free_after_sec(void *ptr, uint32_t seconds);
 
 int psync_match_pattern(const char *name, const char *pattern, size_t plen);
 
+typedef struct _psync_pattern_set_t psync_pattern_set_t;
+
+psync_pattern_set_t *psync_pattern_set_compile(const char *patterns, int caseinsensitive);
+int psync_pattern_set_match(const psync_pattern_set_t *set, const char *name);
+
 uint64_t psync_ato64(const char *str);
 uint32_t psync_ato32(const char *str);
 
@@ -36,6 +36,7 @@
 #include "pupload.h"
 #include "pfolder.h"
 #include "pcallbacks.h"
+#include "palloc.h"
 #include <string.h>
 
 typedef struct {
@@ -65,6 +66,13 @@ typedef struct {
 
 typedef sync_folderlist sync_folderlist_tuple[2];
 
+typedef struct {
+  psync_arena_t *arena;
+  sync_folderlist **entries;
+  size_t cnt;
+  size_t alloc;
+} sync_folderarray;
+
 static pthread_mutex_t scan_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t scan_cond=PTHREAD_COND_INITIALIZER;
 static uint32_t scan_wakes=0;
@@ -89,6 +97,8 @@ static const uint32_t requiredstatuses[]={
 #define SCAN_LIST_RENFOLDERSTO  8
 
 static psync_list scan_lists[SCAN_LIST_CNT];
+// elements of scan_lists live until the end of the scan, so they are allocated from one arena and freed together
+static psync_arena_t *scan_lists_arena;
 static uint64_t localsleepperfolder;
 static time_t starttime;
 static psync_uint_t changes;
@@ -134,13 +144,33 @@ static void scanner_set_syncs_to_list(psync_list *lst){
   psync_free(syncmp);
 }
 
-static void scanner_local_entry_to_list(void *ptr, psync_pstat *st){
-  psync_list *lst;
+static void folderarray_init(sync_folderarray *arr){
+  arr->arena=psync_arena_create(PSYNC_ARENA_BLOCK_SIZE);
+  arr->entries=NULL;
+  arr->cnt=0;
+  arr->alloc=0;
+}
+
+static void folderarray_free(sync_folderarray *arr){
+  psync_free(arr->entries);
+  psync_arena_destroy(arr->arena);
+}
+
+static sync_folderlist *folderarray_new_entry(sync_folderarray *arr, const char *name, size_t namelen){
   sync_folderlist *e;
-  size_t l;
-  lst=(psync_list *)ptr;
-  l=strlen(st->name)+1;
-  e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+l);
+  if (arr->cnt==arr->alloc){
+    arr->alloc=arr->alloc?arr->alloc*2:64;
+    arr->entries=(sync_folderlist **)psync_realloc(arr->entries, sizeof(sync_folderlist *)*arr->alloc);
+  }
+  e=(sync_folderlist *)psync_arena_alloc(arr->arena, offsetof(sync_folderlist, name)+namelen);
+  memcpy(e->name, name, namelen);
+  arr->entries[arr->cnt++]=e;
+  return e;
+}
+
+static void scanner_local_entry_to_array(void *ptr, psync_pstat *st){
+  sync_folderlist *e;
+  e=folderarray_new_entry((sync_folderarray *)ptr, st->name, strlen(st->name)+1);
   e->localid=0;
   e->remoteid=0;
   e->inode=psync_stat_inode(&st->stat);
@@ -148,29 +178,26 @@ static void scanner_local_entry_to_list(void *ptr, psync_pstat *st){
   e->mtimenat=psync_stat_mtime_native(&st->stat);
   e->size=psync_stat_size(&st->stat);
   e->isfolder=psync_stat_isfolder(&st->stat);
-  memcpy(e->name, st->name, l);
-  psync_list_add_tail(lst, &e->list);
 }
 
-static int scanner_local_folder_to_list(const char *localpath, psync_list *lst){
-  psync_list_init(lst);
-  return psync_list_dir(localpath, scanner_local_entry_to_list, lst);
+static int scanner_local_folder_to_array(const char *localpath, sync_folderarray *arr){
+  folderarray_init(arr);
+  return psync_list_dir(localpath, scanner_local_entry_to_array, arr);
 }
 
-static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t localfolderid, psync_list *lst){
+static void scanner_db_folder_to_array(psync_syncid_t syncid, psync_folderid_t localfolderid, psync_deviceid_t deviceid, sync_folderarray *arr){
   psync_sql_res *res;
   psync_variant_row row;
   sync_folderlist *e;
   const char *name;
   size_t namelen;
-  psync_list_init(lst);
+  folderarray_init(arr);
   res=psync_sql_query_rdlock("SELECT id, folderid, inode, deviceid, mtimenative, name FROM localfolder WHERE localparentfolderid=? AND syncid=? AND mtimenative IS NOT NULL");
   psync_sql_bind_uint(res, 1, localfolderid);
   psync_sql_bind_uint(res, 2, syncid);
   while ((row=psync_sql_fetch_row(res))){
     name=psync_get_lstring(row[5], &namelen);
-    namelen++;
-    e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+namelen);
+    e=folderarray_new_entry(arr, name, namelen+1);
     e->localid=psync_get_number(row[0]);
     e->remoteid=psync_get_number_or_null(row[1]);
     e->inode=psync_get_number(row[2]);
@@ -178,8 +205,6 @@ static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t lo
     e->mtimenat=psync_get_number(row[4]);
     e->size=0;
     e->isfolder=1;
-    memcpy(e->name, name, namelen);
-    psync_list_add_tail(lst, &e->list);
   }
   psync_sql_free_result(res);
   res=psync_sql_query_rdlock("SELECT id, fileid, inode, mtimenative, size, name FROM localfile WHERE localparentfolderid=? AND syncid=?");
@@ -187,30 +212,28 @@ static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t lo
   psync_sql_bind_uint(res, 2, syncid);
   while ((row=psync_sql_fetch_row(res))){
     name=psync_get_lstring(row[5], &namelen);
-    namelen++;
-    e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+namelen);
+    e=folderarray_new_entry(arr, name, namelen+1);
     e->localid=psync_get_number(row[0]);
     e->remoteid=psync_get_number_or_null(row[1]);
     e->inode=psync_get_number(row[2]);
-    e->deviceid=0;
+    // deviceid of files is not stored, they are on the device of the folder
+    e->deviceid=deviceid;
     e->mtimenat=psync_get_number(row[3]);
     e->size=psync_get_number(row[4]);
     e->isfolder=0;
-    memcpy(e->name, name, namelen);
-    psync_list_add_tail(lst, &e->list);
   }
   psync_sql_free_result(res);
 }
 
-static int folderlist_cmp(const psync_list *l1, const psync_list *l2){
-  return psync_filename_cmp(psync_list_element(l1, sync_folderlist, list)->name, psync_list_element(l2, sync_folderlist, list)->name);
+static int folderarray_cmp(const void *p1, const void *p2){
+  return psync_filename_cmp((*(const sync_folderlist **)p1)->name, (*(const sync_folderlist **)p2)->name);
 }
 
 static sync_folderlist *copy_folderlist_element(const sync_folderlist *e, psync_folderid_t folderid, psync_folderid_t localfolderid, psync_syncid_t syncid, psync_synctype_t synctype){
   sync_folderlist *ret;
   size_t l;
   l=offsetof(sync_folderlist, name)+strlen(e->name)+1;
-  ret=(sync_folderlist *)psync_malloc(l);
+  ret=(sync_folderlist *)psync_arena_alloc(scan_lists_arena, l);
   memcpy(ret, e, l);
   ret->localparentfolderid=localfolderid;
   ret->parentfolderid=folderid;
@@ -254,21 +277,24 @@ static void add_modified_file(const sync_folderlist *e, psync_folderid_t folderi
 
 static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid, psync_folderid_t localfolderid,
                                 psync_syncid_t syncid, psync_synctype_t synctype, psync_deviceid_t deviceid){
-  psync_list disklist, dblist, *ldisk, *ldb;
+  sync_folderarray disk, db;
   sync_folderlist *l, *fdisk, *fdb;
   char *subpath;
+  size_t idisk, idb;
   int cmp;
 //  debug(D_NOTICE, "scanning folder %s", localpath);
-  if (unlikely_log(scanner_local_folder_to_list(localpath, &disklist)))
+  if (unlikely_log(scanner_local_folder_to_array(localpath, &disk))){
+    folderarray_free(&disk);
     return;
-  scanner_db_folder_to_list(syncid, localfolderid, &dblist);
-  psync_list_sort(&dblist, folderlist_cmp);
-  psync_list_sort(&disklist, folderlist_cmp);
-  ldisk=disklist.next;
-  ldb=dblist.next;
-  while (ldisk!=&disklist && ldb!=&dblist){
-    fdisk=psync_list_element(ldisk, sync_folderlist, list);
-    fdb=psync_list_element(ldb, sync_folderlist, list);
+  }
+  scanner_db_folder_to_array(syncid, localfolderid, deviceid, &db);
+  qsort(db.entries, db.cnt, sizeof(sync_folderlist *), folderarray_cmp);
+  qsort(disk.entries, disk.cnt, sizeof(sync_folderlist *), folderarray_cmp);
+  idisk=0;
+  idb=0;
+  while (idisk<disk.cnt && idb<db.cnt){
+    fdisk=disk.entries[idisk];
+    fdb=db.entries[idb];
     cmp=psync_filename_cmp(fdisk->name, fdb->name);
     if (cmp==0){
       if (fdisk->isfolder==fdb->isfolder){
@@ -295,29 +321,23 @@ static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid
         add_deleted_element(fdb, folderid, localfolderid, syncid, synctype);
         add_new_element(fdisk, folderid, localfolderid, syncid, synctype);
       }
-      ldisk=ldisk->next;
-      ldb=ldb->next;
+      idisk++;
+      idb++;
     }
     else if (cmp<0){ // new element on disk
       add_new_element(fdisk, folderid, localfolderid, syncid, synctype);
-      ldisk=ldisk->next;
+      idisk++;
     }
     else { // deleted element from disk
       add_deleted_element(fdb, folderid, localfolderid, syncid, synctype);
-      ldb=ldb->next;
+      idb++;
     }
   }
-  while (ldisk!=&disklist){
-    fdisk=psync_list_element(ldisk, sync_folderlist, list);
-    add_new_element(fdisk, folderid, localfolderid, syncid, synctype);
-    ldisk=ldisk->next;
-  }
-  while (ldb!=&dblist){
-    fdb=psync_list_element(ldb, sync_folderlist, list);
-    add_deleted_element(fdb, folderid, localfolderid, syncid, synctype);
-    ldb=ldb->next;
-  }
-  psync_list_for_each_element_call(&dblist, sync_folderlist, list, psync_free);
+  for (; idisk<disk.cnt; idisk++)
+    add_new_element(disk.entries[idisk], folderid, localfolderid, syncid, synctype);
+  for (; idb<db.cnt; idb++)
+    add_deleted_element(db.entries[idb], folderid, localfolderid, syncid, synctype);
+  folderarray_free(&db);
   if (localsleepperfolder){
     psync_milisleep(localsleepperfolder);
     if (psync_current_time-starttime>=PSYNC_LOCALSCAN_SLEEPSEC_PER_SCAN*2 && localsleepperfolder>=2)
@@ -325,51 +345,73 @@ static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid
   }
   else
     psync_yield_cpu();
-  psync_list_for_each_element(l, &disklist, sync_folderlist, list)
+  for (idisk=0; idisk<disk.cnt; idisk++){
+    l=disk.entries[idisk];
     if (l->isfolder && l->localid){
       subpath=psync_strcat(localpath, PSYNC_DIRECTORY_SEPARATOR, l->name, NULL);
       scanner_scan_folder(subpath, l->remoteid, l->localid, syncid, synctype, l->deviceid);
       psync_free(subpath);
     }
-  psync_list_for_each_element_call(&disklist, sync_folderlist, list, psync_free);
-}
-
-static int compare_sizeinodemtime(const psync_list *l1, const psync_list *l2){
-  const sync_folderlist *f1, *f2;
-  int64_t d;
-  f1=psync_list_element(l1, sync_folderlist, list);
-  f2=psync_list_element(l2, sync_folderlist, list);
-  d=f1->size-f2->size;
-  if (d<0)
-    return -1;
-  else if (d>0)
-    return 1;
-  d=f1->inode-f2->inode;
-  if (d<0)
-    return -1;
-  else if (d>0)
-    return 1;
-  d=f1->mtimenat-f2->mtimenat;
-  if (d<0)
-    return -1;
-  else if (d>0)
-    return 1;
-  else
-    return 0;
-}
-
-static int compare_inode(const psync_list *l1, const psync_list *l2){
-  const sync_folderlist *f1, *f2;
-  int64_t d;
-  f1=psync_list_element(l1, sync_folderlist, list);
-  f2=psync_list_element(l2, sync_folderlist, list);
-  d=f1->inode-f2->inode;
-  if (d<0)
-    return -1;
-  else if (d>0)
-    return 1;
-  else
-    return 0;
+  }
+  folderarray_free(&disk);
+}
+
+static uint64_t rename_hash(const sync_folderlist *e, int isfolder){
+  uint64_t h;
+  h=(uint64_t)e->inode*0x9E3779B97F4A7C15ULL;
+  h^=((uint64_t)e->deviceid+(h<<6)+(h>>2));
+  if (!isfolder){
+    h^=(e->size+0x9E3779B97F4A7C15ULL+(h<<6)+(h>>2));
+    h^=(e->mtimenat+0x9E3779B97F4A7C15ULL+(h<<6)+(h>>2));
+  }
+  return h^(h>>29);
+}
+
+static int is_renamed_entry(const sync_folderlist *fr, const sync_folderlist *to, int isfolder){
+  return fr->inode==to->inode && fr->deviceid==to->deviceid && (isfolder || (fr->size==to->size && fr->mtimenat==to->mtimenat));
+}
+
+/* Moves pairs of deleted and new elements with the same (inode, deviceid) for folders or (inode, deviceid, size, mtime)
+ * for files to renfrom/rento. Deleted elements are put in an open addressing hash table, matched ones are replaced with
+ * a tombstone, so that repeating keys are paired in the order they were found. */
+static void extract_renames(psync_list *deleted, psync_list *created, psync_list *renfrom, psync_list *rento, int isfolder){
+  static sync_folderlist tombstone;
+  sync_folderlist **table, *fr, *to;
+  psync_list *l1, *l2;
+  size_t cnt, mask, i;
+  if (psync_list_isempty(deleted) || psync_list_isempty(created))
+    return;
+  cnt=0;
+  psync_list_for_each(l1, deleted)
+    cnt++;
+  mask=16;
+  while (mask<cnt*2)
+    mask*=2;
+  table=psync_new_cnt(sync_folderlist *, mask);
+  memset(table, 0, sizeof(sync_folderlist *)*mask);
+  mask--;
+  psync_list_for_each_element(fr, deleted, sync_folderlist, list){
+    i=rename_hash(fr, isfolder)&mask;
+    while (table[i])
+      i=(i+1)&mask;
+    table[i]=fr;
+  }
+  psync_list_for_each_safe(l1, l2, created){
+    to=psync_list_element(l1, sync_folderlist, list);
+    i=rename_hash(to, isfolder)&mask;
+    while ((fr=table[i])){
+      if (fr!=&tombstone && is_renamed_entry(fr, to, isfolder)){
+        table[i]=&tombstone;
+        psync_list_del(&fr->list);
+        psync_list_add_tail(renfrom, &fr->list);
+        psync_list_del(&to->list);
+        psync_list_add_tail(rento, &to->list);
+        break;
+      }
+      i=(i+1)&mask;
+    }
+  }
+  psync_free(table);
 }
 
 static void scan_rename_file(sync_folderlist *rnfr, sync_folderlist *rnto){
@@ -412,7 +454,8 @@ static void scan_upload_modified_file(sync_folderlist *fl){
   psync_sql_res *res;
   debug(D_NOTICE, "file modified %s (%lu)", fl->name, (unsigned long)fl->localid);
   psync_delete_upload_tasks_for_file(fl->localid);
-  res=psync_sql_prep_statement("UPDATE localfile SET size=?, inode=?, mtime=?, mtimenative=? WHERE id=?");
+  // the old checksum no longer describes the content, keep the file out of duplicate lookups until it is rehashed
+  res=psync_sql_prep_statement("UPDATE localfile SET size=?, inode=?, mtime=?, mtimenative=?, checksum=NULL WHERE id=?");
   psync_sql_bind_uint(res, 1, fl->size);
   psync_sql_bind_uint(res, 2, fl->inode);
   psync_sql_bind_uint(res, 3, psync_mtime_native_to_mtime(fl->mtimenat));
@@ -636,6 +679,7 @@ restart:
     return;
   for (i=0; i<SCAN_LIST_CNT; i++)
     psync_list_init(&scan_lists[i]);
+  scan_lists_arena=psync_arena_create(PSYNC_ARENA_BLOCK_SIZE);
   scanner_set_syncs_to_list(&slist);
   changes=0;
   psync_list_for_each_element(l, &slist, sync_list, list)
@@ -646,8 +690,7 @@ restart:
     pthread_mutex_lock(&scan_mutex);
     if (unlikely(restart_scan)){
       pthread_mutex_unlock(&scan_mutex);
-      for (i=0; i<SCAN_LIST_CNT; i++)
-        psync_list_for_each_element_call(&scan_lists[i], sync_folderlist, list, psync_free);
+      psync_arena_destroy(scan_lists_arena);
       psync_milisleep(restartsleep);
       if (restartsleep<16000)
         restartsleep*=2;
@@ -656,11 +699,11 @@ restart:
     pthread_mutex_unlock(&scan_mutex);
     debug(D_NOTICE, "run checks");
     i=0;
-    psync_list_extract_repeating(&scan_lists[SCAN_LIST_DELFOLDERS],
-                                &scan_lists[SCAN_LIST_NEWFOLDERS],
-                                &scan_lists[SCAN_LIST_RENFOLDERSROM],
-                                &scan_lists[SCAN_LIST_RENFOLDERSTO],
-                                compare_inode);
+    extract_renames(&scan_lists[SCAN_LIST_DELFOLDERS],
+                    &scan_lists[SCAN_LIST_NEWFOLDERS],
+                    &scan_lists[SCAN_LIST_RENFOLDERSROM],
+                    &scan_lists[SCAN_LIST_RENFOLDERSTO],
+                    1);
     trn=0;
     if (!psync_list_isempty(&scan_lists[SCAN_LIST_RENFOLDERSROM]) || !psync_list_isempty(&scan_lists[SCAN_LIST_NEWFOLDERS])){
       psync_sql_start_transaction();
@@ -672,9 +715,7 @@ restart:
         w++;
         check_for_query_cnt();
       }
-      psync_list_for_each_element_call(&scan_lists[SCAN_LIST_RENFOLDERSROM], sync_folderlist, list, psync_free);
       psync_list_init(&scan_lists[SCAN_LIST_RENFOLDERSROM]);
-      psync_list_for_each_element_call(&scan_lists[SCAN_LIST_RENFOLDERSTO], sync_folderlist, list, psync_free);
       psync_list_init(&scan_lists[SCAN_LIST_RENFOLDERSTO]);
       psync_list_for_each_element(fl, &scan_lists[SCAN_LIST_NEWFOLDERS], sync_folderlist, list){
         scan_create_folder(fl);
@@ -689,7 +730,6 @@ restart:
         psync_list_add_tail(&newtmp, l1);
       }
       psync_list_for_each_element_call(&newtmp, sync_folderlist, list, scan_created_folder);
-      psync_list_for_each_element_call(&newtmp, sync_folderlist, list, psync_free);
     }
     if (changes){
       i++;
@@ -699,19 +739,18 @@ restart:
   pthread_mutex_lock(&scan_mutex);
   if (unlikely(restart_scan)){
     pthread_mutex_unlock(&scan_mutex);
-    for (i=0; i<SCAN_LIST_CNT; i++)
-      psync_list_for_each_element_call(&scan_lists[i], sync_folderlist, list, psync_free);
+    psync_arena_destroy(scan_lists_arena);
     psync_milisleep(restartsleep);
     if (restartsleep<16000)
       restartsleep*=2;
     goto restart;
   }
   pthread_mutex_unlock(&scan_mutex);
-  psync_list_extract_repeating(&scan_lists[SCAN_LIST_DELFILES],
-                               &scan_lists[SCAN_LIST_NEWFILES],
-                               &scan_lists[SCAN_LIST_RENFILESFROM],
-                               &scan_lists[SCAN_LIST_RENFILESTO],
-                               compare_sizeinodemtime);
+  extract_renames(&scan_lists[SCAN_LIST_DELFILES],
+                  &scan_lists[SCAN_LIST_NEWFILES],
+                  &scan_lists[SCAN_LIST_RENFILESFROM],
+                  &scan_lists[SCAN_LIST_RENFILESTO],
+                  0);
   l2=&scan_lists[SCAN_LIST_RENFILESTO];
   trn=0;
   psync_sql_start_transaction();
@@ -746,8 +785,7 @@ restart:
     psync_wake_upload();
     psync_status_recalc_to_upload_async();
   }
-  for (i=0; i<SCAN_LIST_CNT; i++)
-    psync_list_for_each_element_call(&scan_lists[i], sync_folderlist, list, psync_free);
+  psync_arena_destroy(scan_lists_arena);
 }
 
 static int scanner_wait(){
@@ -313,6 +313,22 @@ int psync_rwlock_towrlock(psync_rwlock_t *rw){
   return 0;
 }
 
+/* unlike psync_rwlock_towrlock() never fails, if another thread is already upgrading the read lock is released before
+ * the write lock is taken, so other writers may run in between */
+void psync_rwlock_rdtowrlock(psync_rwlock_t *rw){
+  psync_rwlock_lockcnt_t cnt;
+  uint_halfptr_t rcnt;
+  if (!psync_rwlock_towrlock(rw))
+    return;
+  cnt=psync_rwlock_get_count(rw);
+  rcnt=cnt.cnt[0];
+  assert(rcnt && !cnt.cnt[1]);
+  psync_rwlock_set_count(rw, psync_rwlock_create_cnt(1, 0));
+  psync_rwlock_unlock(rw);
+  psync_rwlock_wrlock(rw);
+  psync_rwlock_set_count(rw, psync_rwlock_create_cnt(0, rcnt));
+}
+
 void psync_rwlock_unlock(psync_rwlock_t *rw){
   if (psync_rwlock_check_recursive_out(rw))
     return;
@@ -367,6 +383,12 @@ int psync_rwlock_holding_rdlock(psync_rwlock_t *rw){
   return psync_rwlock_get_count(rw).cnt[0]!=0;
 }
 
+int psync_rwlock_holding_wrlock(psync_rwlock_t *rw){
+  psync_rwlock_lockcnt_t cnt;
+  cnt=psync_rwlock_get_count(rw);
+  return cnt.cnt[1]!=0 && cnt.cnt[1]!=PSYNC_WR_RESERVED;
+}
+
 int psync_rwlock_holding_lock(psync_rwlock_t *rw){
   psync_rwlock_lockcnt_t cnt;
   cnt=psync_rwlock_get_count(rw);
@@ -53,10 +53,12 @@ int psync_rwlock_trywrlock(psync_rwlock_t *rw);
 int psync_rwlock_timedwrlock(psync_rwlock_t *rw, const struct timespec *abstime);
 void psync_rwlock_rslock(psync_rwlock_t *rw);
 int psync_rwlock_towrlock(psync_rwlock_t *rw);
+void psync_rwlock_rdtowrlock(psync_rwlock_t *rw);
 void psync_rwlock_unlock(psync_rwlock_t *rw);
 unsigned psync_rwlock_num_waiters(psync_rwlock_t *rw);
 int psync_rwlock_holding_rdlock(psync_rwlock_t *rw);
 int psync_rwlock_holding_lock(psync_rwlock_t *rw);
+int psync_rwlock_holding_wrlock(psync_rwlock_t *rw);
 
 
 #endif
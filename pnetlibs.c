@@ -28,7 +28,6 @@
 #define __STDC_FORMAT_MACROS
 #include <stdio.h>
 #include <ctype.h>
-#include <semaphore.h>
 #include "pnetlibs.h"
 #include "pssl.h"
 #include "psettings.h"
@@ -38,6 +37,7 @@
 #include "papi.h"
 #include "pcache.h"
 #include "ptree.h"
+#include "pshaper.h"
 
 #define API_CACHE_KEY "ApiConn"
 
@@ -46,19 +46,6 @@ struct time_bytes {
   psync_uint_t bytes;
 };
 
-typedef struct {
-  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
-  uint32_t adler;
-} psync_block_checksum;
-
-typedef struct {
-  uint64_t filesize;
-  uint32_t blocksize;
-  uint32_t blockcnt;
-  uint32_t *next;
-  psync_block_checksum blocks[];
-} psync_file_checksums;
-
 typedef struct {
   psync_uint_t elementcnt;
   uint32_t elements[];
@@ -87,39 +74,128 @@ static psync_uint_t upload_bytes_this_sec=0;
 static psync_uint_t upload_bytes_off=0;
 static psync_uint_t upload_speed=0;
 static psync_uint_t dyn_upload_speed=PSYNC_UPL_AUTO_SHAPER_INITIAL;
+static time_t dyn_upload_inc_sec=0;
 
 static psync_list file_lock_list=PSYNC_LIST_STATIC_INIT(file_lock_list);
 static pthread_mutex_t file_lock_mutex=PTHREAD_MUTEX_INITIALIZER;
 
 static struct time_bytes download_bytes_sec[PSYNC_SPEED_CALC_AVERAGE_SEC], upload_bytes_sec[PSYNC_SPEED_CALC_AVERAGE_SEC];
 
-static sem_t api_pool_sem;
+static pthread_mutex_t api_pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t api_pool_cond=PTHREAD_COND_INITIALIZER;
+static uint32_t api_pool_open=0;
+static uint32_t api_pool_idle=0;
+static uint32_t api_pool_maxactive=PSYNC_APIPOOL_MAXACTIVE;
+static uint32_t api_pool_maxidle=PSYNC_APIPOOL_MAXIDLE;
+static psync_apipool_stats_t api_pool_stats;
+static uint64_t api_pool_lastslowwaits=0;
+static uint64_t api_pool_lastcreates=0;
+static uint64_t api_pool_lastfailures=0;
+static uint32_t api_pool_windowhighwater=0;
+
+static uint64_t api_pool_millitime(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000+tm.tv_nsec/1000000;
+}
+
+static void api_pool_update_highwater_locked(){
+  uint32_t inuse;
+  inuse=api_pool_open-api_pool_idle;
+  if (inuse>api_pool_stats.inusehighwater)
+    api_pool_stats.inusehighwater=inuse;
+  if (inuse>api_pool_windowhighwater)
+    api_pool_windowhighwater=inuse;
+}
+
+static void api_pool_account_wait_locked(uint64_t ms){
+  uint64_t lim;
+  uint32_t i;
+  api_pool_stats.waitms+=ms;
+  for (i=0, lim=1; i<PSYNC_APIPOOL_WAIT_BUCKETS-1 && ms>=lim; i++)
+    lim*=10;
+  api_pool_stats.waithist[i]++;
+}
 
 static psync_socket *psync_get_api(){
-  sem_wait(&api_pool_sem);
-  return psync_api_connect(psync_setting_get_bool(_PS(usessl)));
+  psync_socket *ret;
+  uint64_t start;
+  pthread_mutex_lock(&api_pool_mutex);
+  if (api_pool_open>=api_pool_maxactive){
+    api_pool_stats.waits++;
+    start=api_pool_millitime();
+    do {
+      pthread_cond_wait(&api_pool_cond, &api_pool_mutex);
+    } while (api_pool_open>=api_pool_maxactive);
+    api_pool_account_wait_locked(api_pool_millitime()-start);
+  }
+  else
+    api_pool_account_wait_locked(0);
+  api_pool_open++;
+  api_pool_stats.creates++;
+  api_pool_update_highwater_locked();
+  pthread_mutex_unlock(&api_pool_mutex);
+  ret=psync_api_connect(psync_setting_get_bool(_PS(usessl)));
+  if (unlikely(!ret)){
+    pthread_mutex_lock(&api_pool_mutex);
+    api_pool_open--;
+    api_pool_stats.createfailures++;
+    pthread_cond_signal(&api_pool_cond);
+    pthread_mutex_unlock(&api_pool_mutex);
+  }
+  return ret;
 }
 
 static void psync_ret_api(void *ptr){
-  sem_post(&api_pool_sem);
+  pthread_mutex_lock(&api_pool_mutex);
+  api_pool_open--;
+  pthread_cond_signal(&api_pool_cond);
+  pthread_mutex_unlock(&api_pool_mutex);
   debug(D_NOTICE, "closing connection to api");
   psync_socket_close((psync_socket *)ptr);
   debug(D_NOTICE, "closed connection to api");
 }
 
+static void psync_ret_idle_api(void *ptr){
+  pthread_mutex_lock(&api_pool_mutex);
+  api_pool_idle--;
+  pthread_mutex_unlock(&api_pool_mutex);
+  psync_ret_api(ptr);
+}
+
+static psync_socket *psync_apipool_get_cached(){
+  psync_socket *ret;
+  ret=(psync_socket *)psync_cache_get(API_CACHE_KEY);
+  if (ret){
+    pthread_mutex_lock(&api_pool_mutex);
+    api_pool_idle--;
+    pthread_mutex_unlock(&api_pool_mutex);
+  }
+  return ret;
+}
+
 psync_socket *psync_apipool_get(){
   psync_socket *ret;
   while (1){
-    ret=(psync_socket *)psync_cache_get(API_CACHE_KEY);
+    ret=psync_apipool_get_cached();
     if (!ret)
       break;
     if (unlikely_log(psync_socket_is_broken(ret->sock) || psync_socket_isssl(ret)!=psync_setting_get_bool(_PS(usessl))))
       psync_ret_api(ret);
     else{
       debug(D_NOTICE, "got api connection from cache");
+      pthread_mutex_lock(&api_pool_mutex);
+      api_pool_stats.gets++;
+      api_pool_stats.hits++;
+      api_pool_update_highwater_locked();
+      pthread_mutex_unlock(&api_pool_mutex);
       return ret;
     }
   }
+  pthread_mutex_lock(&api_pool_mutex);
+  api_pool_stats.gets++;
+  api_pool_stats.misses++;
+  pthread_mutex_unlock(&api_pool_mutex);
   ret=psync_get_api();
   if (unlikely_log(!ret))
     psync_timer_notify_exception();
@@ -129,7 +205,7 @@ psync_socket *psync_apipool_get(){
 psync_socket *psync_apipool_get_from_cache(){
   psync_socket *ret;
   while (1){
-    ret=(psync_socket *)psync_cache_get(API_CACHE_KEY);
+    ret=psync_apipool_get_cached();
     if (!ret)
       break;
     if (unlikely_log(psync_socket_is_broken(ret->sock) || psync_socket_isssl(ret)!=psync_setting_get_bool(_PS(usessl))))
@@ -238,13 +314,79 @@ void psync_apipool_release(psync_socket *api){
     return;
   }
 #endif
-  psync_cache_add(API_CACHE_KEY, api, PSYNC_APIPOOL_MAXIDLESEC, psync_ret_api, PSYNC_APIPOOL_MAXIDLE);
+  if (unlikely(api->cork) && unlikely_log(psync_socket_uncork(api))){
+    psync_apipool_release_bad(api);
+    return;
+  }
+  pthread_mutex_lock(&api_pool_mutex);
+  api_pool_idle++;
+  pthread_mutex_unlock(&api_pool_mutex);
+  psync_cache_add(API_CACHE_KEY, api, PSYNC_APIPOOL_MAXIDLESEC, psync_ret_idle_api, api_pool_maxidle);
 }
 
 void psync_apipool_release_bad(psync_socket *api){
+  pthread_mutex_lock(&api_pool_mutex);
+  api_pool_stats.badreleases++;
+  pthread_mutex_unlock(&api_pool_mutex);
   psync_ret_api(api);
 }
 
+void psync_apipool_get_stats(psync_apipool_stats_t *stats){
+  pthread_mutex_lock(&api_pool_mutex);
+  memcpy(stats, &api_pool_stats, sizeof(psync_apipool_stats_t));
+  stats->open=api_pool_open;
+  stats->idle=api_pool_idle;
+  stats->maxactive=api_pool_maxactive;
+  stats->maxidle=api_pool_maxidle;
+  pthread_mutex_unlock(&api_pool_mutex);
+}
+
+/* Grows the pool when callers had to wait long for a connection and the server accepts new ones, shrinks it when
+ * creating connections fails often and slowly returns it to the default size when it is not used.
+ */
+static void psync_apipool_adapt(psync_timer_t timer, void *ptr){
+  uint64_t slowwaits, creates, failures;
+  uint32_t i, newmax;
+  pthread_mutex_lock(&api_pool_mutex);
+  slowwaits=0;
+  for (i=PSYNC_APIPOOL_SLOW_WAIT_BUCKET; i<PSYNC_APIPOOL_WAIT_BUCKETS; i++)
+    slowwaits+=api_pool_stats.waithist[i];
+  creates=api_pool_stats.creates-api_pool_lastcreates;
+  failures=api_pool_stats.createfailures-api_pool_lastfailures;
+  newmax=api_pool_maxactive;
+  if (failures*4>creates && failures>=PSYNC_APIPOOL_ADAPT_STEP){
+    if (newmax>PSYNC_APIPOOL_MINACTIVE+PSYNC_APIPOOL_ADAPT_STEP)
+      newmax-=PSYNC_APIPOOL_ADAPT_STEP;
+    else
+      newmax=PSYNC_APIPOOL_MINACTIVE;
+  }
+  else if (slowwaits>api_pool_lastslowwaits){
+    if (newmax+PSYNC_APIPOOL_ADAPT_STEP<PSYNC_APIPOOL_MAXACTIVE_LIMIT)
+      newmax+=PSYNC_APIPOOL_ADAPT_STEP;
+    else
+      newmax=PSYNC_APIPOOL_MAXACTIVE_LIMIT;
+  }
+  else if (api_pool_windowhighwater<newmax/2){
+    if (newmax>PSYNC_APIPOOL_MAXACTIVE)
+      newmax--;
+    else if (newmax<PSYNC_APIPOOL_MAXACTIVE)
+      newmax++;
+  }
+  if (newmax!=api_pool_maxactive){
+    debug(D_NOTICE, "changing api pool size from %u to %u, %lu slow waits, %lu of %lu connects failed",
+          (unsigned)api_pool_maxactive, (unsigned)newmax, (unsigned long)(slowwaits-api_pool_lastslowwaits),
+          (unsigned long)failures, (unsigned long)creates);
+    api_pool_maxactive=newmax;
+    api_pool_maxidle=newmax*PSYNC_APIPOOL_MAXIDLE/PSYNC_APIPOOL_MAXACTIVE;
+    pthread_cond_broadcast(&api_pool_cond);
+  }
+  api_pool_lastslowwaits=slowwaits;
+  api_pool_lastcreates=api_pool_stats.creates;
+  api_pool_lastfailures=api_pool_stats.createfailures;
+  api_pool_windowhighwater=api_pool_open-api_pool_idle;
+  pthread_mutex_unlock(&api_pool_mutex);
+}
+
 static void rm_all(void *vpath, psync_pstat *st){
   char *path;
   path=psync_strcat((char *)vpath, PSYNC_DIRECTORY_SEPARATOR, st->name, NULL);
@@ -555,6 +697,29 @@ err0:
   return PSYNC_NET_PERMFAIL;
 }
 
+/* The checksum of a local file is trusted as long as size, inode and mtime are the ones recorded with it, the same
+ * test the local scanner uses to detect modifications. That allows cloning without reading the source. */
+int psync_clone_local_file_if_unchanged(const char *source, const char *destination, uint64_t fsize, uint64_t inode, uint64_t mtimenative){
+  psync_stat_t st;
+  char *tmpdest;
+  if (psync_stat(source, &st) || psync_stat_size(&st)!=fsize || psync_stat_inode(&st)!=inode || psync_stat_mtime_native(&st)!=mtimenative)
+    return PSYNC_NET_PERMFAIL;
+  tmpdest=psync_strcat(destination, PSYNC_APPEND_PARTIAL_FILES, NULL);
+  if (psync_file_clone(source, tmpdest, fsize)){
+    psync_free(tmpdest);
+    return PSYNC_NET_PERMFAIL;
+  }
+  // the source could have been modified while cloning
+  if (unlikely_log(psync_stat(source, &st) || psync_stat_size(&st)!=fsize || psync_stat_mtime_native(&st)!=mtimenative) ||
+      unlikely_log(psync_file_rename_overwrite(tmpdest, destination))){
+    psync_file_delete(tmpdest);
+    psync_free(tmpdest);
+    return PSYNC_NET_PERMFAIL;
+  }
+  psync_free(tmpdest);
+  return PSYNC_NET_OK;
+}
+
 psync_socket *psync_socket_connect_download(const char *host, int unsigned port, int usessl){
   psync_socket *sock;
   int64_t dwlspeed;
@@ -613,16 +778,9 @@ static void account_downloaded_bytes(int unsigned bytes){
   }
 }
 
-static psync_uint_t get_download_bytes_this_sec(){
-  if (current_download_sec==psync_current_time)
-    return download_bytes_this_sec;
-  else
-    return 0;
-}
-
 static int psync_socket_readall_download_th(psync_socket *sock, void *buff, int num, int th){
   psync_int_t dwlspeed, readbytes, pending, lpending, rd, rrd;
-  psync_uint_t thissec, ds;
+  psync_uint_t ds;
   dwlspeed=psync_setting_get_int(_PS(maxdownloadspeed));
   if (dwlspeed==0){
     if (th)
@@ -648,20 +806,19 @@ static int psync_socket_readall_download_th(psync_socket *sock, void *buff, int
       sock->pending=1;
   }
   else if (dwlspeed>0){
+    psync_shaper_set_rate(&psync_shaper_download, dwlspeed);
     readbytes=0;
     while (num){
-      while ((thissec=get_download_bytes_this_sec())>=dwlspeed)
-        psync_timer_wait_next_sec();
-      if (num>dwlspeed-thissec)
-        rrd=dwlspeed-thissec;
-      else
-        rrd=num;
+      rrd=psync_shaper_consume(&psync_shaper_download, num);
       if (th)
         rd=psync_socket_read_thread(sock, buff, rrd);
       else
         rd=psync_socket_read(sock, buff, rrd);
-      if (rd<=0)
+      if (rd<=0){
+        psync_shaper_refund(&psync_shaper_download, rrd);
         return readbytes?readbytes:rd;
+      }
+      psync_shaper_refund(&psync_shaper_download, rrd-rd);
       num-=rd;
       buff=(char *)buff+rd;
       readbytes+=rd;
@@ -706,13 +863,6 @@ static void account_uploaded_bytes(int unsigned bytes){
   }
 }
 
-static psync_uint_t get_upload_bytes_this_sec(){
-  if (current_upload_sec==psync_current_time)
-    return upload_bytes_this_sec;
-  else
-    return 0;
-}
-
 //static void set_send_buf(psync_socket *sock){
 //  psync_socket_set_sendbuf(sock, dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_BUF_PER/100);
 //}
@@ -724,31 +874,34 @@ int psync_set_default_sendbuf(psync_socket *sock){
 
 int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num){
   psync_int_t uplspeed, writebytes, wr, wwr;
-  psync_uint_t thissec;
   uplspeed=psync_setting_get_int(_PS(maxuploadspeed));
   if (uplspeed==0){
     writebytes=0;
+    psync_shaper_set_rate(&psync_shaper_upload, dyn_upload_speed);
     while (num){
-      while ((thissec=get_upload_bytes_this_sec())>=dyn_upload_speed){
+      // the bucket running empty means the link took everything we allowed, so allow more (at most once a second)
+      if (dyn_upload_inc_sec!=psync_current_time && psync_shaper_is_empty(&psync_shaper_upload)){
+        dyn_upload_inc_sec=psync_current_time;
         dyn_upload_speed=(dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_INC_PER)/100;
-//        set_send_buf(sock);
-        psync_timer_wait_next_sec();
+        psync_shaper_set_rate(&psync_shaper_upload, dyn_upload_speed);
+        debug(D_NOTICE, "dyn_upload_speed=%lu", dyn_upload_speed);
       }
-      debug(D_NOTICE, "dyn_upload_speed=%lu", dyn_upload_speed);
-      if (num>dyn_upload_speed-thissec)
-        wwr=dyn_upload_speed-thissec;
-      else
-        wwr=num;
       if (!psync_socket_writable(sock)){
         dyn_upload_speed=(dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_DEC_PER)/100;
         if (dyn_upload_speed<PSYNC_UPL_AUTO_SHAPER_MIN)
           dyn_upload_speed=PSYNC_UPL_AUTO_SHAPER_MIN;
+        psync_shaper_set_rate(&psync_shaper_upload, dyn_upload_speed);
+        debug(D_NOTICE, "dyn_upload_speed=%lu", dyn_upload_speed);
 //        set_send_buf(sock);
         psync_milisleep(1000);
       }
+      wwr=psync_shaper_consume(&psync_shaper_upload, num);
       wr=psync_socket_write(sock, buff, wwr);
-      if (wr==-1)
+      if (wr==-1){
+        psync_shaper_refund(&psync_shaper_upload, wwr);
         return writebytes?writebytes:wr;
+      }
+      psync_shaper_refund(&psync_shaper_upload, wwr-wr);
       num-=wr;
       buff=(char *)buff+wr;
       writebytes+=wr;
@@ -757,17 +910,16 @@ int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num){
     return writebytes;
   }
   else if (uplspeed>0){
+    psync_shaper_set_rate(&psync_shaper_upload, uplspeed);
     writebytes=0;
     while (num){
-      while ((thissec=get_upload_bytes_this_sec())>=uplspeed)
-        psync_timer_wait_next_sec();
-      if (num>uplspeed-thissec)
-        wwr=uplspeed-thissec;
-      else
-        wwr=num;
+      wwr=psync_shaper_consume(&psync_shaper_upload, num);
       wr=psync_socket_write(sock, buff, wwr);
-      if (wr==-1)
+      if (wr==-1){
+        psync_shaper_refund(&psync_shaper_upload, wwr);
         return writebytes?writebytes:wr;
+      }
+      psync_shaper_refund(&psync_shaper_upload, wwr-wr);
       num-=wr;
       buff=(char *)buff+wr;
       writebytes+=wr;
@@ -781,6 +933,31 @@ int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num){
   return writebytes;
 }
 
+/* content hosts returned by the API may carry an explicit port as host:port, e.g. when talking to a local server */
+static psync_socket *psync_http_host_connect(const char *host, int usessl, int download){
+  const char *c;
+  char *h;
+  psync_socket *sock;
+  unsigned port;
+  c=strchr(host, ':');
+  if (!c || strchr(c+1, ':')){
+    if (download)
+      return psync_socket_connect_download(host, usessl?443:80, usessl);
+    else
+      return psync_socket_connect(host, usessl?443:80, usessl);
+  }
+  port=atoi(c+1);
+  h=psync_new_cnt(char, c-host+1);
+  memcpy(h, host, c-host);
+  h[c-host]=0;
+  if (download)
+    sock=psync_socket_connect_download(h, port, usessl);
+  else
+    sock=psync_socket_connect(h, port, usessl);
+  psync_free(h);
+  return sock;
+}
+
 psync_http_socket *psync_http_connect(const char *host, const char *path, uint64_t from, uint64_t to){
   psync_socket *sock;
   psync_http_socket *hsock;
@@ -795,7 +972,7 @@ psync_http_socket *psync_http_connect(const char *host, const char *path, uint64
   cachekey[sizeof(cachekey)-1]=0;
   sock=(psync_socket *)psync_cache_get(cachekey);
   if (!sock){
-    sock=psync_socket_connect_download(host, usessl?443:80, usessl);
+    sock=psync_http_host_connect(host, usessl, 1);
     if (!sock)
       goto err0;
   }
@@ -970,7 +1147,7 @@ static void connect_cache_thread(void *ptr){
   connect_cache_tree_node_t *node;
   psync_socket *sock;
   node=(connect_cache_tree_node_t *)ptr;
-  sock=psync_socket_connect(node->host, node->usessl?443:80, node->usessl);
+  sock=psync_http_host_connect(node->host, node->usessl, 0);
   pthread_mutex_lock(&connect_cache_mutex);
   psync_tree_del(&connect_cache_tree, &node->tree);
   if (node->haswaiter){
@@ -1165,7 +1342,7 @@ psync_http_socket *psync_http_connect_multihost(const binresult *hosts, const ch
       }
     if (!sock){
       for (i=0; i<hosts->length; i++){
-        sock=psync_socket_connect(hosts->array[i]->str, usessl?443:80, usessl);
+        sock=psync_http_host_connect(hosts->array[i]->str, usessl, 0);
         if (sock){
           cl=snprintf(cachekey, sizeof(cachekey)-1, "HT%d-%s", usessl, hosts->array[i]->str)+1;
           cachekey[sizeof(cachekey)-1]=0;
@@ -1468,6 +1645,10 @@ err0:
   return PSYNC_NET_TEMPFAIL;
 }
 
+int psync_net_download_checksums(psync_fileid_t fileid, uint64_t hash, psync_file_checksums **checksums){
+  return psync_net_get_checksums(NULL, fileid, hash, checksums);
+}
+
 static int psync_net_get_upload_checksums(psync_socket *api, psync_uploadid_t uploadid, psync_file_checksums **checksums){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadid", uploadid)};
   binresult *res;
@@ -2270,5 +2451,5 @@ static void psync_netlibs_timer(psync_timer_t timer, void *ptr){
 
 void psync_netlibs_init(){
   psync_timer_register(psync_netlibs_timer, 1, NULL);
-  sem_init(&api_pool_sem, 0, PSYNC_APIPOOL_MAXACTIVE);
+  psync_timer_register(psync_apipool_adapt, PSYNC_APIPOOL_ADAPT_SEC, NULL);
 }
@@ -32,6 +32,7 @@
 #include "psynclib.h"
 #include "plist.h"
 #include "papi.h"
+#include "pssl.h"
 
 #define PSYNC_NET_OK        0
 #define PSYNC_NET_PERMFAIL -1
@@ -87,6 +88,19 @@ typedef struct {
   char filename[];
 } psync_file_lock_t;
 
+typedef struct {
+  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
+  uint32_t adler;
+} psync_block_checksum;
+
+typedef struct {
+  uint64_t filesize;
+  uint32_t blocksize;
+  uint32_t blockcnt;
+  uint32_t *next;
+  psync_block_checksum blocks[];
+} psync_file_checksums;
+
 void psync_netlibs_init();
 
 psync_socket *psync_apipool_get();
@@ -94,6 +108,7 @@ psync_socket *psync_apipool_get_from_cache();
 void psync_apipool_prepare();
 void psync_apipool_release(psync_socket *api);
 void psync_apipool_release_bad(psync_socket *api);
+void psync_apipool_get_stats(psync_apipool_stats_t *stats);
 
 int psync_rmdir_with_trashes(const char *path);
 int psync_rmdir_recursive(const char *path);
@@ -105,6 +120,7 @@ int psync_get_local_file_checksum(const char *restrict filename, unsigned char *
 int psync_get_local_file_checksum_part(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize,
                                        unsigned char *restrict phexsum, uint64_t pfsize);
 int psync_copy_local_file_if_checksum_matches(const char *source, const char *destination, const unsigned char *hexsum, uint64_t fsize);
+int psync_clone_local_file_if_unchanged(const char *source, const char *destination, uint64_t fsize, uint64_t inode, uint64_t mtimenative);
 int psync_file_writeall_checkoverquota(psync_file_t fd, const void *buf, size_t count);
 
 int psync_set_default_sendbuf(psync_socket *sock);
@@ -124,6 +140,7 @@ int psync_http_request_readall(psync_http_socket *http, void *buff, int num);
 
 char *psync_url_decode(const char *s);
 
+int psync_net_download_checksums(psync_fileid_t fileid, uint64_t hash, psync_file_checksums **checksums);
 int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_t filehash, uint64_t filesize, char *const *files, uint32_t filecnt);
 int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd);
 int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync_uploadid_t uploadid, psync_file_t fd);
@@ -83,6 +83,56 @@ static const size_t min_packet_size[]={
   sizeof(packet_get)
 };
 
+/* not in min_packet_size as it is only sent over tcp */
+#define P2P_GET_RANGES 3
+
+/* peers that serve P2P_GET_RANGES set this above the 16 bit port in their replies, older peers only use the low bits */
+#define P2P_PORT_FLAG_RANGES 0x10000
+#define P2P_PORT_MASK        0xffff
+
+typedef PSYNC_PACKED_STRUCT {
+  uint64_t offset;
+  uint64_t length;
+} packet_range;
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint32_t port;
+  uint32_t ranges;
+  uint32_t chunks;
+  uint64_t bytes;
+  uint64_t millisec;
+} p2p_peer_t;
+
+#define P2P_CHUNK_FREE    0
+#define P2P_CHUNK_RUNNING 1
+#define P2P_CHUNK_DONE    2
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_file_checksums *checksums;
+  const packet_get *request;
+  const unsigned char *token;
+  size_t tlen;
+  uint64_t fsize;
+  uint64_t chunksize;
+  uint64_t bestspeed;
+  unsigned char *chunkstate;
+  uint32_t *chunkfailedby;
+  uint32_t chunkcnt;
+  uint32_t chunksleft;
+  uint32_t running;
+  psync_file_t fd;
+} p2p_swarm_t;
+
+typedef struct {
+  p2p_swarm_t *swarm;
+  p2p_peer_t *peer;
+  uint32_t peerid;
+} p2p_swarm_worker_t;
+
 #define P2P_RESP_NOPE   0
 #define P2P_RESP_HAVEIT 1
 #define P2P_RESP_WAIT   2
@@ -200,7 +250,7 @@ static void psync_p2p_check(const packet_check *packet){
     resp.type=P2P_RESP_WAIT;
   else
     return;
-  resp.port=tcpport;
+  resp.port=tcpport|P2P_PORT_FLAG_RANGES;
   psync_ssl_rand_weak(resp.rand, sizeof(resp.rand));
   memcpy(hashsource, hashhex, PSYNC_HASH_DIGEST_HEXLEN);
   memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
@@ -290,6 +340,7 @@ static int check_token(char *token, uint32_t tlen, unsigned char *key, uint32_t
 
 static void psync_p2p_tcphandler(void *ptr){
   packet_get packet;
+  packet_range range;
   psync_fileid_t localfileid;
   psync_binary_rsa_key_t binpubrsa;
   psync_rsa_publickey_t pubrsa;
@@ -359,19 +410,51 @@ static void psync_p2p_tcphandler(void *ptr){
     goto err0;
   }
   psync_free(encaeskey);
-  off=0;
-  while (off<packet.filesize){
-    if (packet.filesize-off<sizeof(buff))
-      rd=packet.filesize-off;
-    else
-      rd=sizeof(buff);
-    if (unlikely_log(psync_file_read(fd, buff, rd)!=rd))
-      break;
-    psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, rd, off);
-    if (unlikely_log(socket_write_all(sock, buff, rd)))
-      break;
-    off+=rd;
+  pthread_mutex_lock(&p2pmutex);
+  files_serving++;
+  pthread_mutex_unlock(&p2pmutex);
+  if (packet.type==P2P_GET_RANGES){
+    /* swarm peers request chunks of the file until they send a zero length range */
+    while (!socket_read_all(sock, &range, sizeof(range)) && range.length){
+      if (unlikely_log(range.offset>packet.filesize || range.length>packet.filesize-range.offset ||
+                       psync_file_seek(fd, range.offset, P_SEEK_SET)==-1))
+        break;
+      off=range.offset;
+      range.length+=range.offset;
+      while (off<range.length){
+        if (range.length-off<sizeof(buff))
+          rd=range.length-off;
+        else
+          rd=sizeof(buff);
+        if (unlikely_log(psync_file_read(fd, buff, rd)!=rd))
+          break;
+        psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, rd, off);
+        if (unlikely_log(socket_write_all(sock, buff, rd)))
+          break;
+        off+=rd;
+      }
+      if (off<range.length)
+        break;
+    }
+  }
+  else{
+    off=0;
+    while (off<packet.filesize){
+      if (packet.filesize-off<sizeof(buff))
+        rd=packet.filesize-off;
+      else
+        rd=sizeof(buff);
+      if (unlikely_log(psync_file_read(fd, buff, rd)!=rd))
+        break;
+      psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, rd, off);
+      if (unlikely_log(socket_write_all(sock, buff, rd)))
+        break;
+      off+=rd;
+    }
   }
+  pthread_mutex_lock(&p2pmutex);
+  files_serving--;
+  pthread_mutex_unlock(&p2pmutex);
   psync_crypto_aes256_ctr_encoder_decoder_free(encoder);
   psync_file_close(fd);
   debug(D_NOTICE, "file sent successfuly");
@@ -603,17 +686,10 @@ static int psync_p2p_get_download_token(psync_fileid_t fileid, const unsigned ch
   return PSYNC_NET_OK;
 }
 
-static int psync_p2p_download(psync_socket_t sock, psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
+static int psync_p2p_read_key(psync_socket_t sock, psync_crypto_aes256_ctr_encoder_decoder_t *decoder){
   uint32_t keylen, enctype;
   psync_symmetric_key_t key;
   psync_encrypted_symmetric_key_t ekey;
-  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
-  psync_hash_ctx hashctx;
-  uint64_t off;
-  size_t rd;
-  psync_file_t fd;
-  unsigned char buff[4096];
-  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
   if (unlikely_log(socket_read_all(sock, &keylen, sizeof(keylen)) || socket_read_all(sock, &enctype, sizeof(enctype))))
     return PSYNC_NET_TEMPFAIL;
   if (enctype!=P2P_ENCTYPE_RSA_AES){
@@ -631,10 +707,25 @@ static int psync_p2p_download(psync_socket_t sock, psync_fileid_t fileid, const
     return PSYNC_NET_TEMPFAIL;
   }
   psync_free(ekey);
-  decoder=psync_crypto_aes256_ctr_encoder_decoder_create(key);
+  *decoder=psync_crypto_aes256_ctr_encoder_decoder_create(key);
   psync_ssl_free_symmetric_key(key);
-  if (decoder==PSYNC_CRYPTO_INVALID_ENCODER)
+  if (*decoder==PSYNC_CRYPTO_INVALID_ENCODER)
     return PSYNC_NET_PERMFAIL;
+  return PSYNC_NET_OK;
+}
+
+static int psync_p2p_download(psync_socket_t sock, psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  psync_hash_ctx hashctx;
+  uint64_t off;
+  size_t rd;
+  psync_file_t fd;
+  int ret;
+  unsigned char buff[4096];
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  ret=psync_p2p_read_key(sock, &decoder);
+  if (ret!=PSYNC_NET_OK)
+    return ret;
   fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
   if (unlikely(fd==INVALID_HANDLE_VALUE)){
     psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
@@ -674,8 +765,242 @@ err0:
   return PSYNC_NET_TEMPFAIL;
 }
 
-int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
-  struct sockaddr_in6 addr;
+static uint64_t p2p_millitime(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000+tm.tv_nsec/1000000;
+}
+
+static psync_socket_t p2p_connect_peer(p2p_peer_t *peer){
+  psync_socket_t sock;
+  if (peer->addr.ss_family==AF_INET6)
+    ((struct sockaddr_in6 *)&peer->addr)->sin6_port=htons(peer->port);
+  else if (peer->addr.ss_family==AF_INET)
+    ((struct sockaddr_in *)&peer->addr)->sin_port=htons(peer->port);
+  else{
+    debug(D_ERROR, "unknown address family %u", (unsigned)peer->addr.ss_family);
+    return INVALID_SOCKET;
+  }
+  sock=psync_create_socket(peer->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (unlikely_log(sock==INVALID_SOCKET))
+    return INVALID_SOCKET;
+  if (unlikely(connect(sock, (struct sockaddr *)&peer->addr, peer->addrlen)==SOCKET_ERROR)){
+    debug(D_WARNING, "could not connect to %s port %u", p2p_get_address(&peer->addr), (unsigned)peer->port);
+    psync_close_socket(sock);
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+static int p2p_send_request(psync_socket_t sock, const packet_get *request, const unsigned char *token, size_t tlen){
+  if (socket_write_all(sock, request, sizeof(packet_get)) ||
+      socket_write_all(sock, psync_rsa_public_bin->data, psync_rsa_public_bin->datalen) ||
+      socket_write_all(sock, token, tlen)){
+    debug(D_WARNING, "writing to socket failed");
+    return -1;
+  }
+  return 0;
+}
+
+static int p2p_verify_chunk(const psync_file_checksums *checksums, const unsigned char *data, uint64_t off, uint64_t len){
+  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
+  uint64_t bs;
+  uint32_t b;
+  b=off/checksums->blocksize;
+  while (len){
+    bs=len<checksums->blocksize?len:checksums->blocksize;
+    psync_sha1(data, bs, sha1);
+    if (b>=checksums->blockcnt || memcmp(sha1, checksums->blocks[b].sha1, PSYNC_SHA1_DIGEST_LEN))
+      return -1;
+    data+=bs;
+    len-=bs;
+    b++;
+  }
+  return 0;
+}
+
+/* returns -1 if nothing is left for this peer, -2 if it should wait for chunks that other peers are downloading */
+static int p2p_swarm_next_chunk(p2p_swarm_t *swarm, uint32_t peerid){
+  uint32_t i;
+  int ret;
+  ret=-1;
+  for (i=0; i<swarm->chunkcnt; i++)
+    if (swarm->chunkstate[i]!=P2P_CHUNK_DONE && !(swarm->chunkfailedby[i]&(1U<<peerid))){
+      if (swarm->chunkstate[i]==P2P_CHUNK_FREE){
+        swarm->chunkstate[i]=P2P_CHUNK_RUNNING;
+        return i;
+      }
+      ret=-2;
+    }
+  return ret;
+}
+
+static void psync_p2p_swarm_worker(void *ptr){
+  p2p_swarm_worker_t *w;
+  p2p_swarm_t *swarm;
+  p2p_peer_t *peer;
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  packet_range range;
+  unsigned char *buff;
+  uint64_t start, elapsed, speed;
+  psync_socket_t sock;
+  int chunk, ok;
+  w=(p2p_swarm_worker_t *)ptr;
+  swarm=w->swarm;
+  peer=w->peer;
+  buff=NULL;
+  decoder=PSYNC_CRYPTO_INVALID_ENCODER;
+  sock=p2p_connect_peer(peer);
+  if (sock==INVALID_SOCKET)
+    goto ex;
+  if (p2p_send_request(sock, swarm->request, swarm->token, swarm->tlen) || psync_p2p_read_key(sock, &decoder)!=PSYNC_NET_OK)
+    goto ex;
+  buff=(unsigned char *)psync_malloc(swarm->chunksize);
+  while (psync_do_run){
+    pthread_mutex_lock(&swarm->mutex);
+    /* a running chunk may still fail on another peer and come back */
+    while ((chunk=p2p_swarm_next_chunk(swarm, w->peerid))==-2 && psync_do_run)
+      pthread_cond_wait(&swarm->cond, &swarm->mutex);
+    pthread_mutex_unlock(&swarm->mutex);
+    if (chunk<0)
+      break;
+    range.offset=(uint64_t)chunk*swarm->chunksize;
+    range.length=swarm->fsize-range.offset;
+    if (range.length>swarm->chunksize)
+      range.length=swarm->chunksize;
+    start=p2p_millitime();
+    ok=!socket_write_all(sock, &range, sizeof(range)) && !socket_read_all(sock, buff, range.length);
+    if (ok){
+      psync_crypto_aes256_ctr_encode_decode_inplace(decoder, buff, range.length, range.offset);
+      if (p2p_verify_chunk(swarm->checksums, buff, range.offset, range.length)){
+        debug(D_WARNING, "chunk %d from %s failed verification", chunk, p2p_get_address(&peer->addr));
+        ok=0;
+      }
+      else if (unlikely_log(psync_file_pwrite(swarm->fd, buff, range.length, range.offset)!=range.length))
+        ok=0;
+    }
+    elapsed=p2p_millitime()-start+1;
+    pthread_mutex_lock(&swarm->mutex);
+    if (ok){
+      swarm->chunkstate[chunk]=P2P_CHUNK_DONE;
+      swarm->chunksleft--;
+      peer->chunks++;
+      peer->bytes+=range.length;
+      peer->millisec+=elapsed;
+      speed=peer->bytes*1000/peer->millisec;
+      if (speed>swarm->bestspeed)
+        swarm->bestspeed=speed;
+      /* leave the remaining chunks to faster peers */
+      if (peer->chunks>=2 && speed*PSYNC_P2P_SWARM_SLOW_FACTOR<swarm->bestspeed){
+        debug(D_NOTICE, "peer %s is too slow (%lu bytes/sec), dropping it", p2p_get_address(&peer->addr), (unsigned long)speed);
+        ok=0;
+      }
+    }
+    else{
+      swarm->chunkstate[chunk]=P2P_CHUNK_FREE;
+      swarm->chunkfailedby[chunk]|=1U<<w->peerid;
+    }
+    pthread_cond_broadcast(&swarm->cond);
+    pthread_mutex_unlock(&swarm->mutex);
+    if (!ok)
+      break;
+  }
+  range.offset=0;
+  range.length=0;
+  socket_write_all(sock, &range, sizeof(range));
+ex:
+  if (sock!=INVALID_SOCKET)
+    psync_close_socket(sock);
+  if (decoder!=PSYNC_CRYPTO_INVALID_ENCODER)
+    psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
+  psync_free(buff);
+  pthread_mutex_lock(&swarm->mutex);
+  swarm->running--;
+  pthread_cond_broadcast(&swarm->cond);
+  pthread_mutex_unlock(&swarm->mutex);
+  psync_free(w);
+}
+
+/* Downloads chunks of the file from all peers in parallel, every chunk is verified against the block checksums of the
+ * server. If some chunks could not be downloaded from any peer, PSYNC_NET_PERMFAIL is returned and the partial file is
+ * left in place, so the regular download reuses the verified blocks and only gets the missing ones from the server.
+ * Returns -1 if swarm download is not possible or no chunk was received at all.
+ */
+static int psync_p2p_swarm_download(p2p_peer_t *peers, uint32_t peercnt, psync_fileid_t fileid, uint64_t hash,
+                                    const unsigned char *filehashhex, uint64_t fsize, const char *filename,
+                                    const packet_get *request, const unsigned char *token, size_t tlen){
+  p2p_swarm_t swarm;
+  p2p_swarm_worker_t *w;
+  unsigned char hashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  uint64_t lsize;
+  uint32_t i;
+  if (psync_net_download_checksums(fileid, hash, &swarm.checksums)!=PSYNC_NET_OK || !swarm.checksums)
+    return -1;
+  if (unlikely_log(swarm.checksums->filesize!=fsize)){
+    psync_free(swarm.checksums);
+    return -1;
+  }
+  swarm.fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely(swarm.fd==INVALID_HANDLE_VALUE)){
+    debug(D_ERROR, "could not open %s", filename);
+    psync_free(swarm.checksums);
+    return PSYNC_NET_PERMFAIL;
+  }
+  swarm.chunksize=PSYNC_P2P_SWARM_CHUNK_SIZE/swarm.checksums->blocksize*swarm.checksums->blocksize;
+  if (!swarm.chunksize)
+    swarm.chunksize=swarm.checksums->blocksize;
+  swarm.chunkcnt=(fsize+swarm.chunksize-1)/swarm.chunksize;
+  swarm.chunksleft=swarm.chunkcnt;
+  swarm.chunkstate=psync_new_cnt(unsigned char, swarm.chunkcnt);
+  swarm.chunkfailedby=psync_new_cnt(uint32_t, swarm.chunkcnt);
+  memset(swarm.chunkstate, P2P_CHUNK_FREE, swarm.chunkcnt);
+  memset(swarm.chunkfailedby, 0, sizeof(uint32_t)*swarm.chunkcnt);
+  swarm.request=request;
+  swarm.token=token;
+  swarm.tlen=tlen;
+  swarm.fsize=fsize;
+  swarm.bestspeed=0;
+  swarm.running=peercnt;
+  pthread_mutex_init(&swarm.mutex, NULL);
+  pthread_cond_init(&swarm.cond, NULL);
+  debug(D_NOTICE, "downloading %u chunks of %lu bytes from %u peers", (unsigned)swarm.chunkcnt, (unsigned long)swarm.chunksize, (unsigned)peercnt);
+  for (i=0; i<peercnt; i++){
+    w=psync_new(p2p_swarm_worker_t);
+    w->swarm=&swarm;
+    w->peer=&peers[i];
+    w->peerid=i;
+    psync_run_thread1("p2p swarm", psync_p2p_swarm_worker, w);
+  }
+  pthread_mutex_lock(&swarm.mutex);
+  while (swarm.running)
+    pthread_cond_wait(&swarm.cond, &swarm.mutex);
+  pthread_mutex_unlock(&swarm.mutex);
+  pthread_cond_destroy(&swarm.cond);
+  pthread_mutex_destroy(&swarm.mutex);
+  for (i=0; i<peercnt; i++)
+    debug(D_NOTICE, "peer %s sent %u chunks, %lu bytes in %lums", p2p_get_address(&peers[i].addr), (unsigned)peers[i].chunks,
+          (unsigned long)peers[i].bytes, (unsigned long)peers[i].millisec);
+  psync_free(swarm.chunkstate);
+  psync_free(swarm.chunkfailedby);
+  psync_free(swarm.checksums);
+  if (unlikely_log(psync_file_sync(swarm.fd)) || unlikely_log(psync_file_close(swarm.fd)))
+    return PSYNC_NET_TEMPFAIL;
+  if (swarm.chunksleft==swarm.chunkcnt){
+    debug(D_NOTICE, "no chunks of file %s were received from peers", filename);
+    return -1;
+  }
+  if (swarm.chunksleft){
+    debug(D_NOTICE, "%u chunks of file %s could not be downloaded from peers", (unsigned)swarm.chunksleft, filename);
+    return PSYNC_NET_PERMFAIL;
+  }
+  if (unlikely_log(psync_get_local_file_checksum(filename, hashhex, &lsize)) || unlikely_log(lsize!=fsize) ||
+      unlikely_log(memcmp(hashhex, filehashhex, PSYNC_HASH_DIGEST_HEXLEN)))
+    return PSYNC_NET_PERMFAIL;
+  return PSYNC_NET_OK;
+}
+
+int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, uint64_t hash, const char *filename){
+  struct sockaddr_storage addr;
   fd_set rfds;
   packet_check pct1;
   packet_get pct2;
@@ -683,11 +1008,14 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
   struct timeval tv;
   psync_interface_list_t *il;
   psync_socket_t *sockets;
+  p2p_peer_t *peers, tpeer;
   size_t i, tlen;
   psync_socket_t sock, msock;
   packet_resp_t bresp;
   unsigned char hashsource[PSYNC_HASH_BLOCK_SIZE], hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
   unsigned char *token;
+  uint64_t now, deadline;
+  uint32_t peercnt, maxpeers, j;
   socklen_t slen;
   int sret;
   if (!psync_setting_get_bool(_PS(p2psync)))
@@ -704,7 +1032,6 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
   memcpy(pct1.computername, computername, PSYNC_HASH_DIGEST_HEXLEN);
   il=psync_list_ip_adapters();
   sockets=psync_new_cnt(psync_socket_t, il->interfacecnt);
-  FD_ZERO(&rfds);
   msock=0;
   for (i=0; i<il->interfacecnt; i++){
     sockets[i]=INVALID_SOCKET;
@@ -725,7 +1052,6 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
       ((struct sockaddr_in6 *)(&il->interfaces[i].broadcast))->sin6_port=htons(PSYNC_P2P_PORT);
     if (sendto(sock, (const char *)&pct1, sizeof(pct1), 0, (struct sockaddr *)&il->interfaces[i].broadcast, il->interfaces[i].addrsize)!=SOCKET_ERROR){
       sockets[i]=sock;
-      FD_SET(sock, &rfds);
       if (sock>=msock)
         msock=sock+1;
     }
@@ -734,36 +1060,63 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
   }
   if (unlikely_log(!msock))
     goto err_perm;
-  tv.tv_sec=PSYNC_P2P_INITIAL_TIMEOUT/1000;
-  tv.tv_usec=(PSYNC_P2P_INITIAL_TIMEOUT%1000)*1000;
-  sret=select(msock, &rfds, NULL, NULL, &tv);
-  if (sret==0 || unlikely_log(sret==SOCKET_ERROR))
-    goto err_perm;
+  /* for large files collect responses from several peers to download from all of them, otherwise take the first one */
+  maxpeers=fsize>=PSYNC_P2P_SWARM_MIN_SIZE?PSYNC_P2P_SWARM_MAX_PEERS:1;
+  peers=psync_new_cnt(p2p_peer_t, maxpeers);
+  peercnt=0;
   bresp=P2P_RESP_NOPE;
-  for (i=0; i<il->interfacecnt; i++)
-    if (sockets[i]!=INVALID_SOCKET && FD_ISSET(sockets[i], &rfds)){
-      slen=sizeof(addr);
-      sret=recvfrom(sockets[i], (char *)&resp, sizeof(resp), 0, (struct sockaddr *)&addr, &slen);
-      if (unlikely_log(sret==SOCKET_ERROR) || unlikely_log(sret<sizeof(resp)))
-        continue;
-      if (!memcmp(pct1.rand, resp.rand, sizeof(resp.rand))){
-        debug(D_WARNING, "clients are supposed to generate random data, not to reuse mine");
-        continue;
-      }
-      memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
-      memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
-      psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
-      psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
-      if (unlikely_log(memcmp(hashhex, resp.genhash, PSYNC_HASH_DIGEST_HEXLEN)))
-        continue;
-      if (resp.type==P2P_RESP_HAVEIT){
-        debug(D_NOTICE, "got P2P_RESP_HAVEIT");
-        bresp=P2P_RESP_HAVEIT;
-        break;
+  now=p2p_millitime();
+  deadline=now+PSYNC_P2P_INITIAL_TIMEOUT;
+  while (now<deadline && peercnt<maxpeers){
+    FD_ZERO(&rfds);
+    for (i=0; i<il->interfacecnt; i++)
+      if (sockets[i]!=INVALID_SOCKET)
+        FD_SET(sockets[i], &rfds);
+    tv.tv_sec=(deadline-now)/1000;
+    tv.tv_usec=((deadline-now)%1000)*1000;
+    sret=select(msock, &rfds, NULL, NULL, &tv);
+    if (sret==0 || unlikely_log(sret==SOCKET_ERROR))
+      break;
+    for (i=0; i<il->interfacecnt && peercnt<maxpeers; i++)
+      if (sockets[i]!=INVALID_SOCKET && FD_ISSET(sockets[i], &rfds)){
+        slen=sizeof(addr);
+        sret=recvfrom(sockets[i], (char *)&resp, sizeof(resp), 0, (struct sockaddr *)&addr, &slen);
+        if (unlikely_log(sret==SOCKET_ERROR) || unlikely_log(sret<sizeof(resp)))
+          continue;
+        if (!memcmp(pct1.rand, resp.rand, sizeof(resp.rand))){
+          debug(D_WARNING, "clients are supposed to generate random data, not to reuse mine");
+          continue;
+        }
+        memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
+        memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
+        psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
+        psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
+        if (unlikely_log(memcmp(hashhex, resp.genhash, PSYNC_HASH_DIGEST_HEXLEN)))
+          continue;
+        if (resp.type==P2P_RESP_HAVEIT){
+          debug(D_NOTICE, "got P2P_RESP_HAVEIT from %s", p2p_get_address(&addr));
+          for (j=0; j<peercnt; j++)
+            if (peers[j].addrlen==slen && !memcmp(&peers[j].addr, &addr, slen))
+              break;
+          if (j<peercnt)
+            continue;
+          if (!peercnt && p2p_millitime()+PSYNC_P2P_SWARM_COLLECT_TIME<deadline)
+            deadline=p2p_millitime()+PSYNC_P2P_SWARM_COLLECT_TIME;
+          memcpy(&peers[peercnt].addr, &addr, slen);
+          peers[peercnt].addrlen=slen;
+          peers[peercnt].port=resp.port&P2P_PORT_MASK;
+          peers[peercnt].ranges=(resp.port&P2P_PORT_FLAG_RANGES)!=0;
+          peers[peercnt].chunks=0;
+          peers[peercnt].bytes=0;
+          peers[peercnt].millisec=0;
+          peercnt++;
+          bresp=P2P_RESP_HAVEIT;
+        }
+        else if (resp.type==P2P_RESP_WAIT && bresp==P2P_RESP_NOPE)
+          bresp=P2P_RESP_WAIT;
       }
-      else if (resp.type==P2P_RESP_WAIT && bresp==P2P_RESP_NOPE)
-        bresp=P2P_RESP_WAIT;
-    }
+    now=p2p_millitime();
+  }
   for (i=0; i<il->interfacecnt; i++)
     if (sockets[i]!=INVALID_SOCKET)
       psync_close_socket(sockets[i]);
@@ -772,39 +1125,18 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
   if (bresp==P2P_RESP_NOPE)
     goto err_perm2;
   else if (bresp==P2P_RESP_WAIT){
+    psync_free(peers);
     psync_milisleep(PSYNC_P2P_SLEEP_WAIT_DOWNLOAD);
-    goto err_temp2;
+    return PSYNC_NET_TEMPFAIL;
   }
   if (psync_p2p_check_rsa())
     goto err_perm2;
   sret=psync_p2p_get_download_token(fileid, filehashhex, fsize, &token, &tlen);
   debug(D_NOTICE, "got token");
   if (unlikely_log(sret!=PSYNC_NET_OK)){
-    if (sret==PSYNC_NET_TEMPFAIL)
-      goto err_temp2;
-    else
-      goto err_perm2;
-  }
-  if (addr.sin6_family==AF_INET6){
-    sock=psync_create_socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-    addr.sin6_port=htons(resp.port);
+    psync_free(peers);
+    return sret;
   }
-  else if (addr.sin6_family==AF_INET){
-    sock=psync_create_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    ((struct sockaddr_in *)&addr)->sin_port=htons(resp.port);
-  }
-  else{
-    debug(D_ERROR, "unknown address family %u", (unsigned)addr.sin6_family);
-    goto err_perm2;
-  }
-  if (unlikely_log(sock==INVALID_SOCKET))
-    goto err_perm3;
-  if (unlikely(connect(sock, (struct sockaddr *)&addr, slen)==SOCKET_ERROR)){
-    debug(D_WARNING, "could not connect to %s port %u", p2p_get_address(&addr), (unsigned)resp.port);
-    goto err_perm3;
-  }
-  debug(D_NOTICE, "connected to peer");
-  pct2.type=P2P_GET;
   memcpy(pct2.hashstart, filehashhex, PSYNC_P2P_HEXHASH_BYTES);
   pct2.filesize=fsize;
   pct2.keylen=psync_rsa_public_bin->datalen;
@@ -812,30 +1144,50 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
   memcpy(pct2.rand, pct1.rand, sizeof(pct1.rand));
   memcpy(pct2.genhash, pct1.genhash, sizeof(pct1.genhash));
   memcpy(pct2.computername, computername, PSYNC_HASH_DIGEST_HEXLEN);
-  if (socket_write_all(sock, &pct2, sizeof(pct2)) ||
-      socket_write_all(sock, psync_rsa_public_bin->data, psync_rsa_public_bin->datalen) ||
-      socket_write_all(sock, token, tlen)){
-    debug(D_WARNING, "writing to socket failed");
-    goto err_temp3;
+  /* only peers that advertised range support are swarmed, they are moved to the front of the list */
+  for (i=0, j=0; i<peercnt; i++)
+    if (peers[i].ranges){
+      if (i!=j){
+        tpeer=peers[j];
+        peers[j]=peers[i];
+        peers[i]=tpeer;
+      }
+      j++;
+    }
+  if (j>1){
+    pct2.type=P2P_GET_RANGES;
+    sret=psync_p2p_swarm_download(peers, j, fileid, hash, filehashhex, fsize, filename, &pct2, token, tlen);
+    if (sret!=-1){
+      psync_free(token);
+      psync_free(peers);
+      return sret;
+    }
+  }
+  pct2.type=P2P_GET;
+  sock=p2p_connect_peer(&peers[0]);
+  psync_free(peers);
+  if (sock==INVALID_SOCKET){
+    psync_free(token);
+    return PSYNC_NET_PERMFAIL;
+  }
+  debug(D_NOTICE, "connected to peer");
+  if (p2p_send_request(sock, &pct2, token, tlen)){
+    psync_close_socket(sock);
+    psync_free(token);
+    return PSYNC_NET_TEMPFAIL;
   }
   psync_free(token);
   sret=psync_p2p_download(sock, fileid, filehashhex, fsize, filename);
   psync_close_socket(sock);
   return sret;
-err_perm3:
-  psync_free(token);
-  goto err_perm2;
 err_perm:
   for (i=0; i<il->interfacecnt; i++)
     if (sockets[i]!=INVALID_SOCKET)
       psync_close_socket(sockets[i]);
   psync_free(il);
   psync_free(sockets);
+  return PSYNC_NET_PERMFAIL;
 err_perm2:
+  psync_free(peers);
   return PSYNC_NET_PERMFAIL;
-err_temp3:
-  psync_close_socket(sock);
-  psync_free(token);
-err_temp2:
-  return PSYNC_NET_TEMPFAIL;
 }
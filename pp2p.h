@@ -32,6 +32,6 @@
 
 void psync_p2p_init();
 void psync_p2p_change();
-int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename);
+int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, uint64_t hash, const char *filename);
 
 #endif
\ No newline at end of file
@@ -34,12 +34,12 @@
 #include "pcache.h"
 #include "pfscrypto.h"
 #include "pcrc32c.h"
+#include "palloc.h"
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 
-#define CACHE_PAGES (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE)
-#define CACHE_HASH (CACHE_PAGES/2)
+#define CACHE_HASH (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE/2)
 
 #define PAGE_WAITER_HASH 1024
 
@@ -69,6 +69,7 @@ typedef struct {
   uint32_t flushpageid;
   uint32_t crc;
   uint8_t type;
+  uint8_t node;
 } psync_cache_page_t;
 
 typedef struct {
@@ -77,6 +78,20 @@ typedef struct {
   uint32_t usecnt;
 } psync_cachepage_to_update;
 
+typedef struct {
+  /* list is an element of ram_tier_hash or of ram_tier_free, lru is an element of ram_tier_lru, idlist is an element of
+   * ram_tier_id_hash while pagecacheid still holds the page in the cache file (pagecacheid is 0 otherwise) */
+  psync_list list;
+  psync_list lru;
+  psync_list idlist;
+  char *page;
+  uint64_t hash;
+  uint64_t pageid;
+  uint64_t pagecacheid;
+  uint32_t size;
+  uint32_t crc;
+} psync_ram_page_t;
+
 typedef struct {
   /* list is an element of hash table for pages */
   psync_list list;
@@ -130,12 +145,23 @@ typedef struct _psync_crypto_auth_page {
   psync_page_waiter_t *waiter;
   struct _psync_crypto_auth_page *parent;
   uint64_t firstpageid;
+  uint64_t offset;
   uint32_t size;
   uint32_t idinparent;
   uint32_t level;
+  uint8_t trusted;
   psync_crypto_auth_sector_t auth;
 } psync_crypto_auth_page;
 
+typedef struct {
+  psync_tree tree;
+  psync_list list;
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t size;
+  psync_crypto_auth_sector_t auth;
+} psync_verified_auth_t;
+
 typedef struct {
   psync_crypto_auth_page *authpage;
   psync_page_waiter_t *waiter;
@@ -147,8 +173,11 @@ typedef struct {
 static psync_list cache_hash[CACHE_HASH];
 static uint32_t cache_pages_in_hash=0;
 static uint32_t cache_pages_free;
+static uint32_t cache_pages_total;
 static int cache_pages_reset=1;
-static psync_list free_pages;
+/* free pages are kept in one list per NUMA node, threads take pages from the memory of their own node first */
+static psync_list free_pages[PSYNC_FS_MEMORY_CACHE_MAX_NUMA_NODES];
+static uint32_t free_pages_nodes=1;
 static psync_list wait_page_hash[PAGE_WAITER_HASH];
 static char *pages_base;
 
@@ -163,6 +192,10 @@ static pthread_mutex_t flush_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t url_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t url_cache_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t wait_page_mutex;
+
+static psync_slab_t *page_wait_slab;
+static psync_slab_t *page_waiter_slab;
+static psync_slab_t *request_range_slab;
 static pthread_cond_t enc_key_cond=PTHREAD_COND_INITIALIZER;
 
 static uint32_t clean_cache_stoppers=0;
@@ -180,7 +213,48 @@ static psync_file_t readcache=INVALID_HANDLE_VALUE;
 
 static psync_tree *url_cache_tree=PSYNC_TREE_EMPTY;
 
+static pthread_mutex_t pinned_hashes_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *pinned_hashes=NULL;
+static size_t pinned_hashes_cnt=0;
+
+/* RAM tier: verified copies of pages from the cache file that are read more than once, evicted in LRU order back to
+ * the cache file which still holds them unless their slot was freed in the meantime */
+static pthread_mutex_t ram_tier_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list *ram_tier_hash=NULL;
+static psync_list *ram_tier_id_hash=NULL;
+static psync_list ram_tier_free=PSYNC_LIST_STATIC_INIT(ram_tier_free);
+static psync_list ram_tier_lru=PSYNC_LIST_STATIC_INIT(ram_tier_lru);
+static char *ram_tier_base=NULL;
+static size_t ram_tier_alloced=0;
+static int ram_tier_huge=0;
+static uint32_t ram_tier_hash_size=0;
+static uint32_t ram_tier_pages=0;
+static uint32_t ram_tier_pages_used=0;
+static psync_pagecache_tier_stats_t tier_stats;
+
 static int flush_pages(int nosleep);
+static void ram_tier_forget_slot(uint64_t pagecacheid);
+static void ram_tier_forget_slots_above(uint64_t maxpagecacheid);
+
+#define free_page_list(page) (&free_pages[(page)->node])
+
+static uint32_t current_free_pages_node(){
+  if (free_pages_nodes>1)
+    return psync_numa_current_node()%free_pages_nodes;
+  else
+    return 0;
+}
+
+static psync_cache_page_t *get_free_page_locked(uint32_t node){
+  uint32_t i;
+  for (i=0; i<free_pages_nodes; i++){
+    if (likely(!psync_list_isempty(&free_pages[node])))
+      return psync_list_remove_head_element(&free_pages[node], psync_cache_page_t, list);
+    if (++node==free_pages_nodes)
+      node=0;
+  }
+  return NULL;
+}
 
 static void flush_pages_noret(){
   flush_pages(0);
@@ -188,23 +262,24 @@ static void flush_pages_noret(){
 
 static psync_cache_page_t *psync_pagecache_get_free_page_if_available(){
   psync_cache_page_t *page;
+  uint32_t node;
+  node=current_free_pages_node();
   pthread_mutex_lock(&cache_mutex);
-  if (unlikely(cache_pages_free<=CACHE_PAGES*25/100 && !flushcacherun)){
+  if (unlikely(cache_pages_free<=cache_pages_total*25/100 && !flushcacherun)){
     flushcacherun=1;
     psync_run_thread("flush pages get free page ifav", flush_pages_noret);
   }
-  if (likely(!psync_list_isempty(&free_pages)))
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
-  else
-    page=NULL;
+  page=get_free_page_locked(node);
   pthread_mutex_unlock(&cache_mutex);
   return page;
 }
 
 static psync_cache_page_t *psync_pagecache_get_free_page(int runflushcacheinside){
   psync_cache_page_t *page;
+  uint32_t node;
+  node=current_free_pages_node();
   pthread_mutex_lock(&cache_mutex);
-  if (unlikely(cache_pages_free<=CACHE_PAGES*25/100 && !flushcacherun)){
+  if (unlikely(cache_pages_free<=cache_pages_total*25/100 && !flushcacherun)){
     flushcacherun=1;
     if (runflushcacheinside){
       pthread_mutex_unlock(&cache_mutex);
@@ -215,21 +290,19 @@ static psync_cache_page_t *psync_pagecache_get_free_page(int runflushcacheinside
     else
       psync_run_thread("flush pages get free page", flush_pages_noret);
   }
-  if (likely(!psync_list_isempty(&free_pages)))
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
-  else{
+  page=get_free_page_locked(node);
+  if (unlikely(!page)){
     debug(D_NOTICE, "no free pages, flushing cache");
     pthread_mutex_unlock(&cache_mutex);
     flush_pages(1);
     pthread_mutex_lock(&cache_mutex);
-    while (unlikely(psync_list_isempty(&free_pages))){
+    while (unlikely(!(page=get_free_page_locked(node)))){
       pthread_mutex_unlock(&cache_mutex);
       debug(D_NOTICE, "no free pages after flush, sleeping");
       psync_milisleep(200);
       flush_pages(1);
       pthread_mutex_lock(&cache_mutex);
     }
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
   }
   cache_pages_free--;
   pthread_mutex_unlock(&cache_mutex);
@@ -266,11 +339,11 @@ static void psync_pagecache_send_page_wait_page(psync_page_wait_t *pw, psync_cac
     pwt->waiting_for=NULL;
     pthread_cond_broadcast(&pwt->cond);
   }
-  psync_free(pw);
+  psync_slab_free(page_wait_slab, pw);
 }
 
 static void psync_pagecache_return_free_page_locked(psync_cache_page_t *page){
-  psync_list_add_head(&free_pages, &page->list);
+  psync_list_add_head(free_page_list(page), &page->list);
   cache_pages_free++;
 }
 
@@ -340,6 +413,10 @@ typedef struct {
 } shared_api_waiter_t;
 
 static pthread_mutex_t sharedapi_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/* verified_auth_mutex protects openfile's verifiedauth tree and lru, it is a leaf lock as it is taken both with and without of->mutex */
+static pthread_mutex_t verified_auth_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_pagecache_auth_cache_stats_t verified_auth_stats;
 static psync_socket *sharedapi=NULL;
 static psync_list sharedapiwaiters=PSYNC_LIST_STATIC_INIT(sharedapiwaiters);
 
@@ -550,7 +627,7 @@ static int get_urls(psync_request_t *request, psync_urls_t *urls){
         goto err2;
       psync_list_del(l1);
       debug(D_NOTICE, "request for offset %lu, size %lu read from API", (unsigned long)range->offset, (unsigned long)range->length);
-      psync_free(range);
+      psync_slab_free(request_range_slab, range);
     }
     if (pass_shared_api(api))
       psync_apipool_release(api);
@@ -740,6 +817,20 @@ static int has_page_in_db(uint64_t hash, uint64_t pageid){
   return row!=NULL;
 }
 
+int psync_pagecache_has_page(uint64_t hash, uint64_t pageid){
+  return has_page_in_cache_by_hash(hash, pageid) || has_page_in_db(hash, pageid);
+}
+
+unsigned char *psync_pagecache_get_cached_pages(uint64_t hash, uint32_t pagecnt){
+  unsigned char *ret;
+  uint32_t i;
+  ret=has_pages_in_db(hash, 0, pagecnt, 0);
+  for (i=0; i<pagecnt; i++)
+    if (!ret[i])
+      ret[i]=has_page_in_cache_by_hash(hash, i);
+  return ret;
+}
+
 static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
   psync_cache_page_t *page;
   psync_uint_t h;
@@ -766,6 +857,7 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
         cache_pages_in_hash--;
         break;
       }
+      tier_stats.memhits++;
       if (size+off>page->size){
         if (off>page->size)
           size=0;
@@ -805,6 +897,31 @@ typedef struct {
   int8_t isxfirst;
 } pagecache_entry;
 
+static int pinned_hash_cmp(const void *p1, const void *p2){
+  uint64_t h1=*(const uint64_t *)p1, h2=*(const uint64_t *)p2;
+  if (h1<h2)
+    return -1;
+  else if (h1>h2)
+    return 1;
+  else
+    return 0;
+}
+
+void psync_pagecache_set_pinned_hashes(uint64_t *hashes, size_t cnt){
+  uint64_t *old;
+  qsort(hashes, cnt, sizeof(uint64_t), pinned_hash_cmp);
+  pthread_mutex_lock(&pinned_hashes_mutex);
+  old=pinned_hashes;
+  pinned_hashes=hashes;
+  pinned_hashes_cnt=cnt;
+  pthread_mutex_unlock(&pinned_hashes_mutex);
+  psync_free(old);
+}
+
+static int is_hash_pinned_locked(uint64_t hash){
+  return pinned_hashes_cnt && bsearch(&hash, pinned_hashes, pinned_hashes_cnt, sizeof(uint64_t), pinned_hash_cmp)!=NULL;
+}
+
 static int pagecache_entry_cmp_lastuse(const void *p1, const void *p2){
   const pagecache_entry *e1, *e2;
   e1=(const pagecache_entry *)p1;
@@ -942,18 +1059,20 @@ static void clean_cache(){
   i=0;
   e=0;
   while (i<cnt){
-    res=psync_sql_query_rdlock("SELECT id, pageid, lastuse, usecnt, type FROM pagecache WHERE id>? ORDER BY id LIMIT 5000");
+    res=psync_sql_query_rdlock("SELECT id, pageid, lastuse, usecnt, type, hash FROM pagecache WHERE id>? ORDER BY id LIMIT 5000");
     psync_sql_bind_uint(res, 1, e);
     row=psync_sql_fetch_rowint(res);
     if (unlikely(!row)){
       psync_sql_free_result(res);
       break;
     }
+    pthread_mutex_lock(&pinned_hashes_mutex);
     do{
       if (unlikely(i>=cnt))
         break;
       e=row[0];
-      if (likely(row[4]==PAGE_TYPE_READ)){
+      // pages of pinned files are never evicted
+      if (likely(row[4]==PAGE_TYPE_READ) && !is_hash_pinned_locked(row[5])){
         entries[i].lastuse=row[2];
         entries[i].id=row[0];
         if (row[3]>UINT16_MAX)
@@ -966,6 +1085,7 @@ static void clean_cache(){
       }
       row=psync_sql_fetch_rowint(res);
     } while (row);
+    pthread_mutex_unlock(&pinned_hashes_mutex);
     psync_sql_free_result(res);
     if (free_db_pages)
       psync_milisleep(1);
@@ -1003,6 +1123,7 @@ static void clean_cache(){
   for (i=0; i<cnt; i++){
     psync_sql_bind_uint(res, 1, entries[i].id);
     psync_sql_run(res);
+    ram_tier_forget_slot(entries[i].id);
     free_db_pages++;
     if ((i&31)==31 && psync_sql_has_waiters()){
       psync_sql_free_result(res);
@@ -1104,6 +1225,7 @@ static int check_disk_full(){
   res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
   psync_sql_bind_uint(res, 1, maxpage);
   psync_sql_run_free(res);
+  ram_tier_forget_slots_above(maxpage);
   free_db_pages=psync_sql_cellint("SELECT COUNT(*) FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE), 0);
   db_cache_max_page=maxpage;
   debug(D_NOTICE, "free_db_pages=%u, db_cache_max_page=%lu", (unsigned)free_db_pages, (unsigned long)db_cache_max_page);
@@ -1138,7 +1260,7 @@ static int flush_pages(int nosleep){
           psync_list_add_tail(&pages_to_flush, &page->flushlist);
         else if (page->type==PAGE_TYPE_CACHE){
           psync_list_del(&page->list);
-          psync_list_add_head(&free_pages, &page->list);
+          psync_list_add_head(free_page_list(page), &page->list);
           cache_pages_in_hash--;
           cache_pages_free++;
         }
@@ -1149,10 +1271,10 @@ static int flush_pages(int nosleep){
     i=0;
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
       psync_list_del(&page->list);
-      psync_list_add_head(&free_pages, &page->list);
+      psync_list_add_head(free_page_list(page), &page->list);
       cache_pages_in_hash--;
       cache_pages_free++;
-      if (++i>=CACHE_PAGES/2)
+      if (++i>=cache_pages_total/2)
         break;
     }
     debug(D_NOTICE, "discarded %u pages", (unsigned)i);
@@ -1170,7 +1292,7 @@ static int flush_pages(int nosleep){
         }
         else if (page->type==PAGE_TYPE_CACHE){
           psync_list_del(&page->list);
-          psync_list_add_head(&free_pages, &page->list);
+          psync_list_add_head(free_page_list(page), &page->list);
           cache_pages_free++;
         }
       }
@@ -1225,7 +1347,7 @@ static int flush_pages(int nosleep){
         else
           i=0;
         pthread_mutex_lock(&cache_mutex);
-        while (cache_pages_free>=CACHE_PAGES*5/100 && i++<200){
+        while (cache_pages_free>=cache_pages_total*5/100 && i++<200){
           pthread_mutex_unlock(&cache_mutex);
           psync_milisleep(10);
           pthread_mutex_lock(&cache_mutex);
@@ -1246,7 +1368,7 @@ static int flush_pages(int nosleep){
   if (db_cache_max_page<db_cache_in_pages && cache_pages_in_hash && !diskfull){
     i=0;
     res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES && i<cache_pages_in_hash){
+    while (db_cache_max_page+i<db_cache_in_pages && i<cache_pages_total && i<cache_pages_in_hash){
       psync_sql_run(res);
       i++;
       if (i%64==0){
@@ -1286,7 +1408,7 @@ static int flush_pages(int nosleep){
         pagecnt++;
         free_db_pages--;
       }
-      psync_list_add_head(&free_pages, &page->list);
+      psync_list_add_head(free_page_list(page), &page->list);
       cache_pages_free++;
       if (nosleep!=1 && updates%64==0){
         psync_sql_free_result(res);
@@ -1333,7 +1455,7 @@ static int flush_pages(int nosleep){
     ret=psync_sql_commit_transaction();
     pthread_mutex_unlock(&cache_mutex);
     pthread_mutex_unlock(&flush_cache_mutex);
-    if (free_db_pages<=CACHE_PAGES*2)
+    if (free_db_pages<=cache_pages_total*2)
       psync_run_thread("clean cache", clean_cache);
     return ret;
   }
@@ -1359,17 +1481,18 @@ static void psync_pagecache_flush_timer(psync_timer_t timer, void *ptr){
     psync_run_thread("flush pages timer", flush_pages_noret);
   flushedbetweentimers=0;
   pthread_mutex_lock(&cache_mutex);
-  if (cache_pages_free==CACHE_PAGES && !cache_pages_reset){
+  if (cache_pages_free==cache_pages_total && !cache_pages_reset){
     cache_pages_reset=1;
     debug(D_NOTICE, "resetting free pages");
-    psync_anon_reset(pages_base, CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
+    psync_anon_reset(pages_base, cache_pages_total*PSYNC_FS_PAGE_SIZE);
   }
   pthread_mutex_unlock(&cache_mutex);
 }
 
-static void mark_pagecache_used(uint64_t pagecacheid){
+static int mark_pagecache_used(uint64_t pagecacheid){
   uint64_t h;
   time_t tm;
+  int ret;
   if (cachepages_to_update_cnt>DB_CACHE_UPDATE_HASH/2)
     flush_pages(1);
   h=pagecacheid%DB_CACHE_UPDATE_HASH;
@@ -1381,6 +1504,7 @@ static void mark_pagecache_used(uint64_t pagecacheid){
       cachepages_to_update[h].lastuse=tm;
       cachepages_to_update[h].usecnt=1;
       cachepages_to_update_cnt++;
+      ret=0;
       break;
     }
     else if (cachepages_to_update[h].pagecacheid==pagecacheid){
@@ -1388,12 +1512,14 @@ static void mark_pagecache_used(uint64_t pagecacheid){
         cachepages_to_update[h].lastuse=tm;
         cachepages_to_update[h].usecnt++;
       }
+      ret=1;
       break;
     }
     if (++h>=DB_CACHE_UPDATE_HASH)
       h=0;
   }
   pthread_mutex_unlock(&cache_mutex);
+  return ret;
 }
 
 PSYNC_NOINLINE static void mark_page_free(uint64_t pagecacheid){
@@ -1401,6 +1527,137 @@ PSYNC_NOINLINE static void mark_page_free(uint64_t pagecacheid){
   res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", pageid=NULL, hash=NULL WHERE id=?");
   psync_sql_bind_uint(res, 1, pagecacheid);
   psync_sql_run_free(res);
+  ram_tier_forget_slot(pagecacheid);
+}
+
+static psync_int_t check_page_in_ram_tier(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
+  psync_ram_page_t *page;
+  uint64_t pagecacheid;
+  psync_int_t ret;
+  uint32_t crc;
+  ret=-1;
+  pthread_mutex_lock(&ram_tier_mutex);
+  if (!ram_tier_pages_used){
+    pthread_mutex_unlock(&ram_tier_mutex);
+    return -1;
+  }
+  psync_list_for_each_element(page, &ram_tier_hash[pagehash_by_hash_and_pageid(hash, pageid)%ram_tier_hash_size], psync_ram_page_t, list)
+    if (page->hash==hash && page->pageid==pageid){
+      crc=psync_crc32c(PSYNC_CRC_INITIAL, page->page, page->size);
+      if (unlikely(crc!=page->crc)){
+        debug(D_WARNING, "RAM tier page CRC does not match %u!=%u, pageid %u", (unsigned)crc, (unsigned)page->crc, (unsigned)page->pageid);
+        psync_list_del(&page->list);
+        psync_list_del(&page->lru);
+        psync_list_del(&page->idlist);
+        psync_list_add_head(&ram_tier_free, &page->list);
+        ram_tier_pages_used--;
+        break;
+      }
+      if (size+off>page->size){
+        if (off>page->size)
+          size=0;
+        else
+          size=page->size-off;
+      }
+      memcpy(buff, page->page+off, size);
+      psync_list_del(&page->lru);
+      psync_list_add_head(&ram_tier_lru, &page->lru);
+      pagecacheid=page->pagecacheid;
+      tier_stats.ramhits++;
+      ret=size;
+      break;
+    }
+  pthread_mutex_unlock(&ram_tier_mutex);
+  // keep the page recent in the cache file too, so it is still there when it is demoted
+  if (ret!=-1 && pagecacheid)
+    mark_pagecache_used(pagecacheid);
+  return ret;
+}
+
+static void promote_page_to_ram_tier(uint64_t hash, uint64_t pageid, uint64_t pagecacheid, const char *data, uint32_t size, uint32_t crc,
+                                     int hascrc){
+  psync_ram_page_t *page;
+  psync_list *bucket;
+  pthread_mutex_lock(&ram_tier_mutex);
+  if (!ram_tier_pages){
+    pthread_mutex_unlock(&ram_tier_mutex);
+    return;
+  }
+  bucket=&ram_tier_hash[pagehash_by_hash_and_pageid(hash, pageid)%ram_tier_hash_size];
+  psync_list_for_each_element(page, bucket, psync_ram_page_t, list)
+    if (page->hash==hash && page->pageid==pageid){
+      pthread_mutex_unlock(&ram_tier_mutex);
+      return;
+    }
+  if (!psync_list_isempty(&ram_tier_free)){
+    page=psync_list_remove_head_element(&ram_tier_free, psync_ram_page_t, list);
+    ram_tier_pages_used++;
+  }
+  else{
+    page=psync_list_element(ram_tier_lru.prev, psync_ram_page_t, lru);
+    psync_list_del(&page->list);
+    psync_list_del(&page->lru);
+    psync_list_del(&page->idlist);
+    tier_stats.demotions++;
+  }
+  if (data)
+    memcpy(page->page, data, size);
+  else if (unlikely(psync_file_pread(readcache, page->page, size, pagecacheid*PSYNC_FS_PAGE_SIZE)!=size) ||
+           unlikely(hascrc && psync_crc32c(PSYNC_CRC_INITIAL, page->page, size)!=crc)){
+    psync_list_add_head(&ram_tier_free, &page->list);
+    ram_tier_pages_used--;
+    pthread_mutex_unlock(&ram_tier_mutex);
+    return;
+  }
+  if (!hascrc)
+    crc=psync_crc32c(PSYNC_CRC_INITIAL, page->page, size);
+  page->hash=hash;
+  page->pageid=pageid;
+  page->pagecacheid=pagecacheid;
+  page->size=size;
+  page->crc=crc;
+  psync_list_add_tail(bucket, &page->list);
+  psync_list_add_head(&ram_tier_lru, &page->lru);
+  psync_list_add_tail(&ram_tier_id_hash[pagecacheid%ram_tier_hash_size], &page->idlist);
+  tier_stats.promotions++;
+  pthread_mutex_unlock(&ram_tier_mutex);
+}
+
+static void ram_tier_forget_page_slot(psync_ram_page_t *page){
+  psync_list_del(&page->idlist);
+  psync_list_init(&page->idlist);
+  page->pagecacheid=0;
+}
+
+/* Called when a cache file slot is freed or reused, so RAM hits stop refreshing whatever the slot holds now. */
+static void ram_tier_forget_slot(uint64_t pagecacheid){
+  psync_ram_page_t *page;
+  pthread_mutex_lock(&ram_tier_mutex);
+  if (ram_tier_pages_used)
+    psync_list_for_each_element(page, &ram_tier_id_hash[pagecacheid%ram_tier_hash_size], psync_ram_page_t, idlist)
+      if (page->pagecacheid==pagecacheid){
+        ram_tier_forget_page_slot(page);
+        break;
+      }
+  pthread_mutex_unlock(&ram_tier_mutex);
+}
+
+static void ram_tier_forget_slots_above(uint64_t maxpagecacheid){
+  psync_ram_page_t *page;
+  pthread_mutex_lock(&ram_tier_mutex);
+  psync_list_for_each_element(page, &ram_tier_lru, psync_ram_page_t, lru)
+    if (page->pagecacheid>maxpagecacheid)
+      ram_tier_forget_page_slot(page);
+  pthread_mutex_unlock(&ram_tier_mutex);
+}
+
+static void count_disk_tier_access(int hit){
+  pthread_mutex_lock(&ram_tier_mutex);
+  if (hit)
+    tier_stats.diskhits++;
+  else
+    tier_stats.misses++;
+  pthread_mutex_unlock(&ram_tier_mutex);
 }
 
 static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
@@ -1410,10 +1667,12 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
   ssize_t readret;
   psync_int_t ret;
   uint64_t pagecacheid;
-  uint32_t crc;
+  uint32_t crc, usecnt;
   int hascrc;
-  ret=-1;
-  res=psync_sql_query_rdlock("SELECT id, size, crc FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
+  ret=check_page_in_ram_tier(hash, pageid, buff, size, off);
+  if (ret!=-1)
+    return ret;
+  res=psync_sql_query_rdlock("SELECT id, size, crc, usecnt FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
   psync_sql_bind_uint(res, 1, hash);
   psync_sql_bind_uint(res, 2, pageid);
   if ((row=psync_sql_fetch_row(res))){
@@ -1427,6 +1686,7 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
       crc=psync_get_number(row[2]);
       hascrc=1;
     }
+    usecnt=psync_get_number_or_null(row[3]);
     if (size+off>dsize){
       if (off>dsize)
         size=0;
@@ -1450,13 +1710,41 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
         mark_page_free(pagecacheid);
         ret=-1;
       }
-      else
-        mark_pagecache_used(pagecacheid);
+      else if ((mark_pagecache_used(pagecacheid) || usecnt) && ram_tier_pages){
+        if (size==dsize && off==0)
+          promote_page_to_ram_tier(hash, pageid, pagecacheid, buff, dsize, crc, hascrc);
+        else
+          promote_page_to_ram_tier(hash, pageid, pagecacheid, NULL, dsize, crc, hascrc);
+      }
     }
   }
+  count_disk_tier_access(ret!=-1);
   return ret;
 }
 
+/* reads a range of the file with the given hash, only if all of it is available in the cache */
+int psync_pagecache_read_cached_range(uint64_t hash, uint64_t offset, char *buf, uint64_t size){
+  uint64_t pageid;
+  psync_int_t rb;
+  psync_uint_t poff, psize;
+  while (size){
+    pageid=offset/PSYNC_FS_PAGE_SIZE;
+    poff=offset%PSYNC_FS_PAGE_SIZE;
+    psize=PSYNC_FS_PAGE_SIZE-poff;
+    if (psize>size)
+      psize=size;
+    rb=check_page_in_memory_by_hash(hash, pageid, buf, psize, poff);
+    if (rb==-1)
+      rb=check_page_in_database_by_hash(hash, pageid, buf, psize, poff);
+    if (rb!=psize)
+      return -1;
+    buf+=psize;
+    offset+=psize;
+    size-=psize;
+  }
+  return 0;
+}
+
 static psync_int_t check_page_in_database_by_hash_and_cache(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
   psync_sql_res *res;
   psync_variant_row row;
@@ -1467,7 +1755,9 @@ static psync_int_t check_page_in_database_by_hash_and_cache(uint64_t hash, uint6
   uint64_t pagecacheid;
   uint32_t crc, ccrc;
   int hascrc;
-  ret=-1;
+  ret=check_page_in_ram_tier(hash, pageid, buff, size, off);
+  if (ret!=-1)
+    return ret;
   res=psync_sql_query_rdlock("SELECT id, size, crc FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
   psync_sql_bind_uint(res, 1, hash);
   psync_sql_bind_uint(res, 2, pageid);
@@ -1512,6 +1802,7 @@ static psync_int_t check_page_in_database_by_hash_and_cache(uint64_t hash, uint6
       }
       else{
         mark_pagecache_used(pagecacheid);
+        count_disk_tier_access(1);
         memcpy(buff, page->page+off, size);
         page->hash=hash;
         page->pageid=pageid;
@@ -1584,8 +1875,12 @@ int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64
   return rd;
 }
 
+static void psync_free_request_range(psync_request_range_t *range){
+  psync_slab_free(request_range_slab, range);
+}
+
 static void psync_pagecache_free_request(psync_request_t *request){
-  psync_list_for_each_element_call(&request->ranges, psync_request_range_t, list, psync_free);
+  psync_list_for_each_element_call(&request->ranges, psync_request_range_t, list, psync_free_request_range);
   psync_free(request);
 }
 
@@ -1597,7 +1892,7 @@ static void psync_pagecache_send_error_page_wait(psync_page_wait_t *pw, int err)
     pwt->ready=1;
     pthread_cond_broadcast(&pwt->cond);
   }
-  psync_free(pw);
+  psync_slab_free(page_wait_slab, pw);
 }
 
 static void psync_pagecache_send_range_error(psync_request_range_t *range, psync_request_t *request, int err){
@@ -1634,25 +1929,11 @@ static void psync_pagecache_send_error(psync_request_t *request, int err){
 #define psync_pagecache_send_error(r, e) do {psync_pagecache_send_error(r, e); debug(D_NOTICE, "sending request error %d", e);} while (0)
 #endif
 
-static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_request_range_t *range, psync_http_socket *sock){
-  uint64_t first_page_id;
+static int psync_pagecache_read_pages_from_sock(psync_http_socket *sock, uint64_t hash, uint64_t first_page_id, psync_uint_t len){
   psync_page_wait_t *pw;
   psync_cache_page_t *page;
-  psync_uint_t len, i, h;
+  psync_uint_t i, h;
   int rb;
-  first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
-  len=range->length/PSYNC_FS_PAGE_SIZE;
-  rb=psync_http_next_request(sock);
-  if (unlikely(rb)){
-    if (rb==410 || rb==404 || rb==-1){
-      debug(D_WARNING, "got %d from psync_http_next_request, freeing URLs and requesting retry, range from %lu", rb, (long unsigned)range->offset);
-      return 1;
-    }
-    else{
-      debug(D_WARNING, "got %d from psync_http_next_request, returning error", rb);
-      return -1;
-    }
-  }
   for (i=0; i<len; i++){
     page=psync_pagecache_get_free_page(0);
     rb=psync_http_request_readall(sock, page->page, PSYNC_FS_PAGE_SIZE);
@@ -1661,7 +1942,7 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
       psync_timer_notify_exception();
       return -1;
     }
-    page->hash=request->of->hash;
+    page->hash=hash;
     page->pageid=first_page_id+i;
     page->lastuse=psync_timer_time();
     page->size=rb;
@@ -1684,6 +1965,32 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
   return 0;
 }
 
+static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_request_range_t *range, psync_http_socket *sock){
+  int rb;
+  rb=psync_http_next_request(sock);
+  if (unlikely(rb)){
+    if (rb==410 || rb==404 || rb==-1){
+      debug(D_WARNING, "got %d from psync_http_next_request, freeing URLs and requesting retry, range from %lu", rb, (long unsigned)range->offset);
+      return 1;
+    }
+    else{
+      debug(D_WARNING, "got %d from psync_http_next_request, returning error", rb);
+      return -1;
+    }
+  }
+  return psync_pagecache_read_pages_from_sock(sock, request->of->hash, range->offset/PSYNC_FS_PAGE_SIZE, range->length/PSYNC_FS_PAGE_SIZE);
+}
+
+int psync_pagecache_read_pages_from_http(psync_http_socket *sock, uint64_t hash, uint64_t first_page_id, uint32_t pagecnt){
+  int rb;
+  rb=psync_http_next_request(sock);
+  if (unlikely(rb)){
+    debug(D_WARNING, "got %d from psync_http_next_request", rb);
+    return -1;
+  }
+  return psync_pagecache_read_pages_from_sock(sock, hash, first_page_id, pagecnt);
+}
+
 static void psync_pagecache_read_unmodified_thread(void *ptr){
   psync_request_t *request;
   psync_http_socket *sock;
@@ -1860,7 +2167,7 @@ static void check_or_request_page(uint64_t fileid, uint64_t hash, uint64_t pagei
         break;
       }
     if (!found){
-      pw=psync_new(psync_page_wait_t);
+      pw=(psync_page_wait_t *)psync_slab_alloc(page_wait_slab);
       psync_list_add_tail(&wait_page_hash[h], &pw->list);
       psync_list_init(&pw->waiters);
       pw->hash=hash;
@@ -1873,7 +2180,7 @@ static void check_or_request_page(uint64_t fileid, uint64_t hash, uint64_t pagei
       if (range && range->offset+range->length==pageid*PSYNC_FS_PAGE_SIZE)
         range->length+=PSYNC_FS_PAGE_SIZE;
       else{
-        range=psync_new(psync_request_range_t);
+        range=(psync_request_range_t *)psync_slab_alloc(request_range_slab);
         psync_list_add_tail(ranges, &range->list);
         range->offset=pageid*PSYNC_FS_PAGE_SIZE;
         range->length=PSYNC_FS_PAGE_SIZE;
@@ -2014,7 +2321,7 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
     if (found)
       continue;
 //    debug(D_NOTICE, "read-aheading page %lu", first_page_id+i);
-    pw=psync_new(psync_page_wait_t);
+    pw=(psync_page_wait_t *)psync_slab_alloc(page_wait_slab);
     psync_list_add_tail(&wait_page_hash[h], &pw->list);
     psync_list_init(&pw->waiters);
     pw->hash=hash;
@@ -2027,7 +2334,7 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
     if (range && range->offset+range->length==(first_page_id+i)*PSYNC_FS_PAGE_SIZE)
       range->length+=PSYNC_FS_PAGE_SIZE;
     else{
-      range=psync_new(psync_request_range_t);
+      range=(psync_request_range_t *)psync_slab_alloc(request_range_slab);
       psync_list_add_tail(ranges, &range->list);
       range->offset=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
       range->length=PSYNC_FS_PAGE_SIZE;
@@ -2042,7 +2349,7 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
 
 static void psync_free_page_waiter(psync_page_waiter_t *pwt){
   pthread_cond_destroy(&pwt->cond);
-  psync_free(pwt);
+  psync_slab_free(page_waiter_slab, pwt);
 }
 
 static psync_page_waiter_t *add_page_waiter(psync_list *wait_list, psync_list *range_list, uint64_t hash, uint64_t pageid, uint64_t fileid,
@@ -2051,7 +2358,7 @@ static psync_page_waiter_t *add_page_waiter(psync_list *wait_list, psync_list *r
   psync_page_wait_t *pw;
   psync_request_range_t *range;
   psync_uint_t h;
-  pwt=psync_new(psync_page_waiter_t);
+  pwt=(psync_page_waiter_t *)psync_slab_alloc(page_waiter_slab);
   pthread_cond_init(&pwt->cond, NULL);
   pwt->buff=buff;
   pwt->pageidx=pageidx;
@@ -2065,7 +2372,7 @@ static psync_page_waiter_t *add_page_waiter(psync_list *wait_list, psync_list *r
     if (pw->hash==hash && pw->pageid==pageid)
       goto found;
   debug(D_NOTICE, "page %lu not found", (unsigned long)pageid);
-  pw=psync_new(psync_page_wait_t);
+  pw=(psync_page_wait_t *)psync_slab_alloc(page_wait_slab);
   psync_list_add_tail(&wait_page_hash[h], &pw->list);
   psync_list_init(&pw->waiters);
   pw->hash=hash;
@@ -2078,7 +2385,7 @@ static psync_page_waiter_t *add_page_waiter(psync_list *wait_list, psync_list *r
   if (range && range->offset+range->length==pageid*PSYNC_FS_PAGE_SIZE)
     range->length+=PSYNC_FS_PAGE_SIZE;
   else{
-    range=psync_new(psync_request_range_t);
+    range=(psync_request_range_t *)psync_slab_alloc(request_range_slab);
     psync_list_add_tail(range_list, &range->list);
     range->offset=pageid*PSYNC_FS_PAGE_SIZE;
     range->length=PSYNC_FS_PAGE_SIZE;
@@ -2216,11 +2523,12 @@ static void free_waiters(psync_list *waiters){
       pw=pwt->waiting_for;
       if (psync_list_isempty(&pw->waiters)){
         psync_list_del(&pw->list);
-        psync_free(pw);
+        psync_slab_free(page_wait_slab, pw);
       }
     }
     psync_free_page_waiter(pwt);
   }
+  psync_list_init(waiters);
 }
 
 static int request_auth_page(psync_crypto_auth_page *ap, psync_request_t *rq, psync_list *waiting, psync_fileid_t fileid,
@@ -2274,6 +2582,95 @@ static int request_auth_page(psync_crypto_auth_page *ap, psync_request_t *rq, ps
   return 0;
 }
 
+static int get_verified_auth(psync_openfile_t *of, uint64_t hash, psync_crypto_auth_page *ap, uint32_t macssaved){
+  psync_verified_auth_t *va;
+  psync_tree *tr;
+  pthread_mutex_lock(&verified_auth_mutex);
+  tr=of->verifiedauth;
+  while (tr){
+    va=psync_tree_element(tr, psync_verified_auth_t, tree);
+    if (ap->offset<va->offset)
+      tr=tr->left;
+    else if (ap->offset>va->offset)
+      tr=tr->right;
+    else{
+      if (va->hash!=hash || va->size!=ap->size)
+        break;
+      memcpy(ap->auth, va->auth, va->size);
+      psync_list_del(&va->list);
+      psync_list_add_tail(&of->verifiedauthlru, &va->list);
+      verified_auth_stats.hits++;
+      verified_auth_stats.macssaved+=macssaved;
+      pthread_mutex_unlock(&verified_auth_mutex);
+      return 1;
+    }
+  }
+  verified_auth_stats.misses++;
+  pthread_mutex_unlock(&verified_auth_mutex);
+  return 0;
+}
+
+static void add_verified_auth_locked(psync_openfile_t *of, uint64_t hash, psync_crypto_auth_page *ap){
+  psync_verified_auth_t *va;
+  psync_tree *tr, **ptr;
+  pthread_mutex_lock(&verified_auth_mutex);
+  tr=NULL;
+  ptr=&of->verifiedauth;
+  while (*ptr){
+    tr=*ptr;
+    va=psync_tree_element(tr, psync_verified_auth_t, tree);
+    if (ap->offset<va->offset)
+      ptr=&tr->left;
+    else if (ap->offset>va->offset)
+      ptr=&tr->right;
+    else{
+      if (va->size==ap->size){
+        va->hash=hash;
+        memcpy(va->auth, ap->auth, ap->size);
+        psync_list_del(&va->list);
+        psync_list_add_tail(&of->verifiedauthlru, &va->list);
+      }
+      pthread_mutex_unlock(&verified_auth_mutex);
+      return;
+    }
+  }
+  va=(psync_verified_auth_t *)psync_malloc(offsetof(psync_verified_auth_t, auth)+ap->size);
+  va->hash=hash;
+  va->offset=ap->offset;
+  va->size=ap->size;
+  memcpy(va->auth, ap->auth, ap->size);
+  *ptr=&va->tree;
+  psync_tree_added_at(&of->verifiedauth, tr, &va->tree);
+  psync_list_add_tail(&of->verifiedauthlru, &va->list);
+  if (++of->verifiedauthcnt>PSYNC_CRYPTO_VERIFIED_AUTH_NODES){
+    va=psync_list_remove_head_element(&of->verifiedauthlru, psync_verified_auth_t, list);
+    psync_tree_del(&of->verifiedauth, &va->tree);
+    psync_free(va);
+    of->verifiedauthcnt--;
+  }
+  pthread_mutex_unlock(&verified_auth_mutex);
+}
+
+void psync_pagecache_free_verified_auth(psync_openfile_t *of){
+  pthread_mutex_lock(&verified_auth_mutex);
+  if (of->verifiedauth){
+    debug(D_NOTICE, "dropping %u verified auth sectors of %s, total hits %lu misses %lu macs saved %lu", (unsigned)of->verifiedauthcnt,
+          of->currentname, (unsigned long)verified_auth_stats.hits, (unsigned long)verified_auth_stats.misses,
+          (unsigned long)verified_auth_stats.macssaved);
+    psync_tree_for_each_element_call_safe(of->verifiedauth, psync_verified_auth_t, tree, psync_free);
+    of->verifiedauth=NULL;
+    psync_list_init(&of->verifiedauthlru);
+    of->verifiedauthcnt=0;
+  }
+  pthread_mutex_unlock(&verified_auth_mutex);
+}
+
+void psync_pagecache_get_auth_cache_stats(psync_pagecache_auth_cache_stats_t *stats){
+  pthread_mutex_lock(&verified_auth_mutex);
+  memcpy(stats, &verified_auth_stats, sizeof(psync_pagecache_auth_cache_stats_t));
+  pthread_mutex_unlock(&verified_auth_mutex);
+}
+
 int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset){
   psync_crypto_offsets_t offsets;
   uint64_t initialsize, hash, poffset, psize, first_page_id, aoffset, apageid, authupto;
@@ -2282,12 +2679,13 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
   psync_request_t *rq;
   psync_crypto_auth_page *ap;
   psync_crypto_data_page *dp;
+  psync_crypto_sector_batch_t *batch;
   char *pbuff;
   psync_interval_tree_t *intv;
   psync_list auth_pages, waiting;
   psync_fileid_t fileid;
   uint32_t asize, aoff;
-  int ret, needkey;
+  int ret, needkey, needchain;
   initialsize=of->initialsize;
   hash=of->hash;
   fileid=of->remotefileid;
@@ -2320,6 +2718,7 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
   psync_list_init(&auth_pages);
   dp=psync_new_cnt(psync_crypto_data_page, pagecnt);
   memset(dp, 0, sizeof(psync_crypto_data_page)*pagecnt);
+  batch=psync_new_cnt(psync_crypto_sector_batch_t, pagecnt);
   ap=NULL;
   lock_wait(hash);
   for (i=0; i<pagecnt; i++){
@@ -2335,11 +2734,18 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
     ap->size=asize;
     ap->idinparent=0;
     ap->level=0;
+    ap->offset=aoffset;
+    ap->trusted=0;
     psync_list_add_tail(&auth_pages, &ap->list);
     dp[i].authpage=ap;
+    needchain=authupto<(first_page_id+i+1)*PSYNC_FS_PAGE_SIZE && offsets.needmasterauth;
+    if (get_verified_auth(of, hash, ap, needchain?offsets.treelevels+1:0)){
+      ap->trusted=1;
+      continue;
+    }
     if (request_auth_page(ap, rq, &waiting, fileid, hash, aoffset, asize))
       goto err0;
-    if (authupto<(first_page_id+i+1)*PSYNC_FS_PAGE_SIZE && offsets.needmasterauth){
+    if (needchain){
       psync_crypto_auth_page *lap, *cap;
       psync_uint_t l;
       lap=ap;
@@ -2352,10 +2758,17 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
         cap->size=asize;
         cap->idinparent=0;
         cap->level=l;
+        cap->offset=aoffset;
+        cap->trusted=0;
         lap->parent=cap;
         lap->idinparent=aoff;
         lap=cap;
         psync_list_add_tail(&auth_pages, &cap->list);
+        // an already verified ancestor ends the chain, no need to fetch and check the levels above it
+        if (get_verified_auth(of, hash, cap, offsets.treelevels+1-l)){
+          cap->trusted=1;
+          break;
+        }
         if (request_auth_page(cap, rq, &waiting, fileid, hash, aoffset, asize))
           goto err0;
       }
@@ -2428,12 +2841,13 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
     }
     if (ap->parent && !ret){
       psync_crypto_sector_auth_t sa;
-      psync_crypto_auth_page *p;
+      psync_crypto_auth_page *p, *chain;
       debug(D_NOTICE, "checking chain checksums for pages %lu-%lu tree level %d",
             (unsigned long)ap->firstpageid, (unsigned long)ap->firstpageid+ap->size/PSYNC_CRYPTO_AUTH_SIZE, (int)offsets.treelevels);
       psync_crypto_sign_auth_sector(of->encoder, (unsigned char *)ap->auth, ap->size, sa);
       p=ap->parent;
       ap->parent=NULL;
+      chain=p;
       do {
         if (p->waiter){
           wait_waiter(p->waiter, hash, "chain auth");
@@ -2446,14 +2860,20 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
           ret=-EIO;
         }
         ap=p;
+        if (ap->trusted)
+          break;
         psync_crypto_sign_auth_sector(of->encoder, (unsigned char *)ap->auth, ap->size, sa);
         p=ap->parent;
       } while (p);
       ap=dp[i].authpage;
       if (!ret){
         pthread_mutex_lock(&of->mutex);
-        if (likely(of->hash==hash))
+        if (likely(of->hash==hash)){
           psync_interval_tree_add(&of->authenticatedints, ap->firstpageid*PSYNC_FS_PAGE_SIZE, (ap->firstpageid+ap->size/PSYNC_CRYPTO_AUTH_SIZE)*PSYNC_FS_PAGE_SIZE);
+          add_verified_auth_locked(of, hash, ap);
+          for (p=chain; p && !p->trusted; p=p->parent)
+            add_verified_auth_locked(of, hash, p);
+        }
         pthread_mutex_unlock(&of->mutex);
       }
     }
@@ -2462,47 +2882,53 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
       if (!ret && dp[i].waiter->error)
         ret=dp[i].waiter->error;
     }
-    if (!ret){
-      apageid=first_page_id+i-ap->firstpageid;
-      assert(apageid>=0 && apageid<PSYNC_CRYPTO_HASH_TREE_SECTORS);
-      if (psync_crypto_aes256_decode_sector(of->encoder, (unsigned char *)dp[i].buff, dp[i].pagesize, (unsigned char *)dp[i].buff,
-                                            ap->auth[apageid], first_page_id+i)){
-        debug(D_ERROR, "decoding of page %lu of file %s failed pagesize=%u, requested offset=%lu, requested size=%lu",
-              (unsigned long)(first_page_id+i), of->currentname, (unsigned)dp[i].pagesize, (unsigned long)offset, (unsigned long)size);
-        ret=-EIO;
+    apageid=first_page_id+i-ap->firstpageid;
+    assert(apageid>=0 && apageid<PSYNC_CRYPTO_HASH_TREE_SECTORS);
+    batch[i].data=(unsigned char *)dp[i].buff;
+    batch[i].out=(unsigned char *)dp[i].buff;
+    batch[i].auth=ap->auth[apageid];
+    batch[i].sectorid=first_page_id+i;
+    batch[i].datalen=dp[i].pagesize;
+    batch[i].result=0;
+  }
+  if (!ret && psync_crypto_aes256_decode_sectors(of->encoder, batch, pagecnt))
+    ret=-EIO;
+  for (i=0; i<pagecnt; i++){
+    if (batch[i].result)
+      debug(D_ERROR, "decoding of page %lu of file %s failed pagesize=%u, requested offset=%lu, requested size=%lu",
+            (unsigned long)(first_page_id+i), of->currentname, (unsigned)dp[i].pagesize, (unsigned long)offset, (unsigned long)size);
+    else if (!ret && dp[i].freebuff){
+      uint64_t copysize;
+      psync_uint_t copyoff;
+      if (i==0){
+        copyoff=pageoff;
+        if (size>PSYNC_FS_PAGE_SIZE-copyoff)
+          copysize=PSYNC_FS_PAGE_SIZE-copyoff;
+        else
+          copysize=size;
+        pbuff=buf;
       }
-      else if (dp[i].freebuff){
-        uint64_t copysize;
-        psync_uint_t copyoff;
-        if (i==0){
-          copyoff=pageoff;
-          if (size>PSYNC_FS_PAGE_SIZE-copyoff)
-            copysize=PSYNC_FS_PAGE_SIZE-copyoff;
-          else
-            copysize=size;
-          pbuff=buf;
-        }
-        else{
-          assert(i==pagecnt-1);
-          copyoff=0;
-          copysize=(size+pageoff)&(PSYNC_FS_PAGE_SIZE-1);
-          if (!copysize)
-            copysize=PSYNC_FS_PAGE_SIZE;
-          pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
-        }
-        memcpy(pbuff, dp[i].buff+copyoff, copysize);
+      else{
+        assert(i==pagecnt-1);
+        copyoff=0;
+        copysize=(size+pageoff)&(PSYNC_FS_PAGE_SIZE-1);
+        if (!copysize)
+          copysize=PSYNC_FS_PAGE_SIZE;
+        pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
       }
+      memcpy(pbuff, dp[i].buff+copyoff, copysize);
     }
   }
   if (!ret)
     ret=size;
 ret0:
-  psync_list_for_each_element_call(&waiting, psync_page_waiter_t, listwaiter, psync_free);
+  psync_list_for_each_element_call(&waiting, psync_page_waiter_t, listwaiter, psync_free_page_waiter);
   psync_list_for_each_element_call(&auth_pages, psync_crypto_auth_page, list, psync_free);
   for (i=0; i<pagecnt; i++)
     if (dp[i].freebuff)
       psync_free(dp[i].buff);
   psync_free(dp);
+  psync_free(batch);
   return ret;
 err0:
   free_waiters(&waiting);
@@ -3031,6 +3457,7 @@ void psync_pagecache_resize_cache(){
     res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
     psync_sql_bind_uint(res, 1, db_cache_in_pages);
     psync_sql_run_free(res);
+    ram_tier_forget_slots_above(db_cache_in_pages);
     db_cache_max_page=db_cache_in_pages;
     if (!psync_fstat(readcache, &st) && psync_stat_size(&st)>db_cache_in_pages*PSYNC_FS_PAGE_SIZE){
       if (likely_log(psync_file_seek(readcache, db_cache_in_pages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1)){
@@ -3042,6 +3469,89 @@ void psync_pagecache_resize_cache(){
   pthread_mutex_unlock(&flush_cache_mutex);
 }
 
+static void ram_tier_clear_locked(){
+  psync_ram_page_t *page;
+  while (!psync_list_isempty(&ram_tier_lru)){
+    page=psync_list_remove_head_element(&ram_tier_lru, psync_ram_page_t, lru);
+    psync_list_del(&page->list);
+    psync_list_del(&page->idlist);
+    psync_list_add_head(&ram_tier_free, &page->list);
+  }
+  ram_tier_pages_used=0;
+}
+
+void psync_pagecache_resize_ram_cache(){
+  psync_ram_page_t *page;
+  char *page_data;
+  uint64_t size, budget, memcache;
+  uint32_t i, pages;
+  // memory cache is not initialized yet, psync_pagecache_init() will call us
+  if (!cache_pages_total)
+    return;
+  size=psync_setting_get_uint(_PS(fsramcachesize));
+  budget=psync_mem_budget(PSYNC_MEM_TAG_PAGECACHE);
+  memcache=(uint64_t)cache_pages_total*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t));
+  if (budget && size>budget-memcache)
+    size=budget>memcache?budget-memcache:0;
+  pages=size/(PSYNC_FS_PAGE_SIZE+sizeof(psync_ram_page_t));
+  pthread_mutex_lock(&ram_tier_mutex);
+  if (pages==ram_tier_pages){
+    pthread_mutex_unlock(&ram_tier_mutex);
+    return;
+  }
+  if (ram_tier_base){
+    if (ram_tier_huge)
+      psync_munmap_anon_huge(ram_tier_base, ram_tier_alloced);
+    else
+      psync_munmap_anon(ram_tier_base, ram_tier_alloced);
+    psync_mem_account(PSYNC_MEM_TAG_PAGECACHE, -(int64_t)ram_tier_alloced);
+    psync_free(ram_tier_hash);
+    psync_free(ram_tier_id_hash);
+    ram_tier_base=NULL;
+    ram_tier_hash=NULL;
+    ram_tier_id_hash=NULL;
+    ram_tier_alloced=0;
+  }
+  psync_list_init(&ram_tier_free);
+  psync_list_init(&ram_tier_lru);
+  ram_tier_pages=pages;
+  ram_tier_pages_used=0;
+  if (pages){
+    ram_tier_alloced=(size_t)pages*(PSYNC_FS_PAGE_SIZE+sizeof(psync_ram_page_t));
+    ram_tier_huge=psync_setting_get_bool(_PS(fshugepages));
+    if (ram_tier_huge)
+      ram_tier_base=(char *)psync_mmap_anon_huge(ram_tier_alloced);
+    else
+      ram_tier_base=(char *)psync_mmap_anon_safe(ram_tier_alloced);
+    psync_mem_account(PSYNC_MEM_TAG_PAGECACHE, (int64_t)ram_tier_alloced);
+    ram_tier_hash_size=pages/2+1;
+    ram_tier_hash=psync_new_cnt(psync_list, ram_tier_hash_size);
+    ram_tier_id_hash=psync_new_cnt(psync_list, ram_tier_hash_size);
+    for (i=0; i<ram_tier_hash_size; i++){
+      psync_list_init(&ram_tier_hash[i]);
+      psync_list_init(&ram_tier_id_hash[i]);
+    }
+    page_data=ram_tier_base;
+    page=(psync_ram_page_t *)(page_data+(size_t)pages*PSYNC_FS_PAGE_SIZE);
+    for (i=0; i<pages; i++){
+      page->page=page_data;
+      psync_list_add_tail(&ram_tier_free, &page->list);
+      page_data+=PSYNC_FS_PAGE_SIZE;
+      page++;
+    }
+  }
+  pthread_mutex_unlock(&ram_tier_mutex);
+  debug(D_NOTICE, "RAM tier of page cache set to %u pages", (unsigned)pages);
+}
+
+void psync_pagecache_get_tier_stats(psync_pagecache_tier_stats_t *stats){
+  pthread_mutex_lock(&ram_tier_mutex);
+  memcpy(stats, &tier_stats, sizeof(psync_pagecache_tier_stats_t));
+  stats->rampages=ram_tier_pages;
+  stats->rampagesused=ram_tier_pages_used;
+  pthread_mutex_unlock(&ram_tier_mutex);
+}
+
 static int psync_pagecache_free_page_from_read_cache(){
   psync_stat_t st;
   uint64_t sizeinpages;
@@ -3066,6 +3576,7 @@ static int psync_pagecache_free_page_from_read_cache(){
       res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
       psync_sql_bind_uint(res, 1, sizeinpages);
       psync_sql_run_free(res);
+      ram_tier_forget_slots_above(sizeinpages);
       db_cache_max_page=sizeinpages;
     }
     else if (unlikely_log(db_cache_max_page<sizeinpages))
@@ -3109,6 +3620,7 @@ static int psync_pagecache_free_page_from_read_cache(){
     res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
     psync_sql_bind_uint(res, 1, db_cache_max_page);
     psync_sql_run_free(res);
+    ram_tier_forget_slots_above(db_cache_max_page);
     if (psync_file_seek(readcache, sizeinpages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1 && psync_file_truncate(readcache)==0)
       ret=0;
     else
@@ -3131,7 +3643,7 @@ uint64_t psync_pagecache_free_from_read_cache(uint64_t size){
 }
 
 void psync_pagecache_init(){
-  uint64_t i;
+  uint64_t i, node_pages;
   char *page_data, *cache_file;
   const char *cache_dir;
   psync_sql_res *res;
@@ -3142,15 +3654,47 @@ void psync_pagecache_init(){
   for (i=0; i<PAGE_WAITER_HASH; i++)
     psync_list_init(&wait_page_hash[i]);
   pthread_mutex_init(&wait_page_mutex, NULL);
-  psync_list_init(&free_pages);
+  page_wait_slab=psync_slab_create("page wait", sizeof(psync_page_wait_t));
+  page_waiter_slab=psync_slab_create("page waiter", sizeof(psync_page_waiter_t));
+  request_range_slab=psync_slab_create("request range", sizeof(psync_request_range_t));
+  for (i=0; i<PSYNC_FS_MEMORY_CACHE_MAX_NUMA_NODES; i++)
+    psync_list_init(&free_pages[i]);
   memset(cachepages_to_update, 0, sizeof(cachepages_to_update));
-  pages_base=(char *)psync_mmap_anon_safe(CACHE_PAGES*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  cache_pages_total=PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE;
+  if (psync_mem_budget(PSYNC_MEM_TAG_PAGECACHE) && psync_mem_budget(PSYNC_MEM_TAG_PAGECACHE)<PSYNC_FS_MEMORY_CACHE){
+    cache_pages_total=psync_mem_budget(PSYNC_MEM_TAG_PAGECACHE)/(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t));
+    if (cache_pages_total<PSYNC_FS_MIN_MEMORY_CACHE_PAGES)
+      cache_pages_total=PSYNC_FS_MIN_MEMORY_CACHE_PAGES;
+    debug(D_NOTICE, "limiting memory cache to %u pages", (unsigned)cache_pages_total);
+  }
+  if (psync_setting_get_bool(_PS(fshugepages)))
+    pages_base=(char *)psync_mmap_anon_huge(cache_pages_total*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  else
+    pages_base=(char *)psync_mmap_anon_safe(cache_pages_total*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  psync_mem_account(PSYNC_MEM_TAG_PAGECACHE, (int64_t)cache_pages_total*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  /* split the pool in one part per NUMA node, each part aligned to huge pages and preferably backed by its node memory */
+  free_pages_nodes=psync_setting_get_bool(_PS(fsnumasplit))?psync_numa_node_count():1;
+  if (free_pages_nodes>PSYNC_FS_MEMORY_CACHE_MAX_NUMA_NODES)
+    free_pages_nodes=PSYNC_FS_MEMORY_CACHE_MAX_NUMA_NODES;
+  node_pages=cache_pages_total/free_pages_nodes/(PSYNC_HUGE_PAGE_SIZE/PSYNC_FS_PAGE_SIZE)*(PSYNC_HUGE_PAGE_SIZE/PSYNC_FS_PAGE_SIZE);
+  if (free_pages_nodes>1 && node_pages){
+    for (i=0; i<free_pages_nodes; i++)
+      psync_numa_bind_preferred(pages_base+i*node_pages*PSYNC_FS_PAGE_SIZE,
+                                (i==free_pages_nodes-1?cache_pages_total-i*node_pages:node_pages)*PSYNC_FS_PAGE_SIZE, i);
+    debug(D_NOTICE, "memory cache split in %u NUMA node pools of %lu pages", (unsigned)free_pages_nodes, (unsigned long)node_pages);
+  }
+  else
+    free_pages_nodes=1;
   page_data=pages_base;
-  page=(psync_cache_page_t *)(page_data+CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
-  cache_pages_free=CACHE_PAGES;
-  for (i=0; i<CACHE_PAGES; i++){
+  page=(psync_cache_page_t *)(page_data+cache_pages_total*PSYNC_FS_PAGE_SIZE);
+  cache_pages_free=cache_pages_total;
+  for (i=0; i<cache_pages_total; i++){
     page->page=page_data;
-    psync_list_add_tail(&free_pages, &page->list);
+    if (free_pages_nodes>1 && i/node_pages<free_pages_nodes)
+      page->node=i/node_pages;
+    else
+      page->node=free_pages_nodes-1;
+    psync_list_add_tail(free_page_list(page), &page->list);
     page_data+=PSYNC_FS_PAGE_SIZE;
     page++;
   }
@@ -3171,7 +3715,7 @@ void psync_pagecache_init(){
     i=0;
     psync_sql_start_transaction();
     res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES*4){
+    while (db_cache_max_page+i<db_cache_in_pages && i<cache_pages_total*4){
       psync_sql_run(res);
       i++;
     }
@@ -3196,6 +3740,7 @@ void psync_pagecache_init(){
     upload_to_cache_thread_run=1;
   }
   psync_sql_unlock();
+  psync_pagecache_resize_ram_cache();
   psync_timer_register(psync_pagecache_flush_timer, PSYNC_FS_DISK_FLUSH_SEC, NULL);
 }
 
@@ -3210,6 +3755,9 @@ void clean_cache_del(void *delcache, psync_pstat *st){
 void psync_pagecache_clean_cache(){
   const char *cache_dir;
   cache_dir=psync_setting_get_string(_PS(fscachepath));
+  pthread_mutex_lock(&ram_tier_mutex);
+  ram_tier_clear_locked();
+  pthread_mutex_unlock(&ram_tier_mutex);
   if (readcache!=INVALID_HANDLE_VALUE){
     psync_file_seek(readcache, 0, P_SEEK_SET);
     psync_file_truncate(readcache);
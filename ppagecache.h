@@ -29,6 +29,7 @@
 #define _PSYNC_PAGECACHE_H
 
 #include "pfs.h"
+#include "pnetlibs.h"
 
 typedef struct {
   uint64_t offset;
@@ -36,6 +37,23 @@ typedef struct {
   char *buf;
 } psync_pagecache_read_range;
 
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t macssaved;
+} psync_pagecache_auth_cache_stats_t;
+
+typedef struct {
+  uint64_t memhits; /* pages found in the memory pool of pages waiting to be flushed */
+  uint64_t ramhits;
+  uint64_t diskhits;
+  uint64_t misses; /* pages that had to be requested from the server */
+  uint64_t promotions; /* pages copied from the cache file to the RAM tier */
+  uint64_t demotions; /* pages evicted from the RAM tier, they remain in the cache file */
+  uint32_t rampages;
+  uint32_t rampagesused;
+} psync_pagecache_tier_stats_t;
+
 void psync_pagecache_init();
 int psync_pagecache_flush();
 int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset);
@@ -49,7 +67,17 @@ int psync_pagecache_copy_all_pages_from_cache_to_file_locked(psync_openfile_t *o
 int psync_pagecache_lock_pages_in_cache();
 void psync_pagecache_unlock_pages_from_cache();
 void psync_pagecache_resize_cache();
+void psync_pagecache_resize_ram_cache();
 uint64_t psync_pagecache_free_from_read_cache(uint64_t size);
 void psync_pagecache_clean_cache();
+void psync_pagecache_free_verified_auth(psync_openfile_t *of);
+void psync_pagecache_get_auth_cache_stats(psync_pagecache_auth_cache_stats_t *stats);
+void psync_pagecache_get_tier_stats(psync_pagecache_tier_stats_t *stats);
+int psync_pagecache_has_page(uint64_t hash, uint64_t pageid);
+/* returns an array of pagecnt flags, set for the pages of hash that are cached, to be freed with psync_free() */
+unsigned char *psync_pagecache_get_cached_pages(uint64_t hash, uint32_t pagecnt);
+int psync_pagecache_read_cached_range(uint64_t hash, uint64_t offset, char *buf, uint64_t size);
+int psync_pagecache_read_pages_from_http(psync_http_socket *sock, uint64_t hash, uint64_t first_page_id, uint32_t pagecnt);
+void psync_pagecache_set_pinned_hashes(uint64_t *hashes, size_t cnt);
 
 #endif
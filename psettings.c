@@ -52,6 +52,8 @@ typedef struct {
 
 static void lower_patterns(void *ptr);
 
+static psync_pattern_set_t *ignore_patterns=NULL;
+
 static void fsroot_change(){
   psync_fs_remount();
 }
@@ -68,7 +70,10 @@ static psync_setting_t settings[]={
   {"autostartfs", NULL, NULL, {PSYNC_AUTOSTARTFS_DEFAULT}, PSYNC_TBOOL},
   {"fscachesize", psync_pagecache_resize_cache, NULL, {PSYNC_FS_DEFAULT_CACHE_SIZE}, PSYNC_TNUMBER},
   {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING},
-  {"sleepstopcrypto", NULL, NULL, {PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP}, PSYNC_TBOOL}
+  {"sleepstopcrypto", NULL, NULL, {PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP}, PSYNC_TBOOL},
+  {"fsramcachesize", psync_pagecache_resize_ram_cache, NULL, {PSYNC_FS_DEFAULT_RAM_CACHE_SIZE}, PSYNC_TNUMBER},
+  {"fshugepages", NULL, NULL, {PSYNC_FS_MEMORY_CACHE_HUGE_PAGES}, PSYNC_TBOOL},
+  {"fsnumasplit", NULL, NULL, {PSYNC_FS_MEMORY_CACHE_NUMA_SPLIT}, PSYNC_TBOOL}
 };
 
 void psync_settings_reset(){
@@ -94,6 +99,9 @@ void psync_settings_reset(){
   settings[_PS(fscachesize)].num=PSYNC_FS_DEFAULT_CACHE_SIZE;
   settings[_PS(fscachepath)].str=defaultcache;
   settings[_PS(sleepstopcrypto)].num=PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP;
+  settings[_PS(fsramcachesize)].num=PSYNC_FS_DEFAULT_RAM_CACHE_SIZE;
+  settings[_PS(fshugepages)].boolean=PSYNC_FS_MEMORY_CACHE_HUGE_PAGES;
+  settings[_PS(fsnumasplit)].boolean=PSYNC_FS_MEMORY_CACHE_NUMA_SPLIT;
   for (i=0; i<ARRAY_SIZE(settings); i++){
     if (settings[i].type==PSYNC_TSTRING){
       settings[i].str=psync_strdup(settings[i].str);
@@ -279,10 +287,20 @@ int psync_setting_set_string(psync_settingid_t settingid, const char *value){
 }
 
 static void lower_patterns(void *ptr){
+  psync_pattern_set_t *old;
   unsigned char *str;
   str=*((unsigned char **)ptr);
   while (*str){
     *str=tolower(*str);
     str++;
   }
+  // readers may still use the old set, free it as late as the old string
+  old=ignore_patterns;
+  ignore_patterns=psync_pattern_set_compile(*((char **)ptr), 1);
+  if (old)
+    psync_free_after_sec(old, 600);
+}
+
+int psync_setting_match_ignore_patterns(const char *name){
+  return psync_pattern_set_match(ignore_patterns, name);
 }
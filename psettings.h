@@ -57,6 +57,13 @@
 #define PSYNC_DIFF_LIMIT   500000
 
 #define PSYNC_SOCK_CONNECT_TIMEOUT 20
+#define PSYNC_SOCK_CONNECT_ATTEMPT_DELAY_MS 250
+#define PSYNC_SOCK_CONNECT_FAIL_PENALTY_MS  2000
+#define PSYNC_SOCK_CONNECT_MAX_FAILURES     8
+#define PSYNC_SOCK_CONNECT_SCORE_TTL        (7*86400)
+#define PSYNC_SOCK_CONNECT_SCORE_REFRESH    86400
+#define PSYNC_SOCK_CONNECT_SCORE_CHANGE_PCT 25
+#define PSYNC_SOCK_CONNECT_SCORE_PRUNE_INTERVAL 3600
 #define PSYNC_SOCK_READ_TIMEOUT    60
 #define PSYNC_SOCK_WRITE_TIMEOUT   120
 
@@ -68,6 +75,12 @@
 
 #define PSYNC_DEBUG_LOG_ALLOC_OVER (8*1024*1024)
 
+#define PSYNC_SLAB_MAX_SLABS 16
+#define PSYNC_SLAB_CHUNK_SIZE (64*1024)
+#define PSYNC_SLAB_BATCH 32
+#define PSYNC_SLAB_THREAD_CACHE 128
+#define PSYNC_ARENA_BLOCK_SIZE (32*1024)
+
 #define PSYNC_QUERY_CACHE_SEC 600
 #define PSYNC_QUERY_MAX_CNT 8
 
@@ -102,10 +115,29 @@
 #define PSYNC_LOCALSCAN_RESCAN_INTERVAL         10
 #define PSYNC_LOCALSCAN_RESCAN_NOTIFY_SUPPORTED 3600
 #define PSYNC_MIN_INTERVAL_RECALC_UPLOAD        5
+#define PSYNC_STATUS_RECOUNT_INTERVAL           3600
+
+#define PSYNC_EVENT_QUEUE_MAX     16384
+#define PSYNC_EVENT_HASH_SIZE     4096
+#define PSYNC_EVENT_BATCH         64
+#define PSYNC_EVENT_BLOCK_TIMEOUT 2 // in seconds
 
 #define PSYNC_APIPOOL_MAXIDLE    24
 #define PSYNC_APIPOOL_MAXACTIVE  36
 #define PSYNC_APIPOOL_MAXIDLESEC 600
+#define PSYNC_APIPOOL_MINACTIVE  8
+#define PSYNC_APIPOOL_MAXACTIVE_LIMIT 64
+#define PSYNC_APIPOOL_ADAPT_SEC  30
+#define PSYNC_APIPOOL_ADAPT_STEP 4
+#define PSYNC_APIPOOL_SLOW_WAIT_BUCKET 3 // waits of 100ms or more
+
+#define PSYNC_MEM_CHECK_INTERVAL 1
+
+#define PSYNC_LATENCY_SUB_BUCKET_BITS 3
+#define PSYNC_LATENCY_MAX_BITS        40
+#define PSYNC_LATENCY_NAME_LEN        64
+#define PSYNC_LATENCY_MAX_API         96
+#define PSYNC_LATENCY_TRACE_DEFAULT   65536
 
 #define PSYNC_MAX_IDLE_HTTP_CONNS 16
 #define PSYNC_MAX_SSL_SESSIONS_PER_DOMAIN 16
@@ -123,6 +155,11 @@
 #define PSYNC_DEFAULT_NTF_THUMB_DIR "ntfthumbs"
 
 #define PSYNC_DB_CHECKPOINT_AT_PAGES 2000
+#define PSYNC_DB_CHECKPOINT_FORCE_AT_PAGES 64000
+#define PSYNC_DB_CHECKPOINT_BUSY_PAGES 500
+#define PSYNC_DB_CHECKPOINT_IDLE_WAIT_MS 200
+#define PSYNC_DB_CHECKPOINT_MAX_DEFERS 50
+#define PSYNC_DB_CHECKPOINT_MAX_PARTIAL 10
 
 #define PSYNC_DEFAULT_CACHE_FOLDER "Cache"
 #define PSYNC_DEFAULT_READ_CACHE_FILE "cached"
@@ -142,9 +179,15 @@
 #define PSYNC_SLEEP_AUTO_SHAPER        100
 #define PSYNC_SLEEP_ON_LOCKED_FILE     10000
 #define PSYNC_SLEEP_ON_OS_LOCK         5000
+#define PSYNC_SLEEP_BEFORE_LOG_COMPACT 500
 
 #define PSYNC_P2P_INITIAL_TIMEOUT      600
 #define PSYNC_P2P_SLEEP_WAIT_DOWNLOAD  20000
+#define PSYNC_P2P_SWARM_COLLECT_TIME   150
+#define PSYNC_P2P_SWARM_MIN_SIZE       (16*1024*1024)
+#define PSYNC_P2P_SWARM_MAX_PEERS      8
+#define PSYNC_P2P_SWARM_CHUNK_SIZE     (1024*1024)
+#define PSYNC_P2P_SWARM_SLOW_FACTOR    8
 
 #define PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP 0
 
@@ -163,8 +206,20 @@
 #define PSYNC_CRYPTO_CACHE_FILE_ECODER_SEC  15
 
 #define PSYNC_CRYPTO_MAX_LOG_SIZE          (64*1024*1024)
+#define PSYNC_CRYPTO_COMPACT_LOG_SIZE      (4*1024*1024)
+#define PSYNC_CRYPTO_COMPACT_BATCH_SIZE    (256*1024)
+#define PSYNC_CRYPTO_VERIFIED_AUTH_NODES   256
 #define PSYNC_CRYPTO_RUN_EXTEND_IN_THREAD_OVER (1024*1024)
 #define PSYNC_CRYPTO_EXTENDER_STEP         (512*1024)
+#define PSYNC_CRYPTO_MAX_WORKER_THREADS    8
+#define PSYNC_CRYPTO_PARALLEL_MIN_SECTORS  8
+#define PSYNC_CRYPTO_WORKER_CHUNK_SECTORS  4
+#define PSYNC_CRYPTO_MAX_WRITE_BATCH       32
+#define PSYNC_CRYPTO_MAX_CACHED_FILE_KEYS  8192
+#define PSYNC_CRYPTO_PREFETCH_MAX_FILES    8192
+#define PSYNC_CRYPTO_PREFETCH_BATCH        64
+#define PSYNC_CRYPTO_PREFETCH_FOLDER_SEC   60
+#define PSYNC_CRYPTO_KEY_WORKER_THREADS    4
 
 #define PSYNC_HTTP_RESP_BUFFER 4000
 
@@ -189,6 +244,11 @@
 #define psync_lhash_final         psync_sha512_final
 
 
+#define PSYNC_SHAPER_QUANTUM      (16*1024)
+#define PSYNC_SHAPER_MIN_GRANT    (2*1024)
+#define PSYNC_SHAPER_BURST_MS     50
+#define PSYNC_SHAPER_MAX_SLEEP_MS 100
+
 #define PSYNC_UPL_AUTO_SHAPER_INITIAL (100*1024)
 #define PSYNC_UPL_AUTO_SHAPER_MIN     (10*1024)
 #define PSYNC_UPL_AUTO_SHAPER_INC_PER 105
@@ -196,9 +256,16 @@
 #define PSYNC_UPL_AUTO_SHAPER_BUF_PER 400
 
 #define PSYNC_DEFAULT_SEND_BUFF (4*1024*1024)
+/* maximum payload of a TLS record */
+#define PSYNC_SOCK_CORK_BUFF_SIZE (16*1024)
 
 #define PSYNC_FS_PAGE_SIZE 4096
 #define PSYNC_FS_MEMORY_CACHE (64*1024*1024)
+#define PSYNC_FS_MIN_MEMORY_CACHE_PAGES 1024
+#define PSYNC_FS_MEMORY_CACHE_HUGE_PAGES 1
+#define PSYNC_FS_MEMORY_CACHE_NUMA_SPLIT 1
+#define PSYNC_FS_MEMORY_CACHE_MAX_NUMA_NODES 8
+#define PSYNC_HUGE_PAGE_SIZE (2*1024*1024)
 #define PSYNC_FS_DISK_FLUSH_SEC 20
 #define PSYNC_FS_FILESTREAMS_CNT 12
 #define PSYNC_FS_MIN_READAHEAD_START (128*1024)
@@ -207,12 +274,26 @@
 #define PSYNC_FS_MAX_READAHEAD_IF_SEC (64*1024*1024)
 #define PSYNC_FS_MAX_READAHEAD_SEC 16
 #define PSYNC_FS_DEFAULT_CACHE_SIZE ((uint64_t)5*1024*1024*1024)
+#define PSYNC_FS_DEFAULT_RAM_CACHE_SIZE (128*1024*1024)
 #define PSYNC_FS_DIRECT_UPLOAD_LIMIT (256*1024)
 #define PSYNC_FS_FILESIZE_FOR_2CONN (4*1024*1024)
 #define PSYNC_FS_FILE_LOC_HIST_SEC 30
 #define PSYNC_FS_MAX_SIZE_CONVERT_NEWFILE (32*PSYNC_FS_PAGE_SIZE)
 #define PSYNC_FS_MIN_INITIAL_WRITE_SHAPER (200*1024)
 #define PSYNC_FS_MAX_SHAPER_SLEEP_SEC 8
+#define PSYNC_FSTASK_PENDING_BITMAP (1024*1024)
+#define PSYNC_FS_XATTR_CACHE_OBJECTS 8192
+#define PSYNC_FS_XATTR_CACHE_MAX_OBJECT_SIZE 4096
+
+/* gaps between modified ranges up to this size are sent as data instead of splitting the write with upload_writefromfile */
+#define PSYNC_FS_DELTA_MERGE_GAP (32*1024)
+#define PSYNC_FS_DELTA_MAX_MERGE_MEM (4*1024*1024)
+
+#define PSYNC_FS_PIN_WORKERS 2
+#define PSYNC_FS_PIN_MAX_REQUEST_PAGES 1024
+#define PSYNC_FS_PIN_MAX_CACHE_PERCENT 80
+#define PSYNC_FS_PIN_RESCAN_DELAY_MS 2000
+#define PSYNC_FS_PIN_RETRY_SEC 300
 
 /* defaults for database settings */
 #define PSYNC_USE_SSL_DEFAULT 1
@@ -253,6 +334,9 @@ $RECYCLE.BIN;\
 #define PSYNC_SETTING_fscachesize       9
 #define PSYNC_SETTING_fscachepath      10
 #define PSYNC_SETTING_sleepstopcrypto  11
+#define PSYNC_SETTING_fsramcachesize   12
+#define PSYNC_SETTING_fshugepages      13
+#define PSYNC_SETTING_fsnumasplit      14
 
 typedef int psync_settingid_t;
 
@@ -273,4 +357,6 @@ int psync_setting_set_uint(psync_settingid_t settingid, uint64_t value);
 const char *psync_setting_get_string(psync_settingid_t settingid) PSYNC_PURE;
 int psync_setting_set_string(psync_settingid_t settingid, const char *value);
 
+int psync_setting_match_ignore_patterns(const char *name);
+
 #endif
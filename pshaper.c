@@ -0,0 +1,175 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "pshaper.h"
+#include "pcompat.h"
+#include "plibs.h"
+#include "psettings.h"
+
+psync_shaper_t psync_shaper_download={NULL, 0, 0, 0, 0, 0, 0};
+psync_shaper_t psync_shaper_upload={NULL, 0, 0, 0, 0, 0, 0};
+psync_shaper_t psync_shaper_fswrite={NULL, 0, 0, 0, 0, 0, 0};
+
+static pthread_mutex_t shaper_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shaper_cond=PTHREAD_COND_INITIALIZER;
+
+static uint64_t shaper_default_clock(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000+tm.tv_nsec/1000000;
+}
+
+static psync_shaper_clock_t shaper_clock=shaper_default_clock;
+static psync_shaper_sleep_t shaper_sleep=psync_milisleep;
+
+static uint64_t shaper_burst(uint64_t rate){
+  uint64_t burst;
+  burst=rate*PSYNC_SHAPER_BURST_MS/1000;
+  if (burst<PSYNC_SHAPER_MIN_GRANT)
+    burst=PSYNC_SHAPER_MIN_GRANT;
+  return burst;
+}
+
+static void shaper_refill(psync_shaper_t *shaper, uint64_t now){
+  uint64_t add;
+  if (now<=shaper->lastrefill){
+    // the clock can go backwards, just restart from here
+    shaper->lastrefill=now;
+    return;
+  }
+  add=(now-shaper->lastrefill)*shaper->rate/1000;
+  if (!add)
+    return;
+  shaper->lastrefill=now;
+  if (shaper->tokens+(int64_t)add>(int64_t)shaper->burst)
+    shaper->tokens=shaper->burst;
+  else
+    shaper->tokens+=add;
+}
+
+void psync_shaper_init(psync_shaper_t *shaper, psync_shaper_t *parent, uint64_t rate){
+  shaper->parent=parent;
+  shaper->rate=rate;
+  shaper->burst=shaper_burst(rate);
+  shaper->tokens=shaper->burst;
+  shaper->lastrefill=shaper_clock();
+  shaper->nextticket=0;
+  shaper->servingticket=0;
+}
+
+void psync_shaper_set_rate(psync_shaper_t *shaper, uint64_t rate){
+  if (shaper->rate==rate)
+    return;
+  pthread_mutex_lock(&shaper_mutex);
+  if (shaper->rate){
+    shaper_refill(shaper, shaper_clock());
+    if (rate && shaper->tokens>(int64_t)shaper_burst(rate))
+      shaper->tokens=shaper_burst(rate);
+  }
+  else{
+    shaper->lastrefill=shaper_clock();
+    shaper->tokens=0;
+  }
+  shaper->rate=rate;
+  shaper->burst=shaper_burst(rate);
+  pthread_mutex_unlock(&shaper_mutex);
+}
+
+/* returns the number of milliseconds to wait until all buckets in the chain have tokens, 0 if they already have */
+static uint64_t shaper_wait_time(psync_shaper_t *shaper, size_t want, uint64_t now){
+  uint64_t wait, w;
+  int64_t need;
+  wait=0;
+  for (; shaper; shaper=shaper->parent){
+    if (!shaper->rate)
+      continue;
+    shaper_refill(shaper, now);
+    if (shaper->tokens>0)
+      continue;
+    need=want<shaper->burst?want:shaper->burst;
+    if (need>PSYNC_SHAPER_MIN_GRANT)
+      need=PSYNC_SHAPER_MIN_GRANT;
+    w=(need-shaper->tokens)*1000/shaper->rate+1;
+    if (w>wait)
+      wait=w;
+  }
+  if (wait>PSYNC_SHAPER_MAX_SLEEP_MS)
+    wait=PSYNC_SHAPER_MAX_SLEEP_MS;
+  return wait;
+}
+
+size_t psync_shaper_consume(psync_shaper_t *shaper, size_t want){
+  psync_shaper_t *s;
+  uint64_t ticket, wait;
+  if (want>PSYNC_SHAPER_QUANTUM)
+    want=PSYNC_SHAPER_QUANTUM;
+  pthread_mutex_lock(&shaper_mutex);
+  ticket=shaper->nextticket++;
+  while (ticket!=shaper->servingticket)
+    pthread_cond_wait(&shaper_cond, &shaper_mutex);
+  while ((wait=shaper_wait_time(shaper, want, shaper_clock()))){
+    pthread_mutex_unlock(&shaper_mutex);
+    shaper_sleep(wait);
+    pthread_mutex_lock(&shaper_mutex);
+  }
+  for (s=shaper; s; s=s->parent)
+    if (s->rate && s->tokens<(int64_t)want)
+      want=s->tokens;
+  for (s=shaper; s; s=s->parent)
+    if (s->rate)
+      s->tokens-=want;
+  shaper->servingticket++;
+  pthread_cond_broadcast(&shaper_cond);
+  pthread_mutex_unlock(&shaper_mutex);
+  return want;
+}
+
+void psync_shaper_refund(psync_shaper_t *shaper, size_t unused){
+  if (!unused)
+    return;
+  pthread_mutex_lock(&shaper_mutex);
+  for (; shaper; shaper=shaper->parent)
+    if (shaper->rate){
+      shaper->tokens+=unused;
+      if (shaper->tokens>(int64_t)shaper->burst)
+        shaper->tokens=shaper->burst;
+    }
+  pthread_mutex_unlock(&shaper_mutex);
+}
+
+int psync_shaper_is_empty(psync_shaper_t *shaper){
+  int ret;
+  pthread_mutex_lock(&shaper_mutex);
+  shaper_refill(shaper, shaper_clock());
+  ret=shaper->rate && shaper->tokens<=0;
+  pthread_mutex_unlock(&shaper_mutex);
+  return ret;
+}
+
+void psync_shaper_set_clock(psync_shaper_clock_t clock, psync_shaper_sleep_t sleep){
+  shaper_clock=clock;
+  shaper_sleep=sleep;
+}
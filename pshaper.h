@@ -0,0 +1,65 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PSYNC_SHAPER_H
+#define _PSYNC_SHAPER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Token bucket shapers. Buckets are refilled with millisecond granularity and can be chained, a consumer takes
+ * tokens from its bucket and all of its parents. Rate of 0 means unlimited. Concurrent consumers of the same bucket
+ * are served in FIFO order in chunks of at most PSYNC_SHAPER_QUANTUM bytes, so a single transfer can not take all
+ * the bandwidth.
+ */
+
+typedef struct _psync_shaper_t {
+  struct _psync_shaper_t *parent;
+  uint64_t rate;
+  uint64_t burst;
+  int64_t tokens;
+  uint64_t lastrefill;
+  uint64_t nextticket;
+  uint64_t servingticket;
+} psync_shaper_t;
+
+typedef uint64_t (*psync_shaper_clock_t)();
+typedef void (*psync_shaper_sleep_t)(uint64_t ms);
+
+extern psync_shaper_t psync_shaper_download;
+extern psync_shaper_t psync_shaper_upload;
+extern psync_shaper_t psync_shaper_fswrite;
+
+void psync_shaper_init(psync_shaper_t *shaper, psync_shaper_t *parent, uint64_t rate);
+void psync_shaper_set_rate(psync_shaper_t *shaper, uint64_t rate);
+size_t psync_shaper_consume(psync_shaper_t *shaper, size_t want);
+void psync_shaper_refund(psync_shaper_t *shaper, size_t unused);
+int psync_shaper_is_empty(psync_shaper_t *shaper);
+
+/* replaces the clock and sleep functions, allows to run shapers on simulated time */
+void psync_shaper_set_clock(psync_shaper_clock_t clock, psync_shaper_sleep_t sleep);
+
+#endif
@@ -32,6 +32,8 @@
 #include "pfstasks.h"
 #include "psettings.h"
 #include "prunratelimit.h"
+#include "ptimer.h"
+#include "pstatuscounter.h"
 #include <string.h>
 #include <stdarg.h>
 
@@ -48,6 +50,11 @@ static pthread_mutex_t statusmutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t statuscond=PTHREAD_COND_INITIALIZER;
 static psync_uint_t status_waiters=0;
 
+static pthread_mutex_t fsuploadmutex=PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fsbytestoupload=0;
+static uint32_t fsfilestoupload=0;
+static int fsuploadchanged=1;
+
 static uint32_t psync_calc_status(){
   if (statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_AUTH_PROVIDED && statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_INVALID){
     if (statuses[PSTATUS_TYPE_AUTH]==PSTATUS_AUTH_REQUIRED)
@@ -120,6 +127,12 @@ static uint32_t psync_calc_status(){
     return PSTATUS_READY;
 }
 
+static void psync_status_recount_thread();
+
+static void psync_status_recount_timer(psync_timer_t timer, void *ptr){
+  psync_run_thread("status recount", psync_status_recount_thread);
+}
+
 void psync_status_init(){
   memset(&psync_status, 0, sizeof(psync_status));
   statuses[PSTATUS_TYPE_RUN]=psync_sql_cellint("SELECT value FROM setting WHERE id='runstatus'", 0);
@@ -130,29 +143,101 @@ void psync_status_init(){
   psync_status_recalc_to_download();
   psync_status_recalc_to_upload();
   psync_status.status=psync_calc_status();
+  psync_timer_register(psync_status_recount_timer, PSYNC_STATUS_RECOUNT_INTERVAL, NULL);
 }
 
-void psync_status_recalc_to_download(){
+static void psync_status_get_counter(uint64_t id, uint32_t *files, uint64_t *bytes){
+  psync_sql_res *res;
+  psync_uint_row row;
+  res=psync_sql_query_rdlock("SELECT files, bytes FROM statuscounter WHERE id=?");
+  psync_sql_bind_uint(res, 1, id);
+  if ((row=psync_sql_fetch_rowint(res))){
+    *files=row[0];
+    *bytes=row[1];
+  }
+  else{
+    *files=0;
+    *bytes=0;
+  }
+  psync_sql_free_result(res);
+}
+
+static void psync_status_recount_locked(uint64_t id, const char *sql, uint64_t *files, uint64_t *bytes, uint64_t *cfiles, uint64_t *cbytes){
   psync_sql_res *res;
   psync_uint_row row;
-  res=psync_sql_query_rdlock("SELECT COUNT(*), SUM(f.size) FROM task t, file f WHERE t.type=? AND t.itemid=f.id");
-  psync_sql_bind_uint(res, 1, PSYNC_DOWNLOAD_FILE);
+  res=psync_sql_query_nolock(sql);
   if ((row=psync_sql_fetch_rowint(res))){
-    psync_status.filestodownload=row[0];
-    psync_status.bytestodownload=row[1];
+    *files=row[0];
+    *bytes=row[1];
   }
   else{
-    psync_status.filestodownload=0;
-    psync_status.bytestodownload=0;
+    *files=0;
+    *bytes=0;
   }
   psync_sql_free_result(res);
+  res=psync_sql_query_nolock("SELECT files, bytes FROM statuscounter WHERE id=?");
+  psync_sql_bind_uint(res, 1, id);
+  if ((row=psync_sql_fetch_rowint(res))){
+    *cfiles=row[0];
+    *cbytes=row[1];
+  }
+  else{
+    *cfiles=~*files;
+    *cbytes=~*bytes;
+  }
+  psync_sql_free_result(res);
+}
+
+/* the counters are maintained by triggers in the database, this is only a consistency check; the read lock keeps
+ * writers out so the recount and the counter agree, the write lock is only taken to repair a mismatch */
+static void psync_status_check_counter(uint64_t id, const char *sql){
+  psync_sql_res *res;
+  uint64_t files, bytes, cfiles, cbytes;
+  psync_sql_rdlock();
+  psync_status_recount_locked(id, sql, &files, &bytes, &cfiles, &cbytes);
+  psync_sql_rdunlock();
+  if (likely(files==cfiles && bytes==cbytes))
+    return;
+  psync_sql_lock();
+  psync_status_recount_locked(id, sql, &files, &bytes, &cfiles, &cbytes);
+  if (files!=cfiles || bytes!=cbytes){
+    debug(D_WARNING, "status counter %u is %lu files %lu bytes, recounted %lu files %lu bytes", (unsigned)id,
+          (unsigned long)cfiles, (unsigned long)cbytes, (unsigned long)files, (unsigned long)bytes);
+    res=psync_sql_prep_statement("REPLACE INTO statuscounter (id, files, bytes) VALUES (?, ?, ?)");
+    psync_sql_bind_uint(res, 1, id);
+    psync_sql_bind_uint(res, 2, files);
+    psync_sql_bind_uint(res, 3, bytes);
+    psync_sql_run_free(res);
+  }
+  psync_sql_unlock();
+}
+
+static void psync_status_recount_thread(){
+  psync_status_check_counter(PSYNC_STATUS_COUNTER_DOWNLOAD, PSYNC_STATUS_COUNTER_RECOUNT_DOWNLOAD);
+  psync_status_check_counter(PSYNC_STATUS_COUNTER_UPLOAD, PSYNC_STATUS_COUNTER_RECOUNT_UPLOAD);
+  pthread_mutex_lock(&fsuploadmutex);
+  fsuploadchanged=1;
+  pthread_mutex_unlock(&fsuploadmutex);
+  psync_status_recalc_to_download();
+  psync_status_recalc_to_upload();
+  psync_send_status_update();
+}
+
+void psync_status_recalc_to_download(){
+  uint64_t bytestod;
+  uint32_t filestod;
+  psync_status_get_counter(PSYNC_STATUS_COUNTER_DOWNLOAD, &filestod, &bytestod);
+  psync_status.filestodownload=filestod;
+  psync_status.bytestodownload=bytestod;
   if (!psync_status.filestodownload){
     psync_status.downloadspeed=0;
     psync_status.status=psync_calc_status();
   }
 }
 
-void psync_status_recalc_to_upload(){
+/* sizes of the files in fs tasks are only known by stat-ing their data files, so this is only done when fs tasks
+ * changed since the last time */
+static void psync_status_recalc_fs_to_upload(){
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   char *filename;
   const char *fscpath;
@@ -161,17 +246,15 @@ void psync_status_recalc_to_upload(){
   psync_stat_t st;
   uint64_t bytestou;
   uint32_t filestou;
-  res=psync_sql_query_rdlock("SELECT COUNT(*), SUM(f.size) FROM task t, localfile f WHERE t.type=? AND t.localitemid=f.id");
-  psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
-  if ((row=psync_sql_fetch_rowint(res))){
-    filestou=row[0];
-    bytestou=row[1];
+  pthread_mutex_lock(&fsuploadmutex);
+  if (!fsuploadchanged){
+    pthread_mutex_unlock(&fsuploadmutex);
+    return;
   }
-  else{
-    filestou=0;
-    bytestou=0;
-  }
-  psync_sql_free_result(res);
+  fsuploadchanged=0;
+  pthread_mutex_unlock(&fsuploadmutex);
+  filestou=0;
+  bytestou=0;
   fscpath=psync_setting_get_string(_PS(fscachepath));
   res=psync_sql_query_rdlock("SELECT id FROM fstask WHERE type IN ("NTO_STR(PSYNC_FS_TASK_CREAT)", "NTO_STR(PSYNC_FS_TASK_MODIFY)") AND text1 NOT LIKE '.%'"
                              " AND status!=3");
@@ -187,6 +270,21 @@ void psync_status_recalc_to_upload(){
     psync_free(filename);
   }
   psync_sql_free_result(res);
+  pthread_mutex_lock(&fsuploadmutex);
+  fsfilestoupload=filestou;
+  fsbytestoupload=bytestou;
+  pthread_mutex_unlock(&fsuploadmutex);
+}
+
+void psync_status_recalc_to_upload(){
+  uint64_t bytestou;
+  uint32_t filestou;
+  psync_status_get_counter(PSYNC_STATUS_COUNTER_UPLOAD, &filestou, &bytestou);
+  psync_status_recalc_fs_to_upload();
+  pthread_mutex_lock(&fsuploadmutex);
+  filestou+=fsfilestoupload;
+  bytestou+=fsbytestoupload;
+  pthread_mutex_unlock(&fsuploadmutex);
   psync_status.filestoupload=filestou;
   psync_status.bytestoupload=bytestou;
   if (!filestou)
@@ -203,6 +301,13 @@ void psync_status_recalc_to_upload_async(){
   psync_run_ratelimited("recalc upload", psync_status_recalc_to_upload_async_thread, PSYNC_MIN_INTERVAL_RECALC_UPLOAD, 1);
 }
 
+void psync_status_fs_tasks_changed(){
+  pthread_mutex_lock(&fsuploadmutex);
+  fsuploadchanged=1;
+  pthread_mutex_unlock(&fsuploadmutex);
+  psync_status_recalc_to_upload_async();
+}
+
 uint32_t psync_status_get(uint32_t statusid){
   pthread_mutex_lock(&statusmutex);
   statusid=statuses[statusid];
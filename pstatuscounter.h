@@ -0,0 +1,72 @@
+/* Copyright (c) 2015 Anton Titov.
+ * Copyright (c) 2015 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_STATUSCOUNTER_H
+#define _PSYNC_STATUSCOUNTER_H
+
+#include "pcompat.h"
+#include "ptasks.h"
+
+/*
+ * statuscounter keeps the number and total size of files queued for download (id 1, task joined with file) and upload
+ * (id 2, task joined with localfile), the triggers keep it equal to the result of the join. recursive_triggers is on so
+ * that rows removed by REPLACE fire the delete triggers.
+ */
+#define PSYNC_STATUS_COUNTER_DOWNLOAD 1
+#define PSYNC_STATUS_COUNTER_UPLOAD   2
+
+#define PSYNC_STATUS_COUNTER_TASKCNT(tp, col, id) "(SELECT COUNT(*) FROM task WHERE " col "=" id " AND type=" NTO_STR(tp) ")"
+#define PSYNC_STATUS_COUNTER_HASTASK(tp, col, id) "EXISTS (SELECT 1 FROM task WHERE " col "=" id " AND type=" NTO_STR(tp) ")"
+
+#define PSYNC_STATUS_COUNTER_TRIGGERS(name, cid, tp, tbl, col) \
+"CREATE TRIGGER IF NOT EXISTS tsc" name "taskins AFTER INSERT ON task WHEN NEW.type=" NTO_STR(tp) " BEGIN \
+UPDATE statuscounter SET files=files+1, bytes=bytes+IFNULL((SELECT size FROM " tbl " WHERE id=NEW." col "), 0) \
+  WHERE id=" NTO_STR(cid) " AND EXISTS (SELECT 1 FROM " tbl " WHERE id=NEW." col "); END;\
+CREATE TRIGGER IF NOT EXISTS tsc" name "taskdel AFTER DELETE ON task WHEN OLD.type=" NTO_STR(tp) " BEGIN \
+UPDATE statuscounter SET files=files-1, bytes=bytes-IFNULL((SELECT size FROM " tbl " WHERE id=OLD." col "), 0) \
+  WHERE id=" NTO_STR(cid) " AND EXISTS (SELECT 1 FROM " tbl " WHERE id=OLD." col "); END;\
+CREATE TRIGGER IF NOT EXISTS tsc" name "itemins AFTER INSERT ON " tbl " WHEN " PSYNC_STATUS_COUNTER_HASTASK(tp, col, "NEW.id") " BEGIN \
+UPDATE statuscounter SET files=files+" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "NEW.id") ", \
+  bytes=bytes+IFNULL(NEW.size, 0)*" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "NEW.id") " WHERE id=" NTO_STR(cid) "; END;\
+CREATE TRIGGER IF NOT EXISTS tsc" name "itemdel AFTER DELETE ON " tbl " WHEN " PSYNC_STATUS_COUNTER_HASTASK(tp, col, "OLD.id") " BEGIN \
+UPDATE statuscounter SET files=files-" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "OLD.id") ", \
+  bytes=bytes-IFNULL(OLD.size, 0)*" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "OLD.id") " WHERE id=" NTO_STR(cid) "; END;\
+CREATE TRIGGER IF NOT EXISTS tsc" name "itemupd AFTER UPDATE OF id, size ON " tbl " WHEN (NEW.id!=OLD.id OR IFNULL(NEW.size, 0)!=IFNULL(OLD.size, 0)) \
+  AND (" PSYNC_STATUS_COUNTER_HASTASK(tp, col, "NEW.id") " OR " PSYNC_STATUS_COUNTER_HASTASK(tp, col, "OLD.id") ") BEGIN \
+UPDATE statuscounter SET files=files+" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "NEW.id") "-" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "OLD.id") ", \
+  bytes=bytes+IFNULL(NEW.size, 0)*" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "NEW.id") "-IFNULL(OLD.size, 0)*" PSYNC_STATUS_COUNTER_TASKCNT(tp, col, "OLD.id") " \
+  WHERE id=" NTO_STR(cid) "; END;"
+
+#define PSYNC_STATUS_COUNTER_STRUCTURE \
+"CREATE TABLE IF NOT EXISTS statuscounter (id INTEGER PRIMARY KEY, files INTEGER NOT NULL, bytes INTEGER NOT NULL);" \
+PSYNC_STATUS_COUNTER_TRIGGERS("dl", PSYNC_STATUS_COUNTER_DOWNLOAD, PSYNC_DOWNLOAD_FILE, "file", "itemid") \
+PSYNC_STATUS_COUNTER_TRIGGERS("ul", PSYNC_STATUS_COUNTER_UPLOAD, PSYNC_UPLOAD_FILE, "localfile", "localitemid")
+
+#define PSYNC_STATUS_COUNTER_RECOUNT_DOWNLOAD "SELECT COUNT(*), IFNULL(SUM(f.size), 0) FROM task t, file f WHERE t.type=" NTO_STR(PSYNC_DOWNLOAD_FILE) " AND t.itemid=f.id"
+#define PSYNC_STATUS_COUNTER_RECOUNT_UPLOAD "SELECT COUNT(*), IFNULL(SUM(f.size), 0) FROM task t, localfile f WHERE t.type=" NTO_STR(PSYNC_UPLOAD_FILE) " AND t.localitemid=f.id"
+
+#endif
@@ -53,6 +53,8 @@
 #include "ppassword.h"
 #include "pnotifications.h"
 #include "pmemlock.h"
+#include "palloc.h"
+#include "platency.h"
 #include <string.h>
 #include <ctype.h>
 #include <stddef.h>
@@ -74,17 +76,30 @@ static pthread_mutex_t psync_libstate_mutex=PTHREAD_MUTEX_INITIALIZER;
 #define return_error(err) do {psync_error=err; return -1;} while (0)
 #define return_isyncid(err) do {psync_error=err; return PSYNC_INVALID_SYNCID;} while (0)
 
-PSYNC_NOINLINE void *psync_emergency_malloc(size_t size){
-  void *ret;
-  debug(D_WARNING, "could not allocate %lu bytes", (unsigned long)size);
-  psync_try_free_memory();
-  ret=psync_real_malloc(size);
-  if (likely(ret))
+/* every block carries its size and accounting tag in front of it */
+typedef struct {
+  uint64_t size;
+  uint64_t tag;
+} alloc_header_t;
+
+static void *alloc_header_init(alloc_header_t *hdr, uint32_t tag, size_t size){
+  hdr->size=size;
+  hdr->tag=tag;
+  psync_mem_account(tag, size);
 #if IS_DEBUG
-    return memset(ret, 0xfa, size);
+  return memset(hdr+1, 0xfa, size);
 #else
-    return ret;
+  return hdr+1;
 #endif
+}
+
+PSYNC_NOINLINE static void *psync_emergency_malloc(uint32_t tag, size_t size){
+  alloc_header_t *ret;
+  debug(D_WARNING, "could not allocate %lu bytes", (unsigned long)size);
+  psync_try_free_memory();
+  ret=(alloc_header_t *)psync_real_malloc(size+sizeof(alloc_header_t));
+  if (likely(ret))
+    return alloc_header_init(ret, tag, size);
   else{
     debug(D_CRITICAL, "could not allocate %lu bytes even after freeing some memory, aborting", (unsigned long)size);
     abort();
@@ -92,24 +107,24 @@ PSYNC_NOINLINE void *psync_emergency_malloc(size_t size){
   }
 }
 
-void *psync_malloc(size_t size){
-  void *ret;
-  ret=psync_real_malloc(size);
+void *psync_malloc_tag(uint32_t tag, size_t size){
+  alloc_header_t *ret;
+  ret=(alloc_header_t *)psync_real_malloc(size+sizeof(alloc_header_t));
   if (likely(ret))
-#if IS_DEBUG
-    return memset(ret, 0xfa, size);
-#else
-    return ret;
-#endif
+    return alloc_header_init(ret, tag, size);
   else
-    return psync_emergency_malloc(size);
+    return psync_emergency_malloc(tag, size);
 }
 
-PSYNC_NOINLINE void *psync_emergency_realloc(void *ptr, size_t size){
-  void *ret;
+void *psync_malloc(size_t size){
+  return psync_malloc_tag(PSYNC_MEM_TAG_OTHER, size);
+}
+
+PSYNC_NOINLINE static alloc_header_t *psync_emergency_realloc(alloc_header_t *hdr, size_t size){
+  alloc_header_t *ret;
   debug(D_WARNING, "could not reallocate %lu bytes", (unsigned long)size);
   psync_try_free_memory();
-  ret=psync_real_realloc(ptr, size);
+  ret=(alloc_header_t *)psync_real_realloc(hdr, size+sizeof(alloc_header_t));
   if (likely(ret))
     return ret;
   else{
@@ -120,16 +135,27 @@ PSYNC_NOINLINE void *psync_emergency_realloc(void *ptr, size_t size){
 }
 
 void *psync_realloc(void *ptr, size_t size){
-  void *ret;
-  ret=psync_real_realloc(ptr, size);
-  if (likely(ret))
-    return ret;
-  else
-    return psync_emergency_realloc(ptr, size);
+  alloc_header_t *hdr;
+  int64_t diff;
+  if (unlikely(!ptr))
+    return psync_malloc(size);
+  hdr=(alloc_header_t *)ptr-1;
+  diff=(int64_t)size-(int64_t)hdr->size;
+  hdr=(alloc_header_t *)psync_real_realloc(hdr, size+sizeof(alloc_header_t));
+  if (unlikely(!hdr))
+    hdr=psync_emergency_realloc((alloc_header_t *)ptr-1, size);
+  hdr->size=size;
+  psync_mem_account(hdr->tag, diff);
+  return hdr+1;
 }
 
 void psync_free(void *ptr){
-  psync_real_free(ptr);
+  alloc_header_t *hdr;
+  if (unlikely(!ptr))
+    return;
+  hdr=(alloc_header_t *)ptr-1;
+  psync_mem_account(hdr->tag, -(int64_t)hdr->size);
+  psync_real_free(hdr);
 }
 
 uint32_t psync_get_last_error(){
@@ -151,6 +177,11 @@ void psync_set_software_string(const char *str){
   psync_set_software_name(str);
 }
 
+void psync_set_apiserver(const char *host, uint16_t port, uint16_t portssl){
+  debug(D_NOTICE, "setting api server to %s", host?host:"default");
+  psync_api_set_server(host, port, portssl);
+}
+
 static void psync_stop_crypto_on_sleep(){
   if (psync_setting_get_bool(_PS(sleepstopcrypto)) && psync_crypto_isstarted()){
     psync_cloud_crypto_stop();
@@ -186,6 +217,7 @@ int psync_init(){
     return_error(PERROR_DATABASE_OPEN);
   }
   psync_timer_init();
+  psync_mem_init();
   psync_sql_statement("UPDATE task SET inprogress=0 WHERE inprogress=1");
   if (unlikely_log(psync_ssl_init())){
     if (IS_DEBUG)
@@ -195,6 +227,7 @@ int psync_init(){
   psync_libs_init();
   psync_settings_init();
   psync_status_init();
+  psync_compat_timers_init();
   psync_timer_sleep_handler(psync_stop_crypto_on_sleep);
   if (IS_DEBUG){
     psync_libstate=1;
@@ -236,6 +269,14 @@ void psync_start_sync(pstatus_change_callback_t status_callback, pevent_callback
     psync_fs_start();
 }
 
+void psync_set_event_batch_callback(pevent_batch_callback_t callback){
+  psync_callbacks_set_event_batch_callback(callback);
+}
+
+void psync_set_event_queue_policy(uint32_t maxevents, uint32_t policy){
+  psync_callbacks_set_event_queue_policy(maxevents, policy);
+}
+
 void psync_set_notification_callback(pnotification_callback_t notification_callback, const char *thumbsize){
   psync_notifications_set_callback(notification_callback, thumbsize);
 }
@@ -248,6 +289,38 @@ uint32_t psync_download_state(){
   return 0;
 }
 
+void psync_get_apipool_stats(psync_apipool_stats_t *stats){
+  psync_apipool_get_stats(stats);
+}
+
+void psync_get_memory_stats(psync_memory_stats_t *stats){
+  psync_mem_get_stats(stats);
+}
+
+int psync_set_memory_budget(uint32_t tag, uint64_t bytes){
+  return psync_mem_set_budget(tag, bytes);
+}
+
+int psync_get_latency_stats(uint32_t idx, psync_latency_stats_t *stats){
+  return psync_latency_get_stats(idx, stats);
+}
+
+void psync_reset_latency_stats(){
+  psync_latency_reset();
+}
+
+void psync_start_latency_trace(uint32_t maxevents){
+  psync_latency_trace_start(maxevents);
+}
+
+void psync_stop_latency_trace(){
+  psync_latency_trace_stop();
+}
+
+char *psync_get_latency_trace(){
+  return psync_latency_trace_json();
+}
+
 void psync_destroy(){
   psync_do_run=0;
   psync_fs_stop();
@@ -260,6 +333,7 @@ void psync_destroy(){
   psync_sql_lock();
   psync_cache_clean_all();
   psync_sql_close();
+  psync_alloc_dump_stats();
 }
 
 void psync_get_status(pstatus_t *status){
@@ -777,41 +851,12 @@ pentry_t *psync_stat_path(const char *remotepath){
 }
 
 int psync_is_name_to_ignore(const char *name){
-  const char *ign, *sc, *pt;
-  char *namelower;
-  unsigned char *lp;
-  size_t ilen, off, pl;
-  namelower=psync_strdup(name);
-  lp=(unsigned char *)namelower;
-  while (*lp){
-    *lp=tolower(*lp);
-    lp++;
+  if (psync_setting_match_ignore_patterns(name)){
+    debug(D_NOTICE, "ignoring file/folder %s", name);
+    return 1;
   }
-  ign=psync_setting_get_string(_PS(ignorepatterns));
-  ilen=strlen(ign);
-  off=0;
-  do {
-    sc=(const char *)memchr(ign+off, ';', ilen-off);
-    if (sc)
-      pl=sc-ign-off;
-    else
-      pl=ilen-off;
-    pt=ign+off;
-    off+=pl+1;
-    while (pl && isspace((unsigned char)*pt)){
-      pt++;
-      pl--;
-    }
-    while (pl && isspace((unsigned char)pt[pl-1]))
-      pl--;
-    if (psync_match_pattern(namelower, pt, pl)){
-      psync_free(namelower);
-      debug(D_NOTICE, "ignoring file/folder %s", name);
-      return 1;
-    }
-  } while (sc);
-  psync_free(namelower);
-  return 0;
+  else
+    return 0;
 }
 
 static void psync_set_run_status(uint32_t status){
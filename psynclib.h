@@ -121,6 +121,10 @@ typedef struct {
   uint32_t downloadspeed; /* in bytes/sec */
   uint8_t remoteisfull; /* account is full and no files will be synced upwards*/
   uint8_t localisfull; /* (some) local hard drive is full and no files will be synced from the cloud */
+  uint32_t pinnedfiles; /* number of files under pinned paths that are kept in the cache */
+  uint32_t pinnedfilescached; /* number of pinned files that are fully cached */
+  uint64_t pinnedbytes; /* sum of the sizes of pinned files */
+  uint64_t pinnedbytescached; /* sum of the sizes of fully cached pinned files */
 } pstatus_t;
 
 /* PEVENT_LOCAL_FOLDER_CREATED means that a folder was created in remotely and this action was replicated
@@ -275,6 +279,19 @@ typedef struct {
   psync_folder_t folders[];
 } psync_folder_list_t;
 
+typedef struct {
+  const char *path;
+  uint32_t files;
+  uint32_t filescached;
+  uint64_t bytes;
+  uint64_t bytescached;
+} psync_pin_t;
+
+typedef struct {
+  size_t pincnt;
+  psync_pin_t pins[];
+} psync_pin_list_t;
+
 typedef struct {
   psync_fileid_t fileid;
   const char *name;
@@ -384,6 +401,57 @@ typedef struct {
   psync_notification_t notifications[];
 } psync_notification_list_t;
 
+#define PSYNC_APIPOOL_WAIT_BUCKETS 6
+
+/* waithist[i] counts acquisitions of new connections that waited less than 10^i milliseconds (the last bucket is
+ * for everything longer), waits that were not needed are counted in waithist[0] */
+typedef struct {
+  uint64_t gets;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t creates;
+  uint64_t createfailures;
+  uint64_t badreleases;
+  uint64_t waits;
+  uint64_t waitms;
+  uint64_t waithist[PSYNC_APIPOOL_WAIT_BUCKETS];
+  uint32_t open;
+  uint32_t idle;
+  uint32_t inusehighwater;
+  uint32_t maxactive;
+  uint32_t maxidle;
+} psync_apipool_stats_t;
+
+#define PSYNC_MEM_TAG_OTHER     0
+#define PSYNC_MEM_TAG_PAGECACHE 1
+#define PSYNC_MEM_TAG_CACHE     2
+#define PSYNC_MEM_TAG_API       3
+#define PSYNC_MEM_TAG_FSTASKS   4
+#define PSYNC_MEM_TAG_EVENTS    5
+#define PSYNC_MEM_TAG_STACKS    6
+#define PSYNC_MEM_TAG_CNT       7
+/* not a tag, index of the total in stats and budgets */
+#define PSYNC_MEM_TOTAL         PSYNC_MEM_TAG_CNT
+
+/* budget of 0 means unlimited */
+typedef struct {
+  uint64_t current;
+  uint64_t peak;
+  uint64_t budget;
+} psync_memory_stats_t;
+
+/* all values are in microseconds, percentiles are upper bounds of histogram buckets (within 12.5%) */
+typedef struct {
+  char name[64];
+  uint64_t count;
+  uint64_t sumus;
+  uint64_t maxus;
+  uint64_t p50us;
+  uint64_t p90us;
+  uint64_t p99us;
+  uint64_t p999us;
+} psync_latency_stats_t;
+
 #define PSYNC_INVALID_SYNCID (psync_syncid_t)-1
 
 #ifdef __cplusplus
@@ -431,6 +499,24 @@ typedef void (*pstatus_change_callback_t)(pstatus_t *status);
 
 typedef void (*pevent_callback_t)(psync_eventtype_t event, psync_eventdata_t data);
 
+/* Batch variant of the event callback, cnt events are delivered at once in the order they were generated. Same
+ * rules as for pevent_callback_t apply to every element of data.
+ *
+ * Events are queued until delivered. If the callback is slow the queue is bounded to a maximum number of events
+ * and when it is full one of the following policies is applied:
+ *   PEVENT_QUEUE_BLOCK       - the generating thread waits (up to few seconds) for the queue to drain, then the
+ *                              oldest event is dropped; threads that hold the database lock never wait;
+ *   PEVENT_QUEUE_DROP_OLDEST - the oldest event in the queue is dropped, this is the default;
+ *   PEVENT_QUEUE_DROP_NEWEST - the new event is dropped.
+ * Events that are exact repetitions of events still waiting in the queue are not queued again.
+ */
+
+typedef void (*pevent_batch_callback_t)(const psync_eventtype_t *events, const psync_eventdata_t *data, uint32_t cnt);
+
+#define PEVENT_QUEUE_BLOCK       0
+#define PEVENT_QUEUE_DROP_OLDEST 1
+#define PEVENT_QUEUE_DROP_NEWEST 2
+
 /* Notifications callback is called every time new notificaion arrives (well, with some throttling).
  * List of notifications is always sorted from latest to oldest. Every notification has the following
  * fields:
@@ -472,8 +558,12 @@ typedef void (*pnotification_callback_t)(uint32_t notificationcnt, uint32_t newn
  * network calls and other potentially slow to finish tasks.
  *
  * psync_set_alloc can set the allocator to be used by the library. To be called
- * BEFORE psync_init if ever. If allocator is provided, its free() function is to
- * be used to free any memory that is said to be freed when returned by the library.
+ * BEFORE psync_init if ever.
+ *
+ * Every block of memory returned by the library carries an accounting header in
+ * front of it and is to be freed with psync_free(), never with free() (or the free
+ * function passed to psync_set_alloc). This applies to everything that is said to
+ * be freed when returned by the library.
  *
  * psync_set_software_string can set the name (and version) of the software that is passed
  * to the server during token creation. Important: library will not make its own copy, so
@@ -500,12 +590,52 @@ void psync_set_database_path(const char *databasepath);
 void psync_set_alloc(psync_malloc_t malloc_call, psync_realloc_t realloc_call, psync_free_t free_call);
 void psync_set_software_string(const char *str);
 
+/* psync_set_apiserver() points the library to a different API server, e.g. a local server used for testing and
+ * benchmarking. Content hosts returned by such a server may be in host:port form. Passing NULL host restores the
+ * default servers. Call it before psync_init().
+ */
+void psync_set_apiserver(const char *host, uint16_t port, uint16_t portssl);
+
 int psync_init();
 void psync_start_sync(pstatus_change_callback_t status_callback, pevent_callback_t event_callback);
+
+/* psync_set_event_batch_callback() is an alternative to passing event_callback to psync_start_sync(), call it
+ * before psync_start_sync() with NULL event_callback. psync_set_event_queue_policy() sets the maximum number of
+ * queued events (0 for default) and the policy when the limit is reached, call it before setting the callback.
+ */
+void psync_set_event_batch_callback(pevent_batch_callback_t callback);
+void psync_set_event_queue_policy(uint32_t maxevents, uint32_t policy);
 void psync_set_notification_callback(pnotification_callback_t notification_callback, const char *thumbsize);
 psync_notification_list_t *psync_get_notifications();
 int psync_mark_notificaitons_read(uint32_t notificationid);
 uint32_t psync_download_state();
+void psync_get_apipool_stats(psync_apipool_stats_t *stats);
+
+/* Latency histograms are kept for every filesystem operation, for waiting on and holding the database locks and
+ * for every API command. psync_get_latency_stats() fills stats for the histogram with index idx and returns -1 when
+ * there are no more histograms, so callers can iterate starting from 0.
+ *
+ * psync_start_latency_trace() starts recording the last maxevents operations (0 for default) in a ring buffer,
+ * psync_get_latency_trace() returns them in Chrome trace JSON format (open in chrome://tracing), the result is to be
+ * freed with psync_free().
+ */
+int psync_get_latency_stats(uint32_t idx, psync_latency_stats_t *stats);
+void psync_reset_latency_stats();
+void psync_start_latency_trace(uint32_t maxevents);
+void psync_stop_latency_trace();
+char *psync_get_latency_trace();
+
+/* Memory allocated by the library is accounted per subsystem (PSYNC_MEM_TAG_*). psync_get_memory_stats() fills
+ * PSYNC_MEM_TAG_CNT+1 entries, the last one (PSYNC_MEM_TOTAL) being the sum of all tags.
+ *
+ * psync_set_memory_budget() limits a single tag or the total (PSYNC_MEM_TOTAL), 0 removes the limit. Subsystems over
+ * budget shrink their caches or slow down producers: the in-memory page cache is sized by its budget at start, cache
+ * entries are dropped, the event queue applies its policy as if it was full. The total budget only covers memory that
+ * can be freed, the page cache pool and thread stacks are fixed and not counted against it. When that memory is over
+ * the total budget all caches are periodically freed. Returns -1 for invalid tag.
+ */
+void psync_get_memory_stats(psync_memory_stats_t *stats);
+int psync_set_memory_budget(uint32_t tag, uint64_t bytes);
 void psync_destroy();
 
 /* returns current status.
@@ -520,7 +650,7 @@ void psync_get_status(pstatus_t *status);
  * for new password and psync_set_pass should be called. To change the current user, psync_unlink
  * is to be called first and then the new user may log in.
  *
- * The pointer returned by psync_get_username() is to be free()d.
+ * The pointer returned by psync_get_username() is to be freed with psync_free().
  */
 
 char *psync_get_username();
@@ -551,7 +681,7 @@ void psync_unlink();
  * are deleted either in the cloud or locally.
  *
  * psync_get_sync_list returns all folders that are set for sync. On error returns NULL.
- * On success the returned pointer is to be free()d.
+ * On success the returned pointer is to be freed with psync_free().
  *
  */
 
@@ -569,7 +699,7 @@ psuggested_folders_t *psync_get_sync_suggestions();
  * should in general uniquely identify the entry (e.g. inode number).
  * Remote paths use slashes (/) and start with one.
  * In case of success the returned folder list is to be freed with a
- * single call to free(). In case of error NULL is returned. Parameter
+ * single call to psync_free(). In case of error NULL is returned. Parameter
  * listtype should be one of PLIST_FILES, PLIST_FOLDERS or PLIST_ALL.
  *
  * Folders do not contain "." or ".." entries.
@@ -628,7 +758,7 @@ void psync_run_localscan();
  *
  * If err is not NULL in all cases of non-zero return it will be set to point to a
  * psync_malloc-allocated buffer with English language error text, suitable to display
- * to the user. This buffer must be freed by the application.
+ * to the user. This buffer must be freed by the application with psync_free().
  *
  */
 
@@ -672,6 +802,11 @@ const char *psync_get_auth_string();
  * p2psync (bool) - use or not peer to peer downloads
  *
  * fscachesize (uint) - size of filesystem cache, in bytes, sane minimum of few tens of Mb or even hundreds is advised
+ * fsramcachesize (uint) - size of the in-memory tier of the filesystem cache, in bytes, frequently read pages of the
+ *                          filesystem cache are kept there, 0 disables it
+ * fshugepages (bool) - back the memory pools of the filesystem cache with huge pages where the OS supports it
+ * fsnumasplit (bool) - split the memory cache in one pool per NUMA node; this and fshugepages are read when the
+ *                          filesystem is started for the first time, the RAM tier also picks fshugepages up when resized
  * fsroot (string) - where to mount the filesystem
  * autostartfs (bool) - if set starts the fs on app startup
  * sleepstopcrypto (bool) - if set, stops crypto when computer wakes up from sleep
@@ -706,7 +841,7 @@ int psync_set_string_setting(const char *settingname, const char *value);
  * values that you are not supposed to change. There are no type mismatch for values, instead they are converted to requested
  * representation.
  *
- * The pointer returned by psync_get_string_value is to be freed by the application. This function returns NULL when value does not
+ * The pointer returned by psync_get_string_value is to be freed with psync_free(). This function returns NULL when value does not
  * exist (as opposed to psync_get_string_setting).
  *
  * The application can store values even when there is no user logged in. However all values are cleared on unlink.
@@ -746,7 +881,7 @@ void psync_set_string_value(const char *valuename, const char *value);
 void psync_network_exception();
 
 /* The following functions return lists of pending sharerequests in psync_list_sharerequests and
- * list of shared folders in case of psync_list_shares. Memory is to be freed with a single free().
+ * list of shared folders in case of psync_list_shares. Memory is to be freed with a single psync_free().
  *
  * These functions do not return errors. However, if no user is logged in, they will return empty lists.
  *
@@ -764,7 +899,7 @@ psync_share_list_t *psync_list_shares(int incoming);
  * ignored and always set).
  *
  * On success returns 0, otherwise returns API error number (or -1 on network error) and sets err to a string
- * error message if it is not NULL. This string should be freed if the return value is not 0 and err is not NULL.
+ * error message if it is not NULL. This string should be freed with psync_free() if the return value is not 0 and err is not NULL.
  *
  * It is NOT guaranteed that upon successful return psync_list_sharerequests(0) will return the newly created
  * share request. Windows showing list of sharerequests/shares are supposed to requery shares/request upon receiving of
@@ -812,7 +947,7 @@ int psync_modify_share(psync_shareid_t shareid, uint32_t permissions, char **err
 
 /* The following function check for new version of the application. Return NULL if there is no new
  * version or psync_new_version_t structure if a new version is available. Returned value is to be
- * freed with a single free(). The os parameter is one of the following:
+ * freed with a single psync_free(). The os parameter is one of the following:
  * WIN
  * WIN_XP
  * MAC
@@ -843,11 +978,17 @@ void psync_run_new_version(psync_new_version_t *ver);
  * psync_fs_isstarted() - returns 1 if the filesystem is started and 0 otherwise
  * psync_fs_stop() - stops the filesystem
  * psync_fs_getmountpoint() - returns current mountpoint of the filesystem, or NULL if the filesystem is not mounted,
- *                            you are supposed to free the returned pointer
+ *                            you are supposed to free the returned pointer with psync_free()
  * psync_fs_register_start_callback() - registers a callback that will be called once the drive is started
  * psync_fs_get_path_by_folderid() - returns full path (including mountpoint) of a given folderid on the filesystem or
  *                            NULL if it is not mounted or folder could not be found. You are supposed to free the returned
- *                            pointer.
+ *                            pointer with psync_free().
+ * psync_fs_pin_path() - pins a file or folder (given as path on the drive, without the mountpoint) for offline use, the
+ *                            contents of pinned files are downloaded to the cache and never evicted from it. Returns 0
+ *                            on success and -1 if the drive is not started or the path is not found in the cloud.
+ * psync_fs_unpin_path() - removes a pin created by psync_fs_pin_path(), returns -1 if the path is not pinned.
+ * psync_fs_get_pins() - returns the list of pins with the number and size of files under each pin and how many of them
+ *                            are already cached. You are supposed to free the returned pointer with psync_free().
  *
  */
 
@@ -857,6 +998,9 @@ void psync_fs_stop();
 char *psync_fs_getmountpoint();
 void psync_fs_register_start_callback(psync_generic_callback_t callback);
 char *psync_fs_get_path_by_folderid(psync_folderid_t folderid);
+int psync_fs_pin_path(const char *path);
+int psync_fs_unpin_path(const char *path);
+psync_pin_list_t *psync_fs_get_pins();
 
 
 /* psync_password_quality estimates password quality, returns one of:
@@ -884,7 +1028,7 @@ int psync_password_quality10000(const char *password);
  *
  * psync_crypto_setup() - setups crypto with a given password, on error returns one of PSYNC_CRYPTO_SETUP_* errors
  * psync_crypto_get_hint() - if successful sets *hint to point to a string with the user's password hint. In this case
- *                        *hint is to be free-d. On error one of PSYNC_CRYPTO_HINT_* codes is returned and *hint is not
+ *                        *hint is to be freed with psync_free(). On error one of PSYNC_CRYPTO_HINT_* codes is returned and *hint is not
  *                        set.
  * psync_crypto_start() - starts crypto with a given password, on error returns one of PSYNC_CRYPTO_START_* errors
  * psync_crypto_stop() - stops crypto, on error returns one of PSYNC_CRYPTO_STOP_* errors
@@ -907,7 +1051,8 @@ int psync_password_quality10000(const char *password);
  * psync_crypto_folderid() - returns the id of the first encrypted folder it finds. If no encrypted folder is found the function returns
  *                        PSYNC_CRYPTO_INVALID_FOLDERID.
  * psync_crypto_folderids() - returns array of the ids of all encrypted folders (but not their subfolders). Last element of the array is
- *                        always PSYNC_CRYPTO_INVALID_FOLDERID. You need to free the memory returned by this function.
+ *                        always PSYNC_CRYPTO_INVALID_FOLDERID. You need to free the memory returned by this function
+ *                        with psync_free().
  *
  *
  */